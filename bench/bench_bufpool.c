@@ -0,0 +1,186 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Bitmap buffer pool benchmark.
+ *
+ * A synthetic trace of bitmap sizes, mostly small rects with windows and
+ * some full screens, is allocated by one thread, touched page by page
+ * like a copy would, and passed through a DrawableRing to a second
+ * thread that frees it, the way capture and the spice worker share
+ * bitmaps. The same trace runs against plain aligned malloc and against
+ * a BufPool. Reported are the time per allocation, the bitmap bytes
+ * passed per second, and for the pool its hit rate and peak footprint.
+ *
+ *   bench_bufpool [allocations]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+#include "bufpool.h"
+#include "ring.h"
+
+#define BENCH_ALLOCS        20000
+#define BENCH_IN_FLIGHT     32
+#define BENCH_SCREEN_BYTES  (1920 * 1080 * 4)
+#define BENCH_PAGE          4096
+
+typedef struct Bench {
+    BufPool *pool;
+    DrawableRing ring;
+    atomic_bool done;
+} Bench;
+
+static uint32_t rand_state = 0x9e3779b9;
+
+static uint32_t next_rand(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+/// bytes of a dirty rect bitmap: 70% small, 25% windows, 5% full screens
+static size_t trace_size(void)
+{
+    uint32_t kind = next_rand() % 100;
+
+    if (kind < 70) {
+        return (size_t)(1 + next_rand() % 128) * (1 + next_rand() % 128) * 4;
+    }
+    if (kind < 95) {
+        return (size_t)(64 + next_rand() % 1024) * (64 + next_rand() % 768) * 4;
+    }
+    return BENCH_SCREEN_BYTES;
+}
+
+static void *bench_alloc(Bench *b, size_t size)
+{
+    void *buf;
+
+    if (b->pool) {
+        return bufpool_alloc(b->pool, size);
+    }
+    if (posix_memalign(&buf, BUFPOOL_ALIGN, size) != 0) {
+        abort();
+    }
+    return buf;
+}
+
+static void bench_free(Bench *b, void *buf)
+{
+    if (b->pool) {
+        bufpool_free(b->pool, buf);
+    } else {
+        free(buf);
+    }
+}
+
+static void *consumer(void *data)
+{
+    Bench *b = data;
+
+    for (;;) {
+        bool done = atomic_load(&b->done);
+        void *buf = ring_pop(&b->ring);
+
+        if (buf) {
+            bench_free(b, buf);
+        } else if (done) {
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void run(bool use_pool, const size_t *trace, int n)
+{
+    Bench b = { 0 };
+    pthread_t thread;
+    gint64 start, elapsed;
+    uint64_t bytes = 0;
+    int i;
+
+    if (use_pool) {
+        b.pool = bufpool_new(BUFPOOL_DEFAULT_CACHE, false);
+    }
+    ring_init(&b.ring, BENCH_IN_FLIGHT, UINT32_MAX, NULL);
+    atomic_store(&b.done, false);
+
+    start = g_get_monotonic_time();
+    pthread_create(&thread, NULL, consumer, &b);
+    for (i = 0; i < n; i++) {
+        uint8_t *buf = bench_alloc(&b, trace[i]);
+        size_t off;
+
+        /// the first write of every page is where a fresh allocation pays
+        for (off = 0; off < trace[i]; off += BENCH_PAGE) {
+            buf[off] = (uint8_t)i;
+        }
+        buf[trace[i] - 1] = (uint8_t)i;
+        bytes += trace[i];
+        while (!ring_push(&b.ring, buf, 1)) {
+            sched_yield();
+        }
+    }
+    atomic_store(&b.done, true);
+    pthread_join(thread, NULL);
+    elapsed = g_get_monotonic_time() - start;
+    ring_fini(&b.ring);
+
+    printf("%-8s %8.2f us/alloc  %7.2f GB/s", use_pool ? "bufpool" : "malloc",
+           (double)elapsed / n, bytes / (elapsed * 1e3));
+    if (b.pool) {
+        BufPoolStats stats;
+        bufpool_get_stats(b.pool, &stats);
+        printf("  hit rate %5.1f%%  peak footprint %llu MB",
+               stats.allocs ? 100.0 * stats.hits / stats.allocs : 0.0,
+               (unsigned long long)(stats.peak_footprint >> 20));
+        bufpool_destroy(b.pool);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : BENCH_ALLOCS;
+    size_t *trace;
+    int i;
+
+    if (n <= 0) {
+        return 1;
+    }
+    trace = malloc(n * sizeof(size_t));
+    for (i = 0; i < n; i++) {
+        trace[i] = trace_size();
+    }
+
+    printf("%d allocations, up to %d in flight\n", n, BENCH_IN_FLIGHT);
+    run(false, trace, n);
+    run(true, trace, n);
+    free(trace);
+    return 0;
+}
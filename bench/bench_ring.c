@@ -0,0 +1,145 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Drawable queue benchmark: DrawableRing against the GAsyncQueue it
+ * replaced, with one producer and one consumer thread.
+ *
+ * The consumer behaves like the spice worker: it pops until the queue
+ * is empty, then asks whether anything is pending the way
+ * req_cmd_notification() does, and yields. The producer pushes frames
+ * of drawables like the capture thread. Reported are the time per item
+ * end to end and the time the producer spends pushing.
+ *
+ *   bench_ring [items]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+#include "ring.h"
+
+#define BENCH_ITEMS         2000000
+#define BENCH_FRAME         16
+#define BENCH_RING_ENTRIES  1024
+
+typedef struct Bench {
+    bool use_ring;
+    DrawableRing ring;
+    GAsyncQueue *queue;
+    uint32_t items;
+    atomic_bool done;
+    uint64_t popped;
+    uint64_t empty_polls;
+} Bench;
+
+static void *bench_pop(Bench *b)
+{
+    return b->use_ring ? ring_pop(&b->ring) : g_async_queue_try_pop(b->queue);
+}
+
+static bool bench_pending(Bench *b)
+{
+    return b->use_ring ? !ring_is_empty(&b->ring) : g_async_queue_length(b->queue) > 0;
+}
+
+static void *consumer(void *data)
+{
+    Bench *b = data;
+
+    for (;;) {
+        bool done = atomic_load(&b->done);
+
+        if (bench_pop(b)) {
+            b->popped++;
+            continue;
+        }
+        if (bench_pending(b)) {
+            continue;
+        }
+        if (done) {
+            break;
+        }
+        b->empty_polls++;
+        sched_yield();
+    }
+    return NULL;
+}
+
+static void run(bool use_ring, uint32_t items)
+{
+    Bench b = { .use_ring = use_ring, .items = items };
+    gint64 start, pushing = 0, elapsed;
+    pthread_t thread;
+    uint64_t full = 0;
+    uint32_t i, j;
+
+    if (use_ring) {
+        ring_init(&b.ring, BENCH_RING_ENTRIES, UINT32_MAX, NULL);
+    } else {
+        b.queue = g_async_queue_new();
+    }
+    atomic_store(&b.done, false);
+
+    start = g_get_monotonic_time();
+    pthread_create(&thread, NULL, consumer, &b);
+    for (i = 0; i < items; i += BENCH_FRAME) {
+        gint64 t = g_get_monotonic_time();
+        for (j = 0; j < BENCH_FRAME; j++) {
+            void *item = (void *)(uintptr_t)(i + j + 1);
+            if (!use_ring) {
+                g_async_queue_push(b.queue, item);
+                continue;
+            }
+            /// the capture thread backs off when the ring is full
+            while (!ring_push(&b.ring, item, 1)) {
+                full++;
+                sched_yield();
+            }
+        }
+        pushing += g_get_monotonic_time() - t;
+    }
+    atomic_store(&b.done, true);
+    pthread_join(thread, NULL);
+    elapsed = g_get_monotonic_time() - start;
+
+    printf("%-12s %7.1f ns/item  push %6.1f ns/item  %llu empty polls  %llu full pushes\n",
+           use_ring ? "ring" : "GAsyncQueue", elapsed * 1e3 / b.popped,
+           pushing * 1e3 / items, (unsigned long long)b.empty_polls,
+           (unsigned long long)full);
+
+    if (use_ring) {
+        ring_fini(&b.ring);
+    } else {
+        g_async_queue_unref(b.queue);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t items = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_ITEMS;
+
+    printf("%u items in frames of %d\n", items, BENCH_FRAME);
+    run(false, items);
+    run(true, items);
+    return 0;
+}
@@ -0,0 +1,114 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   arena.c
+ * @brief  Scratch memory that lives for one capture iteration
+ */
+
+#include <string.h>
+#include "arena.h"
+#include "memory.h"
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size;
+};
+
+#define ARENA_BLOCK_HEADER \
+    ((sizeof(ArenaBlock) + FRAME_ARENA_ALIGN - 1) & ~(size_t)(FRAME_ARENA_ALIGN - 1))
+
+static inline size_t arena_round(size_t size)
+{
+    return (size + FRAME_ARENA_ALIGN - 1) & ~(size_t)(FRAME_ARENA_ALIGN - 1);
+}
+
+void frame_arena_init(FrameArena *arena, size_t size)
+{
+    memset(arena, 0, sizeof(*arena));
+    arena->size = arena_round(size);
+    arena->base = w_malloc(arena->size);
+    arena->heap_allocs = 1;
+}
+
+static void free_spill(FrameArena *arena)
+{
+    while (arena->spill) {
+        ArenaBlock *block = arena->spill;
+        arena->spill = block->next;
+        w_free(block);
+    }
+    arena->spill_bytes = 0;
+}
+
+void frame_arena_fini(FrameArena *arena)
+{
+    free_spill(arena);
+    w_free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+void *frame_arena_alloc(FrameArena *arena, size_t size)
+{
+    ArenaBlock *block;
+
+    size = arena_round(size);
+    arena->allocs++;
+    if (arena->size - arena->used >= size) {
+        void *p = arena->base + arena->used;
+        arena->used += size;
+        return p;
+    }
+
+    /// the base block cannot move while this iteration uses it
+    block = w_malloc(ARENA_BLOCK_HEADER + size);
+    block->size = size;
+    block->next = arena->spill;
+    arena->spill = block;
+    arena->spill_bytes += size;
+    arena->heap_allocs++;
+    return (uint8_t *)block + ARENA_BLOCK_HEADER;
+}
+
+void *frame_arena_alloc0(FrameArena *arena, size_t size)
+{
+    void *p = frame_arena_alloc(arena, size);
+
+    memset(p, 0, size);
+    return p;
+}
+
+void frame_arena_reset(FrameArena *arena)
+{
+    size_t used = arena->used + arena->spill_bytes;
+
+    if (used > arena->high_water) {
+        arena->high_water = used;
+    }
+    if (arena->spill) {
+        free_spill(arena);
+        w_free(arena->base);
+        arena->size = arena_round(arena->high_water);
+        arena->base = w_malloc(arena->size);
+        arena->heap_allocs++;
+    }
+    arena->used = 0;
+}
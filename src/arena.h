@@ -0,0 +1,64 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   arena.h
+ * @brief  Scratch memory that lives for one capture iteration
+ *
+ * The capture loop needs temporary buffers every frame: duplication
+ * metadata, pointer shapes and masked cursor pixels. They are taken from
+ * one block that is reset at the start of each iteration. A frame that
+ * needs more spills into extra blocks; the next reset replaces all of
+ * them with a single block as large as the high-water mark, so the loop
+ * stops allocating once it has seen its largest frame.
+ */
+
+#ifndef WIN_SPICE_ARENA_H
+#define WIN_SPICE_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_ARENA_ALIGN       16
+#define FRAME_ARENA_INITIAL     (64 * 1024)
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct FrameArena {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    /// overflow blocks of the current iteration
+    ArenaBlock *spill;
+    size_t spill_bytes;
+    /// largest number of bytes one iteration used
+    size_t high_water;
+    uint64_t allocs;
+    /// blocks taken from the heap, flat once the loop is warm
+    uint64_t heap_allocs;
+} FrameArena;
+
+void frame_arena_init(FrameArena *arena, size_t size);
+void frame_arena_fini(FrameArena *arena);
+/// not zeroed, valid until the next frame_arena_reset()
+void *frame_arena_alloc(FrameArena *arena, size_t size);
+void *frame_arena_alloc0(FrameArena *arena, size_t size);
+void frame_arena_reset(FrameArena *arena);
+
+#endif  /* WIN_SPICE_ARENA_H */
@@ -0,0 +1,136 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   batch.c
+ * @brief  Grouping of small dirty rects into clipped drawables
+ */
+
+#include <string.h>
+#include "batch.h"
+#include "memory.h"
+
+static void rect_union(WinSpiceRect *dst, const WinSpiceRect *a, const WinSpiceRect *b)
+{
+    dst->left   = MIN(a->left, b->left);
+    dst->top    = MIN(a->top, b->top);
+    dst->right  = MAX(a->right, b->right);
+    dst->bottom = MAX(a->bottom, b->bottom);
+}
+
+uint64_t batch_group_cost(const BatchPlan *plan, const WinSpiceRect *bbox, int count)
+{
+    uint64_t cost = ((uint64_t)BATCH_DRAWABLE_COST << plan->coarseness)
+                    + wrect_area(bbox) * BATCH_BPP;
+
+    if (count > 1) {
+        cost += (uint64_t)count * BATCH_CLIP_COST;
+    }
+    return cost;
+}
+
+static void plan_reserve(BatchPlan *plan, int n)
+{
+    if (plan->groups_size < n) {
+        w_free(plan->groups);
+        plan->groups = w_malloc(n * sizeof(BatchGroup));
+        plan->groups_size = n;
+    }
+    if (plan->members_size < n) {
+        w_free(plan->members);
+        w_free(plan->group_of);
+        plan->members = w_malloc(n * sizeof(WinSpiceRect));
+        plan->group_of = w_malloc(n * sizeof(int));
+        plan->members_size = n;
+    }
+}
+
+int batch_plan(BatchPlan *plan, const WinSpiceRect *rects, int n)
+{
+    uint64_t small_area = (uint64_t)BATCH_SMALL_AREA << plan->coarseness;
+    int *group_of;
+    int i, g, pos;
+
+    plan->num_groups = 0;
+    if (n <= 0) {
+        return 0;
+    }
+    plan_reserve(plan, n);
+    group_of = plan->group_of;
+
+    for (i = 0; i < n; i++) {
+        const WinSpiceRect *r = &rects[i];
+        int best = -1;
+        int64_t best_gain = 0;
+
+        if (wrect_area(r) <= small_area) {
+            /// join the group where one drawable saves the most
+            for (g = 0; g < plan->num_groups; g++) {
+                BatchGroup *group = &plan->groups[g];
+                WinSpiceRect merged;
+                int64_t gain;
+
+                if (group->count == 0 || group->count >= BATCH_MAX_MEMBERS) {
+                    continue;
+                }
+                rect_union(&merged, &group->bbox, r);
+                gain = (int64_t)(batch_group_cost(plan, &group->bbox, group->count)
+                                 + batch_group_cost(plan, r, 1))
+                       - (int64_t)batch_group_cost(plan, &merged, group->count + 1);
+                if (gain > best_gain) {
+                    best_gain = gain;
+                    best = g;
+                }
+            }
+        }
+
+        if (best >= 0) {
+            rect_union(&plan->groups[best].bbox, &plan->groups[best].bbox, r);
+            plan->groups[best].count++;
+        } else {
+            best = plan->num_groups++;
+            plan->groups[best].bbox = *r;
+            /// large rects never take members, mark them full
+            plan->groups[best].count = wrect_area(r) <= small_area ? 1 : BATCH_MAX_MEMBERS;
+        }
+        group_of[i] = best;
+    }
+
+    /// lay the members out group by group
+    for (g = 0, pos = 0; g < plan->num_groups; g++) {
+        plan->groups[g].first = pos;
+        plan->groups[g].count = 0;
+        for (i = 0; i < n; i++) {
+            if (group_of[i] == g) {
+                plan->members[pos++] = rects[i];
+                plan->groups[g].count++;
+            }
+        }
+    }
+
+    return plan->num_groups;
+}
+
+void batch_plan_fini(BatchPlan *plan)
+{
+    w_free(plan->groups);
+    w_free(plan->members);
+    w_free(plan->group_of);
+    memset(plan, 0, sizeof(*plan));
+}
@@ -0,0 +1,79 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   batch.h
+ * @brief  Grouping of small dirty rects into clipped drawables
+ *
+ * Typing or a progress indicator produces bursts of tiny dirty rects,
+ * and every drawable costs an update, a queue push and work in the spice
+ * worker. Nearby small rects are packed into one drawable carrying their
+ * bounding bitmap and a clip list, so only the real pixels are painted.
+ */
+
+#ifndef WIN_SPICE_BATCH_H
+#define WIN_SPICE_BATCH_H
+
+#include <stdint.h>
+#include "region.h"
+
+/// only rects up to this many pixels are batched
+#define BATCH_SMALL_AREA        (64 * 64)
+/// upper bound of clip rects in one drawable
+#define BATCH_MAX_MEMBERS       32
+/// fixed cost of one drawable, in bytes of bitmap it is worth
+#define BATCH_DRAWABLE_COST     4096
+/// cost of one entry of a clip list
+#define BATCH_CLIP_COST         16
+#define BATCH_BPP               4
+
+typedef struct BatchGroup {
+    WinSpiceRect bbox;
+    /// members are plan->members[first .. first + count)
+    int first;
+    int count;
+} BatchGroup;
+
+typedef struct BatchPlan {
+    BatchGroup *groups;
+    int num_groups;
+    int groups_size;
+    WinSpiceRect *members;
+    /// group of each input rect, sized like members
+    int *group_of;
+    int members_size;
+    /**
+     * 0 normally. Each step doubles the fixed cost of a drawable and the
+     * area of small rects, trading pixels for fewer drawables.
+     */
+    int coarseness;
+} BatchPlan;
+
+/// estimated cost of sending @count rects within @bbox as one drawable
+uint64_t batch_group_cost(const BatchPlan *plan, const WinSpiceRect *bbox, int count);
+
+/**
+ * Split @rects (disjoint) into groups. A rect joins a group only when
+ * one drawable for both is cheaper than two; large rects always stay
+ * alone. Returns the number of groups.
+ */
+int batch_plan(BatchPlan *plan, const WinSpiceRect *rects, int n);
+void batch_plan_fini(BatchPlan *plan);
+
+#endif  /* WIN_SPICE_BATCH_H */
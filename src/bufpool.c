@@ -0,0 +1,254 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   bufpool.c
+ * @brief  Pool of large pixel buffers
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#endif
+#include "bufpool.h"
+#include "memory.h"
+
+/// lives in the BUFPOOL_ALIGN bytes in front of every buffer
+struct BufHeader {
+    BufHeader *next;
+    /// bytes taken from the system, header included
+    size_t alloc_size;
+    int size_class;
+    bool large_page;
+};
+
+#define BUF_HEADER_SIZE BUFPOOL_ALIGN
+#define BUF_NO_CLASS    (-1)
+
+static BufPool *default_pool = NULL;
+
+/// class of @size and the buffer size it stands for, four classes per power of two
+static int size_class(size_t size, size_t *class_size)
+{
+    size_t base = BUFPOOL_MIN_SIZE;
+    size_t step;
+    int index = 0;
+    int n;
+
+    if (size <= base) {
+        *class_size = base;
+        return 0;
+    }
+    if (size > BUFPOOL_MAX_SIZE) {
+        *class_size = size;
+        return BUF_NO_CLASS;
+    }
+    while (base * 2 < size) {
+        base *= 2;
+        index += 4;
+    }
+    step = base / 4;
+    n = (size - base + step - 1) / step;
+    *class_size = base + n * step;
+    return index + n;
+}
+
+#ifdef _WIN32
+/// large pages need SeLockMemoryPrivilege enabled in the process token
+static bool enable_lock_memory_privilege(void)
+{
+    HANDLE token;
+    TOKEN_PRIVILEGES tp;
+    bool ok;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+        return false;
+    }
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    ok = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid)
+         && AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL)
+         && GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return ok;
+}
+#endif
+
+static BufHeader *sys_alloc(BufPool *pool, size_t size)
+{
+    BufHeader *header = NULL;
+    bool large_page = false;
+
+#ifdef _WIN32
+    if (pool->large_page_size && size >= pool->large_page_size) {
+        size = (size + pool->large_page_size - 1) & ~(pool->large_page_size - 1);
+        header = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+                              PAGE_READWRITE);
+        large_page = header != NULL;
+    }
+    if (!header) {
+        header = _aligned_malloc(size, BUFPOOL_ALIGN);
+    }
+#else
+    if (posix_memalign((void **)&header, BUFPOOL_ALIGN, size) != 0) {
+        header = NULL;
+    }
+#endif
+    if (!header) {
+        printf("Failed to allocate %lu bytes of bitmap memory\n", (unsigned long)size);
+        abort();
+    }
+
+    header->alloc_size = size;
+    header->large_page = large_page;
+    return header;
+}
+
+static void sys_free(BufHeader *header)
+{
+#ifdef _WIN32
+    if (header->large_page) {
+        VirtualFree(header, 0, MEM_RELEASE);
+    } else {
+        _aligned_free(header);
+    }
+#else
+    free(header);
+#endif
+}
+
+BufPool *bufpool_new(uint64_t max_cached_bytes, bool large_pages)
+{
+    BufPool *pool = w_malloc0(sizeof(BufPool));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->max_cached_bytes = max_cached_bytes;
+#ifdef _WIN32
+    if (large_pages) {
+        if (enable_lock_memory_privilege()) {
+            pool->large_page_size = GetLargePageMinimum();
+        } else {
+            printf("Large pages are not available, need SeLockMemoryPrivilege\n");
+        }
+    }
+#endif
+    return pool;
+}
+
+void bufpool_destroy(BufPool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+    for (i = 0; i < BUFPOOL_CLASSES; i++) {
+        while (pool->free_list[i]) {
+            BufHeader *header = pool->free_list[i];
+            pool->free_list[i] = header->next;
+            sys_free(header);
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    w_free(pool);
+}
+
+void *bufpool_alloc(BufPool *pool, size_t size)
+{
+    BufHeader *header;
+    size_t class_size;
+    int cls = size_class(size, &class_size);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.allocs++;
+    if (cls != BUF_NO_CLASS && pool->free_list[cls]) {
+        header = pool->free_list[cls];
+        pool->free_list[cls] = header->next;
+        pool->stats.hits++;
+        pool->stats.cached_bytes -= header->alloc_size;
+        pthread_mutex_unlock(&pool->lock);
+        return (uint8_t *)header + BUF_HEADER_SIZE;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /// the system allocation runs outside the lock
+    header = sys_alloc(pool, class_size + BUF_HEADER_SIZE);
+    header->size_class = cls;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.footprint += header->alloc_size;
+    if (pool->stats.footprint > pool->stats.peak_footprint) {
+        pool->stats.peak_footprint = pool->stats.footprint;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return (uint8_t *)header + BUF_HEADER_SIZE;
+}
+
+void bufpool_free(BufPool *pool, void *buf)
+{
+    BufHeader *header;
+
+    if (!buf) {
+        return;
+    }
+    header = (BufHeader *)((uint8_t *)buf - BUF_HEADER_SIZE);
+
+    pthread_mutex_lock(&pool->lock);
+    if (header->size_class != BUF_NO_CLASS
+        && pool->stats.cached_bytes + header->alloc_size <= pool->max_cached_bytes) {
+        header->next = pool->free_list[header->size_class];
+        pool->free_list[header->size_class] = header;
+        pool->stats.cached_bytes += header->alloc_size;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    pool->stats.footprint -= header->alloc_size;
+    pthread_mutex_unlock(&pool->lock);
+
+    sys_free(header);
+}
+
+void bufpool_get_stats(BufPool *pool, BufPoolStats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void bufpool_init_default(uint64_t max_cached_bytes, bool large_pages)
+{
+    if (!default_pool) {
+        default_pool = bufpool_new(max_cached_bytes, large_pages);
+    }
+}
+
+void bufpool_fini_default(void)
+{
+    bufpool_destroy(default_pool);
+    default_pool = NULL;
+}
+
+BufPool *bufpool_default(void)
+{
+    return default_pool;
+}
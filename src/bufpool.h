@@ -0,0 +1,93 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   bufpool.h
+ * @brief  Pool of large pixel buffers
+ *
+ * Bitmaps are allocated by the capture thread and freed by the spice
+ * worker, often several MB each. Freed buffers are kept in size classes,
+ * four per power of two, and handed out again instead of going back to
+ * the system, which would mean fresh pages, page faults and zeroing for
+ * every large update. Buffers are 64 byte aligned; on windows the pool
+ * can back them with large pages.
+ */
+
+#ifndef WIN_SPICE_BUFPOOL_H
+#define WIN_SPICE_BUFPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUFPOOL_ALIGN           64
+#define BUFPOOL_MIN_SIZE        4096
+/// larger buffers are not pooled
+#define BUFPOOL_MAX_SIZE        (128 * 1024 * 1024)
+#define BUFPOOL_CLASSES         64
+/// default upper bound of idle buffers kept by the pool
+#define BUFPOOL_DEFAULT_CACHE   (128 * 1024 * 1024)
+
+typedef struct BufHeader BufHeader;
+
+typedef struct BufPoolStats {
+    uint64_t allocs;
+    /// allocations served from an idle buffer
+    uint64_t hits;
+    /// bytes taken from the system, in use or idle, and their peak
+    uint64_t footprint;
+    uint64_t peak_footprint;
+    uint64_t cached_bytes;
+} BufPoolStats;
+
+typedef struct BufPool {
+    pthread_mutex_t lock;
+    BufHeader *free_list[BUFPOOL_CLASSES];
+    uint64_t max_cached_bytes;
+    /// 0 if large pages are not used
+    size_t large_page_size;
+    BufPoolStats stats;
+} BufPool;
+
+BufPool *bufpool_new(uint64_t max_cached_bytes, bool large_pages);
+void bufpool_destroy(BufPool *pool);
+
+/// never fails, like w_malloc()
+void *bufpool_alloc(BufPool *pool, size_t size);
+/// from any thread, @buf may be NULL
+void bufpool_free(BufPool *pool, void *buf);
+void bufpool_get_stats(BufPool *pool, BufPoolStats *stats);
+
+/// the process wide pool for bitmaps
+void bufpool_init_default(uint64_t max_cached_bytes, bool large_pages);
+void bufpool_fini_default(void);
+BufPool *bufpool_default(void);
+
+static inline void *w_bitmap_alloc(size_t size)
+{
+    return bufpool_alloc(bufpool_default(), size);
+}
+
+static inline void w_bitmap_free(void *buf)
+{
+    bufpool_free(bufpool_default(), buf);
+}
+
+#endif  /* WIN_SPICE_BUFPOOL_H */
@@ -0,0 +1,128 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file   compress.c
+ * @brief  Image compression of the display channel
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "compress.h"
+#include "trace.h"
+
+/// a backlog needs this long to show the effect of the last switch
+#define COMPRESS_HOLD           3000000000ULL
+/// calm samples before a cheaper level is tried
+#define COMPRESS_CALM_SAMPLES   10
+/// after this many calm samples a cheaper level is retried anyway
+#define COMPRESS_RETRY_SAMPLES  60
+#define MB                      (1024.0 * 1024.0)
+
+const CompressTier compress_tiers[COMPRESS_NUM_LEVELS] = {
+    [COMPRESS_LAN] = { "lz4", SPICE_IMAGE_COMPRESSION_LZ4,
+                       SPICE_WAN_COMPRESSION_NEVER, SPICE_WAN_COMPRESSION_NEVER },
+    [COMPRESS_GLZ] = { "glz", SPICE_IMAGE_COMPRESSION_GLZ,
+                       SPICE_WAN_COMPRESSION_NEVER, SPICE_WAN_COMPRESSION_NEVER },
+    [COMPRESS_WAN] = { "quic/glz+jpeg+zlib", SPICE_IMAGE_COMPRESSION_AUTO_GLZ,
+                       SPICE_WAN_COMPRESSION_ALWAYS, SPICE_WAN_COMPRESSION_ALWAYS },
+};
+
+void compress_ctl_init(CompressCtl *ctl, CompressLevel level, uint64_t now)
+{
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->level = level;
+    ctl->max_level = COMPRESS_NUM_LEVELS - 1;
+    ctl->last_sample = now;
+    ctl->last_change = now;
+}
+
+static void log_switch(CompressCtl *ctl, CompressLevel level, const char *trigger,
+                       double offered, double drained, uint32_t inflight)
+{
+    printf("compression: %s -> %s, %s (%.1f MB/s offered, %.1f MB/s drained, "
+           "%u KB in flight)\n", compress_tiers[ctl->level].name,
+           compress_tiers[level].name, trigger, offered / MB, drained / MB,
+           inflight / 1024);
+}
+
+static void switch_level(CompressCtl *ctl, CompressLevel level, uint64_t now)
+{
+    trace_instant("compression switch");
+    ctl->level = level;
+    ctl->last_change = now;
+    ctl->calm = 0;
+}
+
+bool compress_ctl_limit(CompressCtl *ctl, CompressLevel max_level, uint64_t now)
+{
+    ctl->max_level = max_level;
+    if (ctl->level <= max_level) {
+        return false;
+    }
+    printf("compression: %s -> %s, cpu budget\n", compress_tiers[ctl->level].name,
+           compress_tiers[max_level].name);
+    switch_level(ctl, max_level, now);
+    return true;
+}
+
+bool compress_ctl_sample(CompressCtl *ctl, uint64_t now, uint64_t queued,
+                         uint32_t inflight, uint32_t budget)
+{
+    double seconds = (now - ctl->last_sample) / 1e9;
+    double offered, drained;
+    CompressLevel level = ctl->level;
+
+    if (seconds <= 0) {
+        return false;
+    }
+    /// what the worker got rid of is what was queued minus what piled up
+    offered = (queued - ctl->last_queued) / seconds;
+    drained = ((int64_t)(queued - ctl->last_queued)
+               - ((int64_t)inflight - ctl->last_inflight)) / seconds;
+    ctl->last_sample = now;
+    ctl->last_queued = queued;
+    ctl->last_inflight = inflight;
+
+    if (inflight >= budget / 4) {
+        /// the link does not keep up, remember what it shipped at this level
+        ctl->calm = 0;
+        if (drained > 0) {
+            ctl->ceiling[level] = drained;
+        }
+        if (level < ctl->max_level && now - ctl->last_change >= COMPRESS_HOLD) {
+            log_switch(ctl, level + 1, "backlog on the display channel",
+                       offered, drained, inflight);
+            switch_level(ctl, level + 1, now);
+        }
+    } else if (inflight < budget / 16) {
+        ctl->calm++;
+        if (level > 0 && ctl->calm >= COMPRESS_CALM_SAMPLES
+            && (offered < ctl->ceiling[level - 1] * 0.7 || !ctl->ceiling[level - 1]
+                || ctl->calm >= COMPRESS_RETRY_SAMPLES)) {
+            log_switch(ctl, level - 1, "link keeps up", offered, drained, inflight);
+            switch_level(ctl, level - 1, now);
+        }
+    } else {
+        ctl->calm = 0;
+    }
+
+    return ctl->level != level;
+}
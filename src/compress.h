@@ -0,0 +1,89 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file   compress.h
+ * @brief  Image compression of the display channel
+ *
+ * In the auto-WAN mode the controller looks at the display channel once
+ * per COMPRESS_SAMPLE_INTERVAL: how many raw bytes were queued and how
+ * many the worker got rid of. A backlog means the link ships less than the
+ * desktop offers, so it moves to a tier that spends more CPU on fewer
+ * bytes. It moves back once the offered load fits well under what the
+ * cheaper tier drained when it was congested.
+ */
+
+#ifndef WIN_SPICE_COMPRESS_H
+#define WIN_SPICE_COMPRESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <spice.h>
+
+/// the compression option value of the auto-WAN mode
+#define COMPRESSION_AUTO_WAN        SPICE_IMAGE_COMPRESSION_ENUM_END
+
+#define COMPRESS_SAMPLE_INTERVAL    1000
+
+typedef struct CompressTier {
+    const char *name;
+    SpiceImageCompression image;
+    spice_wan_compression_t jpeg;
+    spice_wan_compression_t zlib_glz;
+} CompressTier;
+
+typedef enum CompressLevel {
+    /// lz4, cheapest on the CPU
+    COMPRESS_LAN,
+    /// glz, its dictionary finds repeats across images
+    COMPRESS_GLZ,
+    /// quic for photos, glz otherwise, jpeg and zlib over glz
+    COMPRESS_WAN,
+    COMPRESS_NUM_LEVELS,
+} CompressLevel;
+
+extern const CompressTier compress_tiers[COMPRESS_NUM_LEVELS];
+
+typedef struct CompressCtl {
+    CompressLevel level;
+    /// the most expensive level allowed, lowered by the cpu budget
+    CompressLevel max_level;
+    uint64_t last_sample;
+    uint64_t last_queued;
+    uint32_t last_inflight;
+    uint64_t last_change;
+    /// samples in a row without a backlog
+    uint32_t calm;
+    /// bytes/s drained while a level was congested, 0 if never seen
+    double ceiling[COMPRESS_NUM_LEVELS];
+} CompressCtl;
+
+void compress_ctl_init(CompressCtl *ctl, CompressLevel level, uint64_t now);
+/// lower ctl->level at once if it is above @max_level, true if it changed
+bool compress_ctl_limit(CompressCtl *ctl, CompressLevel max_level, uint64_t now);
+/**
+ * Feed one sample: @queued raw bytes were queued in total so far and
+ * @inflight of @budget bytes are not released yet. Returns true and logs
+ * the trigger if ctl->level changed.
+ */
+bool compress_ctl_sample(CompressCtl *ctl, uint64_t now, uint64_t queued,
+                         uint32_t inflight, uint32_t budget);
+
+#endif  /* WIN_SPICE_COMPRESS_H */
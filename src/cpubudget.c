@@ -0,0 +1,190 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file   cpubudget.c
+ * @brief  CPU budget of the capture pipeline
+ */
+
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+#include "cpubudget.h"
+#include "trace.h"
+#include "memory.h"
+
+/// a step needs this long to show in the usage
+#define CPU_BUDGET_HOLD         1000000000ULL
+/// calm samples before a step is given back
+#define CPU_BUDGET_CALM_SAMPLES 4
+/// a step is given back if its usage is expected under this share of the budget
+#define CPU_BUDGET_CALM_SHARE   0.9
+/// guessed cost of a step that was never measured
+#define CPU_BUDGET_STEP_COST    2.0
+
+static const CpuShedStep shed_steps[CPU_SHED_STEPS] = {
+    { 0,  0, COMPRESS_WAN },
+    /// quic and jpeg are the expensive encoders
+    { 60, 0, COMPRESS_GLZ },
+    { 30, 1, COMPRESS_GLZ },
+    { 20, 2, COMPRESS_LAN },
+    { 10, 3, COMPRESS_LAN },
+};
+
+void thread_clock_self(ThreadClock *clock)
+{
+#ifdef _WIN32
+    /// GetCurrentThread() is a pseudo handle, only valid in this thread
+    if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(),
+                         &clock->thread, THREAD_QUERY_LIMITED_INFORMATION, FALSE, 0)) {
+        return;
+    }
+#else
+    if (pthread_getcpuclockid(pthread_self(), &clock->clock) != 0) {
+        return;
+    }
+#endif
+    atomic_store_explicit(&clock->valid, true, memory_order_release);
+}
+
+uint64_t thread_clock_read(ThreadClock *clock)
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+
+    if (!atomic_load_explicit(&clock->valid, memory_order_acquire)
+        || !GetThreadTimes(clock->thread, &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    /// 100 ns units
+    return ((((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime)
+            + (((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime)) * 100;
+#else
+    struct timespec ts;
+
+    if (!atomic_load_explicit(&clock->valid, memory_order_acquire)
+        || clock_gettime(clock->clock, &ts) != 0) {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+void thread_clock_close(ThreadClock *clock)
+{
+    if (!atomic_exchange_explicit(&clock->valid, false, memory_order_acq_rel)) {
+        return;
+    }
+#ifdef _WIN32
+    CloseHandle(clock->thread);
+#endif
+}
+
+void cpu_budget_init(CpuBudget *cb, int budget, uint64_t now)
+{
+    int i;
+
+    memset(cb, 0, sizeof(*cb));
+    cb->budget = budget;
+    for (i = 0; i < CPU_SHED_STEPS; i++) {
+        cb->cost[i] = CPU_BUDGET_STEP_COST;
+    }
+    cb->last_sample = now;
+    cb->last_change = now;
+}
+
+static void set_step(CpuBudget *cb, int step, uint64_t now, const char *reason,
+                     double capture, double worker)
+{
+    printf("cpu: shed step %d -> %d, %s (%.0f%% of one core used, capture %.0f%%, "
+           "spice worker %.0f%%, budget %d%%)\n", cb->step, step, reason, cb->usage,
+           capture, worker, cb->budget);
+    trace_instant("cpu shed step");
+    cb->step = step;
+    cb->last_change = now;
+    cb->calm = 0;
+}
+
+static bool sample_due(const CpuBudget *cb, uint64_t now)
+{
+    return cb->budget > 0 && now - cb->last_sample >= CPU_BUDGET_INTERVAL;
+}
+
+bool cpu_budget_sample(CpuBudget *cb, uint64_t now, ThreadClock *capture_clock,
+                       ThreadClock *worker_clock)
+{
+    /// called every frame, the clocks are only read when a sample is due
+    if (!sample_due(cb, now)) {
+        return false;
+    }
+    return cpu_budget_update(cb, now, thread_clock_read(capture_clock),
+                             thread_clock_read(worker_clock));
+}
+
+bool cpu_budget_update(CpuBudget *cb, uint64_t now, uint64_t capture_ns, uint64_t worker_ns)
+{
+    uint64_t wall = now - cb->last_sample;
+    double capture, worker;
+    int step = cb->step;
+
+    if (!sample_due(cb, now)) {
+        return false;
+    }
+    /// a thread clock that was (re)set in between reads lower than before
+    capture = capture_ns >= cb->last_capture ? (capture_ns - cb->last_capture) * 100.0 / wall : 0;
+    worker = worker_ns >= cb->last_worker ? (worker_ns - cb->last_worker) * 100.0 / wall : 0;
+    cb->last_sample = now;
+    cb->last_capture = capture_ns;
+    cb->last_worker = worker_ns;
+    cb->usage = (cb->usage + capture + worker) / 2;
+
+    /// once the last step up settled, learn what it saved
+    if (cb->usage_before > 0 && now - cb->last_change >= CPU_BUDGET_HOLD) {
+        cb->cost[step - 1] = MAX(cb->usage_before / MAX(cb->usage, 1.0), 1.0);
+        cb->usage_before = 0;
+    }
+
+    if (cb->usage > cb->budget) {
+        cb->calm = 0;
+        if (step + 1 < CPU_SHED_STEPS && now - cb->last_change >= CPU_BUDGET_HOLD) {
+            double usage = cb->usage;
+
+            set_step(cb, step + 1, now, "over budget", capture, worker);
+            cb->usage_before = usage;
+        }
+    } else if (step > 0
+               && cb->usage * cb->cost[step - 1] < cb->budget * CPU_BUDGET_CALM_SHARE) {
+        if (++cb->calm >= CPU_BUDGET_CALM_SAMPLES) {
+            set_step(cb, step - 1, now, "the step below fits the budget", capture, worker);
+            cb->usage_before = 0;
+        }
+    } else {
+        cb->calm = 0;
+    }
+
+    return cb->step != step;
+}
+
+const CpuShedStep *cpu_budget_step(const CpuBudget *cb)
+{
+    return &shed_steps[cb->step];
+}
@@ -0,0 +1,104 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file   cpubudget.h
+ * @brief  CPU budget of the capture pipeline
+ *
+ * Several servers may share a host, so the CPU time of the capture thread
+ * and of the spice worker, which encodes and sends the display channel,
+ * can be held to a share of one core. Every CPU_BUDGET_INTERVAL the
+ * controller compares their usage with the budget and moves along a
+ * ladder of shed steps: each one caps the frame rate, merges damage more
+ * coarsely and allows cheaper compression only, see cpu_budget_step().
+ */
+
+#ifndef WIN_SPICE_CPUBUDGET_H
+#define WIN_SPICE_CPUBUDGET_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "compress.h"
+
+#define CPU_BUDGET_INTERVAL     500000000ULL
+#define CPU_SHED_STEPS          5
+
+/// CPU time of one thread, readable from any thread
+typedef struct ThreadClock {
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    clockid_t clock;
+#endif
+    atomic_bool valid;
+} ThreadClock;
+
+/// the calling thread is the one measured from now on
+void thread_clock_self(ThreadClock *clock);
+/// ns of CPU the thread used so far, 0 if none is set
+uint64_t thread_clock_read(ThreadClock *clock);
+void thread_clock_close(ThreadClock *clock);
+
+typedef struct CpuShedStep {
+    /// frame rate cap, 0 if none
+    uint32_t fps;
+    /// see BatchPlan
+    int coarseness;
+    /// the most expensive auto-WAN compression allowed
+    CompressLevel compression;
+} CpuShedStep;
+
+typedef struct CpuBudget {
+    /// percent of one core, 0 if there is no budget
+    int budget;
+    int step;
+    uint64_t last_sample;
+    uint64_t last_change;
+    uint64_t last_capture;
+    uint64_t last_worker;
+    /// smoothed usage in percent of one core
+    double usage;
+    /// samples in a row where the step below would fit the budget
+    uint32_t calm;
+    /// usage at a step over usage at the next one, as last measured
+    double cost[CPU_SHED_STEPS];
+    /// usage before the last step up, until its cost is measured
+    double usage_before;
+} CpuBudget;
+
+void cpu_budget_init(CpuBudget *cb, int budget, uint64_t now);
+/**
+ * Read the clocks of the capture thread and the spice worker if a sample
+ * is due. Returns true and logs why if the shed step changed.
+ */
+bool cpu_budget_sample(CpuBudget *cb, uint64_t now, ThreadClock *capture,
+                       ThreadClock *worker);
+/// the same with the CPU times already read, in ns as thread_clock_read() returns
+bool cpu_budget_update(CpuBudget *cb, uint64_t now, uint64_t capture_ns, uint64_t worker_ns);
+/// what the current step sheds
+const CpuShedStep *cpu_budget_step(const CpuBudget *cb);
+
+#endif  /* WIN_SPICE_CPUBUDGET_H */
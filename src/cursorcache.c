@@ -0,0 +1,86 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   cursorcache.c
+ * @brief  Converted cursor shapes, most recently used first
+ */
+
+#include <string.h>
+#include "cursorcache.h"
+#include "memory.h"
+
+void cursor_cache_init(CursorCache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->next_unique = 1;
+}
+
+void cursor_cache_fini(CursorCache *cache)
+{
+    int i;
+
+    for (i = 0; i < CURSOR_CACHE_SIZE; i++) {
+        w_free(cache->entries[i].cursor);
+    }
+    cursor_cache_init(cache);
+}
+
+WinSpiceCursor *cursor_cache_lookup(CursorCache *cache, uint64_t key)
+{
+    int i;
+
+    cache->tick++;
+    for (i = 0; i < CURSOR_CACHE_SIZE; i++) {
+        CursorCacheEntry *e = &cache->entries[i];
+        if (e->cursor && e->key == key) {
+            e->last_use = cache->tick;
+            cache->hits++;
+            return e->cursor;
+        }
+    }
+
+    cache->misses++;
+    return NULL;
+}
+
+WinSpiceCursor *cursor_cache_insert(CursorCache *cache, uint64_t key, WinSpiceCursor *cursor)
+{
+    CursorCacheEntry *victim = &cache->entries[0];
+    int i;
+
+    for (i = 0; i < CURSOR_CACHE_SIZE; i++) {
+        CursorCacheEntry *e = &cache->entries[i];
+        if (!e->cursor) {
+            victim = e;
+            break;
+        }
+        if (e->last_use < victim->last_use) {
+            victim = e;
+        }
+    }
+
+    w_free(victim->cursor);
+    victim->key = key;
+    victim->last_use = ++cache->tick;
+    victim->cursor = cursor;
+    cursor->unique = cache->next_unique++;
+
+    return cursor;
+}
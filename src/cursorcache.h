@@ -0,0 +1,75 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   cursorcache.h
+ * @brief  Converted cursor shapes, most recently used first
+ *
+ * Moving over a page of links switches between the same few shapes,
+ * and animated cursors loop through a fixed set of frames. Converted
+ * shapes are kept by the hash of the shape DXGI reported, so a repeat
+ * costs a hash instead of a conversion, and every shape carries a
+ * unique id that lets spice serve it from the client's cursor cache.
+ */
+
+#ifndef WIN_SPICE_CURSORCACHE_H
+#define WIN_SPICE_CURSORCACHE_H
+
+#include <stdint.h>
+
+/* cursor data format is 32bit RGBA */
+typedef struct WinSpiceCursor {
+    int                 width, height;
+    int                 hot_x, hot_y;
+    int                 ptr_type;
+    /// id of this shape in QXLCursorHeader.unique, never reused
+    uint64_t            unique;
+    uint32_t            data[];
+} WinSpiceCursor;
+
+#define CURSOR_CACHE_SIZE 32
+
+typedef struct CursorCacheEntry {
+    uint64_t key;
+    uint32_t last_use;
+    WinSpiceCursor *cursor;
+} CursorCacheEntry;
+
+typedef struct CursorCache {
+    CursorCacheEntry entries[CURSOR_CACHE_SIZE];
+    uint32_t tick;
+    uint64_t next_unique;
+
+    uint64_t hits;
+    uint64_t misses;
+} CursorCache;
+
+void cursor_cache_init(CursorCache *cache);
+void cursor_cache_fini(CursorCache *cache);
+
+/// cached shape for @key or NULL, owned by the cache
+WinSpiceCursor *cursor_cache_lookup(CursorCache *cache, uint64_t key);
+
+/**
+ * Take ownership of @cursor, give it a fresh unique id and store it
+ * under @key, evicting the least recently used shape if needed.
+ */
+WinSpiceCursor *cursor_cache_insert(CursorCache *cache, uint64_t key, WinSpiceCursor *cursor);
+
+#endif  /* WIN_SPICE_CURSORCACHE_H */
@@ -23,6 +23,15 @@
 #include <stdlib.h>
 #include "display.h"
 #include "memory.h"
+#include "pixel.h"
+#include "hash.h"
+#include "bufpool.h"
+#include "stats.h"
+#include "synthsrc.h"
+
+#ifdef WIN_SPICE_DEBUG
+extern FILE *fp_dbg;
+#endif // WIN_SPICE_DEBUG
 
 static ID3D11Device *gDevice = NULL;
 static ID3D11DeviceContext *gContext = NULL;
@@ -30,6 +39,10 @@ static IDXGIOutputDuplication *gOutputDuplication = NULL;
 static ID3D11Texture2D *gAcquiredDesktopImage = NULL;
 static IDXGISurface *surf = NULL; //获取这个dxgi_text2d的表面
 static ID3D11Texture2D *sStage = NULL;
+static UINT sStageWidth = 0;
+static UINT sStageHeight = 0;
+static bool sStageMapped = false;
+static DXGI_MAPPED_RECT sMappedRect;
 
 /**
  * initial process:
@@ -85,6 +98,69 @@ static int create_device(Display *display)
     return 0;
 }
 
+static void release_staging(Display *display)
+{
+    if (surf) {
+        if (sStageMapped) {
+            surf->lpVtbl->Unmap(surf);
+            sStageMapped = false;
+        }
+        surf->lpVtbl->Release(surf);
+        surf = NULL;
+    }
+    if (sStage) {
+        sStage->lpVtbl->Release(sStage);
+        sStage = NULL;
+    }
+    sStageWidth = 0;
+    sStageHeight = 0;
+}
+
+/**
+ * The staging texture has the size of the whole desktop and is reused
+ * between frames, every damaged rect is copied into it at its own screen
+ * position, so one Map() gives access to all rects of a frame.
+ */
+static int create_staging(Display *display)
+{
+    HRESULT hr;
+    D3D11_TEXTURE2D_DESC tDesc;
+
+    if (sStage && sStageWidth == display->width && sStageHeight == display->height) {
+        return 0;
+    }
+    release_staging(display);
+
+    tDesc.Width = display->width;
+    tDesc.Height = display->height;
+    tDesc.MipLevels = 1;
+    tDesc.ArraySize = 1;
+    tDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    tDesc.SampleDesc.Count = 1;
+    tDesc.SampleDesc.Quality = 0;
+    tDesc.Usage = D3D11_USAGE_STAGING;
+    tDesc.BindFlags = 0;
+    tDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    tDesc.MiscFlags = 0;
+
+    hr = gDevice->lpVtbl->CreateTexture2D(gDevice, &tDesc, NULL, &sStage);
+    if (FAILED(hr)) {
+        printf("Failed to CreateTexture2D: %#lX\n", hr);
+        return -1;
+    }
+
+    hr = sStage->lpVtbl->QueryInterface(sStage, &IID_IDXGISurface, (void **)(&surf));
+    if (FAILED(hr)) {
+        printf("Failed to QI staging surface: %#lX\n", hr);
+        release_staging(display);
+        return -1;
+    }
+
+    sStageWidth = display->width;
+    sStageHeight = display->height;
+    return 0;
+}
+
 static int get_duplication(Display *display)
 {
     HRESULT hr;
@@ -144,6 +220,12 @@ static int get_duplication(Display *display)
         int screen_height = pRect->bottom - pRect->top;
         if (display->width != screen_width
             || display->height != screen_height) {
+            release_staging(display);
+            wregion_clear(&display->deferred);
+            tilehash_destroy(display->tile_hash);
+            display->tile_hash = NULL;
+            video_detect_destroy(display->video);
+            display->video = NULL;
             display->width = screen_width;
             display->height = screen_height;
             if (display->handle_resize_cb) {
@@ -210,14 +292,9 @@ static void release_update_frame(Display *display)
 
 static void release_screen_bitmap(Display *display)
 {
-    if (surf) {
+    if (surf && sStageMapped) {
         surf->lpVtbl->Unmap(surf);
-        surf->lpVtbl->Release(surf);
-        surf = NULL;
-    }
-    if (sStage) {
-        sStage->lpVtbl->Release(sStage);
-        sStage = NULL;
+        sStageMapped = false;
     }
 
     display->accumulated_frames = 0;
@@ -230,13 +307,14 @@ static int update_changes(Display *display)
     IDXGIResource* DesktopResource = 0;
     DXGI_OUTDUPL_FRAME_INFO FrameInfo;
 
-    if (display->accumulated_frames > 0) {
-        release_screen_bitmap(display);
-    }
+    /// the staging texture may be mapped without a new frame, for deferred damage
+    release_screen_bitmap(display);
 
     /// 截取屏幕数据，但是还不能直接访问原始数据
+    /// don't block while deferred damage waits to be sent
     hr = gOutputDuplication->lpVtbl->AcquireNextFrame(
-        gOutputDuplication, 500, &FrameInfo, &DesktopResource);
+        gOutputDuplication, wregion_is_empty(&display->deferred) ? 500 : 0,
+        &FrameInfo, &DesktopResource);
     if (hr != S_OK) {
         /// refer: https://docs.microsoft.com/zh-cn/windows/desktop/api/dxgi1_2/nf-dxgi1_2-idxgioutputduplication-acquirenextframe
         if (hr == DXGI_ERROR_ACCESS_LOST) {
@@ -259,6 +337,11 @@ static int update_changes(Display *display)
         release_update_frame(display);
         return -1;
     }
+    display->acquired_at = stats_now();
+    stats_count(STATS_FRAMES, 1);
+    if (FrameInfo.AccumulatedFrames > 1) {
+        stats_count(STATS_DROPPED_FRAMES, FrameInfo.AccumulatedFrames - 1);
+    }
     display->accumulated_frames = FrameInfo.AccumulatedFrames;
     display->total_metadata_buffer_size = FrameInfo.TotalMetadataBufferSize;
     memcpy(&display->FrameInfo, &FrameInfo, sizeof(FrameInfo));
@@ -283,19 +366,19 @@ static bool find_invalid_region(Display *display)
     UINT bufSize;
     BYTE *dirtyRects;
     UINT dirtyRectSize;
-    RECT *invalid;
+    WinSpiceRect *clipped;
     RECT *pRect;
+    DXGI_OUTDUPL_MOVE_RECT *pMove;
+    UINT moveRectSize;
+    WinSpiceRect bounds;
 
     if (display->accumulated_frames == 0 || display->total_metadata_buffer_size == 0) {
         printf("No accumulated frames\n");
         return false;
     }
 
-    dataBuffer = (BYTE *)w_malloc(display->total_metadata_buffer_size);
-    if (!dataBuffer) {
-        printf("Failed to allocate memory for metadata");
-        exit(1);
-    }
+    dataBuffer = (BYTE *)frame_arena_alloc(&display->arena,
+                                           display->total_metadata_buffer_size);
 
     bufSize = display->total_metadata_buffer_size;
     hr = gOutputDuplication->lpVtbl->GetFrameMoveRects(gOutputDuplication, bufSize, (DXGI_OUTDUPL_MOVE_RECT *)dataBuffer, &bufSize);
@@ -304,6 +387,29 @@ static bool find_invalid_region(Display *display)
         goto failed;
     }
 
+    moveRectSize = bufSize / sizeof(DXGI_OUTDUPL_MOVE_RECT);
+    if (display->moves_size < display->num_moves + (int)moveRectSize) {
+        WinSpiceMove *moves;
+        display->moves_size = display->num_moves + moveRectSize;
+        moves = w_malloc(display->moves_size * sizeof(WinSpiceMove));
+        if (display->num_moves) {
+            memcpy(moves, display->moves, display->num_moves * sizeof(WinSpiceMove));
+        }
+        w_free(display->moves);
+        display->moves = moves;
+    }
+    pMove = (DXGI_OUTDUPL_MOVE_RECT *)dataBuffer;
+    for (i = 0; i < moveRectSize; ++i) {
+        WinSpiceMove *move = &display->moves[display->num_moves++];
+        move->dest.left   = pMove->DestinationRect.left;
+        move->dest.top    = pMove->DestinationRect.top;
+        move->dest.right  = pMove->DestinationRect.right;
+        move->dest.bottom = pMove->DestinationRect.bottom;
+        move->src_x       = pMove->SourcePoint.x;
+        move->src_y       = pMove->SourcePoint.y;
+        ++pMove;
+    }
+
     dirtyRects = dataBuffer + bufSize;
     bufSize = display->total_metadata_buffer_size - bufSize;
 
@@ -314,101 +420,293 @@ static bool find_invalid_region(Display *display)
     }
     dirtyRectSize = bufSize / sizeof(RECT);
     pRect = (RECT *)dirtyRects;
-    invalid = &display->invalid;
+    /// clipped in place, a RECT is as large as a WinSpiceRect, then banded in one pass
+    G_STATIC_ASSERT(sizeof(RECT) == sizeof(WinSpiceRect));
+    clipped = (WinSpiceRect *)dirtyRects;
     for (i = 0; i < dirtyRectSize; ++i) {
-        UnionRect(invalid, invalid, pRect);
+        WinSpiceRect rect;
+        rect.left   = MAX(pRect->left, 0);
+        rect.top    = MAX(pRect->top, 0);
+        rect.right  = MIN(pRect->right, (LONG)display->width);
+        rect.bottom = MIN(pRect->bottom, (LONG)display->height);
+        clipped[i] = rect;
         ++pRect;
     }
-    w_free(dataBuffer);
+    wregion_union_rects(&display->invalid, clipped, dirtyRectSize);
+
+    /// moves are applied by the client before the dirty rects are painted
+    bounds.left = 0;
+    bounds.top = 0;
+    bounds.right = display->width;
+    bounds.bottom = display->height;
+    display->num_moves = moverect_filter(display->moves, display->num_moves,
+                                         &bounds, &display->invalid);
+    display->fetched_at = stats_now();
+    if (display->video_detect_enabled) {
+        if (!display->video) {
+            display->video = video_detect_new(display->width, display->height);
+        }
+        video_detect_frame(display->video, &display->invalid, display->fetched_at);
+        /// whole video regions are staged, also if this frame gets deferred
+        video_detect_extend(display->video, &display->invalid);
+    }
+    stats_record(STATS_STAGE_METADATA, display->fetched_at - display->acquired_at);
     return true;
 
 failed:
-    if (dataBuffer) {
-        w_free(dataBuffer);
-    }
     return false;
 }
 
 static void clear_invalid_region(Display *display)
 {
-    SetRectEmpty(&display->invalid);
+    wregion_clear(&display->invalid);
+    display->num_moves = 0;
+    display->num_video = 0;
+    fill_list_clear(&display->fills);
 }
 
-static bool get_screen_bitmap(Display *display, uint8_t **bitmap, int *pitch)
+/// copy @region of the acquired frame to the staging texture, which must not be mapped
+static bool copy_to_staging(Display *display, const WinSpiceRegion *region)
 {
-    if (!bitmap || !pitch) {
+    WinSpiceRegion *staged = &display->staged;
+    const WinSpiceRect *rects;
+    int i, n;
+
+    if (create_staging(display) != 0) {
         return false;
     }
-    HRESULT hr;
-    D3D11_TEXTURE2D_DESC tDesc;
-    D3D11_BOX box;
-    RECT *invalid = &display->invalid;
 
-    tDesc.Width = (invalid->right - invalid->left);
-    tDesc.Height = (invalid->bottom - invalid->top);
-    tDesc.MipLevels = 1;
-    tDesc.ArraySize = 1;
-    tDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    tDesc.SampleDesc.Count = 1;
-    tDesc.SampleDesc.Quality = 0;
-    tDesc.Usage = D3D11_USAGE_STAGING;
-    tDesc.BindFlags = 0;
-    tDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-    tDesc.MiscFlags = 0;
+    /// tile hashes need the whole tile, not only the dirty part of it
+    if (display->tile_hash) {
+        tilehash_align(display->tile_hash, staged, region);
+    } else {
+        wregion_copy(staged, region);
+    }
 
-    box.top = invalid->top;
-    box.left = invalid->left;
-    box.right = invalid->right;
-    box.bottom = invalid->bottom;
-    box.front = 0;
-    box.back = 1;
+    rects = wregion_rects(staged, &n);
+    for (i = 0; i < n; i++) {
+        D3D11_BOX box;
+        box.left = rects[i].left;
+        box.top = rects[i].top;
+        box.right = rects[i].right;
+        box.bottom = rects[i].bottom;
+        box.front = 0;
+        box.back = 1;
+        gContext->lpVtbl->CopySubresourceRegion(
+            gContext, (ID3D11Resource*)sStage, 0, box.left, box.top, 0,
+            (ID3D11Resource*)gAcquiredDesktopImage, 0, &box);
+    }
 
-    /// 创建一个新的2D纹理对象，用于把 gAcquiredDesktopImage的数据copy进去
-    hr = gDevice->lpVtbl->CreateTexture2D(gDevice, &tDesc, NULL, &sStage);
-    if (FAILED(hr)) {
-        printf("Failed to CreateTexture2D: %#lX\n", hr);
+    return true;
+}
+
+/**
+ * Copy the damage of the acquired frame, if any, to the staging texture,
+ * add the deferred damage, whose pixels are already there, and map it.
+ */
+static bool stage_invalid_region(Display *display, bool fresh)
+{
+    HRESULT hr;
+
+    if (fresh && !copy_to_staging(display, &display->invalid)) {
         return false;
     }
+    wregion_union(&display->invalid, &display->invalid, &display->deferred);
+    wregion_clear(&display->deferred);
 
-    gContext->lpVtbl->CopySubresourceRegion(gContext, (ID3D11Resource*)sStage, 0,0,0,0, (ID3D11Resource*) gAcquiredDesktopImage, 0, &box);
-
-    hr = sStage->lpVtbl->QueryInterface(sStage, &IID_IDXGISurface, (void **)(&surf));
+    hr = surf->lpVtbl->Map(surf, &sMappedRect, DXGI_MAP_READ);
     if (FAILED(hr)) {
-        printf("Failed to QI staging surface: %#lX\n", hr);
+        printf("Failed to map staging surface: %#lX\n", hr);
         return false;
     }
+    sStageMapped = true;
+    if (fresh) {
+        stats_record_since(STATS_STAGE_STAGING, display->fetched_at);
+    }
 
-    /// copy bits to user space
-    DXGI_MAPPED_RECT mappedRect;
-    hr = surf->lpVtbl->Map(surf, &mappedRect, DXGI_MAP_READ);
+    return true;
+}
 
-    if (SUCCEEDED(hr)) {
-//        printf("===%d\n", mappedRect.Pitch * tDesc.Height);
-        *bitmap = (uint8_t *)w_malloc(mappedRect.Pitch * tDesc.Height);
-        memcpy(*bitmap, mappedRect.pBits, mappedRect.Pitch * tDesc.Height);
-        *pitch = mappedRect.Pitch;
+/// the client has not seen the deferred damage, moving its stale pixels would be wrong
+static void moves_to_damage(Display *display)
+{
+    int i;
+
+    for (i = 0; i < display->num_moves; i++) {
+        wregion_union_rect(&display->invalid, &display->invalid, &display->moves[i].dest);
     }
+    display->num_moves = 0;
+}
 
-    return true;
+static void ensure_tile_hash(Display *display)
+{
+    if (display->tile_hash_enabled && !display->tile_hash) {
+        display->tile_hash = tilehash_new(display->width, display->height, TILE_HASH_SIZE);
+    }
 }
 
-bool get_invalid_bitmap(struct Display *display, uint8_t **bitmaps, int *pitch)
+/// drop the parts of the invalid region whose pixels did not really change
+static void verify_invalid_region(Display *display)
 {
-    if (!display->display_have_updates(display)) {
+    uint64_t saved;
+    int i;
+
+    /// moved tiles changed on the client without being reported dirty
+    for (i = 0; i < display->num_moves; i++) {
+        tilehash_invalidate(display->tile_hash, &display->moves[i].dest);
+    }
+
+    saved = tilehash_filter(display->tile_hash, &display->invalid,
+                            sMappedRect.pBits, sMappedRect.Pitch);
+#ifdef WIN_SPICE_DEBUG
+    if (fp_dbg && saved) {
+        fprintf(fp_dbg, "tile hash: %llu bytes saved, %llu total\n",
+                (unsigned long long)saved,
+                (unsigned long long)display->tile_hash->total_saved_bytes);
+    }
+#endif // WIN_SPICE_DEBUG
+}
+
+static bool get_screen_bitmap(Display *display, const WinSpiceRect *rect,
+                              uint8_t **bitmap, int *pitch)
+{
+    int width, height;
+    const uint8_t *src;
+
+    if (!bitmap || !pitch || !sStageMapped || wrect_is_empty(rect)) {
         return false;
     }
 
-    if (!display->find_invalid_region(display)) {
+    width = rect->right - rect->left;
+    height = rect->bottom - rect->top;
+
+    /// copy bits to user space
+    *pitch = width * 4;
+    *bitmap = (uint8_t *)w_bitmap_alloc(*pitch * height);
+    src = sMappedRect.pBits + rect->top * sMappedRect.Pitch + rect->left * 4;
+    pixel_copy_rect(*bitmap, *pitch, src, sMappedRect.Pitch, *pitch, height);
+
+    return true;
+}
+
+bool get_invalid_bitmap(struct Display *display)
+{
+    bool fresh = display->display_have_updates(display);
+    /// every acquired frame holds the whole desktop, also one that only moved the pointer
+    bool refresh = gAcquiredDesktopImage && atomic_load(&display->refresh);
+
+    if (!fresh && !refresh && wregion_is_empty(&display->deferred)) {
         return false;
     }
 
-    if (!display->get_screen_bitmap(display, bitmaps, pitch)) {
+    if (fresh) {
+        if (!display->find_invalid_region(display)) {
+            return false;
+        }
+        if (!wregion_is_empty(&display->deferred)) {
+            moves_to_damage(display);
+        }
+    }
+    if (refresh) {
+        display_refresh_region(display);
+        fresh = true;
+    }
+
+    if (wregion_is_empty(&display->invalid) && wregion_is_empty(&display->deferred)) {
+        /// a frame may consist of moves only
+        return display->num_moves > 0;
+    }
+
+    ensure_tile_hash(display);
+
+    if (!stage_invalid_region(display, fresh)) {
         return false;
     }
+    if (refresh) {
+        atomic_store(&display->refresh, false);
+    }
+
+    if (display->tile_hash) {
+        verify_invalid_region(display);
+    }
+
+    /// before fill detection, which would cut flat parts out of a video
+    if (display->video) {
+        video_detect_classify(display->video, sMappedRect.pBits, sMappedRect.Pitch);
+        display->num_video = video_detect_take(display->video, &display->invalid,
+                                               display->video_rects);
+    }
+
+    fill_detect(sMappedRect.pBits, sMappedRect.Pitch, &display->invalid, &display->fills);
+
+    if (wregion_is_empty(&display->invalid)) {
+        return display->num_moves > 0 || display->fills.num_fills > 0
+               || display->num_video > 0;
+    }
 
     return true;
 }
 
+/**
+ * Remember the damage of the acquired frame without building bitmaps.
+ * Its pixels wait in the staging texture until get_invalid_bitmap()
+ * sends all deferred damage at once.
+ */
+static void defer_invalid_region(Display *display)
+{
+    if (!display->display_have_updates(display)) {
+        return;
+    }
+    if (!display->find_invalid_region(display)) {
+        return;
+    }
+
+    moves_to_damage(display);
+    ensure_tile_hash(display);
+    if (copy_to_staging(display, &display->invalid)) {
+        wregion_union(&display->deferred, &display->deferred, &display->invalid);
+    }
+    clear_invalid_region(display);
+}
+
+void display_request_refresh(Display *display)
+{
+    atomic_store(&display->refresh, true);
+}
+
+void display_refresh_region(Display *display)
+{
+    WinSpiceRect screen = { 0, 0, display->width, display->height };
+
+    wregion_union_rect(&display->invalid, &display->invalid, &screen);
+    /// the whole screen is painted anyway, and the client may have missed what hashes remember
+    display->num_moves = 0;
+    if (display->tile_hash) {
+        tilehash_reset(display->tile_hash);
+    }
+    display->fetched_at = stats_now();
+}
+
+void display_enable_video_detect(Display *display, bool enable)
+{
+    /// takes effect on the next captured frame
+    display->video_detect_enabled = enable;
+    if (!enable) {
+        video_detect_destroy(display->video);
+        display->video = NULL;
+    }
+}
+
+void display_enable_tile_hash(Display *display, bool enable)
+{
+    /// takes effect on the next captured frame
+    display->tile_hash_enabled = enable;
+    if (!enable) {
+        tilehash_destroy(display->tile_hash);
+        display->tile_hash = NULL;
+    }
+}
+
 #define BPP         4
 static int ProcessMonoMask(Display *display, bool IsMono, PTR_INFO* PtrInfo, INT* PtrWidth, INT* PtrHeight, INT* PtrLeft, INT* PtrTop, BYTE** InitBuffer, D3D11_BOX* Box)
 {
@@ -497,7 +795,7 @@ static int ProcessMonoMask(Display *display, bool IsMono, PTR_INFO* PtrInfo, INT
     }
 
     // New mouseshape buffer
-    *InitBuffer = (BYTE *)w_malloc0(*PtrWidth * *PtrHeight * BPP);
+    *InitBuffer = (BYTE *)frame_arena_alloc0(&display->arena, *PtrWidth * *PtrHeight * BPP);
 
     UINT* InitBuffer32 = (UINT *)(*InitBuffer);
     UINT* Desktop32 = (UINT *)(MappedSurface.pBits);
@@ -509,43 +807,22 @@ static int ProcessMonoMask(Display *display, bool IsMono, PTR_INFO* PtrInfo, INT
 
     if (IsMono) {
         for (INT Row = 0; Row < *PtrHeight; ++Row) {
-            // Set mask
-            BYTE Mask = 0x80;
-            Mask = Mask >> (SkipX % 8);
-            for (INT Col = 0; Col < *PtrWidth; ++Col) {
-                // Get masks using appropriate offsets
-                BYTE AndMask = PtrInfo->PtrShapeBuffer[((Col + SkipX) / 8) + ((Row + SkipY) * (PtrInfo->ShapeInfo.Pitch))] & Mask;
-                BYTE XorMask = PtrInfo->PtrShapeBuffer[((Col + SkipX) / 8) + ((Row + SkipY + (PtrInfo->ShapeInfo.Height / 2)) * (PtrInfo->ShapeInfo.Pitch))] & Mask;
-                UINT AndMask32 = (AndMask) ? 0xFFFFFFFF : 0xFF000000;
-                UINT XorMask32 = (XorMask) ? 0x00FFFFFF : 0x00000000;
-
-                // Set new pixel
-                InitBuffer32[(Row * *PtrWidth) + Col] = (Desktop32[(Row * DesktopPitchInPixels) + Col] & AndMask32) ^ XorMask32;
-
-                // Adjust mask
-                if (Mask == 0x01) {
-                    Mask = 0x80;
-                } else {
-                    Mask = Mask >> 1;
-                }
-            }
+            const BYTE *AndMask = PtrInfo->PtrShapeBuffer + (Row + SkipY) * PtrInfo->ShapeInfo.Pitch;
+            const BYTE *XorMask = PtrInfo->PtrShapeBuffer + (Row + SkipY + (PtrInfo->ShapeInfo.Height / 2)) * PtrInfo->ShapeInfo.Pitch;
+            pixel_cursor_mono(InitBuffer32 + Row * *PtrWidth,
+                              Desktop32 + Row * DesktopPitchInPixels,
+                              AndMask, XorMask, SkipX, *PtrWidth);
         }
     } else {
         UINT* Buffer32 = (UINT *)(PtrInfo->PtrShapeBuffer);
+        UINT  ShapePitchInPixels = PtrInfo->ShapeInfo.Pitch / sizeof(UINT);
 
-        // Iterate through pixels
+        // Xor the shape onto the desktop where its mask is 0xFF
         for (INT Row = 0; Row < *PtrHeight; ++Row) {
-            for (INT Col = 0; Col < *PtrWidth; ++Col) {
-                // Set up mask
-                UINT MaskVal = 0xFF000000 & Buffer32[(Col + SkipX) + ((Row + SkipY) * (PtrInfo->ShapeInfo.Pitch / sizeof(UINT)))];
-                if (MaskVal) {
-                    // Mask was 0xFF
-                    InitBuffer32[(Row * *PtrWidth) + Col] = (Desktop32[(Row * DesktopPitchInPixels) + Col] ^ Buffer32[(Col + SkipX) + ((Row + SkipY) * (PtrInfo->ShapeInfo.Pitch / sizeof(UINT)))]) | 0xFF000000;
-                } else {
-                    // Mask was 0x00
-                    InitBuffer32[(Row * *PtrWidth) + Col] = Buffer32[(Col + SkipX) + ((Row + SkipY) * (PtrInfo->ShapeInfo.Pitch / sizeof(UINT)))] | 0xFF000000;
-                }
-            }
+            pixel_cursor_color(InitBuffer32 + Row * *PtrWidth,
+                               Desktop32 + Row * DesktopPitchInPixels,
+                               Buffer32 + SkipX + (Row + SkipY) * ShapePitchInPixels,
+                               *PtrWidth);
         }
     }
 
@@ -590,12 +867,26 @@ static bool mouse_have_new_shape(Display *display)
     return false;
 }
 
+/// cache key of a shape: its pixels and everything else that ends up in the cursor
+static uint64_t cursor_key(const PTR_INFO *PtrInfo, const uint8_t *shape, int pitch,
+                           int height)
+{
+    const DXGI_OUTDUPL_POINTER_SHAPE_INFO *info = &PtrInfo->ShapeInfo;
+    uint64_t key = hash_rect(shape, pitch, pitch, height);
+
+    key = hash_round(key, (uint64_t)info->Type << 32 | info->Width);
+    key = hash_round(key, (uint64_t)info->Height << 32 | (uint32_t)height);
+    return hash_round(key, (uint64_t)(uint32_t)info->HotSpot.x << 32
+                           | (uint32_t)info->HotSpot.y);
+}
+
 static int mouse_get_new_shape(Display *display, WinSpiceCursor **cursor)
 {
     DXGI_OUTDUPL_FRAME_INFO *FrameInfo = &display->FrameInfo;
     PTR_INFO *PtrInfo = display->PtrInfo; /* FIXME: use struct */
     UINT BufferSizeRequired;
     WinSpiceCursor *c = NULL;
+    uint64_t key = 0;
 
     INT PtrWidth  = 0;
     INT PtrHeight = 0;
@@ -605,28 +896,39 @@ static int mouse_get_new_shape(Display *display, WinSpiceCursor **cursor)
     Box.front = 0;
     Box.back  = 1;
 
-    /* FIXME: memery cache? */
-    PtrInfo->PtrShapeBuffer = w_malloc(FrameInfo->PointerShapeBufferSize);
+    PtrInfo->PtrShapeBuffer = frame_arena_alloc(&display->arena,
+                                                FrameInfo->PointerShapeBufferSize);
+    PtrInfo->BufferSize = FrameInfo->PointerShapeBufferSize;
 
     // Get shape
     HRESULT hr = gOutputDuplication->lpVtbl->GetFramePointerShape(
         gOutputDuplication,
-        FrameInfo->PointerShapeBufferSize,
+        PtrInfo->BufferSize,
         (void *)(PtrInfo->PtrShapeBuffer),
         &BufferSizeRequired,
         &(PtrInfo->ShapeInfo));
     if (FAILED(hr)) {
         printf("Failed to get mouse: %#lX\n", hr);
-        w_free(PtrInfo->PtrShapeBuffer);
         return -1;
     }
 
+    /// masked color shapes depend on the desktop below, they are keyed after conversion
+    if (PtrInfo->ShapeInfo.Type != DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR) {
+        key = cursor_key(PtrInfo, PtrInfo->PtrShapeBuffer, PtrInfo->ShapeInfo.Pitch,
+                         PtrInfo->ShapeInfo.Height);
+        *cursor = cursor_cache_lookup(&display->cursor_cache, key);
+        if (*cursor) {
+            return 0;
+        }
+    }
+
     switch (PtrInfo->ShapeInfo.Type) {
     case DXGI_OUTDUPL_POINTER_SHAPE_TYPE_COLOR: {
         PtrWidth = PtrInfo->ShapeInfo.Width;
         PtrHeight = PtrInfo->ShapeInfo.Height;
-        *cursor = w_malloc(sizeof(WinSpiceCursor) + PtrInfo->ShapeInfo.Pitch * PtrHeight);
-        memcpy((*cursor)->data, PtrInfo->PtrShapeBuffer,  PtrInfo->ShapeInfo.Pitch * PtrHeight);
+        c = w_malloc(sizeof(WinSpiceCursor) + PtrWidth * BPP * PtrHeight);
+        pixel_copy_rect((uint8_t *)c->data, PtrWidth * BPP, PtrInfo->PtrShapeBuffer,
+                        PtrInfo->ShapeInfo.Pitch, PtrWidth * BPP, PtrHeight);
         break;
     }
     case DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME: {
@@ -634,33 +936,39 @@ static int mouse_get_new_shape(Display *display, WinSpiceCursor **cursor)
         PtrWidth = PtrInfo->ShapeInfo.Width;
         PtrHeight = PtrInfo->ShapeInfo.Height / 2;
         int bpl = (PtrWidth + 7) / 8;
-        *cursor = w_malloc(sizeof(WinSpiceCursor) + bpl * PtrInfo->ShapeInfo.Height);
-        memcpy((*cursor)->data, PtrInfo->PtrShapeBuffer, bpl * PtrInfo->ShapeInfo.Height);
+        c = w_malloc(sizeof(WinSpiceCursor) + bpl * PtrInfo->ShapeInfo.Height);
+        pixel_copy_rect((uint8_t *)c->data, bpl, PtrInfo->PtrShapeBuffer,
+                        PtrInfo->ShapeInfo.Pitch, bpl, PtrInfo->ShapeInfo.Height);
         break;
     }
     case DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR: {
         /* FIXME: fix later */
         BYTE* InitBuffer = NULL;
         printf("FIXME! UNIMPLEMENTED! %s\n", __func__);
-        ProcessMonoMask(display, false, PtrInfo, &PtrWidth, &PtrHeight, &PtrLeft, &PtrTop, &InitBuffer, &Box);
-        *cursor = w_malloc(sizeof(WinSpiceCursor) + PtrWidth * BPP * PtrHeight);
-        memcpy((*cursor)->data, InitBuffer, PtrWidth * BPP * PtrHeight);
-        w_free(InitBuffer);
+        if (ProcessMonoMask(display, false, PtrInfo, &PtrWidth, &PtrHeight, &PtrLeft, &PtrTop,
+                            &InitBuffer, &Box) != 0) {
+            return -1;
+        }
+        key = cursor_key(PtrInfo, InitBuffer, PtrWidth * BPP, PtrHeight);
+        *cursor = cursor_cache_lookup(&display->cursor_cache, key);
+        if (*cursor) {
+            return 0;
+        }
+        c = w_malloc(sizeof(WinSpiceCursor) + PtrWidth * BPP * PtrHeight);
+        pixel_copy_rect((uint8_t *)c->data, PtrWidth * BPP, InitBuffer,
+                        PtrWidth * BPP, PtrWidth * BPP, PtrHeight);
         break;
     }
     default:
-        /// TODO: free resource and return
-        break;
+        return -1;
     }
 
-    c = *cursor;
     c->width = PtrWidth;
     c->height = PtrHeight;
     c->hot_x = PtrInfo->ShapeInfo.HotSpot.x;
     c->hot_y = PtrInfo->ShapeInfo.HotSpot.y;
     c->ptr_type = PtrInfo->ShapeInfo.Type;
-    w_free(PtrInfo->PtrShapeBuffer);
-    PtrInfo->PtrShapeBuffer = NULL;
+    *cursor = cursor_cache_insert(&display->cursor_cache, key, c);
 
     return 0;
 }
@@ -672,7 +980,11 @@ Display *display_new()
         return NULL;
     }
 
-    SetRectEmpty(&display->invalid);
+    wregion_init(&display->invalid);
+    wregion_init(&display->deferred);
+    wregion_init(&display->staged);
+    cursor_cache_init(&display->cursor_cache);
+    frame_arena_init(&display->arena, FRAME_ARENA_INITIAL);
 
     display->update_changes = update_changes;
     display->release_update_frame = release_update_frame;
@@ -681,6 +993,7 @@ Display *display_new()
     display->clear_invalid_region = clear_invalid_region;
     display->get_screen_bitmap = get_screen_bitmap;
     display->get_invalid_bitmap = get_invalid_bitmap;
+    display->defer_invalid_region = defer_invalid_region;
     display->PtrInfo = w_malloc0(sizeof(PTR_INFO));
 
     /// mouse
@@ -706,11 +1019,33 @@ failed:
 void display_destroy(Display *display)
 {
     if (display) {
+        release_staging(display);
+        tilehash_destroy(display->tile_hash);
+        video_detect_destroy(display->video);
+        wregion_fini(&display->invalid);
+        wregion_fini(&display->deferred);
+        wregion_fini(&display->staged);
+        w_free(display->moves);
+        fill_list_fini(&display->fills);
+        cursor_cache_fini(&display->cursor_cache);
+        printf("frame arena: %llu allocs, %llu from the heap, %lu bytes high-water\n",
+               (unsigned long long)display->arena.allocs,
+               (unsigned long long)display->arena.heap_allocs,
+               (unsigned long)display->arena.high_water);
+        frame_arena_fini(&display->arena);
+        synth_source_destroy(display->synth);
         w_free(display->PtrInfo);
         w_free(display);
     }
 }
 
+void display_begin_frame(Display *display)
+{
+    frame_arena_reset(&display->arena);
+    display->PtrInfo->PtrShapeBuffer = NULL;
+    display->PtrInfo->BufferSize = 0;
+}
+
 void register_handle_resize_cb(Display *display, handle_resize_cb func,
                                void *userdata)
 {
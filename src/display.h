@@ -21,12 +21,21 @@
 #define WIN_SPICE_DISPLAY_H
 #include <glib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <dxgi1_2.h>
 #include <stdint.h>
 #include <windows.h>
+#include "region.h"
+#include "moverect.h"
+#include "tilehash.h"
+#include "fill.h"
+#include "cursorcache.h"
+#include "arena.h"
+#include "videodetect.h"
 
 typedef struct _PTR_INFO
 {
+    /// taken from the frame arena, only valid while a new shape is processed
     _Field_size_bytes_(BufferSize) BYTE* PtrShapeBuffer;
     DXGI_OUTDUPL_POINTER_SHAPE_INFO ShapeInfo;
     POINT Position;
@@ -36,36 +45,61 @@ typedef struct _PTR_INFO
     LARGE_INTEGER LastTimeStamp;
 } PTR_INFO;
 
-/* cursor data format is 32bit RGBA */
-typedef struct WinSpiceCursor {
-    int                 width, height;
-    int                 hot_x, hot_y;
-    int                 ptr_type;
-    uint32_t            data[];
-} WinSpiceCursor;
-
 typedef void (*handle_resize_cb)(void *data);
 
+struct SynthSource;
+
 typedef struct Display {
     /// TODO: provide get/set_width
     uint32_t width;
     uint32_t height;
     uint32_t accumulated_frames;
     uint32_t total_metadata_buffer_size;
-    RECT invalid;
+    WinSpiceRegion invalid;
+    /// damage not sent yet, its pixels are kept in the staging texture
+    WinSpiceRegion deferred;
+    /// parts of the acquired frame copied to the staging texture, kept for reuse
+    WinSpiceRegion staged;
+    /// set by display_request_refresh(), the next frame sends the whole screen
+    atomic_bool refresh;
+    WinSpiceMove *moves;
+    int num_moves;
+    int moves_size;
+    /// flat parts split out of the invalid region
+    FillList fills;
+    /// optional check of dirty rects against the last sent pixels
+    TileHash *tile_hash;
+    bool tile_hash_enabled;
+    /// optional heatmap of the damage that finds video regions
+    VideoDetector *video;
+    bool video_detect_enabled;
+    /// whole video regions of this frame, taken out of the invalid region
+    WinSpiceRect video_rects[VIDEO_MAX_REGIONS];
+    int num_video;
     DXGI_OUTDUPL_FRAME_INFO FrameInfo;
+    /// stats_now() when the last frame was acquired and its dirty rects fetched
+    uint64_t acquired_at;
+    uint64_t fetched_at;
     PTR_INFO *PtrInfo;
+    CursorCache cursor_cache;
+    /// set if frames come from the synthetic desktop, see synthdisplay.c
+    struct SynthSource *synth;
+    /// temporary buffers of one capture iteration, see display_begin_frame()
+    FrameArena arena;
     int (*update_changes)(struct Display *display);
     void (*release_update_frame)(struct Display *display);
     bool (*display_have_updates)(struct Display *display);
     bool (*find_invalid_region)(struct Display *display);
     void (*clear_invalid_region)(struct Display *display);
-    bool (*get_screen_bitmap)(struct Display *display, uint8_t **bitmap, int *pitch);
-    bool (*get_invalid_bitmap)(struct Display *display, uint8_t **bitmap, int *pitch);
+    bool (*get_screen_bitmap)(struct Display *display, const WinSpiceRect *rect,
+                              uint8_t **bitmap, int *pitch);
+    bool (*get_invalid_bitmap)(struct Display *display);
+    void (*defer_invalid_region)(struct Display *display);
 
     /// mouse
     bool (*mouse_have_updates)(struct Display *display);
     bool (*mouse_have_new_shape)(struct Display *display);
+    /// the returned cursor belongs to the display's cursor cache
     int (*mouse_get_new_shape)(struct Display *display, WinSpiceCursor **cursor);
 
     /// callback funcs for handle display event
@@ -74,8 +108,18 @@ typedef struct Display {
 } Display;
 
 Display *display_new();
+/// a display that captures the synthetic desktop, for the latency probe
+Display *display_new_synthetic(uint32_t width, uint32_t height);
 void display_destroy(Display *display);
 void register_handle_resize_cb(Display *display, handle_resize_cb func,
                                void *userdata);
+void display_enable_tile_hash(Display *display, bool enable);
+void display_enable_video_detect(Display *display, bool enable);
+/// start a capture iteration, frees everything taken from display->arena
+void display_begin_frame(Display *display);
+/// send the whole screen with the next frame, may be called from any thread
+void display_request_refresh(Display *display);
+/// add the whole screen to the invalid region of a refresh
+void display_refresh_region(Display *display);
 
 #endif  /* WIN_SPCIE_DISPLAY_H */
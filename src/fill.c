@@ -0,0 +1,200 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   fill.c
+ * @brief  Solid color detection
+ */
+
+#include <string.h>
+#include "fill.h"
+#include "memory.h"
+#include "pixel.h"
+
+/// a horizontal run of flat blocks, possibly grown downwards
+typedef struct FillRun {
+    WinSpiceRect rect;
+    uint32_t color;
+    bool extended;
+} FillRun;
+
+static void fill_list_add(FillList *list, const WinSpiceRect *rect, uint32_t color)
+{
+    if (list->num_fills == list->size) {
+        WinSpiceFill *fills;
+        list->size = list->size ? list->size * 2 : 16;
+        fills = w_malloc(list->size * sizeof(WinSpiceFill));
+        if (list->num_fills) {
+            memcpy(fills, list->fills, list->num_fills * sizeof(WinSpiceFill));
+        }
+        w_free(list->fills);
+        list->fills = fills;
+    }
+    list->fills[list->num_fills].rect = *rect;
+    list->fills[list->num_fills].color = color;
+    list->num_fills++;
+}
+
+void fill_list_clear(FillList *list)
+{
+    list->num_fills = 0;
+}
+
+void fill_list_fini(FillList *list)
+{
+    w_free(list->fills);
+    w_free(list->runs);
+    w_free(list->flat_rects);
+    wregion_fini(&list->flat);
+    memset(list, 0, sizeof(*list));
+}
+
+static const uint8_t *pixel_at(const uint8_t *frame, int pitch, int x, int y)
+{
+    return frame + (size_t)y * pitch + (size_t)x * 4;
+}
+
+static void close_runs(FillRun *runs, int *num_runs, FillList *fills)
+{
+    int i, n = 0;
+
+    for (i = 0; i < *num_runs; i++) {
+        if (runs[i].extended) {
+            runs[i].extended = false;
+            runs[n++] = runs[i];
+        } else if (wrect_area(&runs[i].rect) >= FILL_MIN_AREA) {
+            fill_list_add(fills, &runs[i].rect, runs[i].color);
+        }
+    }
+    *num_runs = n;
+}
+
+/// split flat block-aligned areas out of a rect that is not flat as a whole
+static void detect_in_rect(const uint8_t *frame, int pitch, const WinSpiceRect *r,
+                           FillList *fills, FillRun *open, FillRun *row)
+{
+    int bx1 = (r->left + FILL_BLOCK_SIZE - 1) / FILL_BLOCK_SIZE;
+    int by1 = (r->top + FILL_BLOCK_SIZE - 1) / FILL_BLOCK_SIZE;
+    int bx2 = r->right / FILL_BLOCK_SIZE;
+    int by2 = r->bottom / FILL_BLOCK_SIZE;
+    int num_open = 0;
+    int bx, by, i, j;
+
+    for (by = by1; by < by2; by++) {
+        int y = by * FILL_BLOCK_SIZE;
+        int num_row = 0;
+
+        /// runs of flat blocks with the same color on this block row
+        for (bx = bx1; bx < bx2; bx++) {
+            int x = bx * FILL_BLOCK_SIZE;
+            uint32_t color;
+            if (!pixel_is_uniform(pixel_at(frame, pitch, x, y), pitch,
+                                  FILL_BLOCK_SIZE, FILL_BLOCK_SIZE, &color)) {
+                continue;
+            }
+            if (num_row > 0 && row[num_row - 1].rect.right == x
+                && row[num_row - 1].color == color) {
+                row[num_row - 1].rect.right += FILL_BLOCK_SIZE;
+            } else {
+                row[num_row].rect.left = x;
+                row[num_row].rect.right = x + FILL_BLOCK_SIZE;
+                row[num_row].rect.top = y;
+                row[num_row].rect.bottom = y + FILL_BLOCK_SIZE;
+                row[num_row].color = color;
+                row[num_row].extended = false;
+                num_row++;
+            }
+        }
+
+        /// grow open runs that continue exactly, start new ones for the rest
+        for (i = 0; i < num_row; i++) {
+            for (j = 0; j < num_open; j++) {
+                if (!open[j].extended && open[j].rect.bottom == y
+                    && open[j].rect.left == row[i].rect.left
+                    && open[j].rect.right == row[i].rect.right
+                    && open[j].color == row[i].color) {
+                    open[j].rect.bottom += FILL_BLOCK_SIZE;
+                    open[j].extended = true;
+                    break;
+                }
+            }
+            if (j == num_open) {
+                row[i].extended = true;
+                open[num_open++] = row[i];
+            }
+        }
+        close_runs(open, &num_open, fills);
+    }
+    close_runs(open, &num_open, fills);
+}
+
+/// grow-only, so steady state frames do not allocate
+static void *fill_scratch(void *buf, int *size, int n, size_t elem_size)
+{
+    if (*size >= n) {
+        return buf;
+    }
+    w_free(buf);
+    *size = MAX(n, *size * 2);
+    return w_malloc(*size * elem_size);
+}
+
+int fill_detect(const uint8_t *frame, int pitch, WinSpiceRegion *damage, FillList *fills)
+{
+    const WinSpiceRect *rects;
+    FillRun *open, *row;
+    int i, n, first = fills->num_fills;
+    int max_blocks;
+
+    rects = wregion_rects(damage, &n);
+    if (n == 0) {
+        return 0;
+    }
+
+    max_blocks = (damage->extents.right - damage->extents.left) / FILL_BLOCK_SIZE + 1;
+    fills->runs = fill_scratch(fills->runs, &fills->runs_size, 2 * max_blocks, sizeof(FillRun));
+    open = fills->runs;
+    row = open + max_blocks;
+
+    for (i = 0; i < n; i++) {
+        const WinSpiceRect *r = &rects[i];
+        uint32_t color;
+
+        if (pixel_is_uniform(pixel_at(frame, pitch, r->left, r->top), pitch,
+                             r->right - r->left, r->bottom - r->top, &color)) {
+            fill_list_add(fills, r, color);
+            continue;
+        }
+        if (wrect_area(r) >= FILL_MIN_AREA) {
+            detect_in_rect(frame, pitch, r, fills, open, row);
+        }
+    }
+
+    if (fills->num_fills > first) {
+        fills->flat_rects = fill_scratch(fills->flat_rects, &fills->flat_size,
+                                         fills->num_fills - first, sizeof(WinSpiceRect));
+        for (i = first; i < fills->num_fills; i++) {
+            fills->flat_rects[i - first] = fills->fills[i].rect;
+        }
+        wregion_set_rects(&fills->flat, fills->flat_rects, fills->num_fills - first);
+        wregion_subtract(damage, damage, &fills->flat);
+    }
+
+    return fills->num_fills - first;
+}
@@ -0,0 +1,71 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   fill.h
+ * @brief  Solid color detection
+ *
+ * Window backgrounds, selections and cleared panels are flat colors.
+ * Such parts of the damage are sent as QXL_DRAW_FILL with a solid brush
+ * instead of a bitmap that spice-server would have to compress.
+ */
+
+#ifndef WIN_SPICE_FILL_H
+#define WIN_SPICE_FILL_H
+
+#include <stdint.h>
+#include "region.h"
+
+/// grid used to look for flat areas inside a dirty rect
+#define FILL_BLOCK_SIZE 16
+/// smallest flat area split out of a larger dirty rect, in pixels
+#define FILL_MIN_AREA   (64 * 64)
+
+typedef struct WinSpiceFill {
+    WinSpiceRect rect;
+    uint32_t color;
+} WinSpiceFill;
+
+typedef struct FillList {
+    WinSpiceFill *fills;
+    int num_fills;
+    int size;
+    /// working memory of fill_detect(), kept for the next frame
+    struct FillRun *runs;
+    int runs_size;
+    WinSpiceRect *flat_rects;
+    int flat_size;
+    WinSpiceRegion flat;
+} FillList;
+
+void fill_list_clear(FillList *list);
+void fill_list_fini(FillList *list);
+
+/**
+ * Find flat areas of @damage and move them from @damage to @fills.
+ *
+ * @frame points to pixel (0, 0) of a 32bpp copy of the screen whose
+ * pixels under @damage are current. A dirty rect that is flat as a whole
+ * always becomes a fill; inside larger rects only flat areas of at least
+ * FILL_MIN_AREA pixels are split out, so the remaining bitmaps do not
+ * fragment. Returns the number of fills added.
+ */
+int fill_detect(const uint8_t *frame, int pitch, WinSpiceRegion *damage, FillList *fills);
+
+#endif  /* WIN_SPICE_FILL_H */
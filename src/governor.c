@@ -0,0 +1,180 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file   governor.c
+ * @brief  Frame rate of the capture loop
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <mmsystem.h>
+#endif
+#include "governor.h"
+#include "stats.h"
+#include "trace.h"
+
+/// a cut needs some time to show in the ring before the next one
+#define GOVERNOR_HOLD       250000000ULL
+/// the spice side must keep up this long before the rate goes up
+#define GOVERNOR_CALM       500000000ULL
+
+static uint32_t ceiling(FpsGovernor *gov)
+{
+    return gov->cap_fps ? MIN(gov->max_fps, gov->cap_fps) : gov->max_fps;
+}
+
+/// returns the previous rate
+static uint32_t set_rate(FpsGovernor *gov, uint32_t fps, uint64_t now)
+{
+    uint32_t old = gov->fps;
+
+    gov->last_change = now;
+    gov->fps = MAX(gov->min_fps, MIN(ceiling(gov), fps));
+    gov->interval = 1000000000ULL / gov->fps;
+    if (gov->fps != old) {
+        trace_instant("fps change");
+    }
+    return old;
+}
+
+static void adapt_rate(FpsGovernor *gov, uint32_t fps, uint64_t now, const char *reason,
+                       uint32_t queued, uint32_t inflight)
+{
+    uint32_t old = set_rate(gov, fps, now);
+
+    if (gov->fps != old) {
+        printf("fps: %u -> %u, %s (%u drawables queued, %u KB in flight)\n",
+               old, gov->fps, reason, queued, inflight / 1024);
+    }
+}
+
+void governor_init(FpsGovernor *gov, uint32_t max_fps)
+{
+    memset(gov, 0, sizeof(*gov));
+    gov->min_fps = GOVERNOR_MIN_FPS;
+    gov->max_fps = MAX(GOVERNOR_CEILING_MIN, MIN(GOVERNOR_CEILING_MAX, max_fps));
+    gov->fps = GOVERNOR_START_FPS;
+    gov->interval = 1000000000ULL / gov->fps;
+    gov->report_at = stats_now() + GOVERNOR_REPORT_INTERVAL;
+#ifdef _WIN32
+    /// Sleep() is only as fine as the timer resolution, 15.6 ms by default
+    timeBeginPeriod(1);
+#endif
+}
+
+void governor_fini(FpsGovernor *gov G_GNUC_UNUSED)
+{
+#ifdef _WIN32
+    timeEndPeriod(1);
+#endif
+}
+
+void governor_update(FpsGovernor *gov, uint64_t now, uint32_t queued, uint32_t queue_limit,
+                     uint32_t inflight, uint32_t budget)
+{
+    const char *reason = NULL;
+
+    gov->frames++;
+    if (inflight >= budget) {
+        /// display_update() only collects the damage of this one
+        gov->deferred_frames++;
+        stats_count(STATS_SKIPPED_FRAMES, 1);
+    }
+
+    if (inflight >= budget / 2) {
+        reason = "in-flight bytes grow";
+    } else if (queued >= queue_limit / 2) {
+        reason = "queue depth grows";
+    }
+
+    if (reason) {
+        if (now - gov->last_change >= GOVERNOR_HOLD) {
+            adapt_rate(gov, gov->fps * 3 / 4, now, reason, queued, inflight);
+        }
+    } else if (!gov->late && inflight < budget / 8 && queued <= queue_limit / 16
+               && now - gov->last_change >= GOVERNOR_CALM) {
+        adapt_rate(gov, gov->fps + MAX(gov->fps / 8, 1), now, "consumer keeps up",
+                   queued, inflight);
+    }
+}
+
+void governor_set_cap(FpsGovernor *gov, uint64_t now, uint32_t fps)
+{
+    gov->cap_fps = fps;
+    if (gov->fps > ceiling(gov)) {
+        uint32_t old = set_rate(gov, gov->fps, now);
+
+        printf("fps: %u -> %u, cpu budget\n", old, gov->fps);
+    }
+}
+
+static void report(FpsGovernor *gov, uint64_t now)
+{
+    double seconds = (now - gov->report_at + GOVERNOR_REPORT_INTERVAL) / 1e9;
+
+    if (gov->frames || gov->late_frames || gov->deferred_frames) {
+        printf("fps: target %u, %.1f achieved, %u skipped (%u late, %u deferred)\n",
+               gov->fps, gov->frames / seconds, gov->late_frames + gov->deferred_frames,
+               gov->late_frames, gov->deferred_frames);
+    }
+    gov->frames = 0;
+    gov->late_frames = 0;
+    gov->deferred_frames = 0;
+    gov->report_at = now + GOVERNOR_REPORT_INTERVAL;
+}
+
+void governor_wait(FpsGovernor *gov)
+{
+    uint64_t now = stats_now();
+
+    if (now >= gov->report_at) {
+        report(gov, now);
+    }
+
+    /// deadlines follow each other, so early wakeups do not add up to drift
+    if (!gov->deadline) {
+        gov->deadline = now;
+    }
+    gov->deadline += gov->interval;
+
+    if (now >= gov->deadline) {
+        /// do not try to catch up, the frames whose slots passed are skipped
+        uint32_t missed = (now - gov->deadline) / gov->interval;
+
+        gov->late = true;
+        gov->late_frames += missed;
+        stats_count(STATS_SKIPPED_FRAMES, missed);
+        gov->deadline = now;
+        return;
+    }
+
+    gov->late = false;
+    g_usleep((gov->deadline - now) / 1000);
+}
+
+void governor_idle(FpsGovernor *gov)
+{
+    gov->deadline = 0;
+    gov->late = false;
+}
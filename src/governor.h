@@ -0,0 +1,86 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file   governor.h
+ * @brief  Frame rate of the capture loop
+ *
+ * The governor paces the capture thread against deadlines on the monotonic
+ * clock and adapts the rate to the spice side: it steps the rate up
+ * towards the ceiling while the worker keeps the drawable ring and the
+ * in-flight bytes low, and cuts it back as soon as either grows. Every
+ * change is printed with its reason, achieved fps and skipped frames are
+ * printed every GOVERNOR_REPORT_INTERVAL.
+ */
+
+#ifndef WIN_SPICE_GOVERNOR_H
+#define WIN_SPICE_GOVERNOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define GOVERNOR_MIN_FPS        10
+#define GOVERNOR_START_FPS      30
+/// the ceiling is configurable within these bounds
+#define GOVERNOR_CEILING_MIN    60
+#define GOVERNOR_CEILING_MAX    144
+#define GOVERNOR_REPORT_INTERVAL 5000000000ULL
+
+typedef struct FpsGovernor {
+    uint32_t min_fps;
+    uint32_t max_fps;
+    /// lower ceiling set by the cpu budget, 0 if none
+    uint32_t cap_fps;
+    uint32_t fps;
+    /// ns between two frames at fps
+    uint64_t interval;
+    /// when the next frame is due, 0 if not paced yet
+    uint64_t deadline;
+    uint64_t last_change;
+    /// the last iteration overran its deadline
+    bool late;
+
+    /// since the last report
+    uint64_t report_at;
+    uint32_t frames;
+    /// deadlines passed while the capture overran
+    uint32_t late_frames;
+    /// frames whose damage was deferred because too much is in flight
+    uint32_t deferred_frames;
+} FpsGovernor;
+
+void governor_init(FpsGovernor *gov, uint32_t max_fps);
+void governor_fini(FpsGovernor *gov);
+
+/**
+ * Adapt the rate to the spice side, once per captured frame at @now.
+ * @queued of @queue_limit drawables wait in the ring and @inflight of
+ * @budget bytes are not released yet.
+ */
+void governor_update(FpsGovernor *gov, uint64_t now, uint32_t queued, uint32_t queue_limit,
+                     uint32_t inflight, uint32_t budget);
+/// cap the rate below the ceiling, 0 lifts the cap
+void governor_set_cap(FpsGovernor *gov, uint64_t now, uint32_t fps);
+/// sleep until the next frame is due
+void governor_wait(FpsGovernor *gov);
+/// no frame was captured, the next one is paced from now on
+void governor_idle(FpsGovernor *gov);
+
+#endif  /* WIN_SPICE_GOVERNOR_H */
@@ -108,8 +108,8 @@ static void create_icon_widget(GUI *gui, Session *session)
     image = gtk_image_new_from_file(icon_path);
     gtk_box_pack_start(GTK_BOX(gui->main_box), image, TRUE, FALSE, 0);
 
-    w_free(icon_path);
-    w_free(app_dir);
+    g_free(icon_path);
+    g_free(app_dir);
 }
 
 static void create_arguments_widget(GUI *gui, Session *session)
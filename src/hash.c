@@ -0,0 +1,59 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   hash.c
+ * @brief  Fast non-cryptographic hash of pixel rects
+ */
+
+#include <string.h>
+#include "hash.h"
+
+/**
+ * xxhash style mixing over four independent lanes, so the multiply
+ * latency does not serialize the whole rect.
+ */
+uint64_t hash_rect(const uint8_t *p, int pitch, int row_bytes, int height)
+{
+    uint64_t lane[4] = { HASH_PRIME1, HASH_PRIME2, 0, (uint64_t)row_bytes << 32 | height };
+    int row;
+
+    for (row = 0; row < height; row++) {
+        const uint8_t *q = p + (size_t)row * pitch;
+        int i = 0;
+        for (; i + 32 <= row_bytes; i += 32) {
+            uint64_t v[4];
+            memcpy(v, q + i, sizeof(v));
+            lane[0] = hash_round(lane[0], v[0]);
+            lane[1] = hash_round(lane[1], v[1]);
+            lane[2] = hash_round(lane[2], v[2]);
+            lane[3] = hash_round(lane[3], v[3]);
+        }
+        for (; i + 4 <= row_bytes; i += 4) {
+            uint32_t v;
+            memcpy(&v, q + i, sizeof(v));
+            lane[i & 3] = hash_round(lane[i & 3], v);
+        }
+        for (; i < row_bytes; i++) {
+            lane[i & 3] = hash_round(lane[i & 3], q[i]);
+        }
+    }
+
+    return hash_round(hash_round(lane[0], lane[1]), hash_round(lane[2], lane[3]));
+}
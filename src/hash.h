@@ -0,0 +1,43 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   hash.h
+ * @brief  Fast non-cryptographic hash of pixel rects
+ */
+
+#ifndef WIN_SPICE_HASH_H
+#define WIN_SPICE_HASH_H
+
+#include <stdint.h>
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t v)
+{
+    acc += v * HASH_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * HASH_PRIME1;
+}
+
+/// hash @height rows of @row_bytes bytes, @pitch bytes apart
+uint64_t hash_rect(const uint8_t *p, int pitch, int row_bytes, int height);
+
+#endif  /* WIN_SPICE_HASH_H */
@@ -0,0 +1,51 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   imagecache.c
+ * @brief  Content addressed ids of outgoing images
+ */
+
+#include <string.h>
+#include "imagecache.h"
+
+void image_cache_init(ImageCache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+}
+
+uint64_t image_cache_lookup(ImageCache *cache, uint64_t hash, int pixels, int bytes,
+                            bool *cache_me)
+{
+    /// 0 is never a valid id
+    uint64_t id = hash ? hash : 1;
+    uint64_t *slot = &cache->ids[(id >> 52) & (IMAGE_CACHE_SLOTS - 1)];
+
+    if (*slot == id) {
+        cache->hits++;
+        cache->hit_bytes += bytes;
+        *cache_me = true;
+    } else {
+        cache->misses++;
+        *slot = id;
+        *cache_me = pixels <= IMAGE_CACHE_SMALL_AREA;
+    }
+
+    return id;
+}
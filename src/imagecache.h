@@ -0,0 +1,60 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   imagecache.h
+ * @brief  Content addressed ids of outgoing images
+ *
+ * Every image sent to spice gets an id derived from its content, so the
+ * same pixels always carry the same id. Images that were seen before,
+ * and small ones that tend to come back (carets, icons, buttons), are
+ * flagged for caching; spice then serves repeats from the client's
+ * pixmap cache instead of sending them again.
+ */
+
+#ifndef WIN_SPICE_IMAGECACHE_H
+#define WIN_SPICE_IMAGECACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// number of remembered ids, a power of two
+#define IMAGE_CACHE_SLOTS       4096
+/// images up to this many pixels are cached the first time they are seen
+#define IMAGE_CACHE_SMALL_AREA  (64 * 64)
+
+typedef struct ImageCache {
+    uint64_t ids[IMAGE_CACHE_SLOTS];
+
+    /// images whose content was sent before, and their size in bytes
+    uint64_t hits;
+    uint64_t hit_bytes;
+    uint64_t misses;
+} ImageCache;
+
+void image_cache_init(ImageCache *cache);
+
+/**
+ * Id of an image whose content hashes to @hash. Sets @cache_me if
+ * spice should keep the image for later frames.
+ */
+uint64_t image_cache_lookup(ImageCache *cache, uint64_t hash, int pixels, int bytes,
+                            bool *cache_me);
+
+#endif  /* WIN_SPICE_IMAGECACHE_H */
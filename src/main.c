@@ -28,6 +28,8 @@
 #include "gui.h"
 #include "session.h"
 #include "memory.h"
+#include "pixel.h"
+#include "bufpool.h"
 
 /// FIXME: ugly hack
 /// save application path globally
@@ -51,6 +53,10 @@ int main(int argc, char *argv[])
     }
 #endif
 
+    /// pick the pixel kernels once, before any capture thread runs
+    pixel_init();
+    printf("pixel kernels: %s\n", pixel_kernels()->name);
+
     session = session_new(argc, argv);
     if (!session) {
         printf("Failed to createsession\n");
@@ -58,6 +64,10 @@ int main(int argc, char *argv[])
         goto quit;
     }
 
+    /// bitmaps cycle between the capture and spice threads, keep them around
+    bufpool_init_default(BUFPOOL_DEFAULT_CACHE,
+                         options_get_int(session->options, "large-pages") > 0);
+
     gui = gui_new(session);
     if (!gui) {
         printf("Failed to create gui\n");
@@ -77,6 +87,17 @@ quit:
         session_destroy(session);
     }
 
+    if (bufpool_default()) {
+        BufPoolStats stats;
+        bufpool_get_stats(bufpool_default(), &stats);
+        printf("bitmap pool: %llu allocs, %llu hits, peak %llu KB\n",
+               (unsigned long long)stats.allocs, (unsigned long long)stats.hits,
+               (unsigned long long)(stats.peak_footprint / 1024));
+        bufpool_fini_default();
+    }
+    /// whatever is still live here was leaked
+    memory_dump(stdout, 10);
+
     return rc;
 }
 
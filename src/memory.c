@@ -16,56 +16,317 @@
  * You should have received a copy of the GNU Lesser General Public
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
-
 /**
  * @file   memory.c
  * @brief  Memory Management
  */
 
 #include <glib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "memory.h"
 
-#ifdef WIN_SPICE_DEBUG
-extern FILE *fp_dbg;
-#endif // WIN_SPICE_DEBUG
+/// in front of every allocation, keeps g_malloc()'s alignment
+typedef struct MemoryHeader {
+    gsize n_bytes;
+    uint16_t site;
+    uint16_t shard;
+} MemoryHeader;
+
+#define MEMORY_HEADER_SIZE ((sizeof(MemoryHeader) + 15) & ~(gsize)15)
+
+typedef struct MemorySite {
+    /// set once the entry is filled in
+    atomic_bool used;
+    const char *file;
+    int line;
+    const char *func;
+} MemorySite;
+
+typedef struct MemoryCounter {
+    /// frees from other threads update these too
+    atomic_size_t live_bytes;
+    atomic_size_t live_count;
+    /// only the owner thread writes these, except in the overflow shard
+    atomic_uint_least64_t allocs;
+    atomic_size_t high_water;
+} MemoryCounter;
+
+typedef struct MemoryShard {
+    MemoryCounter sites[MEMORY_MAX_SITES];
+} MemoryShard;
+
+/// site 0 collects the call sites that no longer fit the table
+static MemorySite sites[MEMORY_MAX_SITES] = {
+    [0] = { .used = true, .file = "(other)", .func = "" },
+};
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(MemoryShard *) shards[MEMORY_MAX_SHARDS];
+/// bit i is set while a live thread owns shard i
+static atomic_uint shards_owned;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static _Thread_local int thread_shard = -1;
+static _Thread_local bool thread_exiting;
+
+/// the last shard is shared by the threads that found no free one
+#define MEMORY_OVERFLOW_SHARD (MEMORY_MAX_SHARDS - 1)
+
+static int site_index(const char *file, int line, const char *func)
+{
+    uint32_t h = ((uint32_t)(uintptr_t)file ^ (uint32_t)line * 0x9E3779B1u) * 0x85EBCA6Bu;
+    uint32_t mask = MEMORY_MAX_SITES - 1;
+    uint32_t start = (h >> 16) & mask;
+    uint32_t i, n;
+    int found = 0;
+
+    /// call sites are few and fixed, after the first call this is one probe
+    for (i = start, n = 0; n < MEMORY_MAX_SITES; i = (i + 1) & mask, n++) {
+        MemorySite *site = &sites[i];
+        if (!atomic_load_explicit(&site->used, memory_order_acquire)) {
+            break;
+        }
+        if (site->file == file && site->line == line) {
+            return i;
+        }
+    }
+
+    pthread_mutex_lock(&sites_lock);
+    for (i = start, n = 0; n < MEMORY_MAX_SITES; i = (i + 1) & mask, n++) {
+        MemorySite *site = &sites[i];
+        if (!atomic_load_explicit(&site->used, memory_order_relaxed)) {
+            site->file = file;
+            site->line = line;
+            site->func = func;
+            atomic_store_explicit(&site->used, true, memory_order_release);
+            found = i;
+            break;
+        }
+        if (site->file == file && site->line == line) {
+            found = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sites_lock);
+    return found;
+}
+
+/**
+ * An exiting thread gives its shard back. The counters stay, blocks it
+ * allocated are still freed against them, and the next thread that
+ * takes the shard keeps counting on top.
+ */
+static void shard_release(void *value)
+{
+    int index = (int)(intptr_t)value - 1;
+
+    /// anything this thread still allocates goes to the shared shard
+    thread_shard = -1;
+    thread_exiting = true;
+    atomic_fetch_and(&shards_owned, ~(1u << index));
+}
+
+static void shard_key_create(void)
+{
+    pthread_key_create(&shard_key, shard_release);
+}
 
-static void memory_track(
-    void *pointer, gsize n_bytes, const char *file, int line, const char *func)
+static int shard_claim(void)
 {
-#ifdef WIN_SPICE_DEBUG
-    if (fp_dbg) {
-        static char buf[256];
-        snprintf(buf, sizeof(buf), "[%s:%d %s]: %p:%d\n",
-                 file, line, func, pointer, n_bytes);
-        fwrite(&buf, strlen(buf), 1, fp_dbg);
+    unsigned int owned = atomic_load(&shards_owned);
+    int index;
+
+    for (;;) {
+        for (index = 0; index < MEMORY_OVERFLOW_SHARD; index++) {
+            if (!(owned & (1u << index))) {
+                break;
+            }
+        }
+        if (index == MEMORY_OVERFLOW_SHARD) {
+            return index;
+        }
+        if (atomic_compare_exchange_weak(&shards_owned, &owned, owned | (1u << index))) {
+            break;
+        }
+    }
+    pthread_once(&shard_once, shard_key_create);
+    pthread_setspecific(shard_key, (void *)(intptr_t)(index + 1));
+    return index;
+}
+
+static int shard_index(void)
+{
+    MemoryShard *shard;
+    int index;
+
+    if (thread_shard >= 0) {
+        return thread_shard;
+    }
+    index = thread_exiting ? MEMORY_OVERFLOW_SHARD : shard_claim();
+    if (!atomic_load(&shards[index])) {
+        MemoryShard *expected = NULL;
+        shard = g_malloc0(sizeof(MemoryShard));
+        if (!atomic_compare_exchange_strong(&shards[index], &expected, shard)) {
+            g_free(shard);
+        }
     }
-#endif // WIN_SPICE_DEBUG
+    thread_shard = index;
+    return index;
+}
+
+static void *memory_track(void *mem, gsize n_bytes, const char *file, int line,
+                          const char *func)
+{
+    MemoryHeader *header = mem;
+    MemoryCounter *counter;
+    size_t live, high_water;
+    int shard = shard_index();
+    int site = site_index(file, line, func);
+
+    header->n_bytes = n_bytes;
+    header->site = site;
+    header->shard = shard;
+
+    counter = &atomic_load_explicit(&shards[shard], memory_order_relaxed)->sites[site];
+    atomic_fetch_add_explicit(&counter->live_count, 1, memory_order_relaxed);
+    live = atomic_fetch_add_explicit(&counter->live_bytes, n_bytes,
+                                     memory_order_relaxed) + n_bytes;
+    high_water = atomic_load_explicit(&counter->high_water, memory_order_relaxed);
+    if (shard != MEMORY_OVERFLOW_SHARD) {
+        /// single writer, a load and a store keep the lock prefix off this path
+        atomic_store_explicit(&counter->allocs,
+                              atomic_load_explicit(&counter->allocs, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        if (live > high_water) {
+            atomic_store_explicit(&counter->high_water, live, memory_order_relaxed);
+        }
+    } else {
+        atomic_fetch_add_explicit(&counter->allocs, 1, memory_order_relaxed);
+        while (live > high_water
+               && !atomic_compare_exchange_weak_explicit(&counter->high_water, &high_water, live,
+                                                         memory_order_relaxed,
+                                                         memory_order_relaxed)) {
+        }
+    }
+    return (uint8_t *)mem + MEMORY_HEADER_SIZE;
 }
 
 void *_w_malloc(gsize n_bytes, const char *file, int line, const char*func)
 {
-    void *pointer = g_malloc(n_bytes);
-    memory_track(pointer, n_bytes, file, line, func);
-    return pointer;
+    void *mem = g_malloc(MEMORY_HEADER_SIZE + n_bytes);
+    return memory_track(mem, n_bytes, file, line, func);
 }
 
 void *_w_malloc0(gsize n_bytes, const char *file, int line, const char*func)
 {
-    void *pointer = g_malloc0(n_bytes);
-    memory_track(pointer, n_bytes, file, line, func);
-    return pointer;
+    void *mem = g_malloc0(MEMORY_HEADER_SIZE + n_bytes);
+    return memory_track(mem, n_bytes, file, line, func);
 }
 
 void _w_free(void *mem, const char *file, int line, const char*func)
 {
-    memory_track(mem, 0, file, line, func);
-    g_free(mem);
+    MemoryHeader *header;
+    MemoryCounter *counter;
+
+    if (!mem) {
+        return;
+    }
+    header = (MemoryHeader *)((uint8_t *)mem - MEMORY_HEADER_SIZE);
+    /// counted against the thread and site that allocated it
+    counter = &atomic_load_explicit(&shards[header->shard],
+                                    memory_order_relaxed)->sites[header->site];
+    atomic_fetch_sub_explicit(&counter->live_count, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&counter->live_bytes, header->n_bytes, memory_order_relaxed);
+    g_free(header);
 }
 
 char *_w_strdup(const char *str, const char *file, int line, const char*func)
 {
-    char *pointer = g_strdup(str);
-    memory_track(pointer, 0, file, line, func);
+    char *pointer;
+    gsize n_bytes;
+
+    if (!str) {
+        return NULL;
+    }
+    n_bytes = strlen(str) + 1;
+    pointer = _w_malloc(n_bytes, file, line, func);
+    memcpy(pointer, str, n_bytes);
     return pointer;
 }
+
+static int compare_live_bytes(const void *a, const void *b)
+{
+    const MemorySiteStats *x = a;
+    const MemorySiteStats *y = b;
+
+    if (x->live_bytes != y->live_bytes) {
+        return x->live_bytes < y->live_bytes ? 1 : -1;
+    }
+    return x->allocs < y->allocs ? 1 : x->allocs > y->allocs ? -1 : 0;
+}
+
+int memory_snapshot(MemorySiteStats *out, int max)
+{
+    MemorySiteStats *all;
+    int i, j, n = 0;
+
+    all = g_malloc0(MEMORY_MAX_SITES * sizeof(MemorySiteStats));
+    for (i = 0; i < MEMORY_MAX_SITES; i++) {
+        MemorySiteStats *stats = &all[n];
+
+        if (!atomic_load_explicit(&sites[i].used, memory_order_acquire)) {
+            continue;
+        }
+        for (j = 0; j < MEMORY_MAX_SHARDS; j++) {
+            MemoryShard *shard = atomic_load(&shards[j]);
+            if (!shard) {
+                continue;
+            }
+            stats->live_bytes += atomic_load_explicit(&shard->sites[i].live_bytes,
+                                                      memory_order_relaxed);
+            stats->live_count += atomic_load_explicit(&shard->sites[i].live_count,
+                                                      memory_order_relaxed);
+            stats->allocs += atomic_load_explicit(&shard->sites[i].allocs,
+                                                  memory_order_relaxed);
+            stats->high_water += atomic_load_explicit(&shard->sites[i].high_water,
+                                                      memory_order_relaxed);
+        }
+        if (!stats->allocs) {
+            memset(stats, 0, sizeof(*stats));
+            continue;
+        }
+        stats->file = sites[i].file;
+        stats->line = sites[i].line;
+        stats->func = sites[i].func;
+        n++;
+    }
+
+    qsort(all, n, sizeof(MemorySiteStats), compare_live_bytes);
+    n = MIN(n, max);
+    memcpy(out, all, n * sizeof(MemorySiteStats));
+    g_free(all);
+    return n;
+}
+
+void memory_dump(FILE *fp, int top)
+{
+    MemorySiteStats *stats = g_malloc(top * sizeof(MemorySiteStats));
+    int i, n;
+
+    n = memory_snapshot(stats, top);
+    fprintf(fp, "memory: top %d call sites by live bytes\n", n);
+    for (i = 0; i < n; i++) {
+        fprintf(fp, "  %s:%d %s: %llu bytes in %llu blocks, %llu allocs, %llu high-water\n",
+                stats[i].file, stats[i].line, stats[i].func,
+                (unsigned long long)stats[i].live_bytes,
+                (unsigned long long)stats[i].live_count,
+                (unsigned long long)stats[i].allocs,
+                (unsigned long long)stats[i].high_water);
+    }
+    fflush(fp);
+    g_free(stats);
+}
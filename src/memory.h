@@ -26,6 +26,29 @@
 #define WIN_SPICE_MEMORY_H
 
 #include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Every w_malloc() call site is counted, in per thread shards so that
+ * allocations never share a lock or a cache line with another thread.
+ * A thread gives its shard back when it exits; while all others are
+ * taken, threads share the last one. Memory from w_malloc() must be
+ * released with w_free() and nothing else.
+ */
+#define MEMORY_MAX_SITES    1024
+#define MEMORY_MAX_SHARDS   16
+
+typedef struct MemorySiteStats {
+    const char *file;
+    int line;
+    const char *func;
+    uint64_t allocs;
+    uint64_t live_bytes;
+    uint64_t live_count;
+    /// summed over the allocating threads
+    uint64_t high_water;
+} MemorySiteStats;
 
 void *_w_malloc(gsize n_bytes, const char *file, int line, const char*func);
 void *_w_malloc0(gsize n_bytes, const char *file, int line, const char*func);
@@ -36,5 +59,9 @@ char *_w_strdup(const char *str, const char *file, int line, const char*func);
 #define w_malloc0(x)       _w_malloc0(x, __FILE__, __LINE__, __FUNCTION__)
 #define w_free(x)          _w_free(x, __FILE__, __LINE__, __FUNCTION__)
 #define w_strdup(x)        _w_strdup(x, __FILE__, __LINE__, __FUNCTION__)
+
+/// the @max call sites with the most live bytes, returns how many were filled
+int memory_snapshot(MemorySiteStats *sites, int max);
+void memory_dump(FILE *fp, int top);
     
 #endif //WIN_SPICE_MEMORY_H
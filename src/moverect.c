@@ -0,0 +1,116 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   moverect.c
+ * @brief  Screen-to-screen moves reported by desktop duplication
+ */
+
+#include "moverect.h"
+
+static bool rect_intersect(WinSpiceRect *dst, const WinSpiceRect *a, const WinSpiceRect *b)
+{
+    dst->left   = a->left > b->left ? a->left : b->left;
+    dst->top    = a->top > b->top ? a->top : b->top;
+    dst->right  = a->right < b->right ? a->right : b->right;
+    dst->bottom = a->bottom < b->bottom ? a->bottom : b->bottom;
+
+    return !wrect_is_empty(dst);
+}
+
+static bool rect_overlaps(const WinSpiceRect *a, const WinSpiceRect *b)
+{
+    WinSpiceRect tmp;
+
+    return rect_intersect(&tmp, a, b);
+}
+
+static void move_source_rect(const WinSpiceMove *move, WinSpiceRect *src)
+{
+    src->left   = move->src_x;
+    src->top    = move->src_y;
+    src->right  = move->src_x + (move->dest.right - move->dest.left);
+    src->bottom = move->src_y + (move->dest.bottom - move->dest.top);
+}
+
+/// clip destination and source of @move to @bounds, keeping them in step
+static bool move_clip(WinSpiceMove *move, const WinSpiceRect *bounds)
+{
+    int32_t dx = move->src_x - move->dest.left;
+    int32_t dy = move->src_y - move->dest.top;
+    WinSpiceRect src, dest;
+
+    if (!rect_intersect(&dest, &move->dest, bounds)) {
+        return false;
+    }
+
+    src.left   = dest.left + dx;
+    src.top    = dest.top + dy;
+    src.right  = dest.right + dx;
+    src.bottom = dest.bottom + dy;
+    if (!rect_intersect(&src, &src, bounds)) {
+        return false;
+    }
+
+    move->dest.left   = src.left - dx;
+    move->dest.top    = src.top - dy;
+    move->dest.right  = src.right - dx;
+    move->dest.bottom = src.bottom - dy;
+    move->src_x = src.left;
+    move->src_y = src.top;
+
+    return true;
+}
+
+int moverect_filter(WinSpiceMove *moves, int num_moves,
+                    const WinSpiceRect *bounds, const WinSpiceRegion *dirty)
+{
+    int i, j, n = 0;
+
+    for (i = 0; i < num_moves; i++) {
+        WinSpiceMove move = moves[i];
+        bool needed = false;
+
+        if (!move_clip(&move, bounds)) {
+            continue;
+        }
+        if (move.src_x == move.dest.left && move.src_y == move.dest.top) {
+            continue;
+        }
+
+        if (dirty && wregion_contains_rect(dirty, &move.dest)) {
+            /// still needed if a later move copies out of this destination
+            for (j = i + 1; j < num_moves; j++) {
+                WinSpiceRect src;
+                move_source_rect(&moves[j], &src);
+                if (rect_overlaps(&src, &move.dest)) {
+                    needed = true;
+                    break;
+                }
+            }
+            if (!needed) {
+                continue;
+            }
+        }
+
+        moves[n++] = move;
+    }
+
+    return n;
+}
@@ -0,0 +1,51 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   moverect.h
+ * @brief  Screen-to-screen moves reported by desktop duplication
+ *
+ * DXGI reports scrolls and window drags as move rects which must be
+ * applied in the reported order and before the dirty rects of the same
+ * frame. They are sent to the client as QXL_COPY_BITS drawables.
+ */
+
+#ifndef WIN_SPICE_MOVERECT_H
+#define WIN_SPICE_MOVERECT_H
+
+#include "region.h"
+
+typedef struct WinSpiceMove {
+    WinSpiceRect dest;
+    int32_t src_x;
+    int32_t src_y;
+} WinSpiceMove;
+
+/**
+ * Prepare the move list of one frame, in place.
+ *
+ * Moves are clipped so that both source and destination lie in @bounds,
+ * moves onto themselves are dropped, and so is a move whose destination
+ * is repainted by @dirty anyway, unless a later move reads from it.
+ * The order of the remaining moves is kept. Returns the new count.
+ */
+int moverect_filter(WinSpiceMove *moves, int num_moves,
+                    const WinSpiceRect *bounds, const WinSpiceRegion *dirty);
+
+#endif  /* WIN_SPICE_MOVERECT_H */
@@ -18,10 +18,12 @@
  */
 
 #include "options.h"
+#include <stdlib.h>
 #include <string.h>
 #include <glib.h>
 #include <spice.h>
 #include "memory.h"
+#include "compress.h"
 
 Options *options_new()
 {
@@ -33,6 +35,27 @@ Options *options_new()
     /// TODO: get from config
     options->port = 5900;
     options->ssl = false;
+    options->tile_hash = true;
+    options->batch_rects = true;
+    options->inflight_budget = 64;
+    options->large_pages = false;
+    if (g_getenv("WINSPICE_STATS_FILE")) {
+        options->stats_file = w_strdup(g_getenv("WINSPICE_STATS_FILE"));
+    }
+    options->stats_interval = 5;
+    if (g_getenv("WINSPICE_TRACE_FILE")) {
+        options->trace_file = w_strdup(g_getenv("WINSPICE_TRACE_FILE"));
+    }
+    options->latency_probe = g_getenv("WINSPICE_LATENCY_PROBE") != NULL;
+    options->synthetic_display = g_getenv("WINSPICE_SYNTHETIC_DISPLAY") != NULL;
+    options->max_fps = 60;
+    if (g_getenv("WINSPICE_MAX_FPS")) {
+        options->max_fps = atoi(g_getenv("WINSPICE_MAX_FPS"));
+    }
+    if (g_getenv("WINSPICE_CPU_BUDGET")) {
+        options->cpu_budget = atoi(g_getenv("WINSPICE_CPU_BUDGET"));
+    }
+    options->video_detect = g_getenv("WINSPICE_VIDEO_DETECT") != NULL;
 
     options->compression_name_list = g_list_append(options->compression_name_list, "auto_glz");
     options->compression_name_list = g_list_append(options->compression_name_list, "auto_lz");
@@ -41,6 +64,7 @@ Options *options_new()
     options->compression_name_list = g_list_append(options->compression_name_list, "lz");
     options->compression_name_list = g_list_append(options->compression_name_list, "lz4");
     options->compression_name_list = g_list_append(options->compression_name_list, "off");
+    options->compression_name_list = g_list_append(options->compression_name_list, "auto_wan");
 
     options->compression_list = g_list_append(options->compression_list, GINT_TO_POINTER(SPICE_IMAGE_COMPRESSION_AUTO_GLZ));
     options->compression_list = g_list_append(options->compression_list, GINT_TO_POINTER(SPICE_IMAGE_COMPRESSION_AUTO_LZ));
@@ -49,6 +73,7 @@ Options *options_new()
     options->compression_list = g_list_append(options->compression_list, GINT_TO_POINTER(SPICE_IMAGE_COMPRESSION_LZ));
     options->compression_list = g_list_append(options->compression_list, GINT_TO_POINTER(SPICE_IMAGE_COMPRESSION_LZ4));
     options->compression_list = g_list_append(options->compression_list, GINT_TO_POINTER(SPICE_IMAGE_COMPRESSION_OFF));
+    options->compression_list = g_list_append(options->compression_list, GINT_TO_POINTER(COMPRESSION_AUTO_WAN));
 
     return options;
 }
@@ -61,6 +86,10 @@ char *options_get_string(Options *options, const char *key)
 
     if (!strcmp(key, "password")) {
         return options->password;
+    } else if (!strcmp(key, "stats-file")) {
+        return options->stats_file;
+    } else if (!strcmp(key, "trace-file")) {
+        return options->trace_file;
     } else {
         return NULL;
     }
@@ -78,6 +107,12 @@ void options_set_string(Options *options, const char *key, const char *value)
             w_free(options->password);
         }
         options->password = w_strdup(value);
+    } else if (!strcmp(key, "stats-file")) {
+        w_free(options->stats_file);
+        options->stats_file = w_strdup(value);
+    } else if (!strcmp(key, "trace-file")) {
+        w_free(options->trace_file);
+        options->trace_file = w_strdup(value);
     } else {
         /// TODO: print a warning message
         return ;
@@ -94,6 +129,26 @@ int options_get_int(Options *options, const char *key)
         return options->port;
     } else if (!strcmp(key, "compression")) {
         return options->compression;
+    } else if (!strcmp(key, "tile-hash")) {
+        return options->tile_hash;
+    } else if (!strcmp(key, "batch-rects")) {
+        return options->batch_rects;
+    } else if (!strcmp(key, "inflight-budget")) {
+        return options->inflight_budget;
+    } else if (!strcmp(key, "large-pages")) {
+        return options->large_pages;
+    } else if (!strcmp(key, "stats-interval")) {
+        return options->stats_interval;
+    } else if (!strcmp(key, "latency-probe")) {
+        return options->latency_probe;
+    } else if (!strcmp(key, "synthetic-display")) {
+        return options->synthetic_display;
+    } else if (!strcmp(key, "max-fps")) {
+        return options->max_fps;
+    } else if (!strcmp(key, "cpu-budget")) {
+        return options->cpu_budget;
+    } else if (!strcmp(key, "video-detect")) {
+        return options->video_detect;
     }
     return -1;
 }
@@ -108,6 +163,26 @@ void options_set_int(Options *options, const char *key, int value)
         options->port = value;
     } else if (!strcmp(key, "compression")) {
         options->compression = value;
+    } else if (!strcmp(key, "tile-hash")) {
+        options->tile_hash = value;
+    } else if (!strcmp(key, "batch-rects")) {
+        options->batch_rects = value;
+    } else if (!strcmp(key, "inflight-budget")) {
+        options->inflight_budget = value;
+    } else if (!strcmp(key, "large-pages")) {
+        options->large_pages = value;
+    } else if (!strcmp(key, "stats-interval")) {
+        options->stats_interval = value;
+    } else if (!strcmp(key, "latency-probe")) {
+        options->latency_probe = value;
+    } else if (!strcmp(key, "synthetic-display")) {
+        options->synthetic_display = value;
+    } else if (!strcmp(key, "max-fps")) {
+        options->max_fps = value;
+    } else if (!strcmp(key, "cpu-budget")) {
+        options->cpu_budget = value;
+    } else if (!strcmp(key, "video-detect")) {
+        options->video_detect = value;
     } else {
         /// TODO: print a warning message
     }
@@ -119,6 +194,8 @@ void options_destroy(Options *options)
         g_list_free(options->compression_list);
         g_list_free(options->compression_name_list);
         w_free(options->password);
+        w_free(options->stats_file);
+        w_free(options->trace_file);
         w_free(options);
     }
 }
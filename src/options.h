@@ -10,6 +10,29 @@ typedef struct Options {
     bool ssl;
     int compression;
     const char *compression_text;
+    /// drop dirty tiles whose pixels are identical to the last sent ones
+    bool tile_hash;
+    /// send nearby small dirty rects as one clipped drawable
+    bool batch_rects;
+    /// MB of drawables allowed between capture and release, then damage is deferred
+    int inflight_budget;
+    /// back bitmap buffers with large pages
+    bool large_pages;
+    /// pipeline statistics are appended here every stats_interval seconds, if set
+    char *stats_file;
+    int stats_interval;
+    /// chrome trace-event timeline of the pipeline, written while set
+    char *trace_file;
+    /// paint latency markers into synthetic display frames, see probe.h
+    bool latency_probe;
+    /// capture the synthetic desktop instead of the real one
+    bool synthetic_display;
+    /// ceiling of the adaptive frame rate, see governor.h
+    int max_fps;
+    /// percent of one core for capture and spice worker, 0 if unlimited
+    int cpu_budget;
+    /// stream the video regions found by the capture side, see videodetect.h
+    bool video_detect;
 
     GList *compression_name_list;
     GList *compression_list;
@@ -0,0 +1,184 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   palette.c
+ * @brief  Lossless palette conversion of low color bitmaps
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "palette.h"
+
+#define COLOR_MASK      0x00FFFFFFu
+/// open addressing table, twice the palette size keeps probes short
+#define TABLE_SIZE      (2 * PALETTE_MAX_COLORS)
+#define EMPTY_SLOT      0xFFFFFFFFu
+
+typedef struct ColorTable {
+    uint32_t keys[TABLE_SIZE];
+    uint8_t index[TABLE_SIZE];
+} ColorTable;
+
+static inline uint32_t color_slot(uint32_t color)
+{
+    return (color * 0x9E3779B1u) >> 23;     /* 9 bits, TABLE_SIZE == 512 */
+}
+
+static void table_init(ColorTable *table)
+{
+    memset(table->keys, 0xFF, sizeof(table->keys));
+}
+
+/// slot holding @color, or the empty slot where it belongs
+static int table_find(ColorTable *table, uint32_t color, bool *found)
+{
+    uint32_t slot = color_slot(color);
+
+    while (table->keys[slot] != EMPTY_SLOT) {
+        if (table->keys[slot] == color) {
+            *found = true;
+            return slot;
+        }
+        slot = (slot + 1) & (TABLE_SIZE - 1);
+    }
+    *found = false;
+    return slot;
+}
+
+static int compare_color(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+bool palette_collect(const uint8_t *bitmap, int pitch, int width, int height,
+                     PaletteColors *palette)
+{
+    ColorTable table;
+    uint32_t last = EMPTY_SLOT;
+    int row, col, n = 0;
+
+    table_init(&table);
+    for (row = 0; row < height; row++) {
+        const uint32_t *p = (const uint32_t *)(bitmap + (size_t)row * pitch);
+        for (col = 0; col < width; col++) {
+            uint32_t color = p[col] & COLOR_MASK;
+            bool found;
+            int slot;
+
+            /// flat runs are the common case in text and UI
+            if (color == last) {
+                continue;
+            }
+            last = color;
+            slot = table_find(&table, color, &found);
+            if (!found) {
+                if (n == PALETTE_MAX_COLORS) {
+                    return false;
+                }
+                table.keys[slot] = color;
+                palette->colors[n++] = color;
+            }
+        }
+    }
+
+    qsort(palette->colors, n, sizeof(uint32_t), compare_color);
+    palette->num_colors = n;
+    palette->bits = n <= 16 ? 4 : 8;
+    return true;
+}
+
+int palette_stride(const PaletteColors *palette, int width)
+{
+    return palette->bits == 4 ? (width + 1) / 2 : width;
+}
+
+void palette_convert(const PaletteColors *palette, const uint8_t *bitmap, int pitch,
+                     int width, int height, uint8_t *dst, int dst_stride)
+{
+    ColorTable table;
+    int i, row, col;
+
+    table_init(&table);
+    for (i = 0; i < palette->num_colors; i++) {
+        bool found;
+        int slot = table_find(&table, palette->colors[i], &found);
+        table.keys[slot] = palette->colors[i];
+        table.index[slot] = i;
+    }
+
+    for (row = 0; row < height; row++) {
+        const uint32_t *p = (const uint32_t *)(bitmap + (size_t)row * pitch);
+        uint8_t *d = dst + (size_t)row * dst_stride;
+        uint32_t last = EMPTY_SLOT;
+        uint8_t index = 0;
+
+        if (palette->bits == 4) {
+            memset(d, 0, dst_stride);
+        }
+        for (col = 0; col < width; col++) {
+            uint32_t color = p[col] & COLOR_MASK;
+            if (color != last) {
+                bool found;
+                last = color;
+                index = table.index[table_find(&table, color, &found)];
+            }
+            if (palette->bits == 4) {
+                d[col >> 1] |= (col & 1) ? index : index << 4;
+            } else {
+                d[col] = index;
+            }
+        }
+    }
+}
+
+void palette_cache_init(PaletteCache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->next_unique = 1;
+}
+
+uint64_t palette_cache_unique(PaletteCache *cache, const PaletteColors *palette)
+{
+    PaletteCacheEntry *victim = &cache->entries[0];
+    int i;
+
+    cache->tick++;
+    for (i = 0; i < PALETTE_CACHE_SIZE; i++) {
+        PaletteCacheEntry *e = &cache->entries[i];
+        if (e->unique && e->num_colors == palette->num_colors
+            && !memcmp(e->colors, palette->colors, palette->num_colors * sizeof(uint32_t))) {
+            e->last_use = cache->tick;
+            return e->unique;
+        }
+        if (e->last_use < victim->last_use) {
+            victim = e;
+        }
+    }
+
+    /// ids are never reused, an evicted set gets a new one next time
+    victim->unique = cache->next_unique++;
+    victim->last_use = cache->tick;
+    victim->num_colors = palette->num_colors;
+    memcpy(victim->colors, palette->colors, palette->num_colors * sizeof(uint32_t));
+    return victim->unique;
+}
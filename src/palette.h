@@ -0,0 +1,80 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   palette.h
+ * @brief  Lossless palette conversion of low color bitmaps
+ *
+ * Text, terminals and UI chrome rarely use more than a few distinct
+ * colors. Such bitmaps are sent as exact 4 or 8 bit indexed images
+ * instead of 32bpp ones. Palettes get a stable id per color set, so
+ * spice-server can serve repeated palettes from the client's cache.
+ */
+
+#ifndef WIN_SPICE_PALETTE_H
+#define WIN_SPICE_PALETTE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PALETTE_MAX_COLORS   256
+#define PALETTE_CACHE_SIZE   64
+/// smaller bitmaps are not worth the palette overhead
+#define PALETTE_MIN_PIXELS   64
+
+typedef struct PaletteColors {
+    uint32_t colors[PALETTE_MAX_COLORS];
+    int num_colors;
+    /// 4 or 8
+    int bits;
+} PaletteColors;
+
+typedef struct PaletteCacheEntry {
+    uint64_t unique;
+    uint64_t last_use;
+    int num_colors;
+    uint32_t colors[PALETTE_MAX_COLORS];
+} PaletteCacheEntry;
+
+typedef struct PaletteCache {
+    PaletteCacheEntry entries[PALETTE_CACHE_SIZE];
+    uint64_t next_unique;
+    uint64_t tick;
+} PaletteCache;
+
+/**
+ * Collect the distinct colors of a 32bpp bitmap, alpha ignored.
+ * Returns false as soon as more than PALETTE_MAX_COLORS are found.
+ * On success the colors are sorted, so equal sets compare equal.
+ */
+bool palette_collect(const uint8_t *bitmap, int pitch, int width, int height,
+                     PaletteColors *palette);
+
+/// stride in bytes of the indexed image built by palette_convert()
+int palette_stride(const PaletteColors *palette, int width);
+
+/// write the indexed (4 bit big endian nibbles or 8 bit) image to @dst
+void palette_convert(const PaletteColors *palette, const uint8_t *bitmap, int pitch,
+                     int width, int height, uint8_t *dst, int dst_stride);
+
+void palette_cache_init(PaletteCache *cache);
+/// stable unique id for the color set of @palette
+uint64_t palette_cache_unique(PaletteCache *cache, const PaletteColors *palette);
+
+#endif  /* WIN_SPICE_PALETTE_H */
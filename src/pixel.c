@@ -0,0 +1,646 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   pixel.c
+ * @brief  32bpp pixel kernels
+ *
+ * The SIMD versions are compiled with per-function target attributes so
+ * the rest of the tree keeps the default instruction set, and are only
+ * called after the CPU (and OS) support has been checked.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "pixel.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define PIXEL_X86 1
+#include <immintrin.h>
+#endif
+
+#define ALPHA_MASK 0xFF000000u
+
+/// scalar
+
+static void copy_rect_scalar(uint8_t *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                             int row_bytes, int height, bool nontemporal)
+{
+    int row;
+
+    if (dst_pitch == row_bytes && src_pitch == row_bytes) {
+        memcpy(dst, src, (size_t)row_bytes * height);
+        return;
+    }
+    for (row = 0; row < height; row++) {
+        memcpy(dst, src, row_bytes);
+        dst += dst_pitch;
+        src += src_pitch;
+    }
+}
+
+static bool equal_rect_scalar(const uint8_t *a, int a_pitch, const uint8_t *b, int b_pitch,
+                              int row_bytes, int height)
+{
+    int row;
+
+    for (row = 0; row < height; row++) {
+        if (memcmp(a, b, row_bytes) != 0) {
+            return false;
+        }
+        a += a_pitch;
+        b += b_pitch;
+    }
+    return true;
+}
+
+static bool is_uniform_scalar(const uint8_t *p, int pitch, int width, int height,
+                              uint32_t *color)
+{
+    uint32_t c = *(const uint32_t *)p;
+    int row, col;
+
+    for (row = 0; row < height; row++) {
+        const uint32_t *q = (const uint32_t *)(p + (ptrdiff_t)row * pitch);
+        for (col = 0; col < width; col++) {
+            if (q[col] != c) {
+                return false;
+            }
+        }
+    }
+    if (color) {
+        *color = c;
+    }
+    return true;
+}
+
+static void swap_rb_scalar(uint32_t *dst, const uint32_t *src, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint32_t v = src[i];
+        dst[i] = (v & 0xFF00FF00u) | ((v >> 16) & 0xFF) | ((v & 0xFF) << 16);
+    }
+}
+
+static void set_alpha_scalar(uint32_t *dst, const uint32_t *src, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = src[i] | ALPHA_MASK;
+    }
+}
+
+static void cursor_color_scalar(uint32_t *dst, const uint32_t *desktop,
+                                const uint32_t *shape, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint32_t s = shape[i];
+        dst[i] = ((s & ALPHA_MASK) ? (desktop[i] ^ s) : s) | ALPHA_MASK;
+    }
+}
+
+/**
+ * 1bpp masks do not vectorize usefully at cursor sizes, every variant
+ * uses this one.
+ */
+static void cursor_mono_scalar(uint32_t *dst, const uint32_t *desktop, const uint8_t *and_mask,
+                               const uint8_t *xor_mask, int bit, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        int idx = bit + i;
+        uint8_t m = 0x80 >> (idx & 7);
+        uint32_t and32 = (and_mask[idx >> 3] & m) ? 0xFFFFFFFFu : ALPHA_MASK;
+        uint32_t xor32 = (xor_mask[idx >> 3] & m) ? 0x00FFFFFFu : 0;
+        dst[i] = (desktop[i] & and32) ^ xor32;
+    }
+}
+
+static const PixelKernels kernels_scalar = {
+    .name         = "scalar",
+    .copy_rect    = copy_rect_scalar,
+    .equal_rect   = equal_rect_scalar,
+    .is_uniform   = is_uniform_scalar,
+    .swap_rb      = swap_rb_scalar,
+    .set_alpha    = set_alpha_scalar,
+    .cursor_color = cursor_color_scalar,
+    .cursor_mono  = cursor_mono_scalar,
+};
+
+#ifdef PIXEL_X86
+
+/// SSE2
+
+__attribute__((target("sse2")))
+static void copy_rect_sse2(uint8_t *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                           int row_bytes, int height, bool nontemporal)
+{
+    int row;
+
+    if (!nontemporal) {
+        copy_rect_scalar(dst, dst_pitch, src, src_pitch, row_bytes, height, false);
+        return;
+    }
+
+    for (row = 0; row < height; row++) {
+        uint8_t *d = dst + (ptrdiff_t)row * dst_pitch;
+        const uint8_t *s = src + (ptrdiff_t)row * src_pitch;
+        int head = (16 - ((uintptr_t)d & 15)) & 15;
+        int i;
+
+        if (head > row_bytes) {
+            head = row_bytes;
+        }
+        memcpy(d, s, head);
+        for (i = head; i + 64 <= row_bytes; i += 64) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)(s + i));
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(s + i + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i *)(s + i + 32));
+            __m128i v3 = _mm_loadu_si128((const __m128i *)(s + i + 48));
+            _mm_stream_si128((__m128i *)(d + i), v0);
+            _mm_stream_si128((__m128i *)(d + i + 16), v1);
+            _mm_stream_si128((__m128i *)(d + i + 32), v2);
+            _mm_stream_si128((__m128i *)(d + i + 48), v3);
+        }
+        memcpy(d + i, s + i, row_bytes - i);
+    }
+    _mm_sfence();
+}
+
+__attribute__((target("sse2")))
+static bool equal_rect_sse2(const uint8_t *a, int a_pitch, const uint8_t *b, int b_pitch,
+                            int row_bytes, int height)
+{
+    int row;
+
+    for (row = 0; row < height; row++) {
+        const uint8_t *p = a + (ptrdiff_t)row * a_pitch;
+        const uint8_t *q = b + (ptrdiff_t)row * b_pitch;
+        int i;
+        for (i = 0; i + 16 <= row_bytes; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+            __m128i y = _mm_loadu_si128((const __m128i *)(q + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) {
+                return false;
+            }
+        }
+        if (memcmp(p + i, q + i, row_bytes - i) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+__attribute__((target("sse2")))
+static bool is_uniform_sse2(const uint8_t *p, int pitch, int width, int height,
+                            uint32_t *color)
+{
+    uint32_t c = *(const uint32_t *)p;
+    __m128i vc = _mm_set1_epi32((int)c);
+    int row;
+
+    for (row = 0; row < height; row++) {
+        const uint32_t *q = (const uint32_t *)(p + (ptrdiff_t)row * pitch);
+        int i;
+        for (i = 0; i + 4 <= width; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(q + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, vc)) != 0xFFFF) {
+                return false;
+            }
+        }
+        for (; i < width; i++) {
+            if (q[i] != c) {
+                return false;
+            }
+        }
+    }
+    if (color) {
+        *color = c;
+    }
+    return true;
+}
+
+__attribute__((target("sse2")))
+static void swap_rb_sse2(uint32_t *dst, const uint32_t *src, int n)
+{
+    const __m128i ga = _mm_set1_epi32((int)0xFF00FF00u);
+    const __m128i lo = _mm_set1_epi32(0xFF);
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i r = _mm_and_si128(v, ga);
+        r = _mm_or_si128(r, _mm_and_si128(_mm_srli_epi32(v, 16), lo));
+        r = _mm_or_si128(r, _mm_slli_epi32(_mm_and_si128(v, lo), 16));
+        _mm_storeu_si128((__m128i *)(dst + i), r);
+    }
+    swap_rb_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void set_alpha_sse2(uint32_t *dst, const uint32_t *src, int n)
+{
+    const __m128i alpha = _mm_set1_epi32((int)ALPHA_MASK);
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(v, alpha));
+    }
+    set_alpha_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void cursor_color_sse2(uint32_t *dst, const uint32_t *desktop,
+                              const uint32_t *shape, int n)
+{
+    const __m128i alpha = _mm_set1_epi32((int)ALPHA_MASK);
+    const __m128i zero = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(shape + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(desktop + i));
+        __m128i m = _mm_cmpeq_epi32(_mm_and_si128(s, alpha), zero);
+        __m128i r = _mm_or_si128(_mm_and_si128(m, s),
+                                 _mm_andnot_si128(m, _mm_xor_si128(d, s)));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(r, alpha));
+    }
+    cursor_color_scalar(dst + i, desktop + i, shape + i, n - i);
+}
+
+static const PixelKernels kernels_sse2 = {
+    .name         = "sse2",
+    .copy_rect    = copy_rect_sse2,
+    .equal_rect   = equal_rect_sse2,
+    .is_uniform   = is_uniform_sse2,
+    .swap_rb      = swap_rb_sse2,
+    .set_alpha    = set_alpha_sse2,
+    .cursor_color = cursor_color_sse2,
+    .cursor_mono  = cursor_mono_scalar,
+};
+
+/// AVX2
+
+__attribute__((target("avx2")))
+static void copy_rect_avx2(uint8_t *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                           int row_bytes, int height, bool nontemporal)
+{
+    int row;
+
+    if (!nontemporal) {
+        copy_rect_scalar(dst, dst_pitch, src, src_pitch, row_bytes, height, false);
+        return;
+    }
+
+    for (row = 0; row < height; row++) {
+        uint8_t *d = dst + (ptrdiff_t)row * dst_pitch;
+        const uint8_t *s = src + (ptrdiff_t)row * src_pitch;
+        int head = (32 - ((uintptr_t)d & 31)) & 31;
+        int i;
+
+        if (head > row_bytes) {
+            head = row_bytes;
+        }
+        memcpy(d, s, head);
+        for (i = head; i + 64 <= row_bytes; i += 64) {
+            __m256i v0 = _mm256_loadu_si256((const __m256i *)(s + i));
+            __m256i v1 = _mm256_loadu_si256((const __m256i *)(s + i + 32));
+            _mm256_stream_si256((__m256i *)(d + i), v0);
+            _mm256_stream_si256((__m256i *)(d + i + 32), v1);
+        }
+        memcpy(d + i, s + i, row_bytes - i);
+    }
+    _mm_sfence();
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx2")))
+static bool equal_rect_avx2(const uint8_t *a, int a_pitch, const uint8_t *b, int b_pitch,
+                            int row_bytes, int height)
+{
+    bool equal = true;
+    int row;
+
+    for (row = 0; row < height && equal; row++) {
+        const uint8_t *p = a + (ptrdiff_t)row * a_pitch;
+        const uint8_t *q = b + (ptrdiff_t)row * b_pitch;
+        int i;
+        for (i = 0; i + 32 <= row_bytes; i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i y = _mm256_loadu_si256((const __m256i *)(q + i));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != -1) {
+                equal = false;
+                break;
+            }
+        }
+        if (equal && memcmp(p + i, q + i, row_bytes - i) != 0) {
+            equal = false;
+        }
+    }
+    _mm256_zeroupper();
+    return equal;
+}
+
+__attribute__((target("avx2")))
+static bool is_uniform_avx2(const uint8_t *p, int pitch, int width, int height,
+                            uint32_t *color)
+{
+    uint32_t c = *(const uint32_t *)p;
+    __m256i vc = _mm256_set1_epi32((int)c);
+    bool uniform = true;
+    int row;
+
+    for (row = 0; row < height && uniform; row++) {
+        const uint32_t *q = (const uint32_t *)(p + (ptrdiff_t)row * pitch);
+        int i;
+        for (i = 0; i + 8 <= width; i += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(q + i));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, vc)) != -1) {
+                uniform = false;
+                break;
+            }
+        }
+        for (; uniform && i < width; i++) {
+            if (q[i] != c) {
+                uniform = false;
+            }
+        }
+    }
+    _mm256_zeroupper();
+    if (uniform && color) {
+        *color = c;
+    }
+    return uniform;
+}
+
+__attribute__((target("avx2")))
+static void swap_rb_avx2(uint32_t *dst, const uint32_t *src, int n)
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, shuffle));
+    }
+    _mm256_zeroupper();
+    swap_rb_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void set_alpha_avx2(uint32_t *dst, const uint32_t *src, int n)
+{
+    const __m256i alpha = _mm256_set1_epi32((int)ALPHA_MASK);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(v, alpha));
+    }
+    _mm256_zeroupper();
+    set_alpha_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void cursor_color_avx2(uint32_t *dst, const uint32_t *desktop,
+                              const uint32_t *shape, int n)
+{
+    const __m256i alpha = _mm256_set1_epi32((int)ALPHA_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(shape + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(desktop + i));
+        __m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(s, alpha), zero);
+        __m256i r = _mm256_blendv_epi8(_mm256_xor_si256(d, s), s, m);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(r, alpha));
+    }
+    _mm256_zeroupper();
+    cursor_color_scalar(dst + i, desktop + i, shape + i, n - i);
+}
+
+static const PixelKernels kernels_avx2 = {
+    .name         = "avx2",
+    .copy_rect    = copy_rect_avx2,
+    .equal_rect   = equal_rect_avx2,
+    .is_uniform   = is_uniform_avx2,
+    .swap_rb      = swap_rb_avx2,
+    .set_alpha    = set_alpha_avx2,
+    .cursor_color = cursor_color_avx2,
+    .cursor_mono  = cursor_mono_scalar,
+};
+
+/// AVX-512, cursor kernels are too short to gain anything over AVX2
+
+__attribute__((target("avx512f,avx512bw")))
+static void copy_rect_avx512(uint8_t *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                             int row_bytes, int height, bool nontemporal)
+{
+    int row;
+
+    if (!nontemporal) {
+        copy_rect_scalar(dst, dst_pitch, src, src_pitch, row_bytes, height, false);
+        return;
+    }
+
+    for (row = 0; row < height; row++) {
+        uint8_t *d = dst + (ptrdiff_t)row * dst_pitch;
+        const uint8_t *s = src + (ptrdiff_t)row * src_pitch;
+        int head = (64 - ((uintptr_t)d & 63)) & 63;
+        int i;
+
+        if (head > row_bytes) {
+            head = row_bytes;
+        }
+        memcpy(d, s, head);
+        for (i = head; i + 64 <= row_bytes; i += 64) {
+            __m512i v = _mm512_loadu_si512((const void *)(s + i));
+            _mm512_stream_si512((void *)(d + i), v);
+        }
+        memcpy(d + i, s + i, row_bytes - i);
+    }
+    _mm_sfence();
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static bool equal_rect_avx512(const uint8_t *a, int a_pitch, const uint8_t *b, int b_pitch,
+                              int row_bytes, int height)
+{
+    bool equal = true;
+    int row;
+
+    for (row = 0; row < height && equal; row++) {
+        const uint8_t *p = a + (ptrdiff_t)row * a_pitch;
+        const uint8_t *q = b + (ptrdiff_t)row * b_pitch;
+        int i;
+        for (i = 0; i + 64 <= row_bytes; i += 64) {
+            __m512i x = _mm512_loadu_si512((const void *)(p + i));
+            __m512i y = _mm512_loadu_si512((const void *)(q + i));
+            if (_mm512_cmpneq_epi32_mask(x, y)) {
+                equal = false;
+                break;
+            }
+        }
+        if (equal && i < row_bytes) {
+            __mmask64 k = (__mmask64)-1 >> (64 - (row_bytes - i));
+            __m512i x = _mm512_maskz_loadu_epi8(k, p + i);
+            __m512i y = _mm512_maskz_loadu_epi8(k, q + i);
+            if (_mm512_cmpneq_epi32_mask(x, y)) {
+                equal = false;
+            }
+        }
+    }
+    _mm256_zeroupper();
+    return equal;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static bool is_uniform_avx512(const uint8_t *p, int pitch, int width, int height,
+                              uint32_t *color)
+{
+    uint32_t c = *(const uint32_t *)p;
+    __m512i vc = _mm512_set1_epi32((int)c);
+    bool uniform = true;
+    int row;
+
+    for (row = 0; row < height && uniform; row++) {
+        const uint32_t *q = (const uint32_t *)(p + (ptrdiff_t)row * pitch);
+        int i;
+        for (i = 0; i + 16 <= width; i += 16) {
+            __m512i v = _mm512_loadu_si512((const void *)(q + i));
+            if (_mm512_cmpneq_epi32_mask(v, vc)) {
+                uniform = false;
+                break;
+            }
+        }
+        if (uniform && i < width) {
+            __mmask16 k = (__mmask16)((1u << (width - i)) - 1);
+            __m512i v = _mm512_maskz_loadu_epi32(k, q + i);
+            if (_mm512_mask_cmpneq_epi32_mask(k, v, vc)) {
+                uniform = false;
+            }
+        }
+    }
+    _mm256_zeroupper();
+    if (uniform && color) {
+        *color = c;
+    }
+    return uniform;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void swap_rb_avx512(uint32_t *dst, const uint32_t *src, int n)
+{
+    const __m512i shuffle = _mm512_set4_epi32(0x0F0C0D0E, 0x0B08090A, 0x07040506, 0x03000102);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m512i v = _mm512_loadu_si512((const void *)(src + i));
+        _mm512_storeu_si512((void *)(dst + i), _mm512_shuffle_epi8(v, shuffle));
+    }
+    _mm256_zeroupper();
+    swap_rb_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void set_alpha_avx512(uint32_t *dst, const uint32_t *src, int n)
+{
+    const __m512i alpha = _mm512_set1_epi32((int)ALPHA_MASK);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m512i v = _mm512_loadu_si512((const void *)(src + i));
+        _mm512_storeu_si512((void *)(dst + i), _mm512_or_si512(v, alpha));
+    }
+    _mm256_zeroupper();
+    set_alpha_scalar(dst + i, src + i, n - i);
+}
+
+static const PixelKernels kernels_avx512 = {
+    .name         = "avx512",
+    .copy_rect    = copy_rect_avx512,
+    .equal_rect   = equal_rect_avx512,
+    .is_uniform   = is_uniform_avx512,
+    .swap_rb      = swap_rb_avx512,
+    .set_alpha    = set_alpha_avx512,
+    .cursor_color = cursor_color_avx2,
+    .cursor_mono  = cursor_mono_scalar,
+};
+
+#endif  /* PIXEL_X86 */
+
+static const PixelKernels *kernels = NULL;
+
+const PixelKernels *pixel_get_kernels(PixelIsa isa)
+{
+#ifdef PIXEL_X86
+    __builtin_cpu_init();
+#endif
+
+    switch (isa) {
+    case PIXEL_ISA_SCALAR:
+        return &kernels_scalar;
+#ifdef PIXEL_X86
+    case PIXEL_ISA_SSE2:
+        return __builtin_cpu_supports("sse2") ? &kernels_sse2 : NULL;
+    case PIXEL_ISA_AVX2:
+        return __builtin_cpu_supports("avx2") ? &kernels_avx2 : NULL;
+    case PIXEL_ISA_AVX512:
+        return (__builtin_cpu_supports("avx512f")
+                && __builtin_cpu_supports("avx512bw")) ? &kernels_avx512 : NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+void pixel_init(void)
+{
+    int isa;
+
+    if (kernels) {
+        return;
+    }
+    for (isa = PIXEL_ISA__MAX - 1; isa >= PIXEL_ISA_SCALAR; isa--) {
+        const PixelKernels *k = pixel_get_kernels(isa);
+        if (k) {
+            kernels = k;
+            break;
+        }
+    }
+}
+
+const PixelKernels *pixel_kernels(void)
+{
+    if (!kernels) {
+        pixel_init();
+    }
+    return kernels;
+}
@@ -0,0 +1,112 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   pixel.h
+ * @brief  32bpp pixel kernels
+ *
+ * Every kernel exists in a scalar version and, on x86, in SSE2, AVX2 and
+ * AVX-512 versions. The best set supported by the CPU is picked once by
+ * pixel_init(); the pixel_xxx() helpers call through that set.
+ */
+
+#ifndef WIN_SPICE_PIXEL_H
+#define WIN_SPICE_PIXEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// rects at least this large are copied with non-temporal stores
+#define PIXEL_NT_THRESHOLD (4 * 1024 * 1024)
+
+typedef enum PixelIsa {
+    PIXEL_ISA_SCALAR,
+    PIXEL_ISA_SSE2,
+    PIXEL_ISA_AVX2,
+    PIXEL_ISA_AVX512,
+    PIXEL_ISA__MAX,
+} PixelIsa;
+
+/// pitches may be negative, for bottom-up images
+typedef struct PixelKernels {
+    const char *name;
+    void (*copy_rect)(uint8_t *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                      int row_bytes, int height, bool nontemporal);
+    bool (*equal_rect)(const uint8_t *a, int a_pitch, const uint8_t *b, int b_pitch,
+                       int row_bytes, int height);
+    bool (*is_uniform)(const uint8_t *p, int pitch, int width, int height, uint32_t *color);
+    /// BGRA <-> RGBA
+    void (*swap_rb)(uint32_t *dst, const uint32_t *src, int n);
+    /// BGRX -> BGRA with opaque alpha
+    void (*set_alpha)(uint32_t *dst, const uint32_t *src, int n);
+    /// masked color cursor: xor the shape where its alpha is set
+    void (*cursor_color)(uint32_t *dst, const uint32_t *desktop, const uint32_t *shape, int n);
+    /// monochrome cursor: (desktop AND and_mask) XOR xor_mask, masks start at @bit
+    void (*cursor_mono)(uint32_t *dst, const uint32_t *desktop, const uint8_t *and_mask,
+                        const uint8_t *xor_mask, int bit, int n);
+} PixelKernels;
+
+void pixel_init(void);
+const PixelKernels *pixel_kernels(void);
+/// a specific kernel set, NULL if the CPU does not support it
+const PixelKernels *pixel_get_kernels(PixelIsa isa);
+
+static inline void pixel_copy_rect(uint8_t *dst, int dst_pitch, const uint8_t *src,
+                                   int src_pitch, int row_bytes, int height)
+{
+    pixel_kernels()->copy_rect(dst, dst_pitch, src, src_pitch, row_bytes, height,
+                               (int64_t)row_bytes * height >= PIXEL_NT_THRESHOLD);
+}
+
+static inline bool pixel_equal_rect(const uint8_t *a, int a_pitch, const uint8_t *b,
+                                    int b_pitch, int row_bytes, int height)
+{
+    return pixel_kernels()->equal_rect(a, a_pitch, b, b_pitch, row_bytes, height);
+}
+
+static inline bool pixel_is_uniform(const uint8_t *p, int pitch, int width, int height,
+                                    uint32_t *color)
+{
+    return pixel_kernels()->is_uniform(p, pitch, width, height, color);
+}
+
+static inline void pixel_swap_rb(uint32_t *dst, const uint32_t *src, int n)
+{
+    pixel_kernels()->swap_rb(dst, src, n);
+}
+
+static inline void pixel_set_alpha(uint32_t *dst, const uint32_t *src, int n)
+{
+    pixel_kernels()->set_alpha(dst, src, n);
+}
+
+static inline void pixel_cursor_color(uint32_t *dst, const uint32_t *desktop,
+                                      const uint32_t *shape, int n)
+{
+    pixel_kernels()->cursor_color(dst, desktop, shape, n);
+}
+
+static inline void pixel_cursor_mono(uint32_t *dst, const uint32_t *desktop,
+                                     const uint8_t *and_mask, const uint8_t *xor_mask,
+                                     int bit, int n)
+{
+    pixel_kernels()->cursor_mono(dst, desktop, and_mask, xor_mask, bit, n);
+}
+
+#endif  /* WIN_SPICE_PIXEL_H */
@@ -0,0 +1,149 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   probe.c
+ * @brief  Latency probe primitives
+ */
+
+#include <stdlib.h>
+#include "probe.h"
+#include "stats.h"
+
+#define PROBE_WHITE 0xFFFFFFFF
+#define PROBE_BLACK 0xFF000000
+
+atomic_bool probe_enabled;
+
+static uint32_t next_seq;
+static uint64_t last_marker;
+
+/// the last tablet event, 0 in sent_at once it was seen
+static atomic_bool input_known;
+static atomic_ullong input_sent_at;
+static atomic_int input_x;
+static atomic_int input_y;
+
+void probe_enable(bool enable)
+{
+    atomic_store(&probe_enabled, enable);
+}
+
+static int cell_bit(uint32_t seq, int cell)
+{
+    if (cell < 2) {
+        return cell == 0;
+    }
+    if (cell < 34) {
+        return (seq >> (cell - 2)) & 1;
+    }
+    return __builtin_parity(seq);
+}
+
+void probe_paint(uint8_t *pixels, int pitch, uint32_t seq)
+{
+    int cell, x, y;
+
+    for (y = 0; y < PROBE_HEIGHT; y++) {
+        uint32_t *row = (uint32_t *)(pixels + y * pitch);
+        for (cell = 0; cell < PROBE_CELLS; cell++) {
+            uint32_t color = cell_bit(seq, cell) ? PROBE_WHITE : PROBE_BLACK;
+            for (x = 0; x < PROBE_CELL; x++) {
+                row[cell * PROBE_CELL + x] = color;
+            }
+        }
+    }
+}
+
+/// the middle of a cell, away from the edges lossy codecs smear
+static int read_cell(const uint8_t *pixels, int pitch, int cell)
+{
+    int sum = 0;
+    int x, y;
+
+    for (y = PROBE_CELL / 4; y < PROBE_CELL * 3 / 4; y++) {
+        const uint8_t *p = pixels + y * pitch + (cell * PROBE_CELL + PROBE_CELL / 4) * 4;
+        for (x = 0; x < PROBE_CELL / 2; x++, p += 4) {
+            sum += p[0] + p[1] + p[2];
+        }
+    }
+    return sum > 3 * 128 * (PROBE_CELL / 2) * (PROBE_CELL / 2);
+}
+
+bool probe_decode(const uint8_t *pixels, int pitch, uint32_t *seq)
+{
+    uint32_t value = 0;
+    int cell;
+
+    if (!read_cell(pixels, pitch, 0) || read_cell(pixels, pitch, 1)) {
+        return false;
+    }
+    for (cell = 2; cell < 34; cell++) {
+        value |= (uint32_t)read_cell(pixels, pitch, cell) << (cell - 2);
+    }
+    if (read_cell(pixels, pitch, 34) != __builtin_parity(value)) {
+        return false;
+    }
+    *seq = value;
+    return true;
+}
+
+bool probe_marker_due(uint32_t *seq)
+{
+    uint64_t now = stats_now();
+
+    if (now - last_marker < PROBE_INTERVAL_MS * 1000000ULL) {
+        return false;
+    }
+    last_marker = now;
+    *seq = next_seq++;
+    return true;
+}
+
+void probe_input_sent(int x, int y)
+{
+    atomic_store_explicit(&input_x, x, memory_order_relaxed);
+    atomic_store_explicit(&input_y, y, memory_order_relaxed);
+    atomic_store_explicit(&input_sent_at, stats_now(), memory_order_release);
+    atomic_store_explicit(&input_known, true, memory_order_release);
+}
+
+bool probe_input_position(int *x, int *y)
+{
+    if (!atomic_load_explicit(&input_known, memory_order_acquire)) {
+        return false;
+    }
+    *x = atomic_load_explicit(&input_x, memory_order_relaxed);
+    *y = atomic_load_explicit(&input_y, memory_order_relaxed);
+    return true;
+}
+
+void probe_input_seen(int x, int y)
+{
+    uint64_t sent = atomic_load_explicit(&input_sent_at, memory_order_acquire);
+
+    if (!sent
+        || abs(x - atomic_load_explicit(&input_x, memory_order_relaxed)) > PROBE_INPUT_SLACK
+        || abs(y - atomic_load_explicit(&input_y, memory_order_relaxed)) > PROBE_INPUT_SLACK) {
+        return;
+    }
+    if (atomic_compare_exchange_strong(&input_sent_at, &sent, 0)) {
+        stats_record(STATS_STAGE_INPUT, stats_now() - sent);
+    }
+}
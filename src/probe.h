@@ -0,0 +1,72 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   probe.h
+ * @brief  Latency probe primitives
+ *
+ * In probe mode the capture thread paints a marker into the top left of
+ * frames of the synthetic desktop every PROBE_INTERVAL_MS. The marker is
+ * a row of 8x8 cells, black or white, that encode a sequence number and
+ * survive lossy compression, so a client can read it back from the
+ * display stream with probe_decode().
+ *
+ * Only these primitives exist. No headless client decodes markers from
+ * the received stream, so glass-to-glass latency is not measured; the
+ * server alone cannot see when a marker reaches a screen.
+ *
+ * Input is timed on the server side: from a tablet event to the capture
+ * that shows the pointer there.
+ */
+
+#ifndef WIN_SPICE_PROBE_H
+#define WIN_SPICE_PROBE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PROBE_CELL          8
+/// two sync cells, 32 sequence bits and one parity cell
+#define PROBE_CELLS         (2 + 32 + 1)
+#define PROBE_WIDTH         (PROBE_CELLS * PROBE_CELL)
+#define PROBE_HEIGHT        PROBE_CELL
+#define PROBE_INTERVAL_MS   100
+/// pixels the pointer may land off the tablet position
+#define PROBE_INPUT_SLACK   2
+
+extern atomic_bool probe_enabled;
+
+void probe_enable(bool enable);
+
+/// 32 bit BGRX pixels, @pixels points at the top left of the marker
+void probe_paint(uint8_t *pixels, int pitch, uint32_t seq);
+bool probe_decode(const uint8_t *pixels, int pitch, uint32_t *seq);
+
+/// sequence of the next marker if one is due, capture thread only
+bool probe_marker_due(uint32_t *seq);
+
+/// a tablet event asked for the pointer at @x, @y
+void probe_input_sent(int x, int y);
+/// where the last tablet event put the pointer, false if there was none
+bool probe_input_position(int *x, int *y);
+/// a captured frame shows the pointer at @x, @y
+void probe_input_seen(int x, int y);
+
+#endif  /* WIN_SPICE_PROBE_H */
@@ -0,0 +1,659 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   region.c
+ * @brief  Banded damage region
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "region.h"
+#include "memory.h"
+
+typedef enum RegionOp {
+    REGION_OP_UNION,
+    REGION_OP_INTERSECT,
+    REGION_OP_SUBTRACT,
+} RegionOp;
+
+typedef struct RegionSpan {
+    int32_t x1, x2;
+} RegionSpan;
+
+/**
+ * Working memory of the region operations. Each thread has its own and
+ * it only grows, so once the capture loop has seen its busiest frame no
+ * operation allocates any more.
+ */
+typedef struct RegionScratch {
+    int32_t *ys;
+    int ys_size;
+    RegionSpan *spans;
+    int spans_size;
+    /// input rects sorted by top, then the ones crossing the current band
+    WinSpiceRect *rects;
+    int rects_size;
+    /// results are built here and then copied into the destination
+    WinSpiceRegion result;
+    /// the rects of wregion_union_rects()
+    WinSpiceRegion added;
+} RegionScratch;
+
+static _Thread_local RegionScratch scratch;
+
+static void *scratch_grow(void *buf, int *size, int n, size_t elem_size)
+{
+    if (*size >= n) {
+        return buf;
+    }
+    while (*size < n) {
+        *size = *size ? *size * 2 : 64;
+    }
+    w_free(buf);
+    return w_malloc(*size * elem_size);
+}
+
+static void region_reserve(WinSpiceRegion *region, int n)
+{
+    WinSpiceRect *rects;
+    int size;
+
+    if (region->size >= n) {
+        return;
+    }
+
+    size = region->size ? region->size : 8;
+    while (size < n) {
+        size *= 2;
+    }
+
+    rects = w_malloc(size * sizeof(WinSpiceRect));
+    if (region->num_rects) {
+        memcpy(rects, region->rects, region->num_rects * sizeof(WinSpiceRect));
+    }
+    w_free(region->rects);
+    region->rects = rects;
+    region->size = size;
+}
+
+static void region_update_extents(WinSpiceRegion *region)
+{
+    WinSpiceRect *extents = &region->extents;
+    int i;
+
+    if (region->num_rects == 0) {
+        memset(extents, 0, sizeof(*extents));
+        return;
+    }
+
+    /// bands are sorted, so only left and right need a scan
+    extents->top = region->rects[0].top;
+    extents->bottom = region->rects[region->num_rects - 1].bottom;
+    extents->left = region->rects[0].left;
+    extents->right = region->rects[0].right;
+    for (i = 1; i < region->num_rects; i++) {
+        if (region->rects[i].left < extents->left) {
+            extents->left = region->rects[i].left;
+        }
+        if (region->rects[i].right > extents->right) {
+            extents->right = region->rects[i].right;
+        }
+    }
+}
+
+static int compare_int32(const void *a, const void *b)
+{
+    int32_t x = *(const int32_t *)a;
+    int32_t y = *(const int32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Collect the x spans of @region covering the horizontal strip [y1, y2).
+ * y1 and y2 are taken from the band edges of both operands, so a band
+ * either covers the whole strip or does not touch it at all.
+ */
+static int region_collect_spans(const WinSpiceRegion *region, int32_t y1, int32_t y2,
+                                RegionSpan *spans)
+{
+    int i, n = 0;
+
+    for (i = 0; i < region->num_rects; i++) {
+        const WinSpiceRect *r = &region->rects[i];
+        if (r->top >= y2) {
+            break;
+        }
+        if (r->top <= y1 && r->bottom >= y2) {
+            spans[n].x1 = r->left;
+            spans[n].x2 = r->right;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+static int spans_union(const RegionSpan *a, int na, const RegionSpan *b, int nb,
+                       RegionSpan *out)
+{
+    int i = 0, j = 0, n = 0;
+
+    while (i < na || j < nb) {
+        const RegionSpan *s;
+        if (j >= nb || (i < na && a[i].x1 <= b[j].x1)) {
+            s = &a[i++];
+        } else {
+            s = &b[j++];
+        }
+        if (n > 0 && s->x1 <= out[n - 1].x2) {
+            if (s->x2 > out[n - 1].x2) {
+                out[n - 1].x2 = s->x2;
+            }
+        } else {
+            out[n++] = *s;
+        }
+    }
+
+    return n;
+}
+
+static int spans_intersect(const RegionSpan *a, int na, const RegionSpan *b, int nb,
+                           RegionSpan *out)
+{
+    int i = 0, j = 0, n = 0;
+
+    while (i < na && j < nb) {
+        int32_t x1 = MAX(a[i].x1, b[j].x1);
+        int32_t x2 = MIN(a[i].x2, b[j].x2);
+        if (x1 < x2) {
+            out[n].x1 = x1;
+            out[n].x2 = x2;
+            n++;
+        }
+        if (a[i].x2 < b[j].x2) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+
+    return n;
+}
+
+static int spans_subtract(const RegionSpan *a, int na, const RegionSpan *b, int nb,
+                          RegionSpan *out)
+{
+    int i, j = 0, n = 0;
+
+    for (i = 0; i < na; i++) {
+        int32_t x = a[i].x1;
+        int k;
+
+        while (j < nb && b[j].x2 <= x) {
+            j++;
+        }
+        for (k = j; k < nb && b[k].x1 < a[i].x2; k++) {
+            if (b[k].x1 > x) {
+                out[n].x1 = x;
+                out[n].x2 = b[k].x1;
+                n++;
+            }
+            if (b[k].x2 > x) {
+                x = b[k].x2;
+            }
+        }
+        if (x < a[i].x2) {
+            out[n].x1 = x;
+            out[n].x2 = a[i].x2;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Append a band to @region, merging it into the previous band when that
+ * one ends at y1 and has exactly the same spans.
+ */
+static void region_append_band(WinSpiceRegion *region, int *prev_band,
+                               int32_t y1, int32_t y2,
+                               const RegionSpan *spans, int n)
+{
+    int i, start = *prev_band;
+
+    if (n == 0) {
+        return;
+    }
+
+    if (start >= 0 && region->num_rects - start == n
+        && region->rects[start].bottom == y1) {
+        for (i = 0; i < n; i++) {
+            if (region->rects[start + i].left != spans[i].x1
+                || region->rects[start + i].right != spans[i].x2) {
+                break;
+            }
+        }
+        if (i == n) {
+            for (i = 0; i < n; i++) {
+                region->rects[start + i].bottom = y2;
+            }
+            return;
+        }
+    }
+
+    region_reserve(region, region->num_rects + n);
+    *prev_band = region->num_rects;
+    for (i = 0; i < n; i++) {
+        WinSpiceRect *r = &region->rects[region->num_rects++];
+        r->left = spans[i].x1;
+        r->right = spans[i].x2;
+        r->top = y1;
+        r->bottom = y2;
+    }
+}
+
+static void region_op(WinSpiceRegion *dst, const WinSpiceRegion *a,
+                      const WinSpiceRegion *b, RegionOp op)
+{
+    WinSpiceRegion *result = &scratch.result;
+    RegionSpan *sa, *sb, *out;
+    int32_t *ys;
+    int i, nys = 0, prev_band = -1;
+
+    wregion_clear(result);
+    if (a->num_rects + b->num_rects == 0) {
+        goto done;
+    }
+
+    scratch.ys = scratch_grow(scratch.ys, &scratch.ys_size,
+                              2 * (a->num_rects + b->num_rects), sizeof(int32_t));
+    scratch.spans = scratch_grow(scratch.spans, &scratch.spans_size,
+                                 2 * (a->num_rects + b->num_rects) + 1, sizeof(RegionSpan));
+    ys = scratch.ys;
+    sa = scratch.spans;
+    sb = sa + a->num_rects;
+    out = sb + b->num_rects;
+
+    for (i = 0; i < a->num_rects; i++) {
+        ys[nys++] = a->rects[i].top;
+        ys[nys++] = a->rects[i].bottom;
+    }
+    for (i = 0; i < b->num_rects; i++) {
+        ys[nys++] = b->rects[i].top;
+        ys[nys++] = b->rects[i].bottom;
+    }
+    qsort(ys, nys, sizeof(int32_t), compare_int32);
+
+    for (i = 0; i + 1 < nys; i++) {
+        int32_t y1 = ys[i], y2 = ys[i + 1];
+        int na, nb, n;
+
+        if (y1 == y2) {
+            continue;
+        }
+
+        na = region_collect_spans(a, y1, y2, sa);
+        nb = region_collect_spans(b, y1, y2, sb);
+        switch (op) {
+        case REGION_OP_UNION:
+            n = spans_union(sa, na, sb, nb, out);
+            break;
+        case REGION_OP_INTERSECT:
+            n = spans_intersect(sa, na, sb, nb, out);
+            break;
+        case REGION_OP_SUBTRACT:
+        default:
+            n = spans_subtract(sa, na, sb, nb, out);
+            break;
+        }
+        region_append_band(result, &prev_band, y1, y2, out, n);
+    }
+
+done:
+    /// a and b may be dst, so it is only written now
+    region_update_extents(result);
+    wregion_copy(dst, result);
+}
+
+void wregion_init(WinSpiceRegion *region)
+{
+    memset(region, 0, sizeof(*region));
+}
+
+static int compare_rect_top(const void *a, const void *b)
+{
+    const WinSpiceRect *x = a;
+    const WinSpiceRect *y = b;
+
+    return x->top < y->top ? -1 : x->top > y->top;
+}
+
+static int compare_span(const void *a, const void *b)
+{
+    const RegionSpan *x = a, *y = b;
+
+    return (x->x1 > y->x1) - (x->x1 < y->x1);
+}
+
+void wregion_set_rects(WinSpiceRegion *region, const WinSpiceRect *rects, int n)
+{
+    WinSpiceRect *sorted, *active;
+    RegionSpan *spans;
+    int32_t *ys;
+    int i, j, m = 0, nys = 0, next = 0, num_active = 0, prev_band = -1;
+
+    wregion_clear(region);
+    if (n <= 0) {
+        return;
+    }
+
+    scratch.ys = scratch_grow(scratch.ys, &scratch.ys_size, 2 * n, sizeof(int32_t));
+    scratch.spans = scratch_grow(scratch.spans, &scratch.spans_size, n, sizeof(RegionSpan));
+    scratch.rects = scratch_grow(scratch.rects, &scratch.rects_size, 2 * n, sizeof(WinSpiceRect));
+    ys = scratch.ys;
+    spans = scratch.spans;
+    sorted = scratch.rects;
+    active = sorted + n;
+    for (i = 0; i < n; i++) {
+        if (!wrect_is_empty(&rects[i])) {
+            sorted[m++] = rects[i];
+            ys[nys++] = rects[i].top;
+            ys[nys++] = rects[i].bottom;
+        }
+    }
+    qsort(sorted, m, sizeof(WinSpiceRect), compare_rect_top);
+    qsort(ys, nys, sizeof(int32_t), compare_int32);
+
+    /// sweep down: each band only looks at the rects crossing it
+    for (i = 0; i + 1 < nys; i++) {
+        int32_t y1 = ys[i], y2 = ys[i + 1];
+        int k = 0;
+
+        if (y1 == y2) {
+            continue;
+        }
+        while (next < m && sorted[next].top <= y1) {
+            active[num_active++] = sorted[next++];
+        }
+        for (j = 0; j < num_active; j++) {
+            if (active[j].bottom > y1) {
+                active[k++] = active[j];
+            }
+        }
+        num_active = k;
+
+        /// every band edge is in ys, so each active rect covers all of it
+        for (j = 0; j < num_active; j++) {
+            spans[j].x1 = active[j].left;
+            spans[j].x2 = active[j].right;
+        }
+        qsort(spans, num_active, sizeof(RegionSpan), compare_span);
+        for (j = 0, k = 0; j < num_active; j++) {
+            if (k > 0 && spans[j].x1 <= spans[k - 1].x2) {
+                spans[k - 1].x2 = MAX(spans[k - 1].x2, spans[j].x2);
+            } else {
+                spans[k++] = spans[j];
+            }
+        }
+        region_append_band(region, &prev_band, y1, y2, spans, k);
+    }
+
+    region_update_extents(region);
+}
+
+void wregion_union_rects(WinSpiceRegion *dst, const WinSpiceRect *rects, int n)
+{
+    if (wregion_is_empty(dst)) {
+        wregion_set_rects(dst, rects, n);
+        return;
+    }
+    wregion_set_rects(&scratch.added, rects, n);
+    wregion_union(dst, dst, &scratch.added);
+}
+
+void wregion_init_rects(WinSpiceRegion *region, const WinSpiceRect *rects, int n)
+{
+    wregion_init(region);
+    wregion_set_rects(region, rects, n);
+}
+
+void wregion_init_rect(WinSpiceRegion *region, const WinSpiceRect *rect)
+{
+    wregion_init(region);
+    if (wrect_is_empty(rect)) {
+        return;
+    }
+    region_reserve(region, 1);
+    region->rects[0] = *rect;
+    region->num_rects = 1;
+    region->extents = *rect;
+}
+
+void wregion_fini(WinSpiceRegion *region)
+{
+    w_free(region->rects);
+    wregion_init(region);
+}
+
+void wregion_clear(WinSpiceRegion *region)
+{
+    /// keep the storage, the capture loop reuses it every frame
+    region->num_rects = 0;
+    memset(&region->extents, 0, sizeof(region->extents));
+}
+
+void wregion_copy(WinSpiceRegion *dst, const WinSpiceRegion *src)
+{
+    if (dst == src) {
+        return;
+    }
+    region_reserve(dst, src->num_rects);
+    if (src->num_rects) {
+        memcpy(dst->rects, src->rects, src->num_rects * sizeof(WinSpiceRect));
+    }
+    dst->num_rects = src->num_rects;
+    dst->extents = src->extents;
+}
+
+void wregion_union(WinSpiceRegion *dst, const WinSpiceRegion *a, const WinSpiceRegion *b)
+{
+    if (b->num_rects == 0) {
+        wregion_copy(dst, a);
+    } else if (a->num_rects == 0) {
+        wregion_copy(dst, b);
+    } else if (a->num_rects == 1 && wregion_contains_rect(b, &a->extents)) {
+        wregion_copy(dst, b);
+    } else if (b->num_rects == 1 && wregion_contains_rect(a, &b->extents)) {
+        wregion_copy(dst, a);
+    } else {
+        region_op(dst, a, b, REGION_OP_UNION);
+    }
+}
+
+void wregion_intersect(WinSpiceRegion *dst, const WinSpiceRegion *a, const WinSpiceRegion *b)
+{
+    if (a->num_rects == 0 || b->num_rects == 0) {
+        wregion_clear(dst);
+    } else {
+        region_op(dst, a, b, REGION_OP_INTERSECT);
+    }
+}
+
+void wregion_subtract(WinSpiceRegion *dst, const WinSpiceRegion *a, const WinSpiceRegion *b)
+{
+    if (a->num_rects == 0 || b->num_rects == 0
+        || !wregion_intersects_rect(b, &a->extents)) {
+        wregion_copy(dst, a);
+    } else {
+        region_op(dst, a, b, REGION_OP_SUBTRACT);
+    }
+}
+
+void wregion_union_rect(WinSpiceRegion *dst, const WinSpiceRegion *src, const WinSpiceRect *rect)
+{
+    WinSpiceRegion r = {
+        .extents = *rect, .rects = (WinSpiceRect *)rect, .num_rects = 1, .size = 1,
+    };
+
+    if (wrect_is_empty(rect)) {
+        wregion_copy(dst, src);
+        return;
+    }
+    wregion_union(dst, src, &r);
+}
+
+void wregion_intersect_rect(WinSpiceRegion *dst, const WinSpiceRegion *src, const WinSpiceRect *rect)
+{
+    WinSpiceRegion r = {
+        .extents = *rect, .rects = (WinSpiceRect *)rect, .num_rects = 1, .size = 1,
+    };
+
+    if (wrect_is_empty(rect)) {
+        wregion_clear(dst);
+        return;
+    }
+    wregion_intersect(dst, src, &r);
+}
+
+void wregion_subtract_rect(WinSpiceRegion *dst, const WinSpiceRegion *src, const WinSpiceRect *rect)
+{
+    WinSpiceRegion r = {
+        .extents = *rect, .rects = (WinSpiceRect *)rect, .num_rects = 1, .size = 1,
+    };
+
+    if (wrect_is_empty(rect)) {
+        wregion_copy(dst, src);
+        return;
+    }
+    wregion_subtract(dst, src, &r);
+}
+
+void wregion_translate(WinSpiceRegion *region, int dx, int dy)
+{
+    int i;
+
+    if (region->num_rects == 0) {
+        return;
+    }
+    for (i = 0; i < region->num_rects; i++) {
+        region->rects[i].left += dx;
+        region->rects[i].right += dx;
+        region->rects[i].top += dy;
+        region->rects[i].bottom += dy;
+    }
+    region->extents.left += dx;
+    region->extents.right += dx;
+    region->extents.top += dy;
+    region->extents.bottom += dy;
+}
+
+bool wregion_is_empty(const WinSpiceRegion *region)
+{
+    return region->num_rects == 0;
+}
+
+bool wregion_contains_rect(const WinSpiceRegion *region, const WinSpiceRect *rect)
+{
+    const WinSpiceRect *e = &region->extents;
+    int32_t y;
+    int i;
+
+    if (wrect_is_empty(rect)) {
+        return true;
+    }
+    if (region->num_rects == 0
+        || rect->left < e->left || rect->right > e->right
+        || rect->top < e->top || rect->bottom > e->bottom) {
+        return false;
+    }
+
+    /// walk the bands top-down, each one must cover [left, right) without gap
+    y = rect->top;
+    for (i = 0; i < region->num_rects && y < rect->bottom; i++) {
+        const WinSpiceRect *r = &region->rects[i];
+        if (r->bottom <= y) {
+            continue;
+        }
+        if (r->top > y) {
+            return false;
+        }
+        if (r->left <= rect->left && r->right >= rect->right) {
+            y = r->bottom;
+        }
+    }
+
+    return y >= rect->bottom;
+}
+
+bool wregion_intersects_rect(const WinSpiceRegion *region, const WinSpiceRect *rect)
+{
+    const WinSpiceRect *e = &region->extents;
+    int i;
+
+    if (region->num_rects == 0 || wrect_is_empty(rect)
+        || rect->right <= e->left || rect->left >= e->right
+        || rect->bottom <= e->top || rect->top >= e->bottom) {
+        return false;
+    }
+
+    for (i = 0; i < region->num_rects; i++) {
+        const WinSpiceRect *r = &region->rects[i];
+        if (r->top >= rect->bottom) {
+            break;
+        }
+        if (r->bottom > rect->top && r->right > rect->left && r->left < rect->right) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint64_t wregion_area(const WinSpiceRegion *region)
+{
+    uint64_t area = 0;
+    int i;
+
+    for (i = 0; i < region->num_rects; i++) {
+        area += wrect_area(&region->rects[i]);
+    }
+
+    return area;
+}
+
+const WinSpiceRect *wregion_rects(const WinSpiceRegion *region, int *num_rects)
+{
+    if (num_rects) {
+        *num_rects = region->num_rects;
+    }
+    return region->rects;
+}
+
+void wregion_thread_fini(void)
+{
+    w_free(scratch.ys);
+    w_free(scratch.spans);
+    w_free(scratch.rects);
+    wregion_fini(&scratch.result);
+    wregion_fini(&scratch.added);
+    memset(&scratch, 0, sizeof(scratch));
+}
@@ -0,0 +1,100 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   region.h
+ * @brief  Banded damage region
+ *
+ * A region is a set of disjoint rectangles kept in y-x banded order, the
+ * same representation pixman_region32 uses: rectangles are sorted by top
+ * and then by left, every rectangle of a band shares the same top and
+ * bottom, and vertically adjacent bands with identical spans are merged.
+ *
+ * This module does not depend on any windows or spice header, so it can
+ * be built and exercised on any platform.
+ */
+
+#ifndef WIN_SPICE_REGION_H
+#define WIN_SPICE_REGION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* same layout as RECT / QXLRect field names, right and bottom exclusive */
+typedef struct WinSpiceRect {
+    int32_t left;
+    int32_t top;
+    int32_t right;
+    int32_t bottom;
+} WinSpiceRect;
+
+typedef struct WinSpiceRegion {
+    WinSpiceRect extents;
+    WinSpiceRect *rects;
+    int num_rects;
+    int size;
+} WinSpiceRegion;
+
+void wregion_init(WinSpiceRegion *region);
+void wregion_init_rect(WinSpiceRegion *region, const WinSpiceRect *rect);
+/// build a region from any number of possibly overlapping rects at once
+void wregion_init_rects(WinSpiceRegion *region, const WinSpiceRect *rects, int n);
+/// the same for an initialized region, reusing its storage
+void wregion_set_rects(WinSpiceRegion *region, const WinSpiceRect *rects, int n);
+/// add many rects at once, much cheaper than one wregion_union_rect() each
+void wregion_union_rects(WinSpiceRegion *dst, const WinSpiceRect *rects, int n);
+void wregion_fini(WinSpiceRegion *region);
+void wregion_clear(WinSpiceRegion *region);
+void wregion_copy(WinSpiceRegion *dst, const WinSpiceRegion *src);
+
+/// dst may be the same object as any of the sources
+void wregion_union(WinSpiceRegion *dst, const WinSpiceRegion *a, const WinSpiceRegion *b);
+void wregion_intersect(WinSpiceRegion *dst, const WinSpiceRegion *a, const WinSpiceRegion *b);
+void wregion_subtract(WinSpiceRegion *dst, const WinSpiceRegion *a, const WinSpiceRegion *b);
+void wregion_union_rect(WinSpiceRegion *dst, const WinSpiceRegion *src, const WinSpiceRect *rect);
+void wregion_intersect_rect(WinSpiceRegion *dst, const WinSpiceRegion *src, const WinSpiceRect *rect);
+void wregion_subtract_rect(WinSpiceRegion *dst, const WinSpiceRegion *src, const WinSpiceRect *rect);
+void wregion_translate(WinSpiceRegion *region, int dx, int dy);
+
+bool wregion_is_empty(const WinSpiceRegion *region);
+bool wregion_contains_rect(const WinSpiceRegion *region, const WinSpiceRect *rect);
+bool wregion_intersects_rect(const WinSpiceRegion *region, const WinSpiceRect *rect);
+uint64_t wregion_area(const WinSpiceRegion *region);
+const WinSpiceRect *wregion_rects(const WinSpiceRegion *region, int *num_rects);
+
+/**
+ * Operations work in per thread scratch memory that is kept for reuse.
+ * A thread that used regions frees it with this before it exits.
+ */
+void wregion_thread_fini(void);
+
+static inline bool wrect_is_empty(const WinSpiceRect *rect)
+{
+    return rect->right <= rect->left || rect->bottom <= rect->top;
+}
+
+static inline uint64_t wrect_area(const WinSpiceRect *rect)
+{
+    if (wrect_is_empty(rect)) {
+        return 0;
+    }
+    return (uint64_t)(rect->right - rect->left) * (rect->bottom - rect->top);
+}
+
+#endif  /* WIN_SPICE_REGION_H */
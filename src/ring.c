@@ -0,0 +1,194 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   ring.c
+ * @brief  Bounded single producer, single consumer queue
+ */
+
+#include "ring.h"
+#include "memory.h"
+
+void ring_init(DrawableRing *ring, uint32_t entries, uint32_t max_bytes,
+               RingFreeFunc free_func)
+{
+    uint32_t size = 2;
+
+    while (size < entries) {
+        size <<= 1;
+    }
+
+    ring->items = w_malloc0(size * sizeof(void *));
+    ring->sizes = w_malloc0(size * sizeof(atomic_uint));
+    ring->mask = size - 1;
+    ring->max_bytes = max_bytes;
+    ring->free_func = free_func;
+    ring->full_count = 0;
+    ring->tail_cache = 0;
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->discard_end, 0);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->bytes, 0);
+}
+
+void ring_fini(DrawableRing *ring)
+{
+    void *item;
+
+    if (!ring->items) {
+        return;
+    }
+    while ((item = ring_pop(ring))) {
+        if (ring->free_func) {
+            ring->free_func(item);
+        }
+    }
+    w_free(ring->items);
+    w_free(ring->sizes);
+    ring->items = NULL;
+    ring->sizes = NULL;
+}
+
+static bool ring_room(DrawableRing *ring, uint32_t tail, uint32_t head, uint32_t size)
+{
+    uint32_t bytes;
+
+    if (tail - head > ring->mask) {
+        return false;
+    }
+    /// an empty ring takes anything, or a huge item could never be queued
+    bytes = atomic_load_explicit(&ring->bytes, memory_order_relaxed);
+    return tail == head || bytes + size <= ring->max_bytes;
+}
+
+bool ring_has_room(DrawableRing *ring, uint32_t size)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    return ring_room(ring, tail, head, size);
+}
+
+bool ring_push(DrawableRing *ring, void *item, uint32_t size)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t discard_end;
+
+    if (!ring_room(ring, tail, head, size)) {
+        ring->full_count++;
+        return false;
+    }
+
+    /// keep the discard mark close behind the consumer so it never wraps
+    discard_end = atomic_load_explicit(&ring->discard_end, memory_order_relaxed);
+    if ((int32_t)(discard_end - head) < 0) {
+        atomic_store_explicit(&ring->discard_end, head, memory_order_relaxed);
+    }
+
+    ring->items[tail & ring->mask] = item;
+    atomic_store_explicit(&ring->sizes[tail & ring->mask], size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ring->bytes, size, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+uint32_t ring_next_index(DrawableRing *ring)
+{
+    return atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+void ring_release(DrawableRing *ring, uint32_t index)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t size;
+
+    /// popped already, or never pushed; only the producer reuses entries
+    if ((int32_t)(index - head) < 0 || (int32_t)(tail - index) <= 0) {
+        return;
+    }
+    size = atomic_exchange_explicit(&ring->sizes[index & ring->mask], 0, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&ring->bytes, size, memory_order_relaxed);
+}
+
+void ring_discard_all(DrawableRing *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->discard_end, tail, memory_order_release);
+}
+
+void *ring_pop(DrawableRing *ring)
+{
+    /// bounded by the ring size, discarded items are skipped in one pass
+    for (;;) {
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint32_t discard_end;
+        void *item;
+
+        if (head == ring->tail_cache) {
+            ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            if (head == ring->tail_cache) {
+                return NULL;
+            }
+        }
+
+        item = ring->items[head & ring->mask];
+        /// zero if the producer released it in the meantime
+        atomic_fetch_sub_explicit(&ring->bytes,
+                                  atomic_exchange_explicit(&ring->sizes[head & ring->mask], 0,
+                                                           memory_order_relaxed),
+                                  memory_order_relaxed);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+        discard_end = atomic_load_explicit(&ring->discard_end, memory_order_acquire);
+        if ((int32_t)(discard_end - head) > 0) {
+            if (ring->free_func) {
+                ring->free_func(item);
+            }
+            continue;
+        }
+        return item;
+    }
+}
+
+bool ring_is_empty(DrawableRing *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head != ring->tail_cache) {
+        return false;
+    }
+    ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return head == ring->tail_cache;
+}
+
+uint32_t ring_count(DrawableRing *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    return tail - head;
+}
+
+uint32_t ring_bytes(DrawableRing *ring)
+{
+    return atomic_load_explicit(&ring->bytes, memory_order_relaxed);
+}
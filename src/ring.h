@@ -0,0 +1,100 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   ring.h
+ * @brief  Bounded single producer, single consumer queue
+ *
+ * The capture thread pushes drawables and the spice worker pops them.
+ * Both sides only touch their own index and read the other one, so
+ * neither ever waits for a lock. The ring is bounded both in entries
+ * and in bytes; a push that would exceed either bound fails, which is
+ * the producer's signal to back off.
+ */
+
+#ifndef WIN_SPICE_RING_H
+#define WIN_SPICE_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RING_CACHELINE 64
+
+typedef void (*RingFreeFunc)(void *item);
+
+typedef struct DrawableRing {
+    void **items;
+    /// taken by whoever stops counting an item first, see ring_release()
+    atomic_uint *sizes;
+    uint32_t mask;
+    uint32_t max_bytes;
+    /// frees items dropped by ring_discard_all()
+    RingFreeFunc free_func;
+
+    /// written by the producer
+    char pad0[RING_CACHELINE];
+    atomic_uint tail;
+    /// items before this index are dropped instead of popped
+    atomic_uint discard_end;
+    /// pushes refused because the ring was full
+    uint64_t full_count;
+
+    /// written by the consumer
+    char pad1[RING_CACHELINE];
+    atomic_uint head;
+    uint32_t tail_cache;
+
+    /// written by both
+    char pad2[RING_CACHELINE];
+    atomic_uint bytes;
+    char pad3[RING_CACHELINE];
+} DrawableRing;
+
+/// @entries is rounded up to a power of two
+void ring_init(DrawableRing *ring, uint32_t entries, uint32_t max_bytes,
+               RingFreeFunc free_func);
+/// the consumer must be gone, queued items are freed
+void ring_fini(DrawableRing *ring);
+
+/// producer: false if the ring is full, @item is not queued then
+bool ring_push(DrawableRing *ring, void *item, uint32_t size);
+/// producer: drop everything queued so far, the consumer frees it
+void ring_discard_all(DrawableRing *ring);
+/// producer: whether an item of @size bytes would be accepted now
+bool ring_has_room(DrawableRing *ring, uint32_t size);
+/// producer: the index the next pushed item gets
+uint32_t ring_next_index(DrawableRing *ring);
+/**
+ * producer: the item pushed at @index is still queued but no longer holds
+ * its bytes, e.g. its pixels were freed. They stop counting against the
+ * byte bound now instead of when the consumer pops it.
+ */
+void ring_release(DrawableRing *ring, uint32_t index);
+
+/// consumer: next item or NULL
+void *ring_pop(DrawableRing *ring);
+/// consumer: whether ring_pop() would return NULL
+bool ring_is_empty(DrawableRing *ring);
+
+/// either side, a snapshot
+uint32_t ring_count(DrawableRing *ring);
+uint32_t ring_bytes(DrawableRing *ring);
+
+#endif  /* WIN_SPICE_RING_H */
@@ -19,16 +19,15 @@
 
 #include "session.h"
 #include "memory.h"
+#include "stats.h"
+#include "trace.h"
+#include "probe.h"
+#include "bufpool.h"
 
 static bool mouse_server_mode = true;
-static guint32 fps = 30;
 
-static inline glong get_tick_count()
-{
-    gint64 tv;
-    tv = g_get_real_time();
-    return tv / 1000;
-}
+#define SYNTHETIC_WIDTH     1920
+#define SYNTHETIC_HEIGHT    1080
 
 static void session_handle_resize(void *userdata)
 {
@@ -64,7 +63,11 @@ Session *session_new(int argc, char **argv)
 
     /// display init
     session->update_thread_running = FALSE;
-    session->display = display_new();
+    if (options_get_int(session->options, "synthetic-display") > 0) {
+        session->display = display_new_synthetic(SYNTHETIC_WIDTH, SYNTHETIC_HEIGHT);
+    } else {
+        session->display = display_new();
+    }
     if (!session->display) {
         printf("Failed to new display\n");
         goto failed;
@@ -93,31 +96,131 @@ failed:
     return NULL;
 }
 
+/**
+ * Paint a latency marker over the top left of the frame when one is due.
+ * Clients see it, so only the synthetic desktop gets one, and the tiles
+ * under it no longer match what the client shows.
+ */
+static void add_probe_marker(Display *display, WinSpiceInvalid *invalid)
+{
+    WinSpiceBitmap *bitmap = &invalid->rects[invalid->num_rects];
+    uint32_t seq;
+
+    if (!atomic_load_explicit(&probe_enabled, memory_order_relaxed) || !display->synth
+        || display->width < PROBE_WIDTH || display->height < PROBE_HEIGHT
+        || !probe_marker_due(&seq)) {
+        return;
+    }
+
+    bitmap->pitch = PROBE_WIDTH * 4;
+    bitmap->bitmaps = w_bitmap_alloc(bitmap->pitch * PROBE_HEIGHT);
+    probe_paint(bitmap->bitmaps, bitmap->pitch, seq);
+    bitmap->rect.left = 0;
+    bitmap->rect.top = 0;
+    bitmap->rect.right = PROBE_WIDTH;
+    bitmap->rect.bottom = PROBE_HEIGHT;
+    bitmap->probe = true;
+    invalid->num_rects++;
+    if (display->tile_hash) {
+        tilehash_invalidate(display->tile_hash, &(WinSpiceRect){ 0, 0, PROBE_WIDTH, PROBE_HEIGHT });
+    }
+}
+
 static void display_update(Session *session)
 {
-    //void *drawable;
-    uint8_t *bitmaps = NULL;
-    int pitch = 0;
     WSpice *wspice = session->wspice;
     Display *display = session->display;
+    BatchPlan *batch = &session->batch;
     WinSpiceInvalid invalid;
+    const WinSpiceRect *rects;
+    uint64_t mapped_at;
+    bool batching;
+    int i, n;
+
+    /// too much is in flight, only collect damage until it drains
+    if (wspice->over_budget(wspice)) {
+        display->defer_invalid_region(display);
+        return ;
+    }
+
+    if (!display->get_invalid_bitmap(display)) {
+        return ;
+    }
+    mapped_at = stats_now();
+
+    rects = wregion_rects(&display->invalid, &n);
+    batching = options_get_int(session->options, "batch-rects") > 0;
+    if (batching) {
+        n = batch_plan(batch, rects, n);
+    }
+
+    memset(&invalid, 0, sizeof(invalid));
+    invalid.moves = display->moves;
+    invalid.num_moves = display->num_moves;
+    invalid.fills = display->fills.fills;
+    invalid.num_fills = display->fills.num_fills;
+    /// and the video regions, and one more for a probe marker
+    invalid.rects = frame_arena_alloc0(&display->arena,
+                                       (n + display->num_video + 1) * sizeof(WinSpiceBitmap));
+    invalid.captured_at = display->acquired_at;
+    invalid.arena = &display->arena;
+    invalid.unqueued = &display->deferred;
 
     /**
      * NOTE: In order to improve performance, bitmaps will be freed
      * in wspice context
      */
-    if (!display->get_invalid_bitmap(display, &bitmaps, &pitch)) {
-        return ;
+    for (i = 0; i < n; i++) {
+        WinSpiceBitmap *bitmap = &invalid.rects[invalid.num_rects];
+        const WinSpiceRect *rect = &rects[i];
+
+        if (batching) {
+            /// the bounding bitmap may hold stale pixels, the clip hides them
+            const BatchGroup *group = &batch->groups[i];
+            rect = &group->bbox;
+            if (group->count > 1) {
+                bitmap->clip = &batch->members[group->first];
+                bitmap->num_clip = group->count;
+            }
+        }
+        if (!display->get_screen_bitmap(display, rect, &bitmap->bitmaps,
+                                        &bitmap->pitch)) {
+            bitmap->clip = NULL;
+            bitmap->num_clip = 0;
+            continue;
+        }
+        bitmap->rect.left   = rect->left;
+        bitmap->rect.top    = rect->top;
+        bitmap->rect.right  = rect->right;
+        bitmap->rect.bottom = rect->bottom;
+        invalid.num_rects++;
     }
+    /// always the whole region, so spice sees a run of equal drawables
+    for (i = 0; i < display->num_video; i++) {
+        WinSpiceBitmap *bitmap = &invalid.rects[invalid.num_rects];
+        const WinSpiceRect *rect = &display->video_rects[i];
 
-    memset(&invalid, 0, sizeof(invalid));
-    invalid.rect.left   = display->invalid.left;
-    invalid.rect.top    = display->invalid.top;
-    invalid.rect.right  = display->invalid.right;
-    invalid.rect.bottom = display->invalid.bottom;
-    invalid.bitmaps     = bitmaps;
-    invalid.pitch       = pitch;
+        if (!display->get_screen_bitmap(display, rect, &bitmap->bitmaps, &bitmap->pitch)) {
+            continue;
+        }
+        bitmap->rect.left   = rect->left;
+        bitmap->rect.top    = rect->top;
+        bitmap->rect.right  = rect->right;
+        bitmap->rect.bottom = rect->bottom;
+        bitmap->video = true;
+        invalid.num_rects++;
+    }
+    add_probe_marker(display, &invalid);
     wspice->handle_invalid_bitmaps(wspice, &invalid);
+    stats_record(STATS_STAGE_BUILD, stats_now() - mapped_at);
+
+    /// the ring stalled, what was not queued is sent later but its tiles were hashed as sent
+    if (display->tile_hash) {
+        rects = wregion_rects(&display->deferred, &n);
+        for (i = 0; i < n; i++) {
+            tilehash_invalidate(display->tile_hash, &rects[i]);
+        }
+    }
 
     display->clear_invalid_region(display);
 }
@@ -130,6 +233,9 @@ static void mouse_update(Session *session)
     if (!display->mouse_have_updates(display)) {
         return ;
     }
+    if (atomic_load_explicit(&probe_enabled, memory_order_relaxed)) {
+        probe_input_seen(display->PtrInfo->Position.x, display->PtrInfo->Position.y);
+    }
 
     if (display->mouse_have_new_shape(display)) {
         /// define mouse point
@@ -147,11 +253,12 @@ static void mouse_update(Session *session)
         } else {
             wspice->ptr_type = SPICE_CURSOR_TYPE_ALPHA;
         }
-        w_free(wspice->ptr_move);
+        slab_free(wspice->ptr_move);
         wspice->ptr_move = NULL;
+        /// a shape the worker has not taken yet is replaced
+        slab_free(wspice->ptr_define);
         wspice->ptr_define = create_cursor_update(wspice, cursor, 0);
         pthread_mutex_unlock(&wspice->lock);
-        w_free(cursor);
         wspice->wakeup(wspice);
     } else if (!mouse_server_mode) {
         /// mouse client mode
@@ -159,58 +266,150 @@ static void mouse_update(Session *session)
         pthread_mutex_lock(&wspice->lock);
         wspice->ptr_x = PtrInfo->Position.x;
         wspice->ptr_y = PtrInfo->Position.y;
-        w_free(wspice->ptr_move);
+        slab_free(wspice->ptr_move);
         wspice->ptr_move = create_cursor_update(wspice, NULL, display->FrameInfo.PointerPosition.Visible);
         pthread_mutex_unlock(&wspice->lock);
         wspice->wakeup(wspice);
     }
 }
 
+/// let the governor see how well the spice worker keeps up
+static void governor_feed(Session *session)
+{
+    WSpice *wspice = session->wspice;
+    DrawableRing *ring = &wspice->drawable_ring;
+
+    governor_update(&session->governor, stats_now(), ring_count(ring), ring->mask + 1,
+                    atomic_load_explicit(&wspice->inflight_bytes, memory_order_relaxed),
+                    wspice->inflight_budget);
+}
+
+/// hold the capture thread and the spice worker to the cpu budget
+static void cpu_budget_feed(Session *session, ThreadClock *capture_clock)
+{
+    WSpice *wspice = session->wspice;
+    const CpuShedStep *step;
+    uint64_t now = stats_now();
+
+    if (!cpu_budget_sample(&session->cpu_budget, now, capture_clock, &wspice->worker_clock)) {
+        return;
+    }
+    step = cpu_budget_step(&session->cpu_budget);
+    governor_set_cap(&session->governor, now, step->fps);
+    session->batch.coarseness = step->coarseness;
+    /// the io thread applies it with its next compression sample
+    atomic_store_explicit(&wspice->compress_cap, step->compression, memory_order_relaxed);
+}
+
 static void *display_update_thread(void *arg)
 {
     Session *session;
     Display *display;
-    glong begin, end, diff;
-    guint32 rate = 1000 / fps;
+    ThreadClock capture_clock;
 
     session = (Session *)arg;
     display = session->display;
-    session->update_thread_running = TRUE;
+    governor_init(&session->governor, options_get_int(session->options, "max-fps"));
+    cpu_budget_init(&session->cpu_budget, options_get_int(session->options, "cpu-budget"),
+                    stats_now());
+    atomic_init(&capture_clock.valid, false);
+    thread_clock_self(&capture_clock);
     while (session->running) {
+        uint64_t t;
         int ret;
-        begin = get_tick_count();
+        display_begin_frame(display);
+        trace_thread_name("capture");
 
+        t = trace_begin();
         ret = display->update_changes(display);
+        trace_end("update_changes", t);
+        t = trace_begin();
         if (ret == 0) {
+            governor_feed(session);
             display_update(session);
             mouse_update(session);
             display->release_update_frame(display);
+        } else {
+            /// no new frame, deferred damage may be sent now
+            display_update(session);
+            governor_idle(&session->governor);
         }
+        trace_end("display_update", t);
 
-        end = get_tick_count();
-        diff = end - begin;
-        if (diff < rate) {
-            g_usleep(1000 * (rate - diff));
-        }
+        governor_wait(&session->governor);
+        cpu_budget_feed(session, &capture_clock);
     }
-
-    session->update_thread_running = FALSE;
+    governor_fini(&session->governor);
+    thread_clock_close(&capture_clock);
+    wregion_thread_fini();
 
     return NULL;
 }
 
-void session_start(Session *session)
+static gboolean write_stats(gpointer data)
 {
-    pthread_t pid;
+    Session *session = (Session *)data;
+
+    stats_write_snapshot(session->stats_fp);
+    return G_SOURCE_CONTINUE;
+}
 
+/// append a statistics snapshot to the stats file every stats-interval seconds
+static void start_stats(Session *session)
+{
+    const char *path = options_get_string(session->options, "stats-file");
+    int interval = options_get_int(session->options, "stats-interval");
+
+    if (!path || interval <= 0) {
+        return;
+    }
+    session->stats_fp = fopen(path, "a");
+    if (!session->stats_fp) {
+        printf("Failed to open stats file %s\n", path);
+        return;
+    }
+    /// the first snapshot only starts the interval
+    stats_write_snapshot(session->stats_fp);
+    session->stats_timer = g_timeout_add_seconds(interval, write_stats, session);
+}
+
+static void stop_stats(Session *session)
+{
+    if (session->stats_timer) {
+        g_source_remove(session->stats_timer);
+        session->stats_timer = 0;
+    }
+    if (session->stats_fp) {
+        stats_write_snapshot(session->stats_fp);
+        fclose(session->stats_fp);
+        session->stats_fp = NULL;
+    }
+}
+
+void session_start(Session *session)
+{
     session->running = TRUE;
+    probe_enable(options_get_int(session->options, "latency-probe") > 0);
+    if (options_get_string(session->options, "trace-file")) {
+        trace_start(options_get_string(session->options, "trace-file"));
+        trace_thread_name("main");
+    }
+    display_enable_tile_hash(session->display,
+                             options_get_int(session->options, "tile-hash"));
+    display_enable_video_detect(session->display,
+                                options_get_int(session->options, "video-detect"));
     /// start spice server
     /// note: wspice must run before display thread since display need to
     /// wakeup spice server
     session->wspice->start(session->wspice);
 
     /// start display thread
-    pthread_create(&pid, NULL, display_update_thread, session);
+    if (pthread_create(&session->update_thread, NULL, display_update_thread, session) == 0) {
+        session->update_thread_running = TRUE;
+    } else {
+        printf("Failed to create display update thread\n");
+    }
+    start_stats(session);
 }
 
 void session_stop(Session *session)
@@ -219,16 +418,19 @@ void session_stop(Session *session)
     session->running = FALSE;
     if (session->update_thread_running) {
         /**
-         * For convenience, only a bool variable update_thread_running
-         * is used here to control the start or stop of the update thread,
-         * instead of using the pthread_cancel related function.
-         * We must ensure that the thread has exited here.
+         * The thread sees running on its next iteration, after at most
+         * one frame wait; a full drawable ring stops holding it back as
+         * soon as running is cleared. It is the producer of the drawable
+         * ring, so it must be gone before wspice->stop() empties the ring.
          */
-        g_usleep(1000 * 10);
+        pthread_join(session->update_thread, NULL);
+        session->update_thread_running = FALSE;
     }
 
     /// stop wspice thread
     session->wspice->stop(session->wspice);
+    stop_stats(session);
+    trace_stop();
 }
 
 void session_disconnect_client(Session *session)
@@ -252,6 +454,10 @@ void session_client_connected(Session *session)
     }
     gui = session->gui;
 
+    /// spice syncs the client from its own rendering, resend the desktop as captured now
+    if (session->display) {
+        display_request_refresh(session->display);
+    }
     gui_client_connected(gui);
 }
 
@@ -275,6 +481,7 @@ void session_destroy(Session *session)
         if (session->display) {
             display_destroy(session->display);
         }
+        batch_plan_fini(&session->batch);
 
         if (session->wspice) {
             wspice_destroy(session->wspice);
@@ -24,6 +24,9 @@
 #include "wspice.h"
 #include "options.h"
 #include "gui.h"
+#include "batch.h"
+#include "governor.h"
+#include "cpubudget.h"
 
 typedef struct Session {
     Options *options;
@@ -35,8 +38,18 @@ typedef struct Session {
     gboolean running;
 
     /// display
+    pthread_t update_thread;
     gboolean update_thread_running;
     Display *display;
+    /// grouping of the dirty rects, reused every frame
+    BatchPlan batch;
+    /// frame rate of the update thread
+    FpsGovernor governor;
+    /// sheds capture work to stay within the cpu-budget option
+    CpuBudget cpu_budget;
+    /// periodic pipeline statistics, see start_stats()
+    FILE *stats_fp;
+    guint stats_timer;
 } Session;
 
 Session *session_new(int argc, char **argv);
@@ -0,0 +1,202 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   slab.c
+ * @brief  Fixed size object cache for QXL commands
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "slab.h"
+#include "memory.h"
+
+/// in front of every object, keeps the object 16 byte aligned
+struct SlabObject {
+    SlabObject *next;
+    /// NULL for an oversized object from the heap
+    SlabCache *owner;
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(SlabObject) + 15) & ~(size_t)15)
+
+struct SlabChunk {
+    SlabChunk *next;
+};
+
+#define SLAB_CHUNK_HEADER_SIZE ((sizeof(SlabChunk) + 15) & ~(size_t)15)
+
+static inline void *object_data(SlabObject *obj)
+{
+    return (uint8_t *)obj + SLAB_HEADER_SIZE;
+}
+
+static inline SlabObject *object_header(void *object)
+{
+    return (SlabObject *)((uint8_t *)object - SLAB_HEADER_SIZE);
+}
+
+void slab_init(Slab *slab, const char *name, size_t object_size, int chunk_objects)
+{
+    memset(slab, 0, sizeof(*slab));
+    slab->name = name;
+    slab->object_size = (object_size + 15) & ~(size_t)15;
+    slab->chunk_objects = chunk_objects;
+    atomic_init(&slab->caches, NULL);
+    pthread_mutex_init(&slab->lock, NULL);
+}
+
+void slab_fini(Slab *slab)
+{
+    SlabCache *cache = atomic_load(&slab->caches);
+
+    while (cache) {
+        SlabCache *next = cache->next;
+        w_free(cache);
+        cache = next;
+    }
+    while (slab->chunks) {
+        SlabChunk *chunk = slab->chunks;
+        slab->chunks = chunk->next;
+        w_free(chunk);
+    }
+    atomic_store(&slab->caches, NULL);
+    pthread_mutex_destroy(&slab->lock);
+}
+
+/// cache of the calling thread, created on its first allocation
+static SlabCache *thread_cache(Slab *slab)
+{
+    pthread_t self = pthread_self();
+    SlabCache *cache;
+
+    for (cache = atomic_load_explicit(&slab->caches, memory_order_acquire);
+         cache; cache = cache->next) {
+        if (pthread_equal(cache->thread, self)) {
+            return cache;
+        }
+    }
+
+    cache = w_malloc0(sizeof(SlabCache));
+    cache->slab = slab;
+    cache->thread = self;
+    atomic_init(&cache->remote_free, NULL);
+    cache->next = atomic_load_explicit(&slab->caches, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&slab->caches, &cache->next, cache,
+                                                  memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+    return cache;
+}
+
+/// carve a new chunk into the cache's free list
+static void cache_grow(SlabCache *cache)
+{
+    Slab *slab = cache->slab;
+    size_t stride = SLAB_HEADER_SIZE + slab->object_size;
+    SlabChunk *chunk;
+    uint8_t *p;
+    int i;
+
+    chunk = w_malloc(SLAB_CHUNK_HEADER_SIZE + stride * slab->chunk_objects);
+    cache->heap_allocs++;
+
+    pthread_mutex_lock(&slab->lock);
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    pthread_mutex_unlock(&slab->lock);
+
+    p = (uint8_t *)chunk + SLAB_CHUNK_HEADER_SIZE;
+    for (i = 0; i < slab->chunk_objects; i++, p += stride) {
+        SlabObject *obj = (SlabObject *)p;
+        obj->owner = cache;
+        obj->next = cache->free_list;
+        cache->free_list = obj;
+    }
+}
+
+void *slab_alloc(Slab *slab, size_t size)
+{
+    SlabCache *cache = thread_cache(slab);
+    SlabObject *obj;
+
+    cache->allocs++;
+    if (size > slab->object_size) {
+        cache->heap_allocs++;
+        obj = w_malloc(SLAB_HEADER_SIZE + size);
+        obj->owner = NULL;
+    } else {
+        if (!cache->free_list) {
+            cache->free_list = atomic_exchange_explicit(&cache->remote_free, NULL,
+                                                        memory_order_acquire);
+        }
+        if (!cache->free_list) {
+            cache_grow(cache);
+        }
+        obj = cache->free_list;
+        cache->free_list = obj->next;
+    }
+
+    memset(object_data(obj), 0, size);
+    return object_data(obj);
+}
+
+void slab_free(void *object)
+{
+    SlabObject *obj;
+    SlabCache *owner;
+
+    if (!object) {
+        return;
+    }
+    obj = object_header(object);
+    owner = obj->owner;
+    if (!owner) {
+        w_free(obj);
+        return;
+    }
+
+    if (pthread_equal(owner->thread, pthread_self())) {
+        obj->next = owner->free_list;
+        owner->free_list = obj;
+        return;
+    }
+
+    /**
+     * Any number of threads may push, only the owner pops and it takes the
+     * whole stack at once, so there is no ABA problem.
+     */
+    obj->next = atomic_load_explicit(&owner->remote_free, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&owner->remote_free, &obj->next, obj,
+                                                  memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+void slab_get_stats(Slab *slab, SlabStats *stats)
+{
+    SlabCache *cache;
+
+    memset(stats, 0, sizeof(*stats));
+    for (cache = atomic_load_explicit(&slab->caches, memory_order_acquire);
+         cache; cache = cache->next) {
+        stats->allocs += cache->allocs;
+        stats->heap_allocs += cache->heap_allocs;
+    }
+}
@@ -0,0 +1,85 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   slab.h
+ * @brief  Fixed size object cache for QXL commands
+ *
+ * Every drawable and cursor event needs a small command wrapper that the
+ * spice worker releases on its own thread. A Slab hands these out from
+ * preallocated chunks instead of the heap. Each allocating thread gets
+ * its own cache, which it uses without locks; objects freed by another
+ * thread are pushed onto the owner's lock-free return stack, which the
+ * owner takes over in one swap once its own list runs dry. Memory goes
+ * back to the system only when the slab is destroyed.
+ */
+
+#ifndef WIN_SPICE_SLAB_H
+#define WIN_SPICE_SLAB_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct SlabObject SlabObject;
+typedef struct SlabChunk SlabChunk;
+
+typedef struct SlabCache {
+    struct Slab *slab;
+    pthread_t thread;
+    struct SlabCache *next;
+    /// owner thread only
+    SlabObject *free_list;
+    /// pushed by other threads, taken by the owner
+    _Atomic(SlabObject *) remote_free;
+    uint64_t allocs;
+    /// chunks and oversized objects taken from the heap
+    uint64_t heap_allocs;
+} SlabCache;
+
+typedef struct Slab {
+    const char *name;
+    size_t object_size;
+    int chunk_objects;
+    /// one per thread that allocated, only ever grows
+    _Atomic(SlabCache *) caches;
+    pthread_mutex_t lock;
+    SlabChunk *chunks;
+} Slab;
+
+typedef struct SlabStats {
+    uint64_t allocs;
+    uint64_t heap_allocs;
+} SlabStats;
+
+void slab_init(Slab *slab, const char *name, size_t object_size, int chunk_objects);
+/// all objects must have been freed, or be abandoned with the slab
+void slab_fini(Slab *slab);
+
+/**
+ * Zeroed object of @size bytes. Sizes above the slab's object size come
+ * from the heap, slab_free() handles both.
+ */
+void *slab_alloc(Slab *slab, size_t size);
+/// from any thread, @object may be NULL
+void slab_free(void *object);
+void slab_get_stats(Slab *slab, SlabStats *stats);
+
+#endif  /* WIN_SPICE_SLAB_H */
@@ -0,0 +1,167 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   stats.c
+ * @brief  Latency histograms and counters of the capture pipeline
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "stats.h"
+#include "memory.h"
+
+typedef struct StatsHistogram {
+    atomic_uint buckets[STATS_BUCKETS];
+    atomic_ullong max;
+} StatsHistogram;
+
+static StatsHistogram histograms[STATS_NUM_STAGES];
+static atomic_ullong counters[STATS_NUM_COUNTERS];
+/// the writer's running totals, touched by stats_write_snapshot() only
+static uint64_t totals[STATS_NUM_COUNTERS];
+static uint64_t last_snapshot;
+
+static const char *stage_names[STATS_NUM_STAGES] = {
+    "metadata", "staging", "build", "queue", "wire", "total", "input",
+};
+
+static const char *counter_names[STATS_NUM_COUNTERS] = {
+    "frames", "dropped-frames", "skipped-frames", "rects", "bytes",
+};
+
+uint64_t stats_now(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000ULL
+           + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline int msb64(uint64_t v)
+{
+    return 63 - __builtin_clzll(v);
+}
+
+static int bucket_index(uint64_t ns)
+{
+    int shift;
+
+    if (ns < 2 * STATS_SUB_BUCKETS) {
+        return ns;
+    }
+    if (ns >> STATS_MAX_BITS) {
+        ns = (1ULL << STATS_MAX_BITS) - 1;
+    }
+    shift = msb64(ns) - STATS_SUB_BITS;
+    return shift * STATS_SUB_BUCKETS + (ns >> shift);
+}
+
+/// largest value that falls into @index
+static uint64_t bucket_value(int index)
+{
+    int shift;
+
+    if (index < 2 * STATS_SUB_BUCKETS) {
+        return index;
+    }
+    shift = index / STATS_SUB_BUCKETS - 1;
+    return ((uint64_t)(index % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void stats_record(StatsStage stage, uint64_t ns)
+{
+    StatsHistogram *h = &histograms[stage];
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&h->buckets[bucket_index(ns)], 1, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+                                                             memory_order_relaxed,
+                                                             memory_order_relaxed)) {
+    }
+}
+
+void stats_count(StatsCounter counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+static void write_stage(FILE *fp, StatsStage stage)
+{
+    static uint32_t counts[STATS_BUCKETS];
+    StatsHistogram *h = &histograms[stage];
+    const double quantiles[] = { 0.5, 0.99, 0.999 };
+    uint64_t values[3] = { 0, 0, 0 };
+    uint64_t total = 0, seen = 0, max;
+    int i, q = 0;
+
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        counts[i] = atomic_exchange_explicit(&h->buckets[i], 0, memory_order_relaxed);
+        total += counts[i];
+    }
+    max = atomic_exchange_explicit(&h->max, 0, memory_order_relaxed);
+    for (i = 0; i < STATS_BUCKETS && q < 3; i++) {
+        seen += counts[i];
+        while (q < 3 && seen > quantiles[q] * total) {
+            values[q++] = MIN(bucket_value(i), max);
+        }
+    }
+
+    fprintf(fp, "  %-8s %10llu %10.1f %10.1f %10.1f %10.1f\n", stage_names[stage],
+            (unsigned long long)total, values[0] / 1000.0, values[1] / 1000.0,
+            values[2] / 1000.0, max / 1000.0);
+}
+
+void stats_write_snapshot(FILE *fp)
+{
+    uint64_t now = stats_now();
+    double seconds = last_snapshot ? (now - last_snapshot) / 1e9 : 0;
+    int i;
+
+    fprintf(fp, "stats: %.1f s since the last snapshot\n", seconds);
+    fprintf(fp, "  %-8s %10s %10s %10s %10s %10s\n", "stage", "count", "p50 us",
+            "p99 us", "p999 us", "max us");
+    for (i = 0; i < STATS_NUM_STAGES; i++) {
+        write_stage(fp, i);
+    }
+    for (i = 0; i < STATS_NUM_COUNTERS; i++) {
+        uint64_t n = atomic_exchange_explicit(&counters[i], 0, memory_order_relaxed);
+        totals[i] += n;
+        fprintf(fp, "  %-15s %12llu %14llu total\n", counter_names[i],
+                (unsigned long long)n, (unsigned long long)totals[i]);
+    }
+    fflush(fp);
+    last_snapshot = now;
+}
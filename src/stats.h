@@ -0,0 +1,90 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   stats.h
+ * @brief  Latency histograms and counters of the capture pipeline
+ *
+ * Each pipeline stage records how long it took into a log-linear
+ * histogram: 32 linear buckets per power of two, so any value is off by
+ * at most 1/32. Recording is a relaxed atomic increment, safe from the
+ * capture thread and the spice worker at once. stats_write_snapshot()
+ * drains the histograms and counters of the last interval and writes
+ * p50, p99 and p999 per stage.
+ */
+
+#ifndef WIN_SPICE_STATS_H
+#define WIN_SPICE_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define STATS_SUB_BITS      5
+#define STATS_SUB_BUCKETS   (1 << STATS_SUB_BITS)
+/// values are clamped to 2^40 ns, about 18 minutes
+#define STATS_MAX_BITS      40
+#define STATS_BUCKETS       ((STATS_MAX_BITS - STATS_SUB_BITS) * STATS_SUB_BUCKETS \
+                             + 2 * STATS_SUB_BUCKETS)
+
+typedef enum StatsStage {
+    /// AcquireNextFrame() returned until the dirty rects are fetched
+    STATS_STAGE_METADATA,
+    /// copy of the dirty rects to the staging texture and its map
+    STATS_STAGE_STAGING,
+    /// mapped pixels until all drawables of the frame are queued
+    STATS_STAGE_BUILD,
+    /// one drawable from queue_drawable() to get_command()
+    STATS_STAGE_QUEUE,
+    /// one drawable from get_command() to release_resource()
+    STATS_STAGE_WIRE,
+    /// one drawable from AcquireNextFrame() to release_resource()
+    STATS_STAGE_TOTAL,
+    /// a tablet event until a captured frame shows the pointer there
+    STATS_STAGE_INPUT,
+    STATS_NUM_STAGES,
+} StatsStage;
+
+typedef enum StatsCounter {
+    STATS_FRAMES,
+    /// frames the desktop produced but AcquireNextFrame() folded into one
+    STATS_DROPPED_FRAMES,
+    /// frames the capture loop let pass, see governor.h
+    STATS_SKIPPED_FRAMES,
+    STATS_RECTS,
+    STATS_BYTES,
+    STATS_NUM_COUNTERS,
+} StatsCounter;
+
+/// monotonic nanoseconds
+uint64_t stats_now(void);
+void stats_record(StatsStage stage, uint64_t ns);
+void stats_count(StatsCounter counter, uint64_t n);
+
+/// record the time since @since, which is skipped if it was never taken
+static inline void stats_record_since(StatsStage stage, uint64_t since)
+{
+    if (since) {
+        stats_record(stage, stats_now() - since);
+    }
+}
+
+/// write and reset the statistics gathered since the last snapshot
+void stats_write_snapshot(FILE *fp);
+
+#endif  /* WIN_SPICE_STATS_H */
@@ -0,0 +1,137 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   supersede.c
+ * @brief  Dropping queued drawables that newer damage paints over
+ */
+
+#include <string.h>
+#include "supersede.h"
+
+void supersede_init(SupersedeTracker *tracker)
+{
+    int i;
+
+    memset(tracker, 0, sizeof(*tracker));
+    for (i = 0; i < SUPERSEDE_SLOTS; i++) {
+        atomic_init(&tracker->slots[i].state, SUPERSEDE_FREE);
+    }
+}
+
+/// a slot can be reused once the consumer is done with it
+static bool slot_reusable(SupersedeSlot *slot)
+{
+    int state = atomic_load_explicit(&slot->state, memory_order_acquire);
+
+    return state == SUPERSEDE_FREE || state == SUPERSEDE_TAKEN;
+}
+
+atomic_int *supersede_track(SupersedeTracker *tracker, void *pixels, const WinSpiceRect *rect,
+                            uint32_t bytes, uint32_t ticket)
+{
+    int i;
+
+    for (i = 0; i < SUPERSEDE_SLOTS; i++) {
+        SupersedeSlot *slot = &tracker->slots[tracker->next];
+        tracker->next = (tracker->next + 1) % SUPERSEDE_SLOTS;
+
+        if (!slot_reusable(slot)) {
+            continue;
+        }
+        slot->tracked = true;
+        slot->rect = *rect;
+        slot->pixels = pixels;
+        slot->bytes = bytes;
+        slot->ticket = ticket;
+        atomic_store_explicit(&slot->state, SUPERSEDE_QUEUED, memory_order_release);
+        return &slot->state;
+    }
+
+    return NULL;
+}
+
+void supersede_forget(atomic_int *state)
+{
+    /// the consumer never saw it, the slot may be reused at once
+    atomic_store_explicit(state, SUPERSEDE_FREE, memory_order_release);
+}
+
+void supersede_pin_all(SupersedeTracker *tracker)
+{
+    int i;
+
+    for (i = 0; i < SUPERSEDE_SLOTS; i++) {
+        tracker->slots[i].tracked = false;
+    }
+}
+
+int supersede_drop_covered(SupersedeTracker *tracker, const WinSpiceRegion *painted,
+                           SupersedeDropFunc drop)
+{
+    int i;
+
+    tracker->dropped = 0;
+    tracker->saved_bytes = 0;
+    if (wregion_is_empty(painted)) {
+        return 0;
+    }
+
+    for (i = 0; i < SUPERSEDE_SLOTS; i++) {
+        SupersedeSlot *slot = &tracker->slots[i];
+        int expected = SUPERSEDE_QUEUED;
+
+        if (!slot->tracked) {
+            continue;
+        }
+        if (!wregion_contains_rect(painted, &slot->rect)) {
+            continue;
+        }
+        slot->tracked = false;
+        if (!atomic_compare_exchange_strong_explicit(&slot->state, &expected,
+                                                     SUPERSEDE_DROPPED,
+                                                     memory_order_acq_rel,
+                                                     memory_order_acquire)) {
+            /// already taken by the worker
+            continue;
+        }
+        drop(slot->pixels);
+        tracker->tickets[tracker->dropped] = slot->ticket;
+        tracker->dropped++;
+        tracker->saved_bytes += slot->bytes;
+    }
+
+    tracker->total_dropped += tracker->dropped;
+    tracker->total_saved_bytes += tracker->saved_bytes;
+    return tracker->dropped;
+}
+
+bool supersede_claim(atomic_int *state)
+{
+    int expected = SUPERSEDE_QUEUED;
+
+    if (atomic_compare_exchange_strong_explicit(state, &expected, SUPERSEDE_TAKEN,
+                                                memory_order_acq_rel,
+                                                memory_order_acquire)) {
+        return true;
+    }
+    /// dropped: the slot is ours to give back
+    atomic_store_explicit(state, SUPERSEDE_FREE, memory_order_release);
+    return false;
+}
@@ -0,0 +1,111 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   supersede.h
+ * @brief  Dropping queued drawables that newer damage paints over
+ *
+ * When the spice worker falls behind, the ring holds bitmaps that a
+ * newer frame repaints completely. The capture thread remembers the
+ * area of every bitmap or fill it queued; once newer damage covers it
+ * and the worker has not taken it yet, the drawable is dropped and its
+ * pixels are freed at once.
+ *
+ * A queued drawable is owned by whoever moves its state out of
+ * SUPERSEDE_QUEUED first: the worker when it takes it, or the capture
+ * thread when it drops it.
+ */
+
+#ifndef WIN_SPICE_SUPERSEDE_H
+#define WIN_SPICE_SUPERSEDE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "region.h"
+
+#define SUPERSEDE_SLOTS 1024
+
+enum {
+    SUPERSEDE_FREE,
+    SUPERSEDE_QUEUED,
+    /// the worker owns the drawable
+    SUPERSEDE_TAKEN,
+    /// the capture thread freed the pixels, the worker frees the rest
+    SUPERSEDE_DROPPED,
+};
+
+typedef void (*SupersedeDropFunc)(void *pixels);
+
+typedef struct SupersedeSlot {
+    atomic_int state;
+    /// producer only
+    bool tracked;
+    WinSpiceRect rect;
+    /// freed by the capture thread when dropped, the worker frees the rest
+    void *pixels;
+    uint32_t bytes;
+    /// the caller's handle of the drawable, e.g. its ring index
+    uint32_t ticket;
+} SupersedeSlot;
+
+typedef struct SupersedeTracker {
+    SupersedeSlot slots[SUPERSEDE_SLOTS];
+    int next;
+
+    /**
+     * drawables dropped by the last supersede_drop_covered() call and the
+     * sum of their tracked bytes, which the caller stops counting as in flight
+     */
+    int dropped;
+    uint64_t saved_bytes;
+    /// and their tickets
+    uint32_t tickets[SUPERSEDE_SLOTS];
+    uint64_t total_dropped;
+    uint64_t total_saved_bytes;
+} SupersedeTracker;
+
+void supersede_init(SupersedeTracker *tracker);
+
+/**
+ * producer: remember a queued drawable that paints all of @rect from
+ * @pixels, @bytes long, and @ticket to report when it is dropped. The
+ * producer never touches the drawable itself again. Returns the state
+ * the consumer must claim, NULL if the drawable is not tracked.
+ */
+atomic_int *supersede_track(SupersedeTracker *tracker, void *pixels, const WinSpiceRect *rect,
+                            uint32_t bytes, uint32_t ticket);
+
+/// producer: a tracked drawable was not queued after all
+void supersede_forget(atomic_int *state);
+
+/// producer: nothing queued so far may be dropped, e.g. a screen move reads it
+void supersede_pin_all(SupersedeTracker *tracker);
+
+/**
+ * producer: drop every tracked drawable still queued whose rect lies in
+ * @painted, calling @drop on its pixels. Returns the number dropped.
+ */
+int supersede_drop_covered(SupersedeTracker *tracker, const WinSpiceRegion *painted,
+                           SupersedeDropFunc drop);
+
+/// consumer: true if the drawable is ours, false if its pixels were dropped
+bool supersede_claim(atomic_int *state);
+
+#endif  /* WIN_SPICE_SUPERSEDE_H */
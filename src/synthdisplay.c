@@ -0,0 +1,189 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   synthdisplay.c
+ * @brief  Display backed by the synthetic desktop instead of DXGI
+ *
+ * Lets the pipeline run, with probe markers painted into its frames, on
+ * a Windows machine without an interactive desktop. Like the rest of the
+ * server it does not build on Linux. Frames come from synthsrc.c, one
+ * per update_changes(); there are no moves, fills or cursor shapes.
+ */
+
+#include <stdio.h>
+#include "display.h"
+#include "memory.h"
+#include "pixel.h"
+#include "bufpool.h"
+#include "stats.h"
+#include "synthsrc.h"
+
+static int synth_update_changes(Display *display)
+{
+    SynthSource *src = display->synth;
+    bool pointer_drawn = src->pointer_drawn;
+    int pointer_x = src->pointer_x;
+    int pointer_y = src->pointer_y;
+
+    synth_source_step(src);
+    display->acquired_at = stats_now();
+    stats_count(STATS_FRAMES, 1);
+    display->accumulated_frames = 1;
+
+    /// mouse_have_updates() looks at the pointer timestamp, like with DXGI
+    display->FrameInfo.LastMouseUpdateTime.QuadPart = 0;
+    if (src->pointer_drawn
+        && (!pointer_drawn || pointer_x != src->pointer_x || pointer_y != src->pointer_y)) {
+        display->FrameInfo.LastMouseUpdateTime.QuadPart = display->acquired_at;
+    }
+    return 0;
+}
+
+static void synth_release_update_frame(Display *display)
+{
+    display->accumulated_frames = 0;
+}
+
+static bool synth_display_have_updates(Display *display)
+{
+    return display->accumulated_frames != 0;
+}
+
+static bool synth_find_invalid_region(Display *display)
+{
+    SynthSource *src = display->synth;
+
+    display->num_moves = 0;
+    wregion_union_rects(&display->invalid, src->dirty, src->num_dirty);
+    display->fetched_at = stats_now();
+    stats_record(STATS_STAGE_METADATA, display->fetched_at - display->acquired_at);
+    return true;
+}
+
+static void synth_clear_invalid_region(Display *display)
+{
+    wregion_clear(&display->invalid);
+    display->num_moves = 0;
+    fill_list_clear(&display->fills);
+}
+
+static bool synth_get_screen_bitmap(Display *display, const WinSpiceRect *rect,
+                                    uint8_t **bitmap, int *pitch)
+{
+    SynthSource *src = display->synth;
+    int width, height;
+
+    if (!bitmap || !pitch || wrect_is_empty(rect)) {
+        return false;
+    }
+
+    width = rect->right - rect->left;
+    height = rect->bottom - rect->top;
+    *pitch = width * 4;
+    *bitmap = (uint8_t *)w_bitmap_alloc(*pitch * height);
+    pixel_copy_rect(*bitmap, *pitch, src->pixels + rect->top * src->pitch + rect->left * 4,
+                    src->pitch, *pitch, height);
+    return true;
+}
+
+/// the framebuffer always holds the newest pixels, deferred damage needs no staging
+static bool synth_get_invalid_bitmap(Display *display)
+{
+    bool fresh = display->display_have_updates(display);
+
+    if (!fresh && wregion_is_empty(&display->deferred)) {
+        return false;
+    }
+    if (fresh && !display->find_invalid_region(display)) {
+        return false;
+    }
+    if (atomic_exchange(&display->refresh, false)) {
+        display_refresh_region(display);
+    }
+    wregion_union(&display->invalid, &display->invalid, &display->deferred);
+    wregion_clear(&display->deferred);
+
+    return !wregion_is_empty(&display->invalid);
+}
+
+static void synth_defer_invalid_region(Display *display)
+{
+    if (!display->display_have_updates(display)) {
+        return;
+    }
+    if (display->find_invalid_region(display)) {
+        wregion_union(&display->deferred, &display->deferred, &display->invalid);
+    }
+    synth_clear_invalid_region(display);
+}
+
+static bool synth_mouse_have_updates(Display *display)
+{
+    SynthSource *src = display->synth;
+
+    if (!display->FrameInfo.LastMouseUpdateTime.QuadPart) {
+        return false;
+    }
+    display->PtrInfo->Position.x = src->pointer_x;
+    display->PtrInfo->Position.y = src->pointer_y;
+    display->PtrInfo->Visible = true;
+    return true;
+}
+
+static bool synth_mouse_have_new_shape(Display *display)
+{
+    return false;
+}
+
+static int synth_mouse_get_new_shape(Display *display, WinSpiceCursor **cursor)
+{
+    return -1;
+}
+
+Display *display_new_synthetic(uint32_t width, uint32_t height)
+{
+    Display *display = (Display *)w_malloc0(sizeof(Display));
+
+    wregion_init(&display->invalid);
+    wregion_init(&display->deferred);
+    wregion_init(&display->staged);
+    cursor_cache_init(&display->cursor_cache);
+    frame_arena_init(&display->arena, FRAME_ARENA_INITIAL);
+    display->PtrInfo = w_malloc0(sizeof(PTR_INFO));
+    display->synth = synth_source_new(width, height);
+    display->width = width;
+    display->height = height;
+
+    display->update_changes = synth_update_changes;
+    display->release_update_frame = synth_release_update_frame;
+    display->display_have_updates = synth_display_have_updates;
+    display->find_invalid_region = synth_find_invalid_region;
+    display->clear_invalid_region = synth_clear_invalid_region;
+    display->get_screen_bitmap = synth_get_screen_bitmap;
+    display->get_invalid_bitmap = synth_get_invalid_bitmap;
+    display->defer_invalid_region = synth_defer_invalid_region;
+
+    display->mouse_have_updates = synth_mouse_have_updates;
+    display->mouse_have_new_shape = synth_mouse_have_new_shape;
+    display->mouse_get_new_shape = synth_mouse_get_new_shape;
+
+    printf("synthetic display %ux%u\n", width, height);
+    return display;
+}
@@ -0,0 +1,133 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   synthsrc.c
+ * @brief  Synthetic desktop for running the pipeline without a real one
+ */
+
+#include "synthsrc.h"
+#include "memory.h"
+#include "probe.h"
+
+#define SYNTH_BAR_COLOR     0xFF2060C0
+#define SYNTH_POINTER_COLOR 0xFFFFFFFF
+
+/// smooth gradient with some texture, so palettes and fills do not kick in
+static inline uint32_t background(int x, int y)
+{
+    uint32_t r = (x * 255 / 2048) & 0xFF;
+    uint32_t g = (y * 255 / 2048) & 0xFF;
+    uint32_t b = ((x ^ y) & 0x1F) + 0x40;
+
+    return 0xFF000000 | r << 16 | g << 8 | b;
+}
+
+static void clip_rect(SynthSource *src, WinSpiceRect *rect)
+{
+    rect->left = MAX(rect->left, 0);
+    rect->top = MAX(rect->top, 0);
+    rect->right = MIN(rect->right, src->width);
+    rect->bottom = MIN(rect->bottom, src->height);
+}
+
+/// paint @rect with @color, or the background if @color is 0
+static void paint_rect(SynthSource *src, WinSpiceRect rect, uint32_t color)
+{
+    int x, y;
+
+    clip_rect(src, &rect);
+    if (wrect_is_empty(&rect)) {
+        return;
+    }
+    for (y = rect.top; y < rect.bottom; y++) {
+        uint32_t *row = (uint32_t *)(src->pixels + y * src->pitch);
+        for (x = rect.left; x < rect.right; x++) {
+            row[x] = color ? color : background(x, y);
+        }
+    }
+    if (src->num_dirty < SYNTH_MAX_DIRTY) {
+        src->dirty[src->num_dirty++] = rect;
+    }
+}
+
+static WinSpiceRect make_rect(int left, int top, int right, int bottom)
+{
+    WinSpiceRect rect;
+
+    rect.left = left;
+    rect.top = top;
+    rect.right = right;
+    rect.bottom = bottom;
+    return rect;
+}
+
+SynthSource *synth_source_new(int width, int height)
+{
+    SynthSource *src = w_malloc0(sizeof(SynthSource));
+
+    src->width = width;
+    src->height = height;
+    src->pitch = width * 4;
+    src->pixels = w_malloc((size_t)src->pitch * height);
+    paint_rect(src, make_rect(0, 0, width, height), 0);
+    return src;
+}
+
+void synth_source_destroy(SynthSource *src)
+{
+    if (src) {
+        w_free(src->pixels);
+        w_free(src);
+    }
+}
+
+void synth_source_step(SynthSource *src)
+{
+    int x, y;
+
+    src->num_dirty = 0;
+
+    /// the bar leaves background behind and moves on, wrapping at the edge
+    paint_rect(src, make_rect(src->bar_x, 0, src->bar_x + SYNTH_BAR_WIDTH, src->height), 0);
+    src->bar_x += SYNTH_BAR_STEP;
+    if (src->bar_x >= src->width) {
+        src->bar_x = 0;
+    }
+    paint_rect(src, make_rect(src->bar_x, 0, src->bar_x + SYNTH_BAR_WIDTH, src->height),
+               SYNTH_BAR_COLOR);
+
+    if (probe_input_position(&x, &y)
+        && (!src->pointer_drawn || x != src->pointer_x || y != src->pointer_y)) {
+        if (src->pointer_drawn) {
+            paint_rect(src, make_rect(src->pointer_x, src->pointer_y,
+                                      src->pointer_x + SYNTH_POINTER_SIZE,
+                                      src->pointer_y + SYNTH_POINTER_SIZE), 0);
+        }
+        src->pointer_x = x;
+        src->pointer_y = y;
+        src->pointer_drawn = true;
+    }
+    /// on top of the bar, which may have just painted over it
+    if (src->pointer_drawn) {
+        paint_rect(src, make_rect(src->pointer_x, src->pointer_y,
+                                  src->pointer_x + SYNTH_POINTER_SIZE,
+                                  src->pointer_y + SYNTH_POINTER_SIZE), SYNTH_POINTER_COLOR);
+    }
+}
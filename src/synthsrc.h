@@ -0,0 +1,61 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   synthsrc.h
+ * @brief  Synthetic desktop for running the pipeline without a real one
+ *
+ * A framebuffer in memory with a bar that sweeps across a fixed
+ * background and a pointer box that follows the latency probe's tablet
+ * input. Every step reports the rects it changed, like the dirty rects
+ * of a captured frame.
+ */
+
+#ifndef WIN_SPICE_SYNTHSRC_H
+#define WIN_SPICE_SYNTHSRC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "region.h"
+
+#define SYNTH_BAR_WIDTH     64
+#define SYNTH_BAR_STEP      16
+#define SYNTH_POINTER_SIZE  16
+#define SYNTH_MAX_DIRTY     4
+
+typedef struct SynthSource {
+    uint8_t *pixels;
+    int pitch;
+    int width;
+    int height;
+    int bar_x;
+    /// pointer box, drawn once the probe saw tablet input
+    bool pointer_drawn;
+    int pointer_x;
+    int pointer_y;
+    WinSpiceRect dirty[SYNTH_MAX_DIRTY];
+    int num_dirty;
+} SynthSource;
+
+SynthSource *synth_source_new(int width, int height);
+void synth_source_destroy(SynthSource *src);
+/// draw the next frame, @src->dirty holds what changed
+void synth_source_step(SynthSource *src);
+
+#endif  /* WIN_SPICE_SYNTHSRC_H */
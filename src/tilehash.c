@@ -0,0 +1,180 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   tilehash.c
+ * @brief  Per-tile content hashes of the last sent frame
+ */
+
+#include <string.h>
+#include "tilehash.h"
+#include "hash.h"
+#include "memory.h"
+
+static void tile_rect(TileHash *th, int tx, int ty, WinSpiceRect *rect)
+{
+    rect->left = tx * th->tile_size;
+    rect->top = ty * th->tile_size;
+    rect->right = MIN(rect->left + th->tile_size, th->width);
+    rect->bottom = MIN(rect->top + th->tile_size, th->height);
+}
+
+/// range of tiles touched by @rect, false if it is off screen
+static bool tile_range(TileHash *th, const WinSpiceRect *rect,
+                       int *tx1, int *ty1, int *tx2, int *ty2)
+{
+    int left = MAX(rect->left, 0);
+    int top = MAX(rect->top, 0);
+    int right = MIN(rect->right, th->width);
+    int bottom = MIN(rect->bottom, th->height);
+
+    if (right <= left || bottom <= top) {
+        return false;
+    }
+
+    *tx1 = left / th->tile_size;
+    *ty1 = top / th->tile_size;
+    *tx2 = (right + th->tile_size - 1) / th->tile_size;
+    *ty2 = (bottom + th->tile_size - 1) / th->tile_size;
+    return true;
+}
+
+TileHash *tilehash_new(int width, int height, int tile_size)
+{
+    TileHash *th;
+
+    if (width <= 0 || height <= 0 || tile_size <= 0) {
+        return NULL;
+    }
+
+    th = w_malloc0(sizeof(TileHash));
+    th->width = width;
+    th->height = height;
+    th->tile_size = tile_size;
+    th->tiles_x = (width + tile_size - 1) / tile_size;
+    th->tiles_y = (height + tile_size - 1) / tile_size;
+    th->hashes = w_malloc0(th->tiles_x * th->tiles_y * sizeof(uint64_t));
+    th->valid = w_malloc0(th->tiles_x * th->tiles_y);
+    th->same = w_malloc(th->tiles_x * th->tiles_y * sizeof(WinSpiceRect));
+    wregion_init(&th->scratch);
+
+    return th;
+}
+
+void tilehash_destroy(TileHash *th)
+{
+    if (th) {
+        w_free(th->hashes);
+        w_free(th->valid);
+        w_free(th->same);
+        wregion_fini(&th->scratch);
+        w_free(th);
+    }
+}
+
+void tilehash_reset(TileHash *th)
+{
+    memset(th->valid, 0, th->tiles_x * th->tiles_y);
+}
+
+void tilehash_invalidate(TileHash *th, const WinSpiceRect *rect)
+{
+    int tx1, ty1, tx2, ty2, ty;
+
+    if (!tile_range(th, rect, &tx1, &ty1, &tx2, &ty2)) {
+        return;
+    }
+    for (ty = ty1; ty < ty2; ty++) {
+        memset(th->valid + ty * th->tiles_x + tx1, 0, tx2 - tx1);
+    }
+}
+
+void tilehash_align(TileHash *th, WinSpiceRegion *dst, const WinSpiceRegion *src)
+{
+    WinSpiceRegion *aligned = &th->scratch;
+    const WinSpiceRect *rects;
+    int i, n;
+
+    wregion_clear(aligned);
+    rects = wregion_rects(src, &n);
+    for (i = 0; i < n; i++) {
+        int tx1, ty1, tx2, ty2;
+        WinSpiceRect r;
+        if (!tile_range(th, &rects[i], &tx1, &ty1, &tx2, &ty2)) {
+            continue;
+        }
+        r.left = tx1 * th->tile_size;
+        r.top = ty1 * th->tile_size;
+        r.right = MIN(tx2 * th->tile_size, th->width);
+        r.bottom = MIN(ty2 * th->tile_size, th->height);
+        wregion_union_rect(aligned, aligned, &r);
+    }
+    wregion_copy(dst, aligned);
+}
+
+uint64_t tilehash_filter(TileHash *th, WinSpiceRegion *damage,
+                         const uint8_t *frame, int pitch)
+{
+    WinSpiceRect *same = th->same;
+    int tx1, ty1, tx2, ty2, tx, ty, n = 0;
+    uint64_t before;
+
+    th->saved_bytes = 0;
+    if (wregion_is_empty(damage)
+        || !tile_range(th, &damage->extents, &tx1, &ty1, &tx2, &ty2)) {
+        return 0;
+    }
+
+    for (ty = ty1; ty < ty2; ty++) {
+        for (tx = tx1; tx < tx2; tx++) {
+            int idx = ty * th->tiles_x + tx;
+            WinSpiceRect r;
+            uint64_t hash;
+
+            tile_rect(th, tx, ty, &r);
+            if (!wregion_intersects_rect(damage, &r)) {
+                continue;
+            }
+
+            hash = hash_rect(frame + (size_t)r.top * pitch + r.left * 4, pitch,
+                             (r.right - r.left) * 4, r.bottom - r.top);
+            if (th->valid[idx] && th->hashes[idx] == hash) {
+                /// extend the run of unchanged tiles on this row
+                if (n > 0 && same[n - 1].top == r.top && same[n - 1].right == r.left) {
+                    same[n - 1].right = r.right;
+                } else {
+                    same[n++] = r;
+                }
+            } else {
+                th->hashes[idx] = hash;
+                th->valid[idx] = 1;
+            }
+        }
+    }
+
+    if (n > 0) {
+        wregion_set_rects(&th->scratch, same, n);
+        before = wregion_area(damage);
+        wregion_subtract(damage, damage, &th->scratch);
+        th->saved_bytes = (before - wregion_area(damage)) * 4;
+        th->total_saved_bytes += th->saved_bytes;
+    }
+
+    return th->saved_bytes;
+}
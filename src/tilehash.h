@@ -0,0 +1,77 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   tilehash.h
+ * @brief  Per-tile content hashes of the last sent frame
+ *
+ * DXGI often reports a dirty rect much larger than what really changed,
+ * e.g. a whole window that repainted identical pixels. The screen is
+ * split into fixed size tiles and the hash of every tile as it was last
+ * sent is remembered; tiles of a new frame that hash to the same value
+ * are removed from the damage before any bitmap is built.
+ */
+
+#ifndef WIN_SPICE_TILEHASH_H
+#define WIN_SPICE_TILEHASH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "region.h"
+
+#define TILE_HASH_SIZE 64
+
+typedef struct TileHash {
+    int width, height;
+    int tile_size;
+    int tiles_x, tiles_y;
+    uint64_t *hashes;
+    uint8_t *valid;
+    /// working memory of tilehash_align() and tilehash_filter()
+    WinSpiceRect *same;
+    WinSpiceRegion scratch;
+
+    /// bytes removed from the damage by the last tilehash_filter() call
+    uint64_t saved_bytes;
+    uint64_t total_saved_bytes;
+} TileHash;
+
+TileHash *tilehash_new(int width, int height, int tile_size);
+void tilehash_destroy(TileHash *th);
+
+/// forget every hash, e.g. when the client lost its view of the screen
+void tilehash_reset(TileHash *th);
+
+/// forget the hashes of tiles touching @rect, their content changed unseen
+void tilehash_invalidate(TileHash *th, const WinSpiceRect *rect);
+
+/// @dst = @src grown to whole tiles, clipped to the screen
+void tilehash_align(TileHash *th, WinSpiceRegion *dst, const WinSpiceRegion *src);
+
+/**
+ * Remove unchanged tiles from @damage.
+ *
+ * @frame points to pixel (0, 0) of a 32bpp copy of the screen whose
+ * tiles touching @damage are current. Hashes of changed tiles are stored
+ * as the new reference. Returns the number of bytes removed.
+ */
+uint64_t tilehash_filter(TileHash *th, WinSpiceRegion *damage,
+                         const uint8_t *frame, int pitch);
+
+#endif  /* WIN_SPICE_TILEHASH_H */
@@ -0,0 +1,234 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   trace.c
+ * @brief  Timeline of pipeline events in Chrome trace-event format
+ */
+
+#include <glib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+#include "memory.h"
+
+typedef struct TraceEvent {
+    const char *name;
+    uint64_t ts;
+    uint64_t dur;
+    char phase;
+} TraceEvent;
+
+/// written by its thread, drained by the flusher
+typedef struct TraceRing {
+    TraceEvent events[TRACE_RING_EVENTS];
+    atomic_uint head;
+    atomic_uint tail;
+    _Atomic(const char *) name;
+    int tid;
+    /// flusher only
+    bool name_written;
+    atomic_uint dropped;
+    struct TraceRing *next;
+} TraceRing;
+
+atomic_bool trace_enabled;
+
+/// rings live as long as the process, a thread may still hold one after trace_stop()
+static _Atomic(TraceRing *) rings;
+static atomic_int num_rings;
+static _Thread_local TraceRing *thread_ring;
+
+static FILE *trace_fp;
+static pthread_t flusher;
+static atomic_bool flusher_running;
+static bool first_event;
+
+static TraceRing *get_thread_ring(void)
+{
+    TraceRing *ring = thread_ring;
+
+    if (ring) {
+        return ring;
+    }
+    ring = w_malloc0(sizeof(TraceRing));
+    ring->tid = atomic_fetch_add(&num_rings, 1) + 1;
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring,
+                                                  memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+    thread_ring = ring;
+    return ring;
+}
+
+static void trace_push(const char *name, char phase, uint64_t ts, uint64_t dur)
+{
+    TraceRing *ring = get_thread_ring();
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    TraceEvent *event;
+
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= TRACE_RING_EVENTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    event = &ring->events[tail % TRACE_RING_EVENTS];
+    event->name = name;
+    event->phase = phase;
+    event->ts = ts;
+    event->dur = dur;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void trace_thread_name(const char *name)
+{
+    const char *expected = NULL;
+
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return;
+    }
+    atomic_compare_exchange_strong(&get_thread_ring()->name, &expected, name);
+}
+
+void trace_end(const char *name, uint64_t begin)
+{
+    if (!begin || !atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return;
+    }
+    trace_push(name, 'X', begin, stats_now() - begin);
+}
+
+void trace_instant(const char *name)
+{
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return;
+    }
+    trace_push(name, 'i', stats_now(), 0);
+}
+
+static void write_separator(void)
+{
+    fputs(first_event ? "\n" : ",\n", trace_fp);
+    first_event = false;
+}
+
+static void flush_ring(TraceRing *ring)
+{
+    const char *name = atomic_load_explicit(&ring->name, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    unsigned dropped;
+
+    if (name && !ring->name_written) {
+        write_separator();
+        fprintf(trace_fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", ring->tid, name);
+        ring->name_written = true;
+    }
+
+    for (; head != tail; head++) {
+        const TraceEvent *event = &ring->events[head % TRACE_RING_EVENTS];
+
+        write_separator();
+        if (event->phase == 'X') {
+            fprintf(trace_fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}", event->name, ring->tid,
+                    event->ts / 1000.0, event->dur / 1000.0);
+        } else {
+            fprintf(trace_fp, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+                    "\"tid\":%d,\"ts\":%.3f}", event->name, ring->tid, event->ts / 1000.0);
+        }
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+
+    dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped) {
+        write_separator();
+        fprintf(trace_fp, "{\"name\":\"dropped %u events\",\"ph\":\"i\",\"s\":\"t\","
+                "\"pid\":1,\"tid\":%d,\"ts\":%.3f}", dropped, ring->tid,
+                stats_now() / 1000.0);
+    }
+}
+
+static void flush_rings(void)
+{
+    TraceRing *ring;
+
+    for (ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+        flush_ring(ring);
+    }
+    fflush(trace_fp);
+}
+
+static void *flusher_thread(void *arg)
+{
+    while (atomic_load(&flusher_running)) {
+        g_usleep(TRACE_FLUSH_INTERVAL_MS * 1000);
+        flush_rings();
+    }
+    return NULL;
+}
+
+bool trace_start(const char *path)
+{
+    TraceRing *ring;
+
+    if (trace_fp) {
+        return true;
+    }
+    trace_fp = fopen(path, "w");
+    if (!trace_fp) {
+        printf("Failed to open trace file %s\n", path);
+        return false;
+    }
+    fputs("[", trace_fp);
+    first_event = true;
+
+    /// events left over from an earlier trace are dropped
+    for (ring = atomic_load(&rings); ring; ring = ring->next) {
+        atomic_store(&ring->head, atomic_load(&ring->tail));
+        ring->name_written = false;
+    }
+
+    atomic_store(&flusher_running, true);
+    atomic_store(&trace_enabled, true);
+    if (pthread_create(&flusher, NULL, flusher_thread, NULL) != 0) {
+        atomic_store(&trace_enabled, false);
+        fclose(trace_fp);
+        trace_fp = NULL;
+        return false;
+    }
+    return true;
+}
+
+void trace_stop(void)
+{
+    if (!trace_fp) {
+        return;
+    }
+    atomic_store(&trace_enabled, false);
+    atomic_store(&flusher_running, false);
+    pthread_join(flusher, NULL);
+
+    flush_rings();
+    fputs("\n]\n", trace_fp);
+    fclose(trace_fp);
+    trace_fp = NULL;
+}
@@ -0,0 +1,63 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   trace.h
+ * @brief  Timeline of pipeline events in Chrome trace-event format
+ *
+ * While tracing is on, every thread writes its events into its own ring
+ * without locks and a flusher thread drains the rings into a JSON file
+ * that chrome://tracing and Perfetto can open. A full ring drops events
+ * instead of blocking. While tracing is off, trace_begin() is a single
+ * relaxed load.
+ */
+
+#ifndef WIN_SPICE_TRACE_H
+#define WIN_SPICE_TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "stats.h"
+
+/// events per thread between two flushes
+#define TRACE_RING_EVENTS       16384
+#define TRACE_FLUSH_INTERVAL_MS 50
+
+extern atomic_bool trace_enabled;
+
+bool trace_start(const char *path);
+void trace_stop(void);
+
+/// name of the calling thread in the timeline, the first call wins
+void trace_thread_name(const char *name);
+/// an event that took from @begin until now, @begin is from trace_begin()
+void trace_end(const char *name, uint64_t begin);
+void trace_instant(const char *name);
+
+/// 0 while tracing is off, trace_end() ignores it then
+static inline uint64_t trace_begin(void)
+{
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return 0;
+    }
+    return stats_now();
+}
+
+#endif  /* WIN_SPICE_TRACE_H */
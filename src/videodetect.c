@@ -0,0 +1,326 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file   videodetect.c
+ * @brief  Detection of screen regions that play video
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "videodetect.h"
+#include "memory.h"
+
+/// at most this many pixel pairs per axis are looked at by the classifier
+#define VIDEO_SAMPLES           64
+/// neighbours differing by up to this much per channel form a gradient
+#define VIDEO_SMOOTH_DIFF       24
+/// geometry this similar to the old one does not move a region
+#define VIDEO_SAME_GEOMETRY     0.8
+
+VideoDetector *video_detect_new(int width, int height)
+{
+    VideoDetector *det = w_malloc0(sizeof(VideoDetector));
+    int cells;
+
+    det->width = width;
+    det->height = height;
+    det->cells_x = (width + VIDEO_CELL - 1) / VIDEO_CELL;
+    det->cells_y = (height + VIDEO_CELL - 1) / VIDEO_CELL;
+    cells = det->cells_x * det->cells_y;
+    det->hits = w_malloc0(cells * sizeof(uint16_t));
+    det->stamps = w_malloc0(cells * sizeof(uint32_t));
+    det->hot = w_malloc0(cells);
+    det->seen = w_malloc0(cells);
+    det->stack = w_malloc(cells * sizeof(int));
+
+    return det;
+}
+
+void video_detect_destroy(VideoDetector *det)
+{
+    if (!det) {
+        return;
+    }
+    w_free(det->hits);
+    w_free(det->stamps);
+    w_free(det->hot);
+    w_free(det->seen);
+    w_free(det->stack);
+    w_free(det);
+}
+
+static void rect_intersect(WinSpiceRect *dst, const WinSpiceRect *a, const WinSpiceRect *b)
+{
+    dst->left   = MAX(a->left, b->left);
+    dst->top    = MAX(a->top, b->top);
+    dst->right  = MIN(a->right, b->right);
+    dst->bottom = MIN(a->bottom, b->bottom);
+}
+
+static bool rect_equal(const WinSpiceRect *a, const WinSpiceRect *b)
+{
+    return a->left == b->left && a->top == b->top
+           && a->right == b->right && a->bottom == b->bottom;
+}
+
+static void print_region(const char *what, const VideoRegion *region)
+{
+    printf("video region %dx%d at %d,%d: %s\n",
+           region->rect.right - region->rect.left, region->rect.bottom - region->rect.top,
+           region->rect.left, region->rect.top, what);
+}
+
+/// a group of hot cells showed up at @rect, follow it with a region
+static void match_region(VideoDetector *det, const WinSpiceRect *rect, bool *matched)
+{
+    VideoRegion *region = NULL;
+    uint64_t best = 0;
+    int i;
+
+    for (i = 0; i < det->num_regions; i++) {
+        WinSpiceRect common;
+        uint64_t area;
+
+        rect_intersect(&common, &det->regions[i].rect, rect);
+        area = wrect_area(&common);
+        if (area > best) {
+            best = area;
+            region = &det->regions[i];
+        }
+    }
+
+    if (region) {
+        uint64_t both = wrect_area(&region->rect) + wrect_area(rect) - best;
+
+        matched[region - det->regions] = true;
+        region->quiet = 0;
+        /// a video that grew a bit keeps its drawables' geometry
+        if (!rect_equal(&region->rect, rect) && best < VIDEO_SAME_GEOMETRY * both) {
+            if (region->video) {
+                print_region("moved, lossless until classified again", region);
+            }
+            region->rect = *rect;
+            region->video = false;
+            region->votes = 0;
+        }
+        return;
+    }
+
+    if (det->num_regions < VIDEO_MAX_REGIONS) {
+        region = &det->regions[det->num_regions];
+        matched[det->num_regions++] = true;
+        memset(region, 0, sizeof(*region));
+        region->rect = *rect;
+    }
+}
+
+/// bounding rect of the hot cells connected to @start
+static void group_cells(VideoDetector *det, int start, WinSpiceRect *cells)
+{
+    int top = 0;
+
+    cells->left = cells->right = start % det->cells_x;
+    cells->top = cells->bottom = start / det->cells_x;
+    det->seen[start] = 1;
+    det->stack[top++] = start;
+    while (top) {
+        int c = det->stack[--top];
+        int x = c % det->cells_x, y = c / det->cells_x;
+        int next[4] = { x > 0 ? c - 1 : -1, x + 1 < det->cells_x ? c + 1 : -1,
+                        y > 0 ? c - det->cells_x : -1,
+                        y + 1 < det->cells_y ? c + det->cells_x : -1 };
+        int i;
+
+        cells->left = MIN(cells->left, x);
+        cells->right = MAX(cells->right, x);
+        cells->top = MIN(cells->top, y);
+        cells->bottom = MAX(cells->bottom, y);
+        for (i = 0; i < 4; i++) {
+            if (next[i] >= 0 && !det->seen[next[i]]
+                && det->hot[next[i]] >= VIDEO_HOT_WINDOWS) {
+                det->seen[next[i]] = 1;
+                det->stack[top++] = next[i];
+            }
+        }
+    }
+}
+
+static void end_window(VideoDetector *det, uint64_t now)
+{
+    uint32_t min_hits = VIDEO_MIN_RATE * (now - det->window_start) / 1000000000ULL;
+    bool matched[VIDEO_MAX_REGIONS] = { false };
+    int cells = det->cells_x * det->cells_y;
+    int c, i;
+
+    for (c = 0; c < cells; c++) {
+        det->hot[c] = det->hits[c] >= min_hits ? MIN(det->hot[c] + 1, 255) : 0;
+        det->hits[c] = 0;
+        det->seen[c] = 0;
+    }
+
+    for (c = 0; c < cells; c++) {
+        WinSpiceRect group, rect;
+
+        if (det->seen[c] || det->hot[c] < VIDEO_HOT_WINDOWS) {
+            continue;
+        }
+        group_cells(det, c, &group);
+        rect.left = group.left * VIDEO_CELL;
+        rect.top = group.top * VIDEO_CELL;
+        rect.right = MIN((group.right + 1) * VIDEO_CELL, det->width);
+        rect.bottom = MIN((group.bottom + 1) * VIDEO_CELL, det->height);
+        if (rect.right - rect.left >= VIDEO_MIN_SIZE
+            && rect.bottom - rect.top >= VIDEO_MIN_SIZE) {
+            match_region(det, &rect, matched);
+        }
+    }
+
+    for (i = det->num_regions - 1; i >= 0; i--) {
+        VideoRegion *region = &det->regions[i];
+
+        if (!matched[i] && ++region->quiet >= VIDEO_HOLD_WINDOWS) {
+            if (region->video) {
+                print_region("stopped", region);
+            }
+            *region = det->regions[--det->num_regions];
+            continue;
+        }
+        region->check = true;
+    }
+
+    det->window_start = now;
+}
+
+void video_detect_frame(VideoDetector *det, const WinSpiceRegion *dirty, uint64_t now)
+{
+    const WinSpiceRect *rects;
+    int i, n, x, y;
+
+    rects = wregion_rects(dirty, &n);
+    det->frame++;
+    for (i = 0; i < n; i++) {
+        const WinSpiceRect *r = &rects[i];
+
+        /// a cell counts once per frame, however many rects touch it
+        for (y = r->top / VIDEO_CELL; y <= (r->bottom - 1) / VIDEO_CELL; y++) {
+            for (x = r->left / VIDEO_CELL; x <= (r->right - 1) / VIDEO_CELL; x++) {
+                int c = y * det->cells_x + x;
+
+                if (det->stamps[c] != det->frame) {
+                    det->stamps[c] = det->frame;
+                    det->hits[c] = MIN(det->hits[c] + 1, UINT16_MAX);
+                }
+            }
+        }
+    }
+
+    if (!det->window_start) {
+        det->window_start = now;
+    } else if (now - det->window_start >= VIDEO_WINDOW) {
+        end_window(det, now);
+    }
+}
+
+void video_detect_extend(VideoDetector *det, WinSpiceRegion *invalid)
+{
+    int i;
+
+    for (i = 0; i < det->num_regions; i++) {
+        VideoRegion *region = &det->regions[i];
+
+        /// other hot regions keep their dirty rects, unless pixels are due
+        if ((region->video || region->check)
+            && wregion_intersects_rect(invalid, &region->rect)) {
+            wregion_union_rect(invalid, invalid, &region->rect);
+            region->staged = true;
+        }
+    }
+}
+
+void video_detect_classify(VideoDetector *det, const uint8_t *frame, int pitch)
+{
+    int i;
+
+    for (i = 0; i < det->num_regions; i++) {
+        VideoRegion *region = &det->regions[i];
+
+        if (!region->check || !region->staged) {
+            continue;
+        }
+        region->check = false;
+        if (video_is_photographic(frame, pitch, &region->rect) == region->video) {
+            region->votes = 0;
+        } else if (++region->votes >= VIDEO_VOTES) {
+            region->video = !region->video;
+            region->votes = 0;
+            print_region(region->video ? "video, sent for streaming" : "lossless", region);
+        }
+    }
+}
+
+int video_detect_take(VideoDetector *det, WinSpiceRegion *invalid, WinSpiceRect *rects)
+{
+    int i, n = 0;
+
+    for (i = 0; i < det->num_regions; i++) {
+        VideoRegion *region = &det->regions[i];
+
+        /// the tile hash may have found the whole region unchanged
+        if (region->video && region->staged
+            && wregion_intersects_rect(invalid, &region->rect)) {
+            wregion_subtract_rect(invalid, invalid, &region->rect);
+            rects[n++] = region->rect;
+        }
+        region->staged = false;
+    }
+
+    return n;
+}
+
+bool video_is_photographic(const uint8_t *frame, int pitch, const WinSpiceRect *rect)
+{
+    int step_x = MAX((rect->right - rect->left) / VIDEO_SAMPLES, 1);
+    int step_y = MAX((rect->bottom - rect->top) / VIDEO_SAMPLES, 1);
+    uint32_t flat = 0, smooth = 0, sharp = 0;
+    int x, y;
+
+    /// photos change gradually from one pixel to the next, text and ui
+    /// are flat areas with sharp edges
+    for (y = rect->top; y < rect->bottom; y += step_y) {
+        const uint8_t *row = frame + (size_t)y * pitch;
+
+        for (x = rect->left; x + 1 < rect->right; x += step_x) {
+            const uint8_t *a = row + x * 4, *b = a + 4;
+            int diff = MAX(abs(a[0] - b[0]), MAX(abs(a[1] - b[1]), abs(a[2] - b[2])));
+
+            if (diff == 0) {
+                flat++;
+            } else if (diff <= VIDEO_SMOOTH_DIFF) {
+                smooth++;
+            } else {
+                sharp++;
+            }
+        }
+    }
+
+    return smooth > 2 * sharp && smooth * 5 >= flat + smooth + sharp;
+}
@@ -0,0 +1,118 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file   videodetect.h
+ * @brief  Detection of screen regions that play video
+ *
+ * Video is sent most cheaply as a spice stream, but spice only starts one
+ * for a run of drawables with the same geometry, while DXGI reports the
+ * damage of a playing video in ever different pieces. The dirty region of
+ * every frame is added to a heatmap of VIDEO_CELL sized cells. Cells that
+ * keep changing at a video rate for a while are grouped into regions, and
+ * a region whose pixels look photographic is classified as video: its
+ * whole rect, snapped to the cell grid and kept as is while the video
+ * plays, is sent as one drawable whenever any part of it changed.
+ *
+ * Like region.h this module does not depend on any windows or spice
+ * header.
+ */
+
+#ifndef WIN_SPICE_VIDEODETECT_H
+#define WIN_SPICE_VIDEODETECT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "region.h"
+
+#define VIDEO_CELL              32
+/// the heatmap is evaluated once per window
+#define VIDEO_WINDOW            500000000ULL
+/// updates per second of a cell that plays video
+#define VIDEO_MIN_RATE          10
+/// windows in a row a cell must be hot to join a region
+#define VIDEO_HOT_WINDOWS       2
+/// spice streams nothing smaller, see RED_STREAM_MIN_SIZE
+#define VIDEO_MIN_SIZE          96
+#define VIDEO_MAX_REGIONS       4
+/// windows without hot cells before a region is forgotten
+#define VIDEO_HOLD_WINDOWS      2
+/// windows in a row with the other verdict before a region flips
+#define VIDEO_VOTES             2
+
+typedef struct VideoRegion {
+    WinSpiceRect rect;
+    /// sent as one drawable with stable geometry
+    bool video;
+    /// the pixels are up for classification, see video_detect_classify()
+    bool check;
+    /// video_detect_extend() added the region to the damage this frame
+    bool staged;
+    int votes;
+    int quiet;
+} VideoRegion;
+
+typedef struct VideoDetector {
+    int width, height;
+    int cells_x, cells_y;
+    /// frames that touched a cell in the current window
+    uint16_t *hits;
+    /// last frame that touched a cell
+    uint32_t *stamps;
+    /// windows in a row a cell was hot
+    uint8_t *hot;
+    /// scratch of the grouping
+    uint8_t *seen;
+    int *stack;
+    uint32_t frame;
+    uint64_t window_start;
+    VideoRegion regions[VIDEO_MAX_REGIONS];
+    int num_regions;
+} VideoDetector;
+
+VideoDetector *video_detect_new(int width, int height);
+void video_detect_destroy(VideoDetector *det);
+
+/// add the dirty region of one frame to the heatmap
+void video_detect_frame(VideoDetector *det, const WinSpiceRegion *dirty, uint64_t now);
+
+/**
+ * Grow @invalid by the pixels the detector needs this frame: whole video
+ * regions that @invalid touches, and regions up for classification.
+ */
+void video_detect_extend(VideoDetector *det, WinSpiceRegion *invalid);
+
+/**
+ * Classify the regions up for it. @frame points to pixel (0, 0) of a
+ * 32bpp copy of the screen holding the pixels video_detect_extend() asked
+ * for.
+ */
+void video_detect_classify(VideoDetector *det, const uint8_t *frame, int pitch);
+
+/**
+ * Move the video regions @invalid touches out of it into @rects, which
+ * has room for VIDEO_MAX_REGIONS. Returns their number.
+ */
+int video_detect_take(VideoDetector *det, WinSpiceRegion *invalid, WinSpiceRect *rects);
+
+/// whether the pixels of @rect look like a photo rather than text or flat ui
+bool video_is_photographic(const uint8_t *frame, int pitch, const WinSpiceRect *rect);
+
+#endif  /* WIN_SPICE_VIDEODETECT_H */
@@ -30,6 +30,16 @@
 #include "wspice.h"
 #include "session.h"
 #include "memory.h"
+#include "hash.h"
+#include "bufpool.h"
+#include "batch.h"
+#include "stats.h"
+#include "trace.h"
+#include "probe.h"
+
+#ifdef WIN_SPICE_DEBUG
+extern FILE *fp_dbg;
+#endif // WIN_SPICE_DEBUG
 
 /**
  * Some callback functions called by libspice have no way of passing back
@@ -53,7 +63,12 @@ static void create_primary_surface(WSpice *wspice)
         if (wspice->primary_surface) {
             w_free(wspice->primary_surface);
         }
-        wspice->primary_surface = (uint8_t *)w_malloc(wspice->primary_surface_size);
+        /**
+         * spice renders every drawable into this memory, lazily and in
+         * command order, so nothing else may write it. Black until the
+         * first frame is rendered, never garbage.
+         */
+        wspice->primary_surface = (uint8_t *)w_malloc0(wspice->primary_surface_size);
     }
 
     memset(&surface, 0, sizeof(surface));
@@ -107,9 +122,15 @@ static void attache_worker(QXLInstance *qin, QXLWorker *_qxl_worker)
     spice_server_vm_start(wspice->server);
 }
 
-static void set_compression_level(QXLInstance *qin G_GNUC_UNUSED, int level G_GNUC_UNUSED)
+/// spice reports 1 when it compresses images with quic only, 0 otherwise
+static void set_compression_level(QXLInstance *qin, int level)
 {
-    printf("FIXME! UNIMPLEMENTED! %s\n", __func__);
+    WSpice *wspice = SPICE_CONTAINEROF(qin, WSpice, qxl);
+
+    if (wspice->compression_level != level) {
+        printf("spice compression level: %d\n", level);
+    }
+    wspice->compression_level = level;
 }
 
 static void get_init_info(QXLInstance *qin G_GNUC_UNUSED, QXLDevInitInfo *info)
@@ -122,24 +143,75 @@ static void get_init_info(QXLInstance *qin G_GNUC_UNUSED, QXLDevInitInfo *info)
     info->n_surfaces = 1;
 }
 
+static void drawable_uncount(SimpleSpiceUpdate *update)
+{
+    if (update->inflight) {
+        atomic_fetch_sub_explicit(update->inflight, update->size, memory_order_relaxed);
+    }
+}
+
+static void drawable_free(void *data)
+{
+    SimpleSpiceUpdate *update = data;
+
+    drawable_uncount(update);
+    slab_free(update->clip);
+    w_bitmap_free(update->bitmaps);
+    slab_free(update);
+}
+
+/**
+ * Worker side: take ownership of a popped drawable. A superseded one is
+ * freed here, its pixels and its in-flight bytes are already gone, and
+ * false is returned.
+ */
+static bool drawable_claim(SimpleSpiceUpdate *update)
+{
+    if (!update->state || supersede_claim(update->state)) {
+        return true;
+    }
+    slab_free(update->clip);
+    slab_free(update);
+    return false;
+}
+
+/// drawables the worker pops without sending them, after a resize or stop
+static void drawable_discard(void *data)
+{
+    if (drawable_claim(data)) {
+        drawable_free(data);
+    }
+}
+
 static int get_command(QXLInstance *qin G_GNUC_UNUSED, struct QXLCommandExt *ext)
 {
     WSpice *wspice = SPICE_CONTAINEROF(qin, WSpice, qxl);
     SimpleSpiceUpdate *update;
+    uint64_t t = trace_begin();
 
-    update = g_async_queue_try_pop(wspice->drawable_queue);
-    if (!update) {
-        return false;
+    trace_thread_name("spice worker");
+    if (!atomic_load_explicit(&wspice->worker_clock.valid, memory_order_relaxed)) {
+        thread_clock_self(&wspice->worker_clock);
     }
+    do {
+        update = ring_pop(&wspice->drawable_ring);
+        if (!update) {
+            trace_end("get_command (empty)", t);
+            return false;
+        }
+    } while (!drawable_claim(update));
 
+    update->dequeued_at = stats_now();
+    stats_record(STATS_STAGE_QUEUE, update->dequeued_at - update->queued_at);
     *ext = update->ext;
+    trace_end("get_command", t);
     return true;
 }
 
 static int req_cmd_notification(QXLInstance *qin G_GNUC_UNUSED)
 {
     WSpice *wspice = SPICE_CONTAINEROF(qin, WSpice, qxl);
-    if (g_async_queue_length(wspice->drawable_queue) > 0) {
+    if (!ring_is_empty(&wspice->drawable_ring)) {
         return 0;
     }
     return 1;
@@ -151,27 +223,31 @@ static void release_resource(QXLInstance *qin G_GNUC_UNUSED,
     SimpleSpiceUpdate *update;
     SimpleSpiceCursor *cursor;
     QXLCommandExt *ext;
+    uint64_t t = trace_begin();
 
     ext = (void *)(uintptr_t)(release_info.info->id);
     switch (ext->cmd.type) {
     case QXL_CMD_DRAW:
         update = SPICE_CONTAINEROF(ext, SimpleSpiceUpdate, ext);
-        w_free(update->bitmaps);
-        w_free(update);
+        stats_record_since(STATS_STAGE_WIRE, update->dequeued_at);
+        stats_record_since(STATS_STAGE_TOTAL, update->captured_at);
+        drawable_free(update);
         break;
     case QXL_CMD_CURSOR:
         cursor = SPICE_CONTAINEROF(ext, SimpleSpiceCursor, ext);
-        w_free(cursor);
+        slab_free(cursor);
         break;
     default:
         g_assert_not_reached();
     }
+    trace_end("release_resource", t);
 }
 
 static int get_cursor_command(QXLInstance *qin G_GNUC_UNUSED, struct QXLCommandExt *ext G_GNUC_UNUSED)
 {
     //printf("FIXME! UNIMPLEMENTED! %s\n", __func__);
     WSpice *wspice = SPICE_CONTAINEROF(qin, WSpice, qxl);
+    uint64_t t = trace_begin();
     bool ret;
 
     pthread_mutex_lock(&wspice->lock);
@@ -187,6 +263,7 @@ static int get_cursor_command(QXLInstance *qin G_GNUC_UNUSED, struct QXLCommandE
         ret = false;
     }
     pthread_mutex_unlock(&wspice->lock);
+    trace_end("get_cursor_command", t);
 
     return ret;
 }
@@ -255,57 +332,72 @@ static QXLInterface dpy_interface = {
     .set_client_capabilities = NULL,
 };
 
+/**
+ * All timers and watches of the core interface live in this context, which
+ * is iterated by the spice io thread, see start(). Like win_spice_session,
+ * timer_add() and watch_add() get no data pointer to find it otherwise.
+ */
+static GMainContext *core_context = NULL;
+
+/**
+ * A timer is a GSource of its own that stays attached to core_context from
+ * timer_add() to timer_remove(), timer_start() and timer_cancel() only move
+ * its ready time.
+ */
 struct SpiceTimer {
+    GSource source;
     SpiceTimerFunc func;
     void *opaque;
-    GSource *source;
 };
 typedef struct SpiceTimer SpiceTimer;
 
-static SpiceTimer* timer_add(SpiceTimerFunc func, void *opaque)
+static gboolean timer_dispatch(GSource *source, GSourceFunc callback G_GNUC_UNUSED,
+                               gpointer user_data G_GNUC_UNUSED)
 {
-    SpiceTimer *timer = g_new0(SpiceTimer, 1);
+    SpiceTimer *timer = (SpiceTimer *)source;
+    uint64_t t = trace_begin();
 
-    timer->func = func;
-    timer->opaque = opaque;
+    /// one shot, func() may start it again
+    g_source_set_ready_time(source, -1);
+    timer->func(timer->opaque);
+    /* timer might be removed in func(), don't touch */
+    trace_end("timer", t);
 
-    return timer;
+    return G_SOURCE_CONTINUE;
 }
 
-static gboolean timer_func(gpointer user_data)
+static GSourceFuncs timer_source_funcs = {
+    .dispatch = timer_dispatch,
+};
+
+static SpiceTimer* timer_add(SpiceTimerFunc func, void *opaque)
 {
-    SpiceTimer *timer = user_data;
+    SpiceTimer *timer;
 
-    timer->func(timer->opaque);
-    /* timer might be free after func(), don't touch */
+    timer = (SpiceTimer *)g_source_new(&timer_source_funcs, sizeof(SpiceTimer));
+    timer->func = func;
+    timer->opaque = opaque;
+    g_source_set_ready_time(&timer->source, -1);
+    g_source_attach(&timer->source, core_context);
 
-    return FALSE;
+    return timer;
 }
 
 static void timer_cancel(SpiceTimer *timer)
 {
-    if (timer->source) {
-        g_source_destroy(timer->source);
-        g_source_unref(timer->source);
-        timer->source = NULL;
-    }
+    g_source_set_ready_time(&timer->source, -1);
 }
 
 static void timer_start(SpiceTimer *timer, uint32_t ms)
 {
-    timer_cancel(timer);
-
-    timer->source = g_timeout_source_new(ms);
-
-    g_source_set_callback(timer->source, timer_func, timer, NULL);
-
-    g_source_attach(timer->source, g_main_context_default());
+    g_source_set_ready_time(&timer->source,
+                            g_get_monotonic_time() + (gint64)ms * 1000);
 }
 
 static void timer_remove(SpiceTimer *timer)
 {
-    timer_cancel(timer);
-    w_free(timer);
+    g_source_destroy(&timer->source);
+    g_source_unref(&timer->source);
 }
 
 struct SpiceWatch {
@@ -345,8 +437,10 @@ static gboolean watch_func(GIOChannel *source, GIOCondition condition,
     SpiceWatch *watch = data;
     // this works also under Windows despite the name
     int fd = g_io_channel_unix_get_fd(source);
+    uint64_t t = trace_begin();
 
     watch->func(fd, giocondition_to_spice_event(condition), watch->opaque);
+    trace_end("watch", t);
 
     return TRUE;
 }
@@ -369,14 +463,14 @@ static void watch_update_mask(SpiceWatch *watch, int event_mask)
      * In this case it is a GIOFunc. First cast to GIOFunc to make sure it is the right type.
      * The other casts silence the warning from gcc */
     g_source_set_callback(watch->source, (GSourceFunc)(void*)(GIOFunc)watch_func, watch, NULL);
-    g_source_attach(watch->source, g_main_context_default());
+    g_source_attach(watch->source, core_context);
 }
 
 static SpiceWatch *watch_add(int fd, int event_mask, SpiceWatchFunc func, void *opaque)
 {
     SpiceWatch *watch;
 
-    watch = g_new0(SpiceWatch, 1);
+    watch = w_malloc0(sizeof(SpiceWatch));
     watch->channel = g_io_channel_win32_new_socket(fd);
     watch->func = func;
     watch->opaque = opaque;
@@ -394,10 +488,26 @@ static void watch_remove(SpiceWatch *watch)
     w_free(watch);
 }
 
+/// the gui is only touched from the gtk main loop
+static gboolean client_connected_idle(gpointer data)
+{
+    session_client_connected(data);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean client_disconnected_idle(gpointer data)
+{
+    session_client_disconnected(data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/// called in the spice io thread or a spice worker, never the gtk one
 static void channel_event(int event, SpiceChannelEventInfo *info)
 {
     if (event == SPICE_CHANNEL_EVENT_INITIALIZED && info->type == SPICE_CHANNEL_MAIN) {
-        session_client_connected(win_spice_session);
+        g_idle_add(client_connected_idle, win_spice_session);
     }
     /**
      * FIXME: Due to a problem with our code, when the client disconnects, we can't
@@ -406,7 +516,7 @@ static void channel_event(int event, SpiceChannelEventInfo *info)
      * we should use the main channel status to judge later.
      */
     if (event == SPICE_CHANNEL_EVENT_DISCONNECTED && info->type == SPICE_CHANNEL_DISPLAY)
-        session_client_disconnected(win_spice_session);
+        g_idle_add(client_disconnected_idle, win_spice_session);
 }
 
 static SpiceCoreInterface core_interface = {
@@ -427,35 +537,51 @@ static SpiceCoreInterface core_interface = {
     .channel_event      = channel_event,
 };
 
-static void *bitmaps_to_drawable(uint8_t *bitmaps, QXLRect *rect, int pitch)
+static SimpleSpiceUpdate *drawable_update_new(WSpice *wspice, const QXLRect *rect,
+                                              uint8_t type)
 {
     SimpleSpiceUpdate *update;
     QXLDrawable *drawable;
-    QXLImage *qxl_image;
     QXLCommand *cmd;
-    int bw, bh;
 
-    update    = w_malloc0(sizeof(*update));
+    update    = slab_alloc(&wspice->drawable_slab, sizeof(*update));
     drawable  = &update->drawable;
-    qxl_image = &update->image;
     cmd       = &update->ext.cmd;
 
-    bw        = rect->right - rect->left;
-    bh        = rect->bottom - rect->top;
-
-    update->bitmaps = bitmaps;
-
     drawable->bbox            = *rect;
     drawable->clip.type       = SPICE_CLIP_TYPE_NONE;
     drawable->effect          = QXL_EFFECT_OPAQUE;
     drawable->release_info.id = (uintptr_t)(&update->ext);
-    drawable->type            = QXL_DRAW_COPY;
+    drawable->type            = type;
 
     drawable->surfaces_dest[0] = -1;
     drawable->surfaces_dest[1] = -1;
     drawable->surfaces_dest[2] = -1;
     drawable->surface_id       = 0;
 
+    cmd->type = QXL_CMD_DRAW;
+    cmd->data = (uintptr_t)drawable;
+
+    return update;
+}
+
+static SimpleSpiceUpdate *bitmaps_to_drawable(WSpice *wspice, uint8_t *bitmaps,
+                                              QXLRect *rect, int pitch)
+{
+    SimpleSpiceUpdate *update;
+    QXLDrawable *drawable;
+    QXLImage *qxl_image;
+    int bw, bh;
+
+    update    = drawable_update_new(wspice, rect, QXL_DRAW_COPY);
+    drawable  = &update->drawable;
+    qxl_image = &update->image;
+
+    bw        = rect->right - rect->left;
+    bh        = rect->bottom - rect->top;
+
+    update->bitmaps = bitmaps;
+
     drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
     drawable->u.copy.src_bitmap = (uintptr_t)qxl_image;
     drawable->u.copy.src_area.left = 0;
@@ -472,28 +598,413 @@ static void *bitmaps_to_drawable(uint8_t *bitmaps, QXLRect *rect, int pitch)
     qxl_image->bitmap.palette = 0;
     qxl_image->bitmap.format = SPICE_BITMAP_FMT_RGBA;
 
-    cmd->type = QXL_CMD_DRAW;
-    cmd->data = (uintptr_t)drawable;
+    return update;
+}
+
+/**
+ * Exact 4 or 8 bit indexed version of a bitmap with few colors. The
+ * palette and the indices share one allocation that replaces the 32bpp
+ * bitmap, which is freed here.
+ */
+static void *bitmaps_to_indexed_drawable(WSpice *wspice, uint8_t *bitmaps,
+                                         QXLRect *rect, int pitch)
+{
+    SimpleSpiceUpdate *update;
+    PaletteColors palette;
+    QXLPalette *qxl_palette;
+    uint8_t *buf;
+    int bw, bh, stride, offset;
+
+    bw = rect->right - rect->left;
+    bh = rect->bottom - rect->top;
+    if (bw * bh < PALETTE_MIN_PIXELS
+        || !palette_collect(bitmaps, pitch, bw, bh, &palette)) {
+        return NULL;
+    }
+
+    stride = palette_stride(&palette, bw);
+    offset = (sizeof(QXLPalette) + palette.num_colors * sizeof(uint32_t) + 7) & ~7;
+    buf = w_bitmap_alloc(offset + stride * bh);
+
+    qxl_palette = (QXLPalette *)buf;
+    qxl_palette->unique = palette_cache_unique(&wspice->palette_cache, &palette);
+    qxl_palette->num_ents = palette.num_colors;
+    memcpy(qxl_palette->ents, palette.colors, palette.num_colors * sizeof(uint32_t));
+    palette_convert(&palette, bitmaps, pitch, bw, bh, buf + offset, stride);
+    w_bitmap_free(bitmaps);
+
+    update = bitmaps_to_drawable(wspice, buf + offset, rect, stride);
+    update->bitmaps = buf;
+    update->image.bitmap.palette = (uintptr_t)qxl_palette;
+    update->image.bitmap.format = palette.bits == 4 ? SPICE_BITMAP_FMT_4BIT_BE
+                                                    : SPICE_BITMAP_FMT_8BIT;
+
+    return update;
+}
+
+/// content derived id, so spice can serve repeated images from the client cache
+static void drawable_set_image_id(WSpice *wspice, SimpleSpiceUpdate *update)
+{
+    QXLImage *image = &update->image;
+    QXLPalette *palette = (QXLPalette *)(uintptr_t)image->bitmap.palette;
+    int row_bytes;
+    uint64_t hash;
+    bool cache_me;
+
+    switch (image->bitmap.format) {
+    case SPICE_BITMAP_FMT_4BIT_BE:
+        row_bytes = (image->bitmap.x + 1) / 2;
+        break;
+    case SPICE_BITMAP_FMT_8BIT:
+        row_bytes = image->bitmap.x;
+        break;
+    default:
+        row_bytes = image->bitmap.x * 4;
+        break;
+    }
+
+    hash = hash_rect((const uint8_t *)(uintptr_t)image->bitmap.data, image->bitmap.stride,
+                     row_bytes, image->bitmap.y);
+    if (palette) {
+        hash = hash_round(hash, hash_rect((const uint8_t *)palette->ents, 0,
+                                          palette->num_ents * sizeof(uint32_t), 1));
+    }
+    /// row_bytes alone does not tell a 4bpp bitmap of 3 pixels from one of 4
+    hash = hash_round(hash, image->bitmap.format);
+    hash = hash_round(hash, ((uint64_t)image->bitmap.x << 32) | image->bitmap.y);
+
+    image->descriptor.id = image_cache_lookup(&wspice->image_cache, hash,
+                                              image->bitmap.x * image->bitmap.y,
+                                              row_bytes * image->bitmap.y, &cache_me);
+    if (cache_me) {
+        image->descriptor.flags |= QXL_IMAGE_CACHE;
+    }
+}
+
+/// restrict a batched drawable to the rects it was built from
+static void drawable_set_clip(WSpice *wspice, SimpleSpiceUpdate *update,
+                              const WinSpiceRect *rects, int n)
+{
+    QXLClipRects *clip;
+    QXLRect *dst;
+    int i;
+
+    clip = slab_alloc(&wspice->clip_slab, sizeof(QXLClipRects) + n * sizeof(QXLRect));
+    clip->num_rects = n;
+    clip->chunk.data_size = n * sizeof(QXLRect);
+    clip->chunk.prev_chunk = 0;
+    clip->chunk.next_chunk = 0;
+
+    dst = (QXLRect *)clip->chunk.data;
+    for (i = 0; i < n; i++) {
+        dst[i].left   = rects[i].left;
+        dst[i].top    = rects[i].top;
+        dst[i].right  = rects[i].right;
+        dst[i].bottom = rects[i].bottom;
+    }
+
+    update->clip = clip;
+    update->drawable.clip.type = SPICE_CLIP_TYPE_RECTS;
+    update->drawable.clip.data = (uintptr_t)clip;
+}
+
+/// screen to screen copy on the primary surface, no pixel data attached
+static void *move_to_drawable(WSpice *wspice, const WinSpiceMove *move)
+{
+    SimpleSpiceUpdate *update;
+    QXLDrawable *drawable;
+    QXLRect rect;
+
+    rect.left   = move->dest.left;
+    rect.top    = move->dest.top;
+    rect.right  = move->dest.right;
+    rect.bottom = move->dest.bottom;
+
+    update    = drawable_update_new(wspice, &rect, QXL_COPY_BITS);
+    drawable  = &update->drawable;
+
+    drawable->u.copy_bits.src_pos.x = move->src_x;
+    drawable->u.copy_bits.src_pos.y = move->src_y;
+
+    return update;
+}
+
+/// flat area painted with a solid brush, no pixel data attached
+static void *fill_to_drawable(WSpice *wspice, const WinSpiceFill *fill)
+{
+    SimpleSpiceUpdate *update;
+    QXLDrawable *drawable;
+    QXLRect rect;
+
+    rect.left   = fill->rect.left;
+    rect.top    = fill->rect.top;
+    rect.right  = fill->rect.right;
+    rect.bottom = fill->rect.bottom;
+
+    update    = drawable_update_new(wspice, &rect, QXL_DRAW_FILL);
+    drawable  = &update->drawable;
+
+    drawable->u.fill.brush.type    = SPICE_BRUSH_TYPE_SOLID;
+    drawable->u.fill.brush.u.color = fill->color & 0x00FFFFFF;  /* xRGB */
+    drawable->u.fill.rop_descriptor = SPICE_ROPD_OP_PUT;
 
     return update;
 }
 
+/// bytes a queued drawable keeps alive
+static uint32_t drawable_size(SimpleSpiceUpdate *update)
+{
+    uint32_t size = sizeof(*update);
+
+    if (update->bitmaps) {
+        size += abs(update->image.bitmap.stride) * update->image.bitmap.y;
+    }
+    return size;
+}
+
+/// capture thread: the session stops, or the frame waited long enough
+static bool queue_give_up(WSpice *wspice)
+{
+    if (!wspice->queue_stalled
+        && (!wspice->session->running || stats_now() >= wspice->queue_deadline)) {
+        trace_instant("drawable ring stalled");
+        wspice->queue_stalled = true;
+    }
+    return wspice->queue_stalled;
+}
+
+/**
+ * Hand a drawable to the spice worker. A full ring pushes back: the
+ * worker is woken up and the capture thread waits until it made room,
+ * for DRAWABLE_QUEUE_WAIT per frame at most and only while the session
+ * runs; spice stops taking commands while a slow client's pipe is full.
+ * Returns false if the drawable was freed instead, and so is everything
+ * else of the frame, which keeps drawables in order.
+ * If @painted is set, the drawable paints all of it and may be dropped
+ * while queued once newer damage covers it.
+ */
+static bool queue_drawable(WSpice *wspice, SimpleSpiceUpdate *update,
+                           const WinSpiceRect *painted)
+{
+    uint32_t size = drawable_size(update);
+    uint32_t inflight;
+
+    if (wspice->queue_stalled) {
+        drawable_free(update);
+        return false;
+    }
+
+    update->size = size;
+    update->inflight = &wspice->inflight_bytes;
+    update->captured_at = wspice->captured_at;
+    update->queued_at = stats_now();
+    if (update->bitmaps) {
+        stats_count(STATS_RECTS, 1);
+        stats_count(STATS_BYTES, size);
+    }
+    inflight = atomic_fetch_add_explicit(&wspice->inflight_bytes, size,
+                                         memory_order_relaxed) + size;
+    atomic_fetch_add_explicit(&wspice->queued_bytes, size, memory_order_relaxed);
+    wspice->inflight_peak = MAX(wspice->inflight_peak, inflight);
+
+    /// must be set before the worker can see the drawable
+    if (painted) {
+        update->state = supersede_track(&wspice->supersede, update->bitmaps, painted, size,
+                                        ring_next_index(&wspice->drawable_ring));
+    }
+
+    if (!ring_push(&wspice->drawable_ring, update, size)) {
+        uint64_t t = trace_begin();
+        bool queued;
+        do {
+            wspice->wakeup(wspice);
+            g_usleep(1000);
+        } while (!(queued = ring_push(&wspice->drawable_ring, update, size))
+                 && !queue_give_up(wspice));
+        trace_end("drawable ring full", t);
+        if (!queued) {
+            if (update->state) {
+                supersede_forget(update->state);
+                update->state = NULL;
+            }
+            atomic_fetch_sub_explicit(&wspice->queued_bytes, size, memory_order_relaxed);
+            drawable_free(update);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void bitmap_rect(const WinSpiceBitmap *bitmap, WinSpiceRect *rect)
+{
+    rect->left   = bitmap->rect.left;
+    rect->top    = bitmap->rect.top;
+    rect->right  = bitmap->rect.right;
+    rect->bottom = bitmap->rect.bottom;
+}
+
+static void drop_pixels(void *pixels)
+{
+    w_bitmap_free(pixels);
+}
+
+/// drop queued drawables that this frame paints over completely
+static void supersede_queued(WSpice *wspice, WinSpiceInvalid *invalid)
+{
+    SupersedeTracker *tracker = &wspice->supersede;
+    WinSpiceRect *rects;
+    int i, j, n = 0;
+
+    /// a screen move may read anything queued before it
+    if (invalid->num_moves > 0) {
+        supersede_pin_all(tracker);
+        return;
+    }
+
+    n = invalid->num_fills;
+    for (i = 0; i < invalid->num_rects; i++) {
+        n += MAX(invalid->rects[i].num_clip, 1);
+    }
+    rects = frame_arena_alloc(invalid->arena, n * sizeof(WinSpiceRect));
+
+    n = 0;
+    for (i = 0; i < invalid->num_fills; i++) {
+        rects[n++] = invalid->fills[i].rect;
+    }
+    for (i = 0; i < invalid->num_rects; i++) {
+        const WinSpiceBitmap *bitmap = &invalid->rects[i];
+        if (bitmap->num_clip == 0) {
+            bitmap_rect(bitmap, &rects[n++]);
+        }
+        for (j = 0; j < bitmap->num_clip; j++) {
+            rects[n++] = bitmap->clip[j];
+        }
+    }
+
+    wregion_set_rects(&wspice->painted, rects, n);
+    /// dropped drawables no longer hold back capture, the worker pops them at leisure
+    if (supersede_drop_covered(tracker, &wspice->painted, drop_pixels)) {
+        atomic_fetch_sub_explicit(&wspice->inflight_bytes, (uint32_t)tracker->saved_bytes,
+                                  memory_order_relaxed);
+        for (i = 0; i < tracker->dropped; i++) {
+            ring_release(&wspice->drawable_ring, tracker->tickets[i]);
+        }
+    }
+
+#ifdef WIN_SPICE_DEBUG
+    if (fp_dbg && tracker->dropped) {
+        fprintf(fp_dbg, "superseded %d drawables: %llu bytes saved, %llu total\n",
+                tracker->dropped, (unsigned long long)tracker->saved_bytes,
+                (unsigned long long)tracker->total_saved_bytes);
+    }
+#endif // WIN_SPICE_DEBUG
+}
+
+/// damage of a drawable that was not queued goes back to the display
+static void defer_unqueued(WinSpiceInvalid *invalid, const WinSpiceRect *rect,
+                           const WinSpiceRect *clip, int num_clip)
+{
+    int i;
+
+    if (num_clip == 0) {
+        wregion_union_rect(invalid->unqueued, invalid->unqueued, rect);
+    }
+    /// the rest of the bounding rect may be stale
+    for (i = 0; i < num_clip; i++) {
+        wregion_union_rect(invalid->unqueued, invalid->unqueued, &clip[i]);
+    }
+}
+
 static void handle_invalid_bitmaps(struct WSpice *wspice, WinSpiceInvalid *invalid)
 {
     void *drawable;
+    bool queued = false;
+    int i;
+
+    wspice->captured_at = invalid->captured_at;
+    wspice->queue_deadline = stats_now() + DRAWABLE_QUEUE_WAIT;
+    wspice->queue_stalled = false;
+
+    supersede_queued(wspice, invalid);
+
+    /// moves must reach the client before the dirty rects of the same frame
+    for (i = 0; i < invalid->num_moves; i++) {
+        drawable = move_to_drawable(wspice, &invalid->moves[i]);
+        if (drawable) {
+            /// the pixels of the frame are where the move put them
+            if (!queue_drawable(wspice, drawable, NULL)) {
+                defer_unqueued(invalid, &invalid->moves[i].dest, NULL, 0);
+            }
+            queued = true;
+        }
+    }
+
+    for (i = 0; i < invalid->num_fills; i++) {
+        drawable = fill_to_drawable(wspice, &invalid->fills[i]);
+        if (drawable) {
+            if (!queue_drawable(wspice, drawable, &invalid->fills[i].rect)) {
+                defer_unqueued(invalid, &invalid->fills[i].rect, NULL, 0);
+            }
+            queued = true;
+        }
+    }
+
+    for (i = 0; i < invalid->num_rects; i++) {
+        WinSpiceBitmap *bitmap = &invalid->rects[i];
+        WinSpiceRect rect;
 
-    drawable = bitmaps_to_drawable(invalid->bitmaps, &invalid->rect, invalid->pitch);
-    if (drawable) {
-        g_async_queue_push(wspice->drawable_queue, drawable);
+        bitmap_rect(bitmap, &rect);
+        if (bitmap->probe || bitmap->video) {
+            /**
+             * kept 32 bit and out of the image cache: a probe marker must
+             * stay decodable, and spice only streams plain bitmaps
+             */
+            drawable = bitmaps_to_drawable(wspice, bitmap->bitmaps, &bitmap->rect, bitmap->pitch);
+            /// a lost marker is just a missing sample
+            if (!queue_drawable(wspice, drawable, &rect) && bitmap->video) {
+                defer_unqueued(invalid, &rect, NULL, 0);
+            }
+            queued = true;
+            continue;
+        }
+        drawable = bitmaps_to_indexed_drawable(wspice, bitmap->bitmaps, &bitmap->rect,
+                                               bitmap->pitch);
+        if (!drawable) {
+            drawable = bitmaps_to_drawable(wspice, bitmap->bitmaps, &bitmap->rect, bitmap->pitch);
+        }
+        if (drawable) {
+            drawable_set_image_id(wspice, drawable);
+            if (bitmap->num_clip > 0) {
+                drawable_set_clip(wspice, drawable, bitmap->clip, bitmap->num_clip);
+            }
+            /// a batched drawable paints less than its rect, which is safe here
+            if (!queue_drawable(wspice, drawable, &rect)) {
+                defer_unqueued(invalid, &rect, bitmap->clip, bitmap->num_clip);
+            }
+            queued = true;
+        } else {
+            w_bitmap_free(bitmap->bitmaps);
+        }
+    }
+
+    /// one wakeup for the whole frame
+    if (queued) {
         wspice->wakeup(wspice);
-    } else {
-        w_free(invalid->bitmaps);
     }
 }
 
+static bool over_budget(struct WSpice *wspice)
+{
+    return atomic_load_explicit(&wspice->inflight_bytes, memory_order_relaxed)
+           >= wspice->inflight_budget;
+}
+
 void wakeup(struct WSpice *wspice)
 {
+    uint64_t t = trace_begin();
+
     spice_qxl_wakeup(&wspice->qxl);
+    trace_end("spice_qxl_wakeup", t);
 }
 
 #define INPUT_BUTTON__MAX 5
@@ -589,6 +1100,14 @@ static void tablet_position(SpiceTabletInstance* sin, int x, int y,
 {
     WSpice *wspice = SPICE_CONTAINEROF(sin, WSpice, tablet);
 
+    trace_instant("input: position");
+    if (atomic_load_explicit(&probe_enabled, memory_order_relaxed)) {
+        probe_input_sent(x, y);
+    }
+    /// the synthetic desktop draws its own pointer
+    if (wspice->session->display->synth) {
+        return;
+    }
     //spice_update_buttons(server, 0, buttons_state);
 
     INPUT mouse_event;
@@ -609,6 +1128,7 @@ static void tablet_wheel(SpiceTabletInstance* sin, int wheel,
                          uint32_t buttons_state)
 {
     WSpice *wspice = SPICE_CONTAINEROF(sin, WSpice, tablet);
+    trace_instant("input: wheel");
     spice_update_buttons(wspice, wheel, buttons_state);
 }
 
@@ -616,6 +1136,7 @@ static void tablet_buttons(SpiceTabletInstance *sin,
                            uint32_t buttons_state)
 {
     WSpice *wspice = SPICE_CONTAINEROF(sin, WSpice, tablet);
+    trace_instant("input: buttons");
     spice_update_buttons(wspice, 0, buttons_state);
 }
 
@@ -640,6 +1161,7 @@ static void kbd_push_key(SpiceKbdInstance *sin, uint8_t scancode)
     int keycode;
     INPUT keyboard_event;
 
+    trace_instant("input: key");
     if (scancode == SCANCODE_EMUL0) {
         wspice->emul0 = true;
         return;
@@ -719,7 +1241,7 @@ void *create_cursor_update(WSpice *wspice, WinSpiceCursor *c, int on)
         }
     }
 
-    update   = w_malloc0(sizeof(*update) + size);
+    update   = slab_alloc(&wspice->cursor_slab, sizeof(*update) + size);
     ccmd     = &update->cmd;
     cursor   = &update->cursor;
     cmd      = &update->ext.cmd;
@@ -731,7 +1253,7 @@ void *create_cursor_update(WSpice *wspice, WinSpiceCursor *c, int on)
         ccmd->u.set.visible    = true;
         ccmd->u.set.shape      = (uintptr_t)cursor;
         cursor->header.type       = wspice->ptr_type;
-        cursor->header.unique     = 0;
+        cursor->header.unique     = c->unique;
         cursor->header.width      = c->width;
         cursor->header.height     = c->height;
         cursor->header.hot_spot_x = c->hot_x;
@@ -754,10 +1276,59 @@ void *create_cursor_update(WSpice *wspice, WinSpiceCursor *c, int on)
     return update;
 }
 
+/**
+ * The image compression applies to the display channel at once, jpeg and
+ * zlib over glz only to display channels connected afterwards: spice reads
+ * them when it creates one.
+ */
+static void apply_compression(WSpice *wspice, const CompressTier *tier)
+{
+    spice_server_set_image_compression(wspice->server, tier->image);
+    spice_server_set_jpeg_compression(wspice->server, tier->jpeg);
+    spice_server_set_zlib_glz_compression(wspice->server, tier->zlib_glz);
+}
+
+/// auto-WAN: runs in the io thread, which may call into the server
+static gboolean compress_sample(gpointer data)
+{
+    WSpice *wspice = data;
+    uint64_t now = stats_now();
+    bool changed;
+
+    changed = compress_ctl_limit(&wspice->compress,
+                                 atomic_load_explicit(&wspice->compress_cap,
+                                                      memory_order_relaxed), now);
+    changed |= compress_ctl_sample(&wspice->compress, now,
+                                   atomic_load_explicit(&wspice->queued_bytes,
+                                                        memory_order_relaxed),
+                                   atomic_load_explicit(&wspice->inflight_bytes,
+                                                        memory_order_relaxed),
+                                   wspice->inflight_budget);
+    if (changed) {
+        apply_compression(wspice, &compress_tiers[wspice->compress.level]);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/// the main loop of the spice server, see core_interface
+static void *io_thread_func(void *data)
+{
+    WSpice *wspice = data;
+
+    trace_thread_name("spice io");
+    g_main_context_push_thread_default(wspice->io_context);
+    g_main_loop_run(wspice->io_loop);
+    g_main_context_pop_thread_default(wspice->io_context);
+
+    return NULL;
+}
+
 static void start(WSpice *wspice)
 {
     int port;
     const char *password;
+    int compression;
 
     port = options_get_int(wspice->options, "port");
     password = options_get_string(wspice->options, "password");
@@ -771,7 +1342,14 @@ static void start(WSpice *wspice)
         spice_server_set_noauth(wspice->server);
     }
     spice_server_set_addr(wspice->server, "0.0.0.0", 0);   /* FIXME:  */
-    //spice_server_set_image_compression(wspice->server, SPICE_IMAGE_COMPRESSION_AUTO_GLZ);  /* FIXME:  */
+    /// spice picks its default if nothing was chosen in the gui
+    compression = options_get_int(wspice->options, "compression");
+    if (compression == COMPRESSION_AUTO_WAN) {
+        compress_ctl_init(&wspice->compress, COMPRESS_GLZ, stats_now());
+        apply_compression(wspice, &compress_tiers[COMPRESS_GLZ]);
+    } else if (compression != SPICE_IMAGE_COMPRESSION_INVALID) {
+        spice_server_set_image_compression(wspice->server, compression);
+    }
 
     /**
      * disable spice_stream_video.
@@ -786,8 +1364,16 @@ static void start(WSpice *wspice)
      * data is sent very frequently. I don’t know which part of the client
      * has a problem, temporarily turn off spice_stream_video to bypass
      * this problem.
+     *
+     * With video-detect the capture side sends the video regions it found
+     * with stable geometry, and the filter mode only streams those of
+     * them that spice also finds photographic; all else stays lossless.
      */
-    spice_server_set_streaming_video(wspice->server, SPICE_STREAM_VIDEO_OFF);
+    if (options_get_int(wspice->options, "video-detect") > 0) {
+        spice_server_set_streaming_video(wspice->server, SPICE_STREAM_VIDEO_FILTER);
+    } else {
+        spice_server_set_streaming_video(wspice->server, SPICE_STREAM_VIDEO_OFF);
+    }
 
     /// qxl
     wspice->qxl.base.sif = &dpy_interface.base;
@@ -805,6 +1391,15 @@ static void start(WSpice *wspice)
            options_get_int(wspice->options, "port"),
            wspice->options->compression_text);
 
+    /**
+     * Sources attached while the server is set up below are not dispatched
+     * until the io thread runs, so the server is only ever entered from one
+     * thread at a time.
+     */
+    wspice->io_context = g_main_context_new();
+    wspice->io_loop = g_main_loop_new(wspice->io_context, FALSE);
+    core_context = wspice->io_context;
+
     if (spice_server_init(wspice->server, &core_interface) != 0) {
         printf("failed to initialize spice server\n");
         exit(1);
@@ -827,27 +1422,51 @@ static void start(WSpice *wspice)
         printf("failed to add kbd interface\n");
         exit(1);
     }
+
+    if (compression == COMPRESSION_AUTO_WAN) {
+        wspice->compress_timer = g_timeout_source_new(COMPRESS_SAMPLE_INTERVAL);
+        g_source_set_callback(wspice->compress_timer, compress_sample, wspice, NULL);
+        g_source_attach(wspice->compress_timer, wspice->io_context);
+    }
+
+    if (pthread_create(&wspice->io_thread, NULL, io_thread_func, wspice) != 0) {
+        printf("failed to create spice io thread\n");
+        exit(1);
+    }
 }
 
 static void stop(WSpice *wspice)
 {
-    while (1) {
-        /**
-         * display update thread has exited, just remove all data in
-         * drawable_queue.
-         */
-        void *data;
-        data = g_async_queue_try_pop(wspice->drawable_queue);
-        if (data) {
-            w_free(data);
-        } else {
-            break;
-        }
+    /**
+     * session_stop() joined the display update thread, so this is the
+     * ring's only producer now; the worker drops what is queued
+     */
+    ring_discard_all(&wspice->drawable_ring);
+
+    if (!wspice->io_loop) {
+        return;
+    }
+
+    /// nothing dispatches the timers and watches destroyed below any more
+    g_main_loop_quit(wspice->io_loop);
+    pthread_join(wspice->io_thread, NULL);
+
+    if (wspice->compress_timer) {
+        g_source_destroy(wspice->compress_timer);
+        g_source_unref(wspice->compress_timer);
+        wspice->compress_timer = NULL;
     }
 
     spice_server_destroy(wspice->server);
 
     wspice->server = NULL;
+    thread_clock_close(&wspice->worker_clock);
+
+    g_main_loop_unref(wspice->io_loop);
+    wspice->io_loop = NULL;
+    core_context = NULL;
+    g_main_context_unref(wspice->io_context);
+    wspice->io_context = NULL;
 }
 
 
@@ -855,16 +1474,9 @@ static void handle_resize(struct WSpice *wspice)
 {
     wspice->destroy_primary_surface(wspice);
 
-    /// release all bitmap data queued in list
-    while (1) {
-        void *data;
-        data = g_async_queue_try_pop(wspice->drawable_queue);
-        if (data) {
-            w_free(data);
-        } else {
-            break;
-        }
-    }
+    /// drawables queued for the old surface are freed by the worker
+    ring_discard_all(&wspice->drawable_ring);
+    supersede_pin_all(&wspice->supersede);
 
     wspice->create_primary_surface(wspice);
 }
@@ -879,8 +1491,9 @@ static void set_screen_size(struct WSpice *wspice, int width, int height)
 }
 
 
-void disconnect_client(struct WSpice *wspice)
+static gboolean disconnect_client_func(gpointer data)
 {
+    WSpice *wspice = data;
     const char *password;
 
     password = options_get_string(wspice->options, "password");
@@ -899,6 +1512,18 @@ void disconnect_client(struct WSpice *wspice)
     if (!password || strlen(password) == 0) {
         spice_server_set_noauth(wspice->server);
     }
+
+    return G_SOURCE_REMOVE;
+}
+
+/// called by the gui, the server is only touched in the spice io thread
+void disconnect_client(struct WSpice *wspice)
+{
+    if (!wspice->io_loop) {
+        return;
+    }
+
+    g_main_context_invoke(wspice->io_context, disconnect_client_func, wspice);
 }
 
 WSpice *wspice_new(struct Session *session)
@@ -914,10 +1539,24 @@ WSpice *wspice_new(struct Session *session)
 
     wspice->options = session->options;
 
-    /// drawable_queue init
-    wspice->drawable_queue = g_async_queue_new();
+    ring_init(&wspice->drawable_ring, DRAWABLE_RING_ENTRIES, DRAWABLE_RING_BYTES,
+              drawable_discard);
+    supersede_init(&wspice->supersede);
+    wregion_init(&wspice->painted);
+    atomic_init(&wspice->inflight_bytes, 0);
+    atomic_init(&wspice->queued_bytes, 0);
+    atomic_init(&wspice->compress_cap, COMPRESS_NUM_LEVELS - 1);
+    wspice->inflight_budget = options_get_int(wspice->options, "inflight-budget") * 1024 * 1024;
 
     pthread_mutex_init(&wspice->lock, NULL);
+    palette_cache_init(&wspice->palette_cache);
+    image_cache_init(&wspice->image_cache);
+    slab_init(&wspice->drawable_slab, "drawables", sizeof(SimpleSpiceUpdate),
+              DRAWABLE_SLAB_CHUNK);
+    slab_init(&wspice->clip_slab, "clips",
+              sizeof(QXLClipRects) + BATCH_MAX_MEMBERS * sizeof(QXLRect), DRAWABLE_SLAB_CHUNK);
+    slab_init(&wspice->cursor_slab, "cursors", sizeof(SimpleSpiceCursor) + CURSOR_SLAB_DATA,
+              CURSOR_SLAB_CHUNK);
 
     /// primary_surface
     wspice->primary_surface_size = 0;
@@ -928,6 +1567,7 @@ WSpice *wspice_new(struct Session *session)
     wspice->stop = stop;
     wspice->wakeup = wakeup;
     wspice->handle_invalid_bitmaps = handle_invalid_bitmaps;
+    wspice->over_budget = over_budget;
     wspice->disconnect_client = disconnect_client;
     wspice->handle_resize = handle_resize;
     wspice->create_primary_surface = create_primary_surface;
@@ -943,18 +1583,39 @@ failed:
     return NULL;
 }
 
+/// heap_allocs stops growing once the slabs are warm
+static void print_slab_stats(Slab *slab)
+{
+    SlabStats stats;
+
+    slab_get_stats(slab, &stats);
+    printf("%s slab: %llu allocs, %llu from the heap\n", slab->name,
+           (unsigned long long)stats.allocs, (unsigned long long)stats.heap_allocs);
+}
+
 void wspice_destroy(WSpice *wspice)
 {
     if (wspice) {
         /// destroy lock
         pthread_mutex_destroy(&wspice->lock);
 
-        /// destroy resources allocated for drawable_queue
-        if (wspice->drawable_queue) {
-            g_async_queue_unref(wspice->drawable_queue);
-        }
-
-        /// TODO: free ptr_define and ptr_move
+        printf("image cache: %llu hits (%llu bytes), %llu misses\n",
+               (unsigned long long)wspice->image_cache.hits,
+               (unsigned long long)wspice->image_cache.hit_bytes,
+               (unsigned long long)wspice->image_cache.misses);
+        printf("in-flight drawables: %u bytes peak\n", wspice->inflight_peak);
+
+        /// the spice worker is gone, free what it did not take
+        ring_fini(&wspice->drawable_ring);
+
+        /// also frees ptr_define and ptr_move if they were never taken
+        print_slab_stats(&wspice->drawable_slab);
+        print_slab_stats(&wspice->clip_slab);
+        print_slab_stats(&wspice->cursor_slab);
+        slab_fini(&wspice->drawable_slab);
+        slab_fini(&wspice->clip_slab);
+        slab_fini(&wspice->cursor_slab);
+        wregion_fini(&wspice->painted);
 
         if (wspice->primary_surface) {
             w_free(wspice->primary_surface);
@@ -26,6 +26,23 @@
 #include <spice.h>
 #include "display.h"
 #include "options.h"
+#include "palette.h"
+#include "imagecache.h"
+#include "ring.h"
+#include "compress.h"
+#include "cpubudget.h"
+#include "supersede.h"
+#include "slab.h"
+
+/// bounds of the drawable ring, a 4K frame is 32MB
+#define DRAWABLE_RING_ENTRIES   1024
+#define DRAWABLE_RING_BYTES     (128 * 1024 * 1024)
+/// command wrappers per slab chunk, and the largest cursor kept in the slab
+#define DRAWABLE_SLAB_CHUNK     256
+#define CURSOR_SLAB_CHUNK       16
+#define CURSOR_SLAB_DATA        (64 * 64 * 4)
+/// longest a frame waits for room in the drawable ring, in ns
+#define DRAWABLE_QUEUE_WAIT     (100 * 1000000ULL)
 
 typedef struct SimpleSpiceCursor {
     QXLCursorCmd cmd;
@@ -38,12 +55,50 @@ typedef struct SimpleSpiceUpdate {
     QXLImage image;
     QXLCommandExt ext;
     uint8_t *bitmaps;
+    /// clip list of a batched drawable, NULL otherwise
+    QXLClipRects *clip;
+    /// ownership of a drawable that newer damage may supersede, or NULL
+    atomic_int *state;
+    /// bytes counted in *inflight until the drawable is freed
+    uint32_t size;
+    atomic_uint *inflight;
+    /// stats_now() at capture, queue_drawable() and get_command()
+    uint64_t captured_at;
+    uint64_t queued_at;
+    uint64_t dequeued_at;
 } SimpleSpiceUpdate;
 
-typedef struct WinSpiceInvalid {
+typedef struct WinSpiceBitmap {
     QXLRect rect;
     uint8_t *bitmaps;
     int pitch;
+    /// if set, only these parts of the bitmap are painted
+    const WinSpiceRect *clip;
+    int num_clip;
+    /// a latency marker, sent as is for a client to decode
+    bool probe;
+    /// a whole video region, sent as is for spice to stream
+    bool video;
+} WinSpiceBitmap;
+
+/**
+ * all damage of one captured frame: screen moves, which are sent first and
+ * in order, then solid fills and one bitmap per dirty rect or batch of
+ * small dirty rects
+ */
+typedef struct WinSpiceInvalid {
+    const WinSpiceMove *moves;
+    int num_moves;
+    const WinSpiceFill *fills;
+    int num_fills;
+    WinSpiceBitmap *rects;
+    int num_rects;
+    /// stats_now() when the frame was acquired
+    uint64_t captured_at;
+    /// temporary buffers of this frame, rects is taken from it too
+    FrameArena *arena;
+    /// damage whose drawables could not be queued, to be sent with a later frame
+    WinSpiceRegion *unqueued;
 } WinSpiceInvalid;
 
 struct Session;
@@ -53,11 +108,43 @@ typedef struct WSpice {
 
     Options *options;
 
-    /// drawable queue
-    GAsyncQueue *drawable_queue;
+    /// drawables from the capture thread to the spice worker
+    DrawableRing drawable_ring;
+    /// queued drawables that may still be dropped, capture thread side
+    SupersedeTracker supersede;
+    /// damage of the frame being queued, kept for reuse by the capture thread
+    WinSpiceRegion painted;
+    /// bytes of drawables between capture and release_resource()
+    atomic_uint inflight_bytes;
+    /// raw bytes ever queued, the compression controller samples it
+    atomic_ullong queued_bytes;
+    uint32_t inflight_peak;
+    uint32_t inflight_budget;
+    /// capture time of the frame being queued, capture thread only
+    uint64_t captured_at;
+    /// when the frame being queued stops waiting for the ring, and whether it did
+    uint64_t queue_deadline;
+    bool queue_stalled;
+    /// command wrappers, allocated by the capture thread and released anywhere
+    Slab drawable_slab;
+    Slab clip_slab;
+    Slab cursor_slab;
 
     // spice interface
     SpiceServer *server;
+    /// the core interface's timers and watches run here, not in the gtk loop
+    GMainContext *io_context;
+    GMainLoop *io_loop;
+    pthread_t io_thread;
+    /// auto-WAN compression, sampled in the io thread
+    CompressCtl compress;
+    GSource *compress_timer;
+    /// as last told by spice, see set_compression_level()
+    int compression_level;
+    /// the most expensive auto-WAN level the cpu budget allows
+    atomic_int compress_cap;
+    /// cpu time of the spice worker, set when it first asks for a command
+    ThreadClock worker_clock;
     QXLInstance qxl;
     SpiceTabletInstance tablet;
 
@@ -72,6 +159,11 @@ typedef struct WSpice {
 
     uint32_t last_bmask;
 
+    /// palette ids of low color bitmaps, used by the capture thread only
+    PaletteCache palette_cache;
+    /// content ids of sent images, used by the capture thread only
+    ImageCache image_cache;
+
     pthread_mutex_t lock;
 
     uint8_t *primary_surface;
@@ -84,6 +176,8 @@ typedef struct WSpice {
     void (*stop)(struct WSpice *wspice);
     void (*wakeup)(struct WSpice *wspice);
     void (*handle_invalid_bitmaps)(struct WSpice *wspice, WinSpiceInvalid *invalid);
+    /// true while in-flight drawables use up the budget, no bitmaps should be built
+    bool (*over_budget)(struct WSpice *wspice);
     void (*disconnect_client)(struct WSpice *wspice);
     void (*handle_resize)(struct WSpice *wspice);
     void (*create_primary_surface)(struct WSpice *wspice);
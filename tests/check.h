@@ -0,0 +1,62 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file   check.h
+ * @brief  Minimal assertions for the unit tests
+ *
+ * A failed check prints where it failed and exits, ctest reports the
+ * test as failed from the exit status.
+ */
+
+#ifndef WIN_SPICE_CHECK_H
+#define WIN_SPICE_CHECK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CHECK(cond) do {                                                    \
+        if (!(cond)) {                                                      \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+#define CHECK_EQ(a, b) do {                                                 \
+        long long _a = (long long)(a), _b = (long long)(b);                 \
+        if (_a != _b) {                                                     \
+            printf("%s:%d: check failed: %s == %s (%lld != %lld)\n",        \
+                   __FILE__, __LINE__, #a, #b, _a, _b);                     \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+/// xorshift, tests must be reproducible so never seed from the clock
+static inline uint32_t check_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+#endif  /* WIN_SPICE_CHECK_H */
@@ -0,0 +1,108 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   shadow.c
+ * @brief  Client stand-in for the tests
+ */
+
+#include <glib.h>
+#include <stddef.h>
+#include <string.h>
+#include "shadow.h"
+#include "pixel.h"
+
+static inline uint8_t *shadow_pixel(ShadowSurface *shadow, int x, int y)
+{
+    return shadow->line_0 + (ptrdiff_t)y * shadow->stride + x * 4;
+}
+
+/// clip @rect to the surface, false if nothing is left
+static bool shadow_clip(ShadowSurface *shadow, const WinSpiceRect *rect, WinSpiceRect *out)
+{
+    out->left   = MAX(rect->left, 0);
+    out->top    = MAX(rect->top, 0);
+    out->right  = MIN(rect->right, shadow->width);
+    out->bottom = MIN(rect->bottom, shadow->height);
+    return !wrect_is_empty(out);
+}
+
+void shadow_init(ShadowSurface *shadow, uint8_t *mem, int width, int height, int stride)
+{
+    shadow->width = width;
+    shadow->height = height;
+    shadow->stride = stride;
+    shadow->line_0 = stride < 0 ? mem - (ptrdiff_t)stride * (height - 1) : mem;
+}
+
+void shadow_put(ShadowSurface *shadow, const WinSpiceRect *rect, const uint8_t *src,
+                int src_pitch)
+{
+    WinSpiceRect r;
+
+    if (!shadow->line_0 || !shadow_clip(shadow, rect, &r)) {
+        return;
+    }
+    src += (ptrdiff_t)(r.top - rect->top) * src_pitch + (r.left - rect->left) * 4;
+    pixel_copy_rect(shadow_pixel(shadow, r.left, r.top), shadow->stride, src, src_pitch,
+                    (r.right - r.left) * 4, r.bottom - r.top);
+}
+
+void shadow_fill(ShadowSurface *shadow, const WinSpiceRect *rect, uint32_t color)
+{
+    WinSpiceRect r;
+    int x, y;
+
+    if (!shadow->line_0 || !shadow_clip(shadow, rect, &r)) {
+        return;
+    }
+    for (y = r.top; y < r.bottom; y++) {
+        uint32_t *row = (uint32_t *)shadow_pixel(shadow, r.left, y);
+        for (x = 0; x < r.right - r.left; x++) {
+            row[x] = color;
+        }
+    }
+}
+
+void shadow_move(ShadowSurface *shadow, const WinSpiceMove *move)
+{
+    WinSpiceRect r;
+    int dx, dy, y, row_bytes;
+
+    if (!shadow->line_0 || !shadow_clip(shadow, &move->dest, &r)) {
+        return;
+    }
+    dx = move->src_x - move->dest.left;
+    dy = move->src_y - move->dest.top;
+    /// moverect_filter() already clipped the source to the screen
+    row_bytes = (r.right - r.left) * 4;
+
+    /// walk away from the overlap, memmove handles it within a row
+    if (dy < 0) {
+        for (y = r.bottom - 1; y >= r.top; y--) {
+            memmove(shadow_pixel(shadow, r.left, y),
+                    shadow_pixel(shadow, r.left + dx, y + dy), row_bytes);
+        }
+    } else {
+        for (y = r.top; y < r.bottom; y++) {
+            memmove(shadow_pixel(shadow, r.left, y),
+                    shadow_pixel(shadow, r.left + dx, y + dy), row_bytes);
+        }
+    }
+}
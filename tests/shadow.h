@@ -0,0 +1,54 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file   shadow.h
+ * @brief  Client stand-in for the tests
+ *
+ * Moves, fills and bitmaps are applied to a plain 32bpp surface in the
+ * order a spice client paints them, so the surface holds what a client
+ * would show. The server keeps no such copy: a client that connects
+ * gets a full refresh instead, see display_request_refresh().
+ */
+
+#ifndef WIN_SPICE_SHADOW_H
+#define WIN_SPICE_SHADOW_H
+
+#include <stdint.h>
+#include "region.h"
+#include "moverect.h"
+
+typedef struct ShadowSurface {
+    /// first visible row; with a negative stride it is the last one in memory
+    uint8_t *line_0;
+    int stride;
+    int width;
+    int height;
+} ShadowSurface;
+
+/// @mem holds @height rows of |@stride| bytes, @stride < 0 for bottom-up
+void shadow_init(ShadowSurface *shadow, uint8_t *mem, int width, int height, int stride);
+
+/// copy @rect from @src, which points at the pixel of its top left corner
+void shadow_put(ShadowSurface *shadow, const WinSpiceRect *rect, const uint8_t *src,
+                int src_pitch);
+void shadow_fill(ShadowSurface *shadow, const WinSpiceRect *rect, uint32_t color);
+void shadow_move(ShadowSurface *shadow, const WinSpiceMove *move);
+
+#endif  /* WIN_SPICE_SHADOW_H */
@@ -0,0 +1,160 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * batch_plan() on fixed rect sets: where the grouping threshold lies,
+ * how coarseness moves it, and the clip lists of the groups.
+ */
+
+#include <glib.h>
+#include "check.h"
+#include "batch.h"
+
+/// groups must partition the input and have exact bounding boxes
+static void check_plan(const BatchPlan *plan, int n)
+{
+    int g, i, total = 0;
+
+    for (g = 0; g < plan->num_groups; g++) {
+        const BatchGroup *group = &plan->groups[g];
+        WinSpiceRect bbox = plan->members[group->first];
+
+        CHECK(group->count >= 1 && group->count <= BATCH_MAX_MEMBERS);
+        CHECK_EQ(group->first, total);
+        for (i = group->first; i < group->first + group->count; i++) {
+            const WinSpiceRect *r = &plan->members[i];
+            bbox.left = MIN(bbox.left, r->left);
+            bbox.top = MIN(bbox.top, r->top);
+            bbox.right = MAX(bbox.right, r->right);
+            bbox.bottom = MAX(bbox.bottom, r->bottom);
+        }
+        CHECK_EQ(bbox.left, group->bbox.left);
+        CHECK_EQ(bbox.top, group->bbox.top);
+        CHECK_EQ(bbox.right, group->bbox.right);
+        CHECK_EQ(bbox.bottom, group->bbox.bottom);
+        total += group->count;
+    }
+    CHECK_EQ(total, n);
+}
+
+/// two 8x8 rects @gap pixels apart on one row
+static int plan_pair(BatchPlan *plan, int gap)
+{
+    WinSpiceRect rects[2] = {
+        { 0, 0, 8, 8 }, { 8 + gap, 0, 16 + gap, 8 },
+    };
+    int n = batch_plan(plan, rects, 2);
+
+    check_plan(plan, 2);
+    return n;
+}
+
+static void test_threshold(void)
+{
+    BatchPlan plan = { 0 };
+
+    /**
+     * apart: 2 * (4096 + 8 * 8 * 4) = 8704 bytes, together:
+     * 4096 + (16 + gap) * 8 * 4 + 2 * 16, so grouping pays below 127
+     */
+    CHECK_EQ(plan_pair(&plan, 0), 1);
+    CHECK_EQ(plan_pair(&plan, 126), 1);
+    CHECK_EQ(plan.groups[0].count, 2);
+    CHECK_EQ(plan_pair(&plan, 127), 2);
+    CHECK_EQ(plan_pair(&plan, 1000), 2);
+
+    /// a rect larger than BATCH_SMALL_AREA is never grouped, even touching
+    {
+        WinSpiceRect rects[2] = { { 0, 0, 65, 64 }, { 65, 0, 70, 5 } };
+        CHECK_EQ(batch_plan(&plan, rects, 2), 2);
+        check_plan(&plan, 2);
+    }
+
+    CHECK_EQ(batch_plan(&plan, NULL, 0), 0);
+    batch_plan_fini(&plan);
+}
+
+static void test_coarseness(void)
+{
+    WinSpiceRect rects[2] = { { 0, 0, 65, 64 }, { 65, 0, 70, 5 } };
+    BatchPlan plan = { 0 };
+
+    CHECK_EQ(plan_pair(&plan, 200), 2);
+    CHECK_EQ(batch_group_cost(&plan, &rects[1], 1), 4096 + 5 * 5 * 4);
+
+    /// each step doubles the drawable cost and the small area
+    plan.coarseness = 1;
+    CHECK_EQ(batch_group_cost(&plan, &rects[1], 1), 8192 + 5 * 5 * 4);
+    CHECK_EQ(batch_group_cost(&plan, &rects[1], 3), 8192 + 5 * 5 * 4 + 3 * BATCH_CLIP_COST);
+    CHECK_EQ(plan_pair(&plan, 200), 1);
+    CHECK_EQ(plan_pair(&plan, 254), 1);
+    CHECK_EQ(plan_pair(&plan, 255), 2);
+    CHECK_EQ(batch_plan(&plan, rects, 2), 1);
+    check_plan(&plan, 2);
+
+    plan.coarseness = 3;
+    CHECK_EQ(plan_pair(&plan, 1000), 1);
+    batch_plan_fini(&plan);
+}
+
+static void test_clip_counts(void)
+{
+    WinSpiceRect rects[80];
+    BatchPlan plan = { 0 };
+    int i;
+
+    /// 40 caret sized rects in a row fill one group and start another
+    for (i = 0; i < 40; i++) {
+        rects[i] = (WinSpiceRect){ i * 4, 0, i * 4 + 2, 16 };
+    }
+    CHECK_EQ(batch_plan(&plan, rects, 40), 2);
+    check_plan(&plan, 40);
+    CHECK_EQ(plan.groups[0].count, BATCH_MAX_MEMBERS);
+    CHECK_EQ(plan.groups[1].count, 40 - BATCH_MAX_MEMBERS);
+
+    /// two clusters far apart, interleaved in the input
+    for (i = 0; i < 10; i++) {
+        rects[2 * i] = (WinSpiceRect){ i * 10, 0, i * 10 + 4, 4 };
+        rects[2 * i + 1] = (WinSpiceRect){ 1000 + i * 10, 800, 1000 + i * 10 + 4, 804 };
+    }
+    CHECK_EQ(batch_plan(&plan, rects, 20), 2);
+    check_plan(&plan, 20);
+    CHECK_EQ(plan.groups[0].count, 10);
+    CHECK_EQ(plan.groups[1].count, 10);
+    CHECK_EQ(plan.groups[1].bbox.top, 800);
+
+    /// a full screen of large rects stays one drawable each
+    for (i = 0; i < 80; i++) {
+        rects[i] = (WinSpiceRect){ (i % 10) * 100, (i / 10) * 100,
+                                   (i % 10) * 100 + 100, (i / 10) * 100 + 100 };
+    }
+    CHECK_EQ(batch_plan(&plan, rects, 80), 80);
+    check_plan(&plan, 80);
+    batch_plan_fini(&plan);
+}
+
+int main(int argc, char **argv)
+{
+    test_threshold();
+    test_coarseness();
+    test_clip_counts();
+    printf("batch: ok\n");
+    return 0;
+}
@@ -0,0 +1,263 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * CpuBudget on synthetic clocks: no budget means no shedding, usage over
+ * the budget steps up at most once a second, the step's cost is learned
+ * once it settled and a step is given back after four calm samples. And
+ * the capture loop's view of it: a governor and a batch plan fed with
+ * synthetic frames on a fake clock, shedding the way session.c does.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "batch.h"
+#include "cpubudget.h"
+#include "governor.h"
+#include "synthsrc.h"
+
+#define BUDGET  50
+
+#define CHECK_NEAR(value, expected) CHECK(fabs((value) - (expected)) < 0.01)
+
+typedef struct Clocks {
+    uint64_t now;
+    uint64_t capture;
+    uint64_t worker;
+} Clocks;
+
+/// one CPU_BUDGET_INTERVAL in which the threads used these percents of a core
+static bool feed(CpuBudget *cb, Clocks *clocks, int capture, int worker)
+{
+    clocks->now += CPU_BUDGET_INTERVAL;
+    clocks->capture += CPU_BUDGET_INTERVAL * capture / 100;
+    clocks->worker += CPU_BUDGET_INTERVAL * worker / 100;
+    return cpu_budget_update(cb, clocks->now, clocks->capture, clocks->worker);
+}
+
+static void test_no_budget(void)
+{
+    Clocks clocks = { 1000000000ULL, 0, 0 };
+    CpuBudget cb;
+    int i;
+
+    cpu_budget_init(&cb, 0, clocks.now);
+    for (i = 0; i < 20; i++) {
+        CHECK(!feed(&cb, &clocks, 100, 100));
+    }
+    CHECK_EQ(cb.step, 0);
+    CHECK_EQ(cpu_budget_step(&cb)->fps, 0);
+}
+
+static void test_shed_and_give_back(void)
+{
+    Clocks clocks = { 1000000000ULL, 0, 0 };
+    CpuBudget cb;
+    int i;
+
+    cpu_budget_init(&cb, BUDGET, clocks.now);
+
+    /// not due yet
+    CHECK(!cpu_budget_update(&cb, clocks.now + CPU_BUDGET_INTERVAL - 1, 0, 0));
+
+    /// 80%, smoothed from 0: 40 fits, 60 does not
+    CHECK(!feed(&cb, &clocks, 50, 30));
+    CHECK_NEAR(cb.usage, 40);
+    CHECK(feed(&cb, &clocks, 50, 30));
+    CHECK_NEAR(cb.usage, 60);
+    CHECK_EQ(cb.step, 1);
+    CHECK_EQ(cpu_budget_step(&cb)->fps, 60);
+    CHECK_NEAR(cb.usage_before, 60);
+
+    /// still over, but a step needs a second to show
+    CHECK(!feed(&cb, &clocks, 50, 30));
+    CHECK_EQ(cb.step, 1);
+
+    /// the step brought usage down to 30%: 50 once settled, a cost of 1.2
+    CHECK(!feed(&cb, &clocks, 20, 10));
+    CHECK_EQ(cb.step, 1);
+    CHECK_NEAR(cb.usage, 50);
+    CHECK_NEAR(cb.cost[0], 1.2);
+    CHECK(cb.usage_before == 0);
+    CHECK_EQ(cb.calm, 0);
+
+    /// 10% left: usage * cost must stay under 45 four times in a row
+    CHECK(!feed(&cb, &clocks, 5, 5));
+    CHECK_NEAR(cb.usage, 30);
+    CHECK_EQ(cb.calm, 1);
+    CHECK(!feed(&cb, &clocks, 5, 5));
+    CHECK_EQ(cb.calm, 2);
+    /// a busy sample starts the count over
+    CHECK(!feed(&cb, &clocks, 30, 30));
+    CHECK_EQ(cb.calm, 0);
+    for (i = 0; i < 3; i++) {
+        feed(&cb, &clocks, 5, 5);
+    }
+    CHECK_EQ(cb.step, 1);
+    CHECK(cb.calm > 0);
+    for (i = 0; i < 4 && cb.step == 1; i++) {
+        feed(&cb, &clocks, 5, 5);
+    }
+    CHECK_EQ(cb.step, 0);
+    CHECK_EQ(cb.calm, 0);
+    CHECK_EQ(cpu_budget_step(&cb)->fps, 0);
+}
+
+static void test_ladder(void)
+{
+    Clocks clocks = { 1000000000ULL, 0, 0 };
+    CpuBudget cb;
+    int i, changes = 0;
+
+    /// nothing helps: one step up per second until the last one
+    cpu_budget_init(&cb, BUDGET, clocks.now);
+    for (i = 0; i < 40; i++) {
+        changes += feed(&cb, &clocks, 100, 100);
+    }
+    CHECK_EQ(cb.step, CPU_SHED_STEPS - 1);
+    CHECK_EQ(changes, CPU_SHED_STEPS - 1);
+    /// a step that saved nothing is learned as a cost of 1, never less
+    for (i = 0; i < CPU_SHED_STEPS - 1; i++) {
+        CHECK(cb.cost[i] >= 1.0);
+    }
+    CHECK_EQ(cpu_budget_step(&cb)->fps, 10);
+    CHECK_EQ(cpu_budget_step(&cb)->compression, COMPRESS_LAN);
+}
+
+static void test_clock_reset(void)
+{
+    Clocks clocks = { 1000000000ULL, 0, 0 };
+    CpuBudget cb;
+
+    cpu_budget_init(&cb, BUDGET, clocks.now);
+    feed(&cb, &clocks, 40, 0);
+    CHECK_NEAR(cb.usage, 20);
+
+    /// the worker clock was set again and reads below the last sample
+    clocks.now += CPU_BUDGET_INTERVAL;
+    clocks.capture += CPU_BUDGET_INTERVAL * 40 / 100;
+    CHECK(!cpu_budget_update(&cb, clocks.now, clocks.capture, 0));
+    CHECK_NEAR(cb.usage, 30);
+}
+
+/// the capture loop of session.c, with the cpu cost of a frame made up
+typedef struct Pipeline {
+    Clocks clocks;
+    CpuBudget cb;
+    FpsGovernor gov;
+    BatchPlan batch;
+    CompressLevel compress_cap;
+    SynthSource *src;
+} Pipeline;
+
+/// run for @duration ns, each frame costing @ns_per_pixel of its damage
+static void run(Pipeline *p, uint64_t duration, uint64_t ns_per_pixel)
+{
+    uint64_t end = p->clocks.now + duration;
+    int i;
+
+    while (p->clocks.now < end) {
+        uint64_t area = 0;
+
+        synth_source_step(p->src);
+        /// the spice side keeps up, only the cpu budget holds the rate back
+        governor_update(&p->gov, p->clocks.now, 0, 64, 0, 1 << 20);
+        batch_plan(&p->batch, p->src->dirty, p->src->num_dirty);
+        for (i = 0; i < p->src->num_dirty; i++) {
+            area += wrect_area(&p->src->dirty[i]);
+        }
+
+        /// governor_wait(), then cpu_budget_feed()
+        p->clocks.now += p->gov.interval;
+        p->clocks.capture += area * ns_per_pixel / 2;
+        p->clocks.worker += area * ns_per_pixel / 2;
+        if (cpu_budget_update(&p->cb, p->clocks.now, p->clocks.capture, p->clocks.worker)) {
+            const CpuShedStep *step = cpu_budget_step(&p->cb);
+
+            governor_set_cap(&p->gov, p->clocks.now, step->fps);
+            p->batch.coarseness = step->coarseness;
+            p->compress_cap = step->compression;
+        }
+        if (p->gov.cap_fps) {
+            CHECK(p->gov.fps <= p->gov.cap_fps);
+        }
+    }
+}
+
+static void test_pipeline(void)
+{
+    Pipeline p;
+    uint32_t fps;
+
+    memset(&p, 0, sizeof(p));
+    p.clocks.now = 1000000000ULL;
+    p.src = synth_source_new(640, 480);
+    cpu_budget_init(&p.cb, BUDGET, p.clocks.now);
+    governor_init(&p.gov, GOVERNOR_CEILING_MAX);
+    p.compress_cap = cpu_budget_step(&p.cb)->compression;
+
+    /// cheap frames: the governor climbs to the ceiling
+    run(&p, 10000000000ULL, 0);
+    CHECK_EQ(p.gov.fps, GOVERNOR_CEILING_MAX);
+    CHECK_EQ(p.cb.step, 0);
+
+    /// the bar now costs 6 ms a frame, too much at 144 fps
+    fps = p.gov.fps;
+    run(&p, 3000000000ULL, 100);
+    CHECK_EQ(p.cb.step, 1);
+    CHECK(p.gov.fps < fps);
+    CHECK_EQ(p.gov.cap_fps, cpu_budget_step(&p.cb)->fps);
+    CHECK_EQ(p.batch.coarseness, 0);
+    CHECK_EQ(p.compress_cap, COMPRESS_GLZ);
+
+    /// and 12 ms: the next step batches coarser, and holds still once it fits
+    fps = p.gov.fps;
+    run(&p, 5000000000ULL, 200);
+    CHECK_EQ(p.cb.step, 2);
+    CHECK(p.gov.fps < fps);
+    CHECK_EQ(p.batch.coarseness, cpu_budget_step(&p.cb)->coarseness);
+    CHECK(p.batch.coarseness > 0);
+    CHECK(p.compress_cap < COMPRESS_WAN);
+
+    /// cheap again: every step is given back and the governor climbs again
+    run(&p, 20000000000ULL, 0);
+    CHECK_EQ(p.cb.step, 0);
+    CHECK_EQ(p.gov.cap_fps, 0);
+    CHECK_EQ(p.gov.fps, GOVERNOR_CEILING_MAX);
+    CHECK_EQ(p.batch.coarseness, 0);
+    CHECK_EQ(p.compress_cap, COMPRESS_WAN);
+
+    batch_plan_fini(&p.batch);
+    governor_fini(&p.gov);
+    synth_source_destroy(p.src);
+}
+
+int main(void)
+{
+    test_no_budget();
+    test_shed_and_give_back();
+    test_ladder();
+    test_clock_reset();
+    test_pipeline();
+
+    printf("cpubudget: ok\n");
+    return 0;
+}
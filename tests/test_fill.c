@@ -0,0 +1,274 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * fill_detect() on synthetic frames: textured backgrounds with flat areas
+ * painted over them, on a screen whose size is not a multiple of the
+ * block size.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "fill.h"
+
+#define W           200
+#define H           150
+#define B           FILL_BLOCK_SIZE
+#define ITERATIONS  200
+
+static uint32_t frame[W * H];
+static int8_t cover[W * H];
+
+static void texture(uint32_t salt)
+{
+    int i;
+
+    for (i = 0; i < W * H; i++) {
+        frame[i] = i * 2654435761u ^ salt;
+    }
+}
+
+static void paint(const WinSpiceRect *r, uint32_t color)
+{
+    int x, y;
+
+    for (y = r->top; y < r->bottom; y++) {
+        for (x = r->left; x < r->right; x++) {
+            frame[y * W + x] = color;
+        }
+    }
+}
+
+static int detect(WinSpiceRegion *damage, FillList *fills)
+{
+    fill_list_clear(fills);
+    return fill_detect((const uint8_t *)frame, W * 4, damage, fills);
+}
+
+static void check_rect(const WinSpiceRect *r, int left, int top, int right, int bottom)
+{
+    CHECK_EQ(r->left, left);
+    CHECK_EQ(r->top, top);
+    CHECK_EQ(r->right, right);
+    CHECK_EQ(r->bottom, bottom);
+}
+
+static void add_cover(const WinSpiceRect *r, int delta)
+{
+    int x, y;
+
+    for (y = r->top; y < r->bottom; y++) {
+        for (x = r->left; x < r->right; x++) {
+            cover[y * W + x] += delta;
+        }
+    }
+}
+
+/// each fill is flat, and fills plus what is left of @damage tile @before exactly
+static void check_cover(const WinSpiceRegion *before, const WinSpiceRegion *damage,
+                        const FillList *fills)
+{
+    const WinSpiceRect *rects;
+    int i, n, x, y;
+
+    memset(cover, 0, sizeof(cover));
+    for (i = 0; i < fills->num_fills; i++) {
+        const WinSpiceFill *f = &fills->fills[i];
+        for (y = f->rect.top; y < f->rect.bottom; y++) {
+            for (x = f->rect.left; x < f->rect.right; x++) {
+                CHECK_EQ(frame[y * W + x], f->color);
+            }
+        }
+        add_cover(&f->rect, 1);
+    }
+    rects = wregion_rects(damage, &n);
+    for (i = 0; i < n; i++) {
+        add_cover(&rects[i], 1);
+    }
+    rects = wregion_rects(before, &n);
+    for (i = 0; i < n; i++) {
+        add_cover(&rects[i], -1);
+    }
+    for (i = 0; i < W * H; i++) {
+        CHECK_EQ(cover[i], 0);
+    }
+}
+
+static void test_flat_rect(void)
+{
+    WinSpiceRect r = { 10, 20, 43, 27 };
+    WinSpiceRegion damage;
+    FillList fills = { 0 };
+
+    wregion_init(&damage);
+    texture(1);
+    paint(&r, 0xff123456);
+
+    /// a dirty rect flat as a whole is a fill however small it is
+    wregion_union_rect(&damage, &damage, &r);
+    CHECK_EQ(detect(&damage, &fills), 1);
+    check_rect(&fills.fills[0].rect, 10, 20, 43, 27);
+    CHECK_EQ(fills.fills[0].color, 0xff123456);
+    CHECK(wregion_is_empty(&damage));
+
+    /// one textured pixel and it stays a bitmap
+    frame[22 * W + 30] ^= 1;
+    wregion_union_rect(&damage, &damage, &r);
+    CHECK_EQ(detect(&damage, &fills), 0);
+    CHECK_EQ(wregion_area(&damage), wrect_area(&r));
+
+    wregion_fini(&damage);
+    fill_list_fini(&fills);
+}
+
+static void test_l_shape(void)
+{
+    WinSpiceRect all = { 0, 0, 8 * B, 8 * B };
+    WinSpiceRegion damage, before;
+    FillList fills = { 0 };
+
+    wregion_init(&damage);
+    wregion_init(&before);
+    texture(2);
+
+    /// a left bar and a bottom bar of one color, meeting in the corner
+    paint(&(WinSpiceRect){ 0, 0, 4 * B, 8 * B }, 0xff00ff00);
+    paint(&(WinSpiceRect){ 0, 6 * B, 8 * B, 8 * B }, 0xff00ff00);
+    wregion_union_rect(&damage, &damage, &all);
+    wregion_copy(&before, &damage);
+
+    CHECK_EQ(detect(&damage, &fills), 2);
+    check_rect(&fills.fills[0].rect, 0, 0, 4 * B, 6 * B);
+    check_rect(&fills.fills[1].rect, 0, 6 * B, 8 * B, 8 * B);
+    CHECK_EQ(damage.num_rects, 1);
+    check_rect(&damage.rects[0], 4 * B, 0, 8 * B, 6 * B);
+    check_cover(&before, &damage, &fills);
+
+    wregion_fini(&before);
+    wregion_fini(&damage);
+    fill_list_fini(&fills);
+}
+
+static void test_small_runs(void)
+{
+    WinSpiceRect all = { 0, 0, 8 * B, 8 * B };
+    WinSpiceRegion damage;
+    FillList fills = { 0 };
+
+    wregion_init(&damage);
+    texture(3);
+
+    /// flat, but each under FILL_MIN_AREA: splitting them would only fragment
+    paint(&(WinSpiceRect){ 0, 0, 3 * B, 3 * B }, 0xff0000ff);
+    paint(&(WinSpiceRect){ 4 * B, 0, 5 * B, 8 * B }, 0xff0000ff);
+    paint(&(WinSpiceRect){ 0, 7 * B, 3 * B, 8 * B }, 0xff0000ff);
+    CHECK(3 * B * 3 * B < FILL_MIN_AREA && B * 8 * B < FILL_MIN_AREA);
+    wregion_union_rect(&damage, &damage, &all);
+    CHECK_EQ(detect(&damage, &fills), 0);
+    CHECK_EQ(damage.num_rects, 1);
+    CHECK_EQ(wregion_area(&damage), wrect_area(&all));
+
+    /// flat blocks off the block grid are not seen either
+    texture(3);
+    paint(&(WinSpiceRect){ 8, 8, 8 + 5 * B, 8 + 5 * B }, 0xff0000ff);
+    CHECK_EQ(detect(&damage, &fills), 1);
+    check_rect(&fills.fills[0].rect, B, B, 5 * B, 5 * B);
+
+    wregion_fini(&damage);
+    fill_list_fini(&fills);
+}
+
+static void test_screen_edge(void)
+{
+    WinSpiceRect all = { 0, 0, W, H };
+    WinSpiceRect corner = { 150, 100, W, H };
+    WinSpiceRegion damage, before;
+    FillList fills = { 0 };
+
+    wregion_init(&damage);
+    wregion_init(&before);
+
+    /// a flat dirty rect in the bottom right corner is a fill as a whole
+    texture(4);
+    paint(&corner, 0xffabcdef);
+    wregion_union_rect(&damage, &damage, &corner);
+    CHECK_EQ(detect(&damage, &fills), 1);
+    check_rect(&fills.fills[0].rect, 150, 100, W, H);
+    CHECK(wregion_is_empty(&damage));
+
+    /// inside a larger rect the partial blocks at the edge stay bitmaps
+    paint(&(WinSpiceRect){ 100, 0, W, H }, 0xffabcdef);
+    wregion_union_rect(&damage, &damage, &all);
+    wregion_copy(&before, &damage);
+    CHECK_EQ(detect(&damage, &fills), 1);
+    check_rect(&fills.fills[0].rect, 7 * B, 0, (W / B) * B, (H / B) * B);
+    check_cover(&before, &damage, &fills);
+
+    wregion_fini(&before);
+    wregion_fini(&damage);
+    fill_list_fini(&fills);
+}
+
+/// flat patches and damage of random shapes, the fills must never lose or add pixels
+static void test_random(uint32_t *seed)
+{
+    WinSpiceRegion damage, before;
+    FillList fills = { 0 };
+    int i, j;
+
+    wregion_init(&damage);
+    wregion_init(&before);
+    for (i = 0; i < ITERATIONS; i++) {
+        texture(check_rand(seed));
+        for (j = check_rand(seed) % 6; j > 0; j--) {
+            int32_t x = check_rand(seed) % W, y = check_rand(seed) % H;
+            int32_t w = check_rand(seed) % 150, h = check_rand(seed) % 150;
+            paint(&(WinSpiceRect){ x, y, MIN(x + w, W), MIN(y + h, H) },
+                  0xff000000 | (check_rand(seed) % 3));
+        }
+        wregion_clear(&damage);
+        for (j = 1 + check_rand(seed) % 8; j > 0; j--) {
+            int32_t x = check_rand(seed) % W, y = check_rand(seed) % H;
+            int32_t w = check_rand(seed) % W, h = check_rand(seed) % H;
+            wregion_union_rect(&damage, &damage,
+                               &(WinSpiceRect){ x, y, MIN(x + w, W), MIN(y + h, H) });
+        }
+        wregion_copy(&before, &damage);
+        detect(&damage, &fills);
+        check_cover(&before, &damage, &fills);
+    }
+
+    wregion_fini(&before);
+    wregion_fini(&damage);
+    fill_list_fini(&fills);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 0x5eed5eed;
+
+    test_flat_rect();
+    test_l_shape();
+    test_small_runs();
+    test_screen_edge();
+    test_random(&seed);
+    printf("fill: ok\n");
+    return 0;
+}
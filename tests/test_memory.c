@@ -0,0 +1,110 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Call site statistics of w_malloc(): more threads than shards, first
+ * one after the other so that shards must be given back, then all at
+ * once so that several share the overflow shard. No count may be lost.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "memory.h"
+
+#define SEQUENTIAL_THREADS  (4 * MEMORY_MAX_SHARDS)
+#define PARALLEL_THREADS    (MEMORY_MAX_SHARDS + 8)
+#define THREAD_ALLOCS       20000
+#define THREAD_LIVE         8
+
+static int alloc_line;
+
+static void *alloc_thread(void *arg)
+{
+    void *live[THREAD_LIVE] = { NULL };
+    int i;
+
+    for (i = 0; i < THREAD_ALLOCS; i++) {
+        w_free(live[i % THREAD_LIVE]);
+        alloc_line = __LINE__ + 1;
+        live[i % THREAD_LIVE] = w_malloc(16);
+    }
+    for (i = 0; i < THREAD_LIVE; i++) {
+        w_free(live[i]);
+    }
+    return NULL;
+}
+
+static void run_threads(int n, bool parallel)
+{
+    pthread_t threads[PARALLEL_THREADS];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        pthread_t *thread = &threads[parallel ? i : 0];
+        CHECK(pthread_create(thread, NULL, alloc_thread, NULL) == 0);
+        if (!parallel) {
+            pthread_join(*thread, NULL);
+        }
+    }
+    for (i = 0; parallel && i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static const MemorySiteStats *find_site(MemorySiteStats *sites, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(sites[i].file, __FILE__) == 0 && sites[i].line == alloc_line) {
+            return &sites[i];
+        }
+    }
+    return NULL;
+}
+
+static void check_site(uint64_t allocs, int max_threads)
+{
+    static MemorySiteStats sites[MEMORY_MAX_SITES];
+    const MemorySiteStats *site;
+
+    site = find_site(sites, memory_snapshot(sites, MEMORY_MAX_SITES));
+    CHECK(site != NULL);
+    CHECK_EQ(site->allocs, allocs);
+    CHECK_EQ(site->live_count, 0);
+    CHECK_EQ(site->live_bytes, 0);
+    /// at least one thread's worth, at most every thread's at once
+    CHECK(site->high_water >= THREAD_LIVE * 16);
+    CHECK(site->high_water <= (uint64_t)max_threads * THREAD_LIVE * 16);
+}
+
+int main(void)
+{
+    run_threads(SEQUENTIAL_THREADS, false);
+    check_site((uint64_t)SEQUENTIAL_THREADS * THREAD_ALLOCS, SEQUENTIAL_THREADS);
+
+    run_threads(PARALLEL_THREADS, true);
+    check_site((uint64_t)(SEQUENTIAL_THREADS + PARALLEL_THREADS) * THREAD_ALLOCS,
+               SEQUENTIAL_THREADS + PARALLEL_THREADS);
+
+    printf("memory: ok\n");
+    return 0;
+}
@@ -0,0 +1,242 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Move rect filtering and shadow_move() against a per-pixel reference:
+ * the filtered list applied to a surface must leave the same pixels as
+ * every move applied in order, once the dirty region is repainted.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "moverect.h"
+#include "shadow.h"
+
+#define W           48
+#define H           40
+#define ITERATIONS  2000
+
+static const WinSpiceRect bounds = { 0, 0, W, H };
+
+/// one move on a plain top-down W x H surface, pixel by pixel
+static void reference_move(uint32_t *pixels, const WinSpiceMove *move)
+{
+    uint32_t snapshot[W * H];
+    int x, y;
+
+    memcpy(snapshot, pixels, sizeof(snapshot));
+    for (y = move->dest.top; y < move->dest.bottom; y++) {
+        for (x = move->dest.left; x < move->dest.right; x++) {
+            int sx = move->src_x + x - move->dest.left;
+            int sy = move->src_y + y - move->dest.top;
+            if (x >= 0 && x < W && y >= 0 && y < H && sx >= 0 && sx < W && sy >= 0 && sy < H) {
+                pixels[y * W + x] = snapshot[sy * W + sx];
+            }
+        }
+    }
+}
+
+static void fill_pattern(uint32_t *pixels, uint32_t salt)
+{
+    int i;
+
+    for (i = 0; i < W * H; i++) {
+        pixels[i] = i * 2654435761u ^ salt;
+    }
+}
+
+/// the surface as top-down rows, whatever its stride
+static void shadow_read(const ShadowSurface *shadow, uint32_t *pixels)
+{
+    int y;
+
+    for (y = 0; y < H; y++) {
+        memcpy(pixels + y * W, shadow->line_0 + (ptrdiff_t)y * shadow->stride, W * 4);
+    }
+}
+
+static void shadow_write(ShadowSurface *shadow, const uint32_t *pixels)
+{
+    WinSpiceRect all = bounds;
+
+    shadow_put(shadow, &all, (const uint8_t *)pixels, W * 4);
+}
+
+static void check_move(ShadowSurface *shadow, const WinSpiceMove *move)
+{
+    uint32_t expected[W * H], got[W * H];
+    WinSpiceMove clipped = *move;
+
+    fill_pattern(expected, move->src_x);
+    shadow_write(shadow, expected);
+    reference_move(expected, move);
+    CHECK(moverect_filter(&clipped, 1, &bounds, NULL) <= 1);
+    shadow_move(shadow, &clipped);
+    shadow_read(shadow, got);
+    CHECK(memcmp(got, expected, sizeof(got)) == 0);
+}
+
+static void test_shadow_move(void)
+{
+    static uint32_t mem[W * H];
+    ShadowSurface down, up;
+    int dx, dy;
+
+    shadow_init(&down, (uint8_t *)mem, W, H, W * 4);
+    shadow_init(&up, (uint8_t *)mem, W, H, -W * 4);
+
+    /// overlapping scrolls in both directions, also diagonal
+    for (dy = -3; dy <= 3; dy++) {
+        for (dx = -3; dx <= 3; dx++) {
+            WinSpiceMove move = {
+                .dest = { 5, 5, 40, 35 }, .src_x = 5 + dx, .src_y = 5 + dy,
+            };
+            check_move(&down, &move);
+            check_move(&up, &move);
+        }
+    }
+}
+
+static void test_clip(void)
+{
+    WinSpiceMove moves[4] = {
+        /// destination hangs off the right, source off the top
+        { .dest = { 40, 2, 60, 12 }, .src_x = 30, .src_y = -4 },
+        /// entirely outside
+        { .dest = { 60, 0, 70, 10 }, .src_x = 0, .src_y = 0 },
+        /// onto itself
+        { .dest = { 0, 0, 10, 10 }, .src_x = 0, .src_y = 0 },
+        /// source outside once clipped
+        { .dest = { 0, 0, 10, 10 }, .src_x = W, .src_y = 0 },
+    };
+    int n;
+
+    n = moverect_filter(moves, 4, &bounds, NULL);
+    CHECK_EQ(n, 1);
+    CHECK_EQ(moves[0].dest.left, 40);
+    CHECK_EQ(moves[0].dest.top, 6);
+    CHECK_EQ(moves[0].dest.right, W);
+    CHECK_EQ(moves[0].dest.bottom, 12);
+    CHECK_EQ(moves[0].src_x, 30);
+    CHECK_EQ(moves[0].src_y, 0);
+}
+
+static void test_dirty_order(void)
+{
+    WinSpiceRect r = { 0, 0, 20, 20 };
+    WinSpiceRegion dirty;
+    WinSpiceMove moves[3] = {
+        /// repainted, but the next move reads from it
+        { .dest = { 0, 0, 10, 10 }, .src_x = 0, .src_y = 10 },
+        { .dest = { 30, 0, 40, 10 }, .src_x = 0, .src_y = 0 },
+        /// repainted and read by nobody
+        { .dest = { 10, 10, 20, 20 }, .src_x = 10, .src_y = 0 },
+    };
+    int n;
+
+    wregion_init_rect(&dirty, &r);
+    n = moverect_filter(moves, 3, &bounds, &dirty);
+    CHECK_EQ(n, 2);
+    CHECK_EQ(moves[0].dest.left, 0);
+    CHECK_EQ(moves[0].src_y, 10);
+    CHECK_EQ(moves[1].dest.left, 30);
+    wregion_fini(&dirty);
+}
+
+static void random_rect(uint32_t *seed, WinSpiceRect *r, int margin)
+{
+    r->left = (int)(check_rand(seed) % (W + 2 * margin)) - margin;
+    r->top = (int)(check_rand(seed) % (H + 2 * margin)) - margin;
+    r->right = r->left + 1 + check_rand(seed) % (W / 2);
+    r->bottom = r->top + 1 + check_rand(seed) % (H / 2);
+}
+
+/// filtering must not change what the client ends up with
+static void test_random(uint32_t *seed)
+{
+    static uint32_t mem[W * H];
+    uint32_t all[W * H], filtered[W * H], frame[W * H];
+    WinSpiceMove moves[6], kept[6];
+    WinSpiceRect rects[3];
+    WinSpiceRegion dirty;
+    ShadowSurface shadow;
+    const WinSpiceRect *r;
+    int i, n, num_moves = 1 + check_rand(seed) % 6, num_dirty = check_rand(seed) % 3;
+
+    for (i = 0; i < num_moves; i++) {
+        random_rect(seed, &moves[i].dest, 8);
+        moves[i].src_x = moves[i].dest.left + (int)(check_rand(seed) % 17) - 8;
+        moves[i].src_y = moves[i].dest.top + (int)(check_rand(seed) % 17) - 8;
+    }
+    for (i = 0; i < num_dirty; i++) {
+        random_rect(seed, &rects[i], 0);
+    }
+    wregion_init_rects(&dirty, rects, num_dirty);
+    wregion_intersect_rect(&dirty, &dirty, &bounds);
+
+    fill_pattern(all, 0);
+    for (i = 0; i < num_moves; i++) {
+        reference_move(all, &moves[i]);
+    }
+
+    memcpy(kept, moves, sizeof(moves));
+    n = moverect_filter(kept, num_moves, &bounds, &dirty);
+    CHECK(n <= num_moves);
+    shadow_init(&shadow, (uint8_t *)mem, W, H, W * 4);
+    fill_pattern(filtered, 0);
+    shadow_write(&shadow, filtered);
+    for (i = 0; i < n; i++) {
+        CHECK(!wrect_is_empty(&kept[i].dest));
+        CHECK(kept[i].dest.left >= 0 && kept[i].dest.right <= W);
+        CHECK(kept[i].dest.top >= 0 && kept[i].dest.bottom <= H);
+        shadow_move(&shadow, &kept[i]);
+    }
+    shadow_read(&shadow, filtered);
+
+    /// the dirty region is repainted from the new frame after the moves
+    fill_pattern(frame, 0xdeadbeef);
+    r = wregion_rects(&dirty, &n);
+    for (i = 0; i < n; i++) {
+        int x, y;
+        for (y = r[i].top; y < r[i].bottom; y++) {
+            for (x = r[i].left; x < r[i].right; x++) {
+                all[y * W + x] = filtered[y * W + x] = frame[y * W + x];
+            }
+        }
+    }
+    CHECK(memcmp(all, filtered, sizeof(all)) == 0);
+    wregion_fini(&dirty);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 0x9e3779b9;
+    int i;
+
+    test_clip();
+    test_dirty_order();
+    test_shadow_move();
+    for (i = 0; i < ITERATIONS; i++) {
+        test_random(&seed);
+    }
+    printf("moverect: %d random iterations ok\n", ITERATIONS);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Palette conversion round trips: bitmaps of 4 and 8 bit palettes are
+ * converted, decoded back through their palette and compared with the
+ * source, at odd and even widths and with a padded source pitch.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "palette.h"
+
+#define MAX_W       37
+#define MAX_H       9
+/// source rows are padded, like the rows of a captured frame
+#define PITCH       ((MAX_W + 3) * 4)
+
+static uint8_t source[MAX_H * PITCH];
+static uint8_t indexed[MAX_H * MAX_W];
+
+/// @num_colors distinct colors in random places, with random alpha bytes
+static void random_bitmap(uint32_t *seed, int width, int height, int num_colors)
+{
+    int x, y;
+
+    memset(source, 0xee, sizeof(source));
+    for (y = 0; y < height; y++) {
+        uint32_t *row = (uint32_t *)(source + y * PITCH);
+        for (x = 0; x < width; x++) {
+            uint32_t i = check_rand(seed) % num_colors;
+            row[x] = (check_rand(seed) << 24) | (i * 0x010203u + 0x102030u);
+        }
+    }
+}
+
+static int decode(const PaletteColors *palette, int stride, int x, int y)
+{
+    const uint8_t *row = indexed + y * stride;
+
+    if (palette->bits == 4) {
+        /// big endian nibbles: the left pixel is the high one
+        return x & 1 ? row[x >> 1] & 0x0f : row[x >> 1] >> 4;
+    }
+    return row[x];
+}
+
+static void check_round_trip(uint32_t *seed, int width, int height, int num_colors)
+{
+    PaletteColors palette;
+    int bits, stride, x, y;
+
+    random_bitmap(seed, width, height, num_colors);
+    CHECK(palette_collect(source, PITCH, width, height, &palette));
+    CHECK(palette.num_colors <= num_colors);
+    bits = palette.num_colors <= 16 ? 4 : 8;
+    CHECK_EQ(palette.bits, bits);
+    for (x = 1; x < palette.num_colors; x++) {
+        CHECK(palette.colors[x - 1] < palette.colors[x]);
+    }
+
+    stride = palette_stride(&palette, width);
+    CHECK_EQ(stride, bits == 4 ? (width + 1) / 2 : width);
+    memset(indexed, 0xff, sizeof(indexed));
+    palette_convert(&palette, source, PITCH, width, height, indexed, stride);
+
+    for (y = 0; y < height; y++) {
+        const uint32_t *row = (const uint32_t *)(source + y * PITCH);
+        for (x = 0; x < width; x++) {
+            int index = decode(&palette, stride, x, y);
+            CHECK(index < palette.num_colors);
+            CHECK_EQ(palette.colors[index], row[x] & 0x00ffffff);
+        }
+        /// the unused low nibble of an odd row is not left over garbage
+        if (bits == 4 && width & 1) {
+            CHECK_EQ(indexed[y * stride + stride - 1] & 0x0f, 0);
+        }
+    }
+}
+
+static void test_round_trip(uint32_t *seed)
+{
+    static const int widths[] = { 1, 3, 4, 16, MAX_W };
+    int i, height;
+
+    for (i = 0; i < G_N_ELEMENTS(widths); i++) {
+        for (height = 1; height <= MAX_H; height += 4) {
+            check_round_trip(seed, widths[i], height, 2);
+            check_round_trip(seed, widths[i], height, 16);
+            check_round_trip(seed, widths[i], height, PALETTE_MAX_COLORS);
+        }
+    }
+}
+
+static void test_color_count(void)
+{
+    PaletteColors palette;
+    uint32_t row[PALETTE_MAX_COLORS + 1];
+    int i;
+
+    /// 16 colors fit 4 bits, the 17th needs 8
+    for (i = 0; i <= PALETTE_MAX_COLORS; i++) {
+        row[i] = 0xff000000 | (PALETTE_MAX_COLORS - i) * 0x010101u;
+    }
+    CHECK(palette_collect((const uint8_t *)row, sizeof(row), 16, 1, &palette));
+    CHECK_EQ(palette.num_colors, 16);
+    CHECK_EQ(palette.bits, 4);
+    CHECK(palette_collect((const uint8_t *)row, sizeof(row), 17, 1, &palette));
+    CHECK_EQ(palette.num_colors, 17);
+    CHECK_EQ(palette.bits, 8);
+
+    /// 256 is the most an 8 bit palette holds
+    CHECK(palette_collect((const uint8_t *)row, sizeof(row), PALETTE_MAX_COLORS, 1, &palette));
+    CHECK_EQ(palette.num_colors, PALETTE_MAX_COLORS);
+    CHECK_EQ(palette.bits, 8);
+    CHECK(!palette_collect((const uint8_t *)row, sizeof(row), PALETTE_MAX_COLORS + 1, 1,
+                           &palette));
+
+    /// alpha is not a color of its own
+    for (i = 0; i < 32; i++) {
+        row[i] = (i << 24) | 0x123456;
+    }
+    CHECK(palette_collect((const uint8_t *)row, sizeof(row), 32, 1, &palette));
+    CHECK_EQ(palette.num_colors, 1);
+    CHECK_EQ(palette.colors[0], 0x123456);
+}
+
+static void test_cache(void)
+{
+    PaletteCache cache;
+    PaletteColors a = { { 1, 2, 3 }, 3, 4 };
+    PaletteColors b = { { 1, 2, 4 }, 3, 4 };
+    uint64_t id;
+
+    /// the same color set keeps its id, another one gets a new id
+    palette_cache_init(&cache);
+    id = palette_cache_unique(&cache, &a);
+    CHECK(id != 0);
+    CHECK(palette_cache_unique(&cache, &b) != id);
+    CHECK_EQ(palette_cache_unique(&cache, &a), id);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 0x9a1e77e5;
+
+    test_round_trip(&seed);
+    test_color_count();
+    test_cache();
+    printf("palette: ok\n");
+    return 0;
+}
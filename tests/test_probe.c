@@ -0,0 +1,144 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Latency probe without Windows: markers decode from any 32 bit frame,
+ * also after lossy noise and on top of the synthetic desktop, and only
+ * intact markers decode. The synthetic pointer follows tablet input.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "probe.h"
+#include "synthsrc.h"
+
+#define FRAME_WIDTH     320
+#define FRAME_HEIGHT    64
+#define NOISE           48
+
+/// +-NOISE on every channel, about what a lossy codec does to flat cells
+static void add_noise(uint8_t *pixels, int pitch, uint32_t *rng)
+{
+    int x, y, c;
+
+    for (y = 0; y < PROBE_HEIGHT; y++) {
+        for (x = 0; x < PROBE_WIDTH; x++) {
+            uint8_t *p = pixels + y * pitch + x * 4;
+            for (c = 0; c < 3; c++) {
+                int v = p[c] + (int)(check_rand(rng) % (2 * NOISE + 1)) - NOISE;
+                p[c] = CLAMP(v, 0, 255);
+            }
+        }
+    }
+}
+
+static void test_roundtrip(void)
+{
+    static const uint32_t seqs[] = { 0, 1, 0x80000000, 0xFFFFFFFF, 0x12345678 };
+    int pitch = FRAME_WIDTH * 4 + 12;
+    uint8_t *frame = g_malloc0(pitch * FRAME_HEIGHT);
+    uint8_t *marker = frame + 5 * pitch + 7 * 4;
+    uint32_t rng = 1, seq;
+    int i, y;
+
+    for (i = 0; i < (int)G_N_ELEMENTS(seqs); i++) {
+        probe_paint(marker, pitch, seqs[i]);
+        CHECK(probe_decode(marker, pitch, &seq));
+        CHECK_EQ(seq, seqs[i]);
+
+        add_noise(marker, pitch, &rng);
+        CHECK(probe_decode(marker, pitch, &seq));
+        CHECK_EQ(seq, seqs[i]);
+    }
+
+    /// a flipped bit breaks the parity, bit 0 of the sequence is cell 2
+    probe_paint(marker, pitch, 0x12345678);
+    for (y = 0; y < PROBE_HEIGHT; y++) {
+        memset(marker + y * pitch + 2 * PROBE_CELL * 4, 0xFF, PROBE_CELL * 4);
+    }
+    CHECK(!probe_decode(marker, pitch, &seq));
+
+    /// plain frames have no sync cells
+    memset(frame, 0, pitch * FRAME_HEIGHT);
+    CHECK(!probe_decode(marker, pitch, &seq));
+    memset(frame, 0xFF, pitch * FRAME_HEIGHT);
+    CHECK(!probe_decode(marker, pitch, &seq));
+
+    g_free(frame);
+}
+
+static void test_synthetic(void)
+{
+    SynthSource *src = synth_source_new(FRAME_WIDTH * 2, FRAME_HEIGHT * 2);
+    uint32_t seq;
+    int i, x, y;
+
+    /// painted over the desktop the way the capture thread does it
+    probe_paint(src->pixels, src->pitch, 42);
+    CHECK(probe_decode(src->pixels, src->pitch, &seq));
+    CHECK_EQ(seq, 42);
+
+    /// no pointer until the probe sent tablet input
+    synth_source_step(src);
+    CHECK(!src->pointer_drawn);
+    CHECK(!probe_input_position(&x, &y));
+
+    probe_input_sent(100, 50);
+    synth_source_step(src);
+    CHECK(src->pointer_drawn);
+    CHECK_EQ(src->pointer_x, 100);
+    CHECK_EQ(src->pointer_y, 50);
+    for (i = 0; i < src->num_dirty; i++) {
+        if (src->dirty[i].left == 100 && src->dirty[i].top == 50) {
+            break;
+        }
+    }
+    CHECK(i < src->num_dirty);
+    CHECK_EQ(*(uint32_t *)(src->pixels + 50 * src->pitch + 100 * 4), 0xFFFFFFFF);
+    probe_input_seen(100, 50);
+
+    /// moving the pointer repaints the background where it was
+    probe_input_sent(200, 60);
+    synth_source_step(src);
+    CHECK_EQ(src->pointer_x, 200);
+    CHECK(*(uint32_t *)(src->pixels + 50 * src->pitch + 100 * 4) != 0xFFFFFFFF);
+
+    synth_source_destroy(src);
+}
+
+static void test_marker_due(void)
+{
+    uint32_t seq, next;
+
+    CHECK(probe_marker_due(&seq));
+    /// at most one marker per PROBE_INTERVAL_MS
+    CHECK(!probe_marker_due(&next));
+}
+
+int main(void)
+{
+    test_roundtrip();
+    test_synthetic();
+    test_marker_due();
+
+    printf("probe: ok\n");
+    return 0;
+}
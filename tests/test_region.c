@@ -0,0 +1,379 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Region operations against a brute-force bitmap reference: every region
+ * is painted into a small grid and compared pixel by pixel with the same
+ * operation done on plain bitmaps, then checked for banded order.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "region.h"
+
+#define GRID        40
+#define ITERATIONS  2000
+
+typedef uint8_t Bitmap[GRID][GRID];
+
+static void random_rect(uint32_t *seed, WinSpiceRect *r)
+{
+    /// allow empty and edge-touching rects, they are the interesting cases
+    int32_t x1 = check_rand(seed) % (GRID + 1), x2 = check_rand(seed) % (GRID + 1);
+    int32_t y1 = check_rand(seed) % (GRID + 1), y2 = check_rand(seed) % (GRID + 1);
+
+    r->left = MIN(x1, x2);
+    r->right = MAX(x1, x2);
+    r->top = MIN(y1, y2);
+    r->bottom = MAX(y1, y2);
+}
+
+static void bitmap_fill(Bitmap bm, const WinSpiceRect *r)
+{
+    int x, y;
+
+    for (y = r->top; y < r->bottom; y++) {
+        for (x = r->left; x < r->right; x++) {
+            bm[y][x] = 1;
+        }
+    }
+}
+
+static void bitmap_from_region(Bitmap bm, const WinSpiceRegion *region)
+{
+    const WinSpiceRect *rects;
+    int i, n, x, y;
+
+    memset(bm, 0, sizeof(Bitmap));
+    rects = wregion_rects(region, &n);
+    for (i = 0; i < n; i++) {
+        for (y = rects[i].top; y < rects[i].bottom; y++) {
+            for (x = rects[i].left; x < rects[i].right; x++) {
+                /// rects of a region never overlap
+                CHECK(!bm[y][x]);
+                bm[y][x] = 1;
+            }
+        }
+    }
+}
+
+static uint64_t bitmap_area(Bitmap bm)
+{
+    uint64_t area = 0;
+    int x, y;
+
+    for (y = 0; y < GRID; y++) {
+        for (x = 0; x < GRID; x++) {
+            area += bm[y][x];
+        }
+    }
+    return area;
+}
+
+/// banded order, coalesced spans and exact extents
+static void check_invariants(const WinSpiceRegion *region)
+{
+    const WinSpiceRect *rects;
+    WinSpiceRect ext = { 0 };
+    int i, n;
+
+    rects = wregion_rects(region, &n);
+    CHECK_EQ(wregion_is_empty(region), n == 0);
+    for (i = 0; i < n; i++) {
+        const WinSpiceRect *r = &rects[i];
+        CHECK(!wrect_is_empty(r));
+        if (i == 0) {
+            ext = *r;
+        } else {
+            const WinSpiceRect *p = &rects[i - 1];
+            if (p->top == r->top) {
+                /// same band: same height, sorted and not touching
+                CHECK_EQ(p->bottom, r->bottom);
+                CHECK(p->right < r->left);
+            } else {
+                CHECK(p->bottom <= r->top);
+            }
+            ext.left = MIN(ext.left, r->left);
+            ext.right = MAX(ext.right, r->right);
+            ext.bottom = MAX(ext.bottom, r->bottom);
+        }
+    }
+    if (n) {
+        CHECK_EQ(region->extents.left, ext.left);
+        CHECK_EQ(region->extents.top, ext.top);
+        CHECK_EQ(region->extents.right, ext.right);
+        CHECK_EQ(region->extents.bottom, ext.bottom);
+    }
+}
+
+static void check_region(const WinSpiceRegion *region, Bitmap expected)
+{
+    Bitmap got;
+
+    check_invariants(region);
+    bitmap_from_region(got, region);
+    CHECK(memcmp(got, expected, sizeof(Bitmap)) == 0);
+    CHECK_EQ(wregion_area(region), bitmap_area(expected));
+}
+
+static void random_region(uint32_t *seed, WinSpiceRegion *region, Bitmap bm)
+{
+    WinSpiceRect rects[12];
+    int i, n = check_rand(seed) % 12;
+
+    memset(bm, 0, sizeof(Bitmap));
+    for (i = 0; i < n; i++) {
+        random_rect(seed, &rects[i]);
+        bitmap_fill(bm, &rects[i]);
+    }
+    wregion_init_rects(region, rects, n);
+    check_region(region, bm);
+}
+
+static void test_init(uint32_t *seed)
+{
+    WinSpiceRegion a, b;
+    WinSpiceRect r;
+    Bitmap bm;
+    int i, n = check_rand(seed) % 12;
+
+    /// one rect at a time must end up the same as all rects at once
+    memset(bm, 0, sizeof(Bitmap));
+    wregion_init(&a);
+    for (i = 0; i < n; i++) {
+        random_rect(seed, &r);
+        bitmap_fill(bm, &r);
+        wregion_union_rect(&a, &a, &r);
+        check_region(&a, bm);
+    }
+    wregion_init(&b);
+    wregion_copy(&b, &a);
+    check_region(&b, bm);
+    wregion_fini(&b);
+    wregion_fini(&a);
+}
+
+/// hundreds of small overlapping rects, like the dirty rects of a busy frame
+static void test_many_rects(uint32_t *seed)
+{
+    static WinSpiceRect rects[800];
+    WinSpiceRegion a, b;
+    Bitmap bm;
+    int i, n = 200 + check_rand(seed) % 600;
+
+    memset(bm, 0, sizeof(Bitmap));
+    wregion_init(&a);
+    wregion_init(&b);
+    random_region(seed, &a, bm);
+    wregion_copy(&b, &a);
+    for (i = 0; i < n; i++) {
+        int32_t x = check_rand(seed) % GRID, y = check_rand(seed) % GRID;
+        int32_t w = check_rand(seed) % 9, h = check_rand(seed) % 9;
+
+        rects[i].left = x;
+        rects[i].top = y;
+        rects[i].right = MIN(x + w, GRID);
+        rects[i].bottom = MIN(y + h, GRID);
+        bitmap_fill(bm, &rects[i]);
+        wregion_union_rect(&b, &b, &rects[i]);
+    }
+
+    /// added to an existing region at once, the same as one by one
+    wregion_union_rects(&a, rects, n);
+    check_region(&a, bm);
+    CHECK_EQ(a.num_rects, b.num_rects);
+    CHECK(memcmp(a.rects, b.rects, a.num_rects * sizeof(WinSpiceRect)) == 0);
+
+    /// and into an empty one, reusing its storage
+    memset(bm, 0, sizeof(Bitmap));
+    for (i = 0; i < n; i++) {
+        bitmap_fill(bm, &rects[i]);
+    }
+    wregion_clear(&a);
+    wregion_union_rects(&a, rects, n);
+    check_region(&a, bm);
+    wregion_set_rects(&b, rects, n);
+    check_region(&b, bm);
+
+    wregion_fini(&b);
+    wregion_fini(&a);
+}
+
+static void test_ops(uint32_t *seed)
+{
+    WinSpiceRegion a, b, dst;
+    Bitmap ba, bb, expected;
+    int x, y;
+
+    random_region(seed, &a, ba);
+    random_region(seed, &b, bb);
+    wregion_init(&dst);
+
+    wregion_union(&dst, &a, &b);
+    for (y = 0; y < GRID; y++) {
+        for (x = 0; x < GRID; x++) {
+            expected[y][x] = ba[y][x] | bb[y][x];
+        }
+    }
+    check_region(&dst, expected);
+
+    wregion_intersect(&dst, &a, &b);
+    for (y = 0; y < GRID; y++) {
+        for (x = 0; x < GRID; x++) {
+            expected[y][x] = ba[y][x] & bb[y][x];
+        }
+    }
+    check_region(&dst, expected);
+
+    wregion_subtract(&dst, &a, &b);
+    for (y = 0; y < GRID; y++) {
+        for (x = 0; x < GRID; x++) {
+            expected[y][x] = ba[y][x] & !bb[y][x];
+        }
+    }
+    check_region(&dst, expected);
+
+    /// the destination may alias a source
+    wregion_subtract(&a, &a, &b);
+    check_region(&a, expected);
+
+    wregion_fini(&dst);
+    wregion_fini(&b);
+    wregion_fini(&a);
+}
+
+static void test_rect_ops(uint32_t *seed)
+{
+    WinSpiceRegion a, dst;
+    WinSpiceRect r;
+    Bitmap ba, br, expected;
+    bool contains = true, intersects = false;
+    int x, y;
+
+    random_region(seed, &a, ba);
+    random_rect(seed, &r);
+    memset(br, 0, sizeof(Bitmap));
+    bitmap_fill(br, &r);
+    for (y = r.top; y < r.bottom; y++) {
+        for (x = r.left; x < r.right; x++) {
+            contains &= ba[y][x];
+            intersects |= ba[y][x];
+        }
+    }
+    CHECK_EQ(wregion_contains_rect(&a, &r), contains);
+    CHECK_EQ(wregion_intersects_rect(&a, &r), intersects);
+
+    wregion_init(&dst);
+    wregion_intersect_rect(&dst, &a, &r);
+    for (y = 0; y < GRID; y++) {
+        for (x = 0; x < GRID; x++) {
+            expected[y][x] = ba[y][x] & br[y][x];
+        }
+    }
+    check_region(&dst, expected);
+
+    wregion_subtract_rect(&dst, &a, &r);
+    for (y = 0; y < GRID; y++) {
+        for (x = 0; x < GRID; x++) {
+            expected[y][x] = ba[y][x] & !br[y][x];
+        }
+    }
+    check_region(&dst, expected);
+
+    wregion_union_rect(&dst, &a, &r);
+    for (y = 0; y < GRID; y++) {
+        for (x = 0; x < GRID; x++) {
+            expected[y][x] = ba[y][x] | br[y][x];
+        }
+    }
+    check_region(&dst, expected);
+
+    wregion_fini(&dst);
+    wregion_fini(&a);
+}
+
+static void test_translate(uint32_t *seed)
+{
+    WinSpiceRegion a;
+    Bitmap ba, expected;
+    int x, y;
+    int dx = check_rand(seed) % 9 - 4, dy = check_rand(seed) % 9 - 4;
+
+    random_region(seed, &a, ba);
+    /// keep the translated region inside the grid
+    wregion_intersect_rect(&a, &a, &(WinSpiceRect){ 4, 4, GRID - 4, GRID - 4 });
+    memset(expected, 0, sizeof(Bitmap));
+    for (y = 4; y < GRID - 4; y++) {
+        for (x = 4; x < GRID - 4; x++) {
+            expected[y + dy][x + dx] = ba[y][x];
+        }
+    }
+    wregion_translate(&a, dx, dy);
+    check_region(&a, expected);
+    wregion_fini(&a);
+}
+
+static void test_edges(void)
+{
+    WinSpiceRegion a, b;
+    WinSpiceRect r1 = { 0, 0, 10, 10 }, r2 = { 10, 0, 20, 10 }, r3 = { 0, 10, 20, 20 };
+
+    /// side by side spans coalesce, then the two bands merge into one rect
+    wregion_init_rect(&a, &r1);
+    wregion_union_rect(&a, &a, &r2);
+    CHECK_EQ(a.num_rects, 1);
+    wregion_union_rect(&a, &a, &r3);
+    CHECK_EQ(a.num_rects, 1);
+    CHECK_EQ(wregion_area(&a), 400);
+
+    /// empty operands
+    wregion_init(&b);
+    wregion_union(&b, &b, &a);
+    CHECK_EQ(b.num_rects, 1);
+    wregion_subtract(&b, &b, &a);
+    CHECK(wregion_is_empty(&b));
+    CHECK(wregion_contains_rect(&b, &(WinSpiceRect){ 5, 5, 5, 9 }));
+    CHECK(!wregion_intersects_rect(&a, &(WinSpiceRect){ 20, 0, 30, 10 }));
+
+    wregion_clear(&a);
+    CHECK(wregion_is_empty(&a));
+    wregion_fini(&b);
+    wregion_fini(&a);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 0x2545f491;
+    int i;
+
+    test_edges();
+    for (i = 0; i < ITERATIONS; i++) {
+        test_init(&seed);
+        if (i % 20 == 0) {
+            test_many_rects(&seed);
+        }
+        test_ops(&seed);
+        test_rect_ops(&seed);
+        test_translate(&seed);
+    }
+    printf("region: %d random iterations ok\n", ITERATIONS);
+    return 0;
+}
@@ -0,0 +1,261 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * DrawableRing: the entry and byte bounds, released items, index
+ * wraparound, and a producer and a consumer thread racing, with
+ * ring_discard_all() and ring_release() called while the consumer pops. Every item must come out in order and be
+ * either popped or freed exactly once.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "ring.h"
+
+#define STRESS_ITEMS    1000000
+#define STRESS_ENTRIES  64
+#define STRESS_BYTES    4096
+
+/// one flag per item, set when it is popped or freed
+static atomic_uchar seen[STRESS_ITEMS + 1];
+/// items below this sequence number may be discarded
+static atomic_uint discard_below;
+static atomic_uint freed;
+
+static void free_item(void *item)
+{
+    uint32_t seq = (uint32_t)(uintptr_t)item;
+
+    CHECK(seq < atomic_load(&discard_below));
+    CHECK_EQ(atomic_exchange(&seen[seq], 1), 0);
+    atomic_fetch_add(&freed, 1);
+}
+
+static void test_bounds(void)
+{
+    DrawableRing ring;
+    int i;
+
+    /// rounded up to 4 entries
+    ring_init(&ring, 3, 100, free_item);
+    atomic_store(&discard_below, 0);
+
+    CHECK(ring_is_empty(&ring));
+    CHECK(ring_push(&ring, (void *)1, 60));
+    CHECK(!ring_has_room(&ring, 50));
+    CHECK(!ring_push(&ring, (void *)2, 50));
+    CHECK_EQ(ring.full_count, 1);
+    CHECK(ring_push(&ring, (void *)2, 40));
+    CHECK_EQ(ring_bytes(&ring), 100);
+    CHECK(ring_pop(&ring) == (void *)1);
+    CHECK(ring_push(&ring, (void *)3, 50));
+    CHECK(ring_pop(&ring) == (void *)2);
+    CHECK(ring_pop(&ring) == (void *)3);
+    CHECK(ring_pop(&ring) == NULL);
+
+    /// an empty ring takes an item larger than the byte bound
+    CHECK(ring_push(&ring, (void *)4, 1000));
+    CHECK(!ring_push(&ring, (void *)5, 1));
+    CHECK(ring_pop(&ring) == (void *)4);
+    CHECK_EQ(ring_bytes(&ring), 0);
+
+    /// the entry bound
+    for (i = 0; i < 4; i++) {
+        CHECK(ring_push(&ring, (void *)(uintptr_t)(10 + i), 1));
+    }
+    CHECK(!ring_push(&ring, (void *)14, 1));
+    CHECK_EQ(ring_count(&ring), 4);
+
+    /// discarded items are freed by the consumer, later ones are kept
+    memset(seen, 0, sizeof(seen));
+    atomic_store(&discard_below, 14);
+    ring_discard_all(&ring);
+    CHECK(ring_pop(&ring) == NULL);
+    CHECK_EQ(atomic_load(&freed), 4);
+    CHECK(ring_push(&ring, (void *)20, 1));
+    CHECK(ring_pop(&ring) == (void *)20);
+
+    ring_fini(&ring);
+}
+
+/// released items stay queued but no longer hold back the producer
+static void test_release(void)
+{
+    DrawableRing ring;
+    uint32_t first, second;
+
+    ring_init(&ring, 8, 100, NULL);
+
+    first = ring_next_index(&ring);
+    CHECK(ring_push(&ring, (void *)1, 60));
+    second = ring_next_index(&ring);
+    CHECK(ring_push(&ring, (void *)2, 40));
+    CHECK(!ring_push(&ring, (void *)3, 50));
+
+    /// a superseded frame gives its bytes back before it is popped
+    ring_release(&ring, first);
+    CHECK_EQ(ring_bytes(&ring), 40);
+    CHECK(ring_push(&ring, (void *)3, 50));
+    CHECK_EQ(ring_bytes(&ring), 90);
+    /// only once
+    ring_release(&ring, first);
+    CHECK_EQ(ring_bytes(&ring), 90);
+
+    /// popping a released item takes nothing off the count
+    CHECK(ring_pop(&ring) == (void *)1);
+    CHECK_EQ(ring_bytes(&ring), 90);
+    CHECK(ring_pop(&ring) == (void *)2);
+    CHECK_EQ(ring_bytes(&ring), 50);
+    /// popped already, releasing it must not touch the count
+    ring_release(&ring, second);
+    CHECK_EQ(ring_bytes(&ring), 50);
+    /// not pushed yet
+    ring_release(&ring, ring_next_index(&ring));
+    CHECK_EQ(ring_bytes(&ring), 50);
+    CHECK(ring_pop(&ring) == (void *)3);
+    CHECK_EQ(ring_bytes(&ring), 0);
+    CHECK_EQ(ring_count(&ring), 0);
+
+    ring_fini(&ring);
+}
+
+/// head and tail are free running counters, they must survive overflow
+static void test_wraparound(void)
+{
+    DrawableRing ring;
+    uint32_t start = UINT32_MAX - 5;
+    uintptr_t next = 1, expected = 1;
+    int i;
+
+    ring_init(&ring, 4, 1000, NULL);
+    atomic_store(&ring.head, start);
+    atomic_store(&ring.tail, start);
+    atomic_store(&ring.discard_end, start);
+    ring.tail_cache = start;
+
+    for (i = 0; i < 100; i++) {
+        while (ring_push(&ring, (void *)next, 10)) {
+            next++;
+        }
+        CHECK_EQ(ring_count(&ring), 4);
+        CHECK(ring_pop(&ring) == (void *)expected++);
+        CHECK(ring_pop(&ring) == (void *)expected++);
+        CHECK_EQ(ring_bytes(&ring), 20);
+    }
+    CHECK((int32_t)atomic_load(&ring.head) > 0);
+    while (ring_pop(&ring)) {
+        expected++;
+    }
+    CHECK_EQ(expected, next);
+    ring_fini(&ring);
+}
+
+typedef struct Stress {
+    DrawableRing ring;
+    atomic_bool done;
+    uint32_t popped;
+} Stress;
+
+static uint32_t item_size(uint32_t seq)
+{
+    return 1 + seq * 2654435761u % (STRESS_BYTES / 4);
+}
+
+static void *consumer(void *data)
+{
+    Stress *s = data;
+    uint32_t last = 0;
+
+    for (;;) {
+        bool done = atomic_load(&s->done);
+        void *item = ring_pop(&s->ring);
+
+        if (!item) {
+            if (done) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        /// in order, gaps are discarded items
+        CHECK((uint32_t)(uintptr_t)item > last);
+        last = (uint32_t)(uintptr_t)item;
+        CHECK_EQ(atomic_exchange(&seen[last], 1), 0);
+        s->popped++;
+    }
+    return NULL;
+}
+
+static void test_stress(void)
+{
+    static Stress s;
+    pthread_t thread;
+    uint32_t seq, full = 0, discards = 0, index = 0;
+
+    memset(seen, 0, sizeof(seen));
+    atomic_store(&discard_below, 0);
+    atomic_store(&freed, 0);
+    ring_init(&s.ring, STRESS_ENTRIES, STRESS_BYTES, free_item);
+    atomic_store(&s.done, false);
+    CHECK_EQ(pthread_create(&thread, NULL, consumer, &s), 0);
+
+    for (seq = 1; seq <= STRESS_ITEMS; seq++) {
+        /// release an earlier item, which the consumer may be popping right now
+        if (seq % 3 == 0) {
+            ring_release(&s.ring, index - 2);
+        }
+        index = ring_next_index(&s.ring);
+        while (!ring_push(&s.ring, (void *)(uintptr_t)seq, item_size(seq))) {
+            full++;
+            sched_yield();
+        }
+        /// the producer sees the consumer only shrink the bytes
+        CHECK(ring_bytes(&s.ring) <= STRESS_BYTES || ring_count(&s.ring) <= 1);
+        if (seq % 1009 == 0) {
+            atomic_store(&discard_below, seq + 1);
+            ring_discard_all(&s.ring);
+            discards++;
+        }
+    }
+    atomic_store(&s.done, true);
+    pthread_join(thread, NULL);
+
+    CHECK(ring_is_empty(&s.ring));
+    CHECK_EQ(ring_bytes(&s.ring), 0);
+    CHECK_EQ(s.popped + atomic_load(&freed), STRESS_ITEMS);
+    for (seq = 1; seq <= STRESS_ITEMS; seq++) {
+        CHECK(atomic_load(&seen[seq]));
+    }
+    ring_fini(&s.ring);
+    printf("ring: %u popped, %u discarded in %u discards, %u full pushes\n",
+           s.popped, atomic_load(&freed), discards, full);
+}
+
+int main(int argc, char **argv)
+{
+    test_bounds();
+    test_release();
+    test_wraparound();
+    test_stress();
+    return 0;
+}
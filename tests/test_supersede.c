@@ -0,0 +1,184 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SupersedeTracker: the capture thread dropping covered drawables with
+ * supersede_drop_covered() while a worker thread pops and claims them
+ * with supersede_claim(), both wired to a DrawableRing the way wspice.c
+ * does it. Every drawable's pixels must be freed exactly once, by
+ * whichever side owns them, and the in-flight and ring bytes must add up.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "ring.h"
+#include "supersede.h"
+
+#define STRESS_ITEMS    200000
+#define STRESS_ENTRIES  64
+#define STRESS_BYTES    (64 * 1024)
+/// drawables cover one of these cells, so newer ones often cover older ones
+#define CELL            16
+#define CELLS           4
+
+typedef struct Item {
+    uint32_t seq;
+    uint32_t bytes;
+    atomic_int *state;
+} Item;
+
+static Item items[STRESS_ITEMS + 1];
+/// one flag per item for its pixels and one for the rest of it
+static atomic_uchar pixels_freed[STRESS_ITEMS + 1];
+static atomic_uchar item_freed[STRESS_ITEMS + 1];
+
+typedef struct Stress {
+    DrawableRing ring;
+    atomic_bool done;
+    /// added when queued, taken off by the worker or by a drop
+    atomic_ullong inflight;
+    uint64_t claimed;
+    uint64_t claimed_bytes;
+} Stress;
+
+static void drop_pixels(void *pixels)
+{
+    uint32_t seq = (uint32_t)(uintptr_t)pixels;
+
+    CHECK_EQ(atomic_exchange(&pixels_freed[seq], 1), 0);
+}
+
+static void item_rect(uint32_t seq, WinSpiceRect *r)
+{
+    uint32_t cell = seq * 2654435761u >> 28;
+
+    r->left = cell % CELLS * CELL;
+    r->top = cell / CELLS % CELLS * CELL;
+    r->right = r->left + CELL;
+    r->bottom = r->top + CELL;
+}
+
+/// the spice worker: drawable_claim() and drawable_free()
+static void *worker(void *data)
+{
+    Stress *s = data;
+
+    for (;;) {
+        bool done = atomic_load(&s->done);
+        Item *item = ring_pop(&s->ring);
+
+        if (!item) {
+            if (done) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        if (!item->state || supersede_claim(item->state)) {
+            drop_pixels((void *)(uintptr_t)item->seq);
+            atomic_fetch_sub(&s->inflight, item->bytes);
+            s->claimed++;
+            s->claimed_bytes += item->bytes;
+        }
+        CHECK_EQ(atomic_exchange(&item_freed[item->seq], 1), 0);
+    }
+    return NULL;
+}
+
+static void test_race(void)
+{
+    static SupersedeTracker tracker;
+    static Stress s;
+    WinSpiceRegion painted;
+    pthread_t thread;
+    uint64_t queued_bytes = 0;
+    uint32_t seq, untracked = 0, full = 0;
+    int i;
+
+    supersede_init(&tracker);
+    wregion_init(&painted);
+    ring_init(&s.ring, STRESS_ENTRIES, STRESS_BYTES, NULL);
+    atomic_store(&s.done, false);
+    atomic_store(&s.inflight, 0);
+    CHECK_EQ(pthread_create(&thread, NULL, worker, &s), 0);
+
+    for (seq = 1; seq <= STRESS_ITEMS; seq++) {
+        Item *item = &items[seq];
+        WinSpiceRect rect;
+
+        /// queue_drawable(): tracked before the worker can see it
+        item->seq = seq;
+        item->bytes = 1 + seq % 4096;
+        item_rect(seq, &rect);
+        queued_bytes += item->bytes;
+        atomic_fetch_add(&s.inflight, item->bytes);
+        item->state = supersede_track(&tracker, (void *)(uintptr_t)seq, &rect, item->bytes,
+                                      ring_next_index(&s.ring));
+        untracked += !item->state;
+        while (!ring_push(&s.ring, item, item->bytes)) {
+            full++;
+            sched_yield();
+        }
+
+        /// supersede_queued(): the next frame paints over one or all cells
+        if (seq % 7 == 0) {
+            wregion_clear(&painted);
+            wregion_union_rect(&painted, &painted, &rect);
+            if (seq % 91 == 0) {
+                wregion_union_rect(&painted, &painted,
+                                   &(WinSpiceRect){ 0, 0, CELL * CELLS, CELL * CELLS });
+            }
+            if (supersede_drop_covered(&tracker, &painted, drop_pixels)) {
+                atomic_fetch_sub(&s.inflight, tracker.saved_bytes);
+                for (i = 0; i < tracker.dropped; i++) {
+                    ring_release(&s.ring, tracker.tickets[i]);
+                }
+            }
+        }
+        CHECK(atomic_load(&s.inflight) <= queued_bytes);
+    }
+    atomic_store(&s.done, true);
+    pthread_join(thread, NULL);
+
+    CHECK(ring_is_empty(&s.ring));
+    CHECK_EQ(ring_bytes(&s.ring), 0);
+    CHECK_EQ(atomic_load(&s.inflight), 0);
+    CHECK_EQ(s.claimed + tracker.total_dropped, STRESS_ITEMS);
+    CHECK_EQ(s.claimed_bytes + tracker.total_saved_bytes, queued_bytes);
+    CHECK(tracker.total_dropped > 0);
+    for (seq = 1; seq <= STRESS_ITEMS; seq++) {
+        CHECK(atomic_load(&pixels_freed[seq]));
+        CHECK(atomic_load(&item_freed[seq]));
+    }
+
+    wregion_fini(&painted);
+    ring_fini(&s.ring);
+    printf("supersede: %llu claimed, %llu dropped, %u untracked, %u full pushes\n",
+           (unsigned long long)s.claimed, (unsigned long long)tracker.total_dropped,
+           untracked, full);
+}
+
+int main(int argc, char **argv)
+{
+    test_race();
+    return 0;
+}
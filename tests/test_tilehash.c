@@ -0,0 +1,198 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * tilehash_filter() on synthetic frame pairs, on a screen whose size is
+ * not a multiple of the tile size.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "tilehash.h"
+
+#define W   150
+#define H   100
+#define T   TILE_HASH_SIZE
+
+static uint32_t frame[W * H];
+
+static void fill_frame(uint32_t salt)
+{
+    int i;
+
+    for (i = 0; i < W * H; i++) {
+        frame[i] = i * 2654435761u ^ salt;
+    }
+}
+
+static uint64_t filter(TileHash *th, WinSpiceRegion *damage, const WinSpiceRect *rect)
+{
+    wregion_clear(damage);
+    wregion_union_rect(damage, damage, rect);
+    return tilehash_filter(th, damage, (const uint8_t *)frame, W * 4);
+}
+
+static void check_damage(const WinSpiceRegion *damage, const WinSpiceRect *expected)
+{
+    if (!expected) {
+        CHECK(wregion_is_empty(damage));
+        return;
+    }
+    CHECK_EQ(damage->num_rects, 1);
+    CHECK_EQ(damage->rects[0].left, expected->left);
+    CHECK_EQ(damage->rects[0].top, expected->top);
+    CHECK_EQ(damage->rects[0].right, expected->right);
+    CHECK_EQ(damage->rects[0].bottom, expected->bottom);
+}
+
+static void test_unchanged(void)
+{
+    WinSpiceRect all = { 0, 0, W, H };
+    WinSpiceRegion damage;
+    TileHash *th = tilehash_new(W, H, T);
+
+    wregion_init(&damage);
+    fill_frame(1);
+
+    /// nothing to compare with yet, everything is kept
+    CHECK_EQ(filter(th, &damage, &all), 0);
+    check_damage(&damage, &all);
+    CHECK_EQ(th->saved_bytes, 0);
+
+    /// the same pixels again are dropped and counted as saved
+    CHECK_EQ(filter(th, &damage, &all), (uint64_t)W * H * 4);
+    check_damage(&damage, NULL);
+    CHECK_EQ(th->total_saved_bytes, (uint64_t)W * H * 4);
+
+    /// a damage rect inside one tile saves only its own bytes
+    CHECK_EQ(filter(th, &damage, &(WinSpiceRect){ 10, 10, 20, 30 }), 10 * 20 * 4);
+
+    wregion_fini(&damage);
+    tilehash_destroy(th);
+}
+
+static void test_one_pixel(void)
+{
+    WinSpiceRect all = { 0, 0, W, H };
+    WinSpiceRegion damage;
+    TileHash *th = tilehash_new(W, H, T);
+
+    wregion_init(&damage);
+    fill_frame(2);
+    filter(th, &damage, &all);
+
+    /// a pixel of the middle tile of the top row: that tile only is kept
+    frame[5 * W + 70] ^= 1;
+    filter(th, &damage, &all);
+    check_damage(&damage, &(WinSpiceRect){ T, 0, 2 * T, T });
+
+    /// the new hash is the reference now
+    filter(th, &damage, &all);
+    check_damage(&damage, NULL);
+
+    /// damage narrower than the tile keeps only the damaged part
+    frame[5 * W + 70] ^= 1;
+    filter(th, &damage, &(WinSpiceRect){ 66, 2, 80, 9 });
+    check_damage(&damage, &(WinSpiceRect){ 66, 2, 80, 9 });
+
+    wregion_fini(&damage);
+    tilehash_destroy(th);
+}
+
+static void test_edge_tiles(void)
+{
+    WinSpiceRect all = { 0, 0, W, H };
+    WinSpiceRect corner = { 2 * T, T, W, H };
+    WinSpiceRegion damage, aligned;
+    TileHash *th = tilehash_new(W, H, T);
+
+    CHECK_EQ(th->tiles_x, 3);
+    CHECK_EQ(th->tiles_y, 2);
+    wregion_init(&damage);
+    wregion_init(&aligned);
+    fill_frame(3);
+    filter(th, &damage, &all);
+
+    /// the last pixel of the screen, in the partial bottom right tile
+    frame[W * H - 1] ^= 1;
+    filter(th, &damage, &all);
+    check_damage(&damage, &corner);
+
+    /// damage reaching past the screen is clipped, not hashed out of bounds
+    frame[W * H - 1] ^= 1;
+    filter(th, &damage, &(WinSpiceRect){ W - 5, H - 5, W + 40, H + 40 });
+    check_damage(&damage, &(WinSpiceRect){ W - 5, H - 5, W + 40, H + 40 });
+    filter(th, &damage, &(WinSpiceRect){ W - 5, H - 5, W + 40, H + 40 });
+    CHECK(!wregion_intersects_rect(&damage, &all));
+    CHECK_EQ(wregion_area(&damage), 45 * 45 - 5 * 5);
+
+    /// alignment grows to whole tiles but stops at the screen edge
+    wregion_union_rect(&damage, &damage, &(WinSpiceRect){ 140, 70, 145, 90 });
+    tilehash_align(th, &aligned, &damage);
+    check_damage(&aligned, &corner);
+
+    wregion_fini(&aligned);
+    wregion_fini(&damage);
+    tilehash_destroy(th);
+}
+
+static void test_invalidate(void)
+{
+    WinSpiceRect all = { 0, 0, W, H };
+    WinSpiceRegion damage;
+    TileHash *th = tilehash_new(W, H, T);
+
+    wregion_init(&damage);
+    fill_frame(4);
+    filter(th, &damage, &all);
+
+    /// tiles touched by an invalidated rect are sent even if unchanged
+    tilehash_invalidate(th, &(WinSpiceRect){ 60, 60, 70, 70 });
+    filter(th, &damage, &all);
+    check_damage(&damage, &(WinSpiceRect){ 0, 0, 2 * T, H });
+
+    tilehash_reset(th);
+    filter(th, &damage, &all);
+    check_damage(&damage, &all);
+
+    /// a resize replaces the table, no hash of the old size survives
+    tilehash_destroy(th);
+    th = tilehash_new(W / 2, H / 2, T);
+    filter(th, &damage, &all);
+    check_damage(&damage, &all);
+    filter(th, &damage, &all);
+    CHECK(!wregion_intersects_rect(&damage, &(WinSpiceRect){ 0, 0, W / 2, H / 2 }));
+    CHECK_EQ(wregion_area(&damage), (uint64_t)W * H - (W / 2) * (H / 2));
+
+    wregion_fini(&damage);
+    tilehash_destroy(th);
+}
+
+int main(int argc, char **argv)
+{
+    CHECK(tilehash_new(0, H, T) == NULL);
+    test_unchanged();
+    test_one_pixel();
+    test_edge_tiles();
+    test_invalidate();
+    printf("tilehash: ok\n");
+    return 0;
+}
@@ -0,0 +1,251 @@
+/**
+ * winspice - windows spice server
+ *
+ * Copyright 2021 Dunrong Huang <riegamaths@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * VideoDetector fed the dirty regions of a synthetic screen at a fake
+ * clock, frame by frame in the order the session runs it: a region
+ * changing at a video rate is classified after VIDEO_VOTES windows,
+ * keeps its rect while it grows a little and is taken out of the damage
+ * as a whole.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "check.h"
+#include "videodetect.h"
+
+#define W       640
+#define H       480
+#define SECOND  1000000000ULL
+
+static uint32_t frame[W * H];
+
+typedef struct Player {
+    VideoDetector *det;
+    uint64_t now;
+    WinSpiceRegion invalid;
+    WinSpiceRect taken[VIDEO_MAX_REGIONS];
+    int num_taken;
+} Player;
+
+/// gradients like a photo, or black text on white
+static void paint(bool photo)
+{
+    int x, y;
+
+    for (y = 0; y < H; y++) {
+        for (x = 0; x < W; x++) {
+            uint32_t v = (x * 3 + y) & 0xff;
+            if (!photo) {
+                v = x % 8 == 0 || y % 12 == 0 ? 0 : 0xff;
+            }
+            frame[y * W + x] = 0xff000000 | v << 16 | v << 8 | v;
+        }
+    }
+}
+
+static void player_init(Player *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->det = video_detect_new(W, H);
+    p->now = SECOND;
+    wregion_init(&p->invalid);
+}
+
+static void player_fini(Player *p)
+{
+    wregion_fini(&p->invalid);
+    video_detect_destroy(p->det);
+}
+
+/// one captured frame whose damage is @dirty, or nothing if NULL
+static void step(Player *p, const WinSpiceRect *dirty, int fps)
+{
+    wregion_clear(&p->invalid);
+    if (dirty) {
+        wregion_union_rect(&p->invalid, &p->invalid, dirty);
+    }
+    video_detect_frame(p->det, &p->invalid, p->now);
+    video_detect_extend(p->det, &p->invalid);
+    video_detect_classify(p->det, (const uint8_t *)frame, W * 4);
+    p->num_taken = video_detect_take(p->det, &p->invalid, p->taken);
+    p->now += SECOND / fps;
+}
+
+static void play(Player *p, const WinSpiceRect *dirty, int fps, uint64_t duration)
+{
+    uint64_t end = p->now + duration;
+
+    while (p->now < end) {
+        step(p, dirty, fps);
+    }
+}
+
+static void check_rect(const WinSpiceRect *r, const WinSpiceRect *expected)
+{
+    CHECK_EQ(r->left, expected->left);
+    CHECK_EQ(r->top, expected->top);
+    CHECK_EQ(r->right, expected->right);
+    CHECK_EQ(r->bottom, expected->bottom);
+}
+
+/// play until the region's verdict flips, returns the windows it took
+static int windows_to_flip(Player *p, const WinSpiceRect *dirty, bool video)
+{
+    uint64_t start = p->now;
+
+    while (p->det->num_regions == 0 || p->det->regions[0].video != video) {
+        step(p, dirty, 30);
+        CHECK(p->now - start < 10 * SECOND);
+    }
+    return (p->now - start + VIDEO_WINDOW / 2) / VIDEO_WINDOW;
+}
+
+static void test_classify(void)
+{
+    WinSpiceRect video = { 64, 64, 320, 256 };
+    Player p;
+    int windows;
+
+    player_init(&p);
+    paint(true);
+
+    /// the cells must be hot for VIDEO_HOT_WINDOWS before a region exists
+    while (p.det->num_regions == 0) {
+        step(&p, &video, 30);
+        CHECK(!p.num_taken);
+    }
+    check_rect(&p.det->regions[0].rect, &video);
+
+    /// one photographic verdict is not enough, it takes VIDEO_VOTES windows
+    CHECK(!p.det->regions[0].video);
+    CHECK_EQ(p.det->regions[0].votes, 1);
+    windows = windows_to_flip(&p, &video, true);
+    CHECK_EQ(windows, VIDEO_VOTES - 1);
+    CHECK_EQ(p.num_taken, 1);
+    check_rect(&p.taken[0], &video);
+
+    /// text in the same place flips it back after as many windows
+    paint(false);
+    windows = windows_to_flip(&p, &video, false);
+    CHECK(windows >= VIDEO_VOTES - 1 && windows <= VIDEO_VOTES);
+    CHECK_EQ(p.num_taken, 0);
+    CHECK(!wregion_is_empty(&p.invalid));
+
+    player_fini(&p);
+}
+
+static void test_slow_updates(void)
+{
+    WinSpiceRect rect = { 64, 64, 320, 256 };
+    Player p;
+
+    /// a clock or a progress bar updating below VIDEO_MIN_RATE is no video
+    player_init(&p);
+    paint(true);
+    play(&p, &rect, VIDEO_MIN_RATE / 2, 5 * SECOND);
+    CHECK_EQ(p.det->num_regions, 0);
+    CHECK_EQ(p.num_taken, 0);
+    CHECK_EQ(wregion_area(&p.invalid), wrect_area(&rect));
+
+    /// nor is a region smaller than VIDEO_MIN_SIZE, however fast
+    rect.right = rect.left + VIDEO_MIN_SIZE - VIDEO_CELL;
+    play(&p, &rect, 30, 5 * SECOND);
+    CHECK_EQ(p.det->num_regions, 0);
+
+    player_fini(&p);
+}
+
+static void test_stable_rect(void)
+{
+    WinSpiceRect video = { 64, 64, 320, 256 };
+    WinSpiceRect grown = { 64, 64, 320 + VIDEO_CELL, 256 };
+    WinSpiceRect full = { 0, 0, W, H };
+    Player p;
+
+    player_init(&p);
+    paint(true);
+    windows_to_flip(&p, &video, true);
+
+    /// a cell more of damage keeps the geometry the client streams
+    play(&p, &grown, 30, 4 * VIDEO_WINDOW);
+    CHECK_EQ(p.det->num_regions, 1);
+    CHECK(p.det->regions[0].video);
+    check_rect(&p.det->regions[0].rect, &video);
+
+    /// gone full screen it takes the new rect, lossless until classified again
+    play(&p, &full, 30, 3 * VIDEO_WINDOW);
+    CHECK_EQ(p.det->num_regions, 1);
+    check_rect(&p.det->regions[0].rect, &full);
+    CHECK(!p.det->regions[0].video);
+    windows_to_flip(&p, &full, true);
+
+    /// and it is forgotten once the screen stays still
+    play(&p, NULL, 30, (VIDEO_HOLD_WINDOWS + 1) * VIDEO_WINDOW);
+    CHECK_EQ(p.det->num_regions, 0);
+
+    player_fini(&p);
+}
+
+static void test_take(void)
+{
+    WinSpiceRect video = { 64, 64, 320, 256 };
+    WinSpiceRect other = { 400, 300, 500, 400 };
+    WinSpiceRect inside = { 100, 100, 110, 110 };
+    Player p;
+
+    player_init(&p);
+    paint(true);
+    windows_to_flip(&p, &video, true);
+
+    /// a few pixels of the video send the whole region as one drawable
+    step(&p, &inside, 30);
+    CHECK_EQ(p.num_taken, 1);
+    check_rect(&p.taken[0], &video);
+    CHECK(wregion_is_empty(&p.invalid));
+
+    /// damage elsewhere stays in the region
+    wregion_clear(&p.invalid);
+    wregion_union_rect(&p.invalid, &p.invalid, &(WinSpiceRect){ 300, 100, 340, 120 });
+    wregion_union_rect(&p.invalid, &p.invalid, &other);
+    video_detect_frame(p.det, &p.invalid, p.now);
+    video_detect_extend(p.det, &p.invalid);
+    CHECK_EQ(video_detect_take(p.det, &p.invalid, p.taken), 1);
+    check_rect(&p.taken[0], &video);
+    CHECK(!wregion_intersects_rect(&p.invalid, &video));
+    CHECK_EQ(wregion_area(&p.invalid), wrect_area(&other) + 20 * 20);
+
+    /// without video_detect_extend() the region was not fetched: not taken
+    wregion_clear(&p.invalid);
+    wregion_union_rect(&p.invalid, &p.invalid, &inside);
+    CHECK_EQ(video_detect_take(p.det, &p.invalid, p.taken), 0);
+    CHECK_EQ(wregion_area(&p.invalid), wrect_area(&inside));
+
+    player_fini(&p);
+}
+
+int main(int argc, char **argv)
+{
+    test_classify();
+    test_slow_updates();
+    test_stable_rect();
+    test_take();
+    printf("videodetect: ok\n");
+    return 0;
+}